@@ -1,8 +1,129 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
 #include <zlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+#include <signal.h>
+#include <time.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdalign.h>
+#include <threads.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define USE_SSE2
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#if defined(__GNUC__)
+#define ALWAYS_INLINE static inline __attribute__((always_inline))
+#elif defined(_MSC_VER)
+#define ALWAYS_INLINE static __forceinline
+#else
+#define ALWAYS_INLINE static inline
+#endif
+
+// Build-time feature selection, define any of these to 0 to leave its decode paths out of the binary. Files that need a
+// stripped colour type, bit depth or interlacing are rejected, stripped ancillary chunks are decoded as if absent, and
+// functions only those paths call are dropped when linking with -ffunction-sections -Wl,--gc-sections
+#ifndef PNG_SUPPORT_GRAYSCALE
+#define PNG_SUPPORT_GRAYSCALE 1
+#endif
+#ifndef PNG_SUPPORT_TRUECOLOR
+#define PNG_SUPPORT_TRUECOLOR 1
+#endif
+#ifndef PNG_SUPPORT_INDEXED_COLOR
+#define PNG_SUPPORT_INDEXED_COLOR 1
+#endif
+#ifndef PNG_SUPPORT_GRAYSCALE_WITH_ALPHA
+#define PNG_SUPPORT_GRAYSCALE_WITH_ALPHA 1
+#endif
+#ifndef PNG_SUPPORT_TRUECOLOR_WITH_ALPHA
+#define PNG_SUPPORT_TRUECOLOR_WITH_ALPHA 1
+#endif
+#ifndef PNG_SUPPORT_LOW_BIT_DEPTHS
+#define PNG_SUPPORT_LOW_BIT_DEPTHS 1     // 1, 2 and 4 bits
+#endif
+#ifndef PNG_SUPPORT_16_BIT_DEPTH
+#define PNG_SUPPORT_16_BIT_DEPTH 1
+#endif
+#ifndef PNG_SUPPORT_INTERLACE
+#define PNG_SUPPORT_INTERLACE 1
+#endif
+#ifndef PNG_SUPPORT_ANCILLARY_CHUNKS
+#define PNG_SUPPORT_ANCILLARY_CHUNKS 1   // tRNS, eXIf, bKGD and sBIT, with the colour keying, compositing and rescaling they drive
+#endif
+#ifndef PNG_CHECK_CRC
+#define PNG_CHECK_CRC 1
+#endif
+
+// The tools built around the decoder, define any of these to 0 to leave its code and command line options out, with all of
+// them at 0 the binary only decodes
+#ifndef PNG_SUPPORT_CACHE
+#define PNG_SUPPORT_CACHE 1              // In-memory and on-disk decoded image caches
+#endif
+#ifndef PNG_SUPPORT_BATCH
+#define PNG_SUPPORT_BATCH 1              // Multi-file decoding with read-ahead
+#endif
+#ifndef PNG_SUPPORT_DAEMON
+#define PNG_SUPPORT_DAEMON 1             // Decode daemon and its scheduler
+#endif
+#ifndef PNG_SUPPORT_ENCODER
+#define PNG_SUPPORT_ENCODER 1
+#endif
+#ifndef PNG_SUPPORT_OPTIMIZER
+#define PNG_SUPPORT_OPTIMIZER 1
+#endif
+#ifndef PNG_SUPPORT_QOI
+#define PNG_SUPPORT_QOI 1
+#endif
+#ifndef PNG_SUPPORT_BCN
+#define PNG_SUPPORT_BCN 1
+#endif
+#ifndef PNG_SUPPORT_MIPS
+#define PNG_SUPPORT_MIPS 1
+#endif
+#ifndef PNG_SUPPORT_YUV
+#define PNG_SUPPORT_YUV 1
+#endif
+#if PNG_SUPPORT_DAEMON && !PNG_SUPPORT_CACHE
+#error The daemon needs the cache
+#endif
+#if PNG_SUPPORT_OPTIMIZER && !PNG_SUPPORT_ENCODER
+#error The optimiser needs the encoder
+#endif
+#if !PNG_SUPPORT_GRAYSCALE && !PNG_SUPPORT_TRUECOLOR && !PNG_SUPPORT_INDEXED_COLOR && !PNG_SUPPORT_GRAYSCALE_WITH_ALPHA && !PNG_SUPPORT_TRUECOLOR_WITH_ALPHA
+#error At least one color type has to be supported
+#endif
+
+#ifdef __linux__
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#ifndef _WIN32
+// fopen_s and fread_s only exist in the Microsoft CRT
+#define fopen_s(file, path, mode) ((*(file) = fopen((path), (mode))) == NULL)
+#define fread_s(buffer, bufferSize, elementSize, count, file) fread((buffer), (elementSize), (count), (file))
+#endif
 
 #define PNG_PATH "basn6a08.png"
 #define PNG_SIGNATURE_LENGTH 8
@@ -15,6 +136,85 @@
 #define IHDR_HEIGHT_BYTES 4
 #define IHDR_OTHER_BYTES 1
 #define DATA_CHUNK_TYPE "IDAT"
+#define HEADER_CHUNK_TYPE "IHDR"
+#define INFLATE_CHECK_INTERVAL (64 * 1024)
+#define DECODE_CANCELLED -2
+#define DECODE_TIMED_OUT -3
+#define PALETTE_CHUNK_TYPE "PLTE"
+#define TRANSPARENCY_CHUNK_TYPE "tRNS"
+#define EXIF_CHUNK_TYPE "eXIf"
+#define BACKGROUND_CHUNK_TYPE "bKGD"
+#define SIGNIFICANT_BITS_CHUNK_TYPE "sBIT"
+#define ICC_PROFILE_CHUNK_TYPE "iCCP"
+#define ICC_COLOR_SPACE_OFFSET 16
+#define EXIF_ORIENTATION_TAG 0x0112
+#define ORIENTATION_BAND_ROWS 16
+#define MAX_PALETTE_ENTRIES 256
+#define DAEMON_WORKER_COUNT 16
+#define DAEMON_QUEUE_LENGTH 64
+#define DAEMON_MAX_BATCH 32
+#define DAEMON_MESSAGE_LENGTH 8192
+#define DAEMON_POLL_MILLISECONDS 250
+#define DAEMON_IDLE_SECONDS 30.0
+#define DAEMON_CONTENDED_IDLE_SECONDS 1.0
+#define CACHE_SHARD_COUNT 16
+#define CACHE_BUCKET_COUNT 256
+#define RASTER_FILE_MAGIC "PNGRAW\0\0"
+#define RASTER_FILE_VERSION 1
+#define RASTER_FILE_ALIGNMENT 4096
+#define RASTER_ROW_ALIGNMENT 64
+#define BATCH_DEFAULT_THREADS 4
+#define BATCH_DEFAULT_WINDOW 16
+#define BATCH_DEFAULT_BYTE_LIMIT (64ull * 1024 * 1024)
+#define CACHE_LINE_SIZE 64
+#define STREAM_INFLATE_BUFFER_SIZE (64 * 1024)
+#define STREAM_MAX_KEPT_CHUNK (64 * 1024)
+#define DIRECT_IO_ALIGNMENT 4096
+#define DIRECT_IO_BUFFER_SIZE (4 * 1024 * 1024)
+#define QOI_MAGIC "qoif"
+#define QOI_HEADER_LENGTH 14
+#define QOI_END_LENGTH 8
+#define QOI_INDEX_SIZE 64
+#define QOI_MAX_RUN 62
+#define QOI_MAX_DIMENSION 0x7FFFFFFFu       // The limit PNG puts on the width and the height
+#define QOI_MASK 0xC0
+#define QOI_OP_INDEX 0x00
+#define QOI_OP_DIFF 0x40
+#define QOI_OP_LUMA 0x80
+#define QOI_OP_RUN 0xC0
+#define QOI_OP_RGB 0xFE
+#define QOI_OP_RGBA 0xFF
+#define DDS_HEADER_LENGTH 128
+#define DDS_DX10_HEADER_LENGTH 20
+#define DDS_PIXEL_FORMAT_LENGTH 32
+#define DDS_FLAGS 0x81007
+#define DDS_FOURCC_FLAG 0x4
+#define DDS_TEXTURE_CAPS 0x1000
+#define DDS_TEXTURE_2D 3
+#define DXGI_FORMAT_BC7_UNORM 98
+#define MIP_MAX_LEVELS 32
+#define MIP_LINEAR_BITS 12
+#define YUV_WEIGHT_BITS 14
+#define DECODE_ROW_BATCH 64
+#define DAEMON_DECODE_SLOTS 4
+#define SCHEDULER_SMALL_COST (1024 * 1024)
+#define SCHEDULER_AGING_SECONDS 5.0
+#define ENCODE_DEFAULT_THREADS 4
+#define ENCODE_SEGMENT_BYTES (128 * 1024)
+#define ENCODE_DICTIONARY_BYTES (32 * 1024)
+#define ENCODE_IDAT_BYTES (64 * 1024)
+#define FAST_HASH_BITS 15
+#define FAST_WINDOW_SIZE 32768
+#define FAST_MAX_MATCH 258
+#define FAST_FILTER_SAMPLE_STEP 8
+#define FAST_SKIP_SHIFT 5
+#define FAST_STREAM_BYTES (256 * 1024)
+#define FILTER_TYPE_COUNT 5
+#define FILTER_TRIAL_COUNT 7
+#define ENTROPY_FRACTION_BITS 8
+#define OPTIMIZE_LEVEL 9
+#define OPTIMIZE_COLOR_BITS 10
+#define OPTIMIZE_COLOR_TABLE_SIZE (1 << OPTIMIZE_COLOR_BITS)
 
 // Structure to represent a PNG chunk
 typedef struct Chunk
@@ -24,11 +224,100 @@ typedef struct Chunk
     unsigned char* data;
 } Chunk;
 
+// Enumeration for the stages a decode goes through
+typedef enum DecodeStage
+{
+    STAGE_READING_CHUNKS,
+    STAGE_PARSING_HEADER,
+    STAGE_INFLATING,
+    STAGE_DONE
+} DecodeStage;
+
+// Structure to bound a decode in time and let another thread cancel it
+typedef struct DecodeControl
+{
+    double deadline;                // Absolute time in seconds, zero means no deadline
+    atomic_bool* cancelToken;       // Optional, set to true to stop the decode
+    unsigned long checkInterval;    // Bytes of inflate output between two checks
+    DecodeStage stage;
+    unsigned int chunksRead;
+    unsigned long bytesInflated;
+    unsigned long rowBatchBytes;    // Inflate output of DECODE_ROW_BATCH full rows, set by the decoder
+    void (*rowBatchHook)(void* context);    // Optional, called between row batches and may block to let more urgent work run
+    void* rowBatchContext;
+} DecodeControl;
+
+// Function to get a monotonic time in seconds, unaffected by wall clock changes
+static double GetTimeSeconds()
+{
+    struct timespec now;
+#ifdef CLOCK_MONOTONIC
+    clock_gettime(CLOCK_MONOTONIC, &now);
+#else
+    timespec_get(&now, TIME_UTC);
+#endif
+
+    return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+// Function to initialize a decode control with a deadline relative to now
+static void InitDecodeControl(DecodeControl* control, const double budgetSeconds, atomic_bool* cancelToken)
+{
+    control->deadline = budgetSeconds > 0 ? GetTimeSeconds() + budgetSeconds : 0;
+    control->cancelToken = cancelToken;
+    control->checkInterval = INFLATE_CHECK_INTERVAL;
+    control->stage = STAGE_READING_CHUNKS;
+    control->chunksRead = 0;
+    control->bytesInflated = 0;
+    control->rowBatchBytes = 0;
+    control->rowBatchHook = NULL;
+    control->rowBatchContext = NULL;
+}
+
+// Function to check if a decode has to stop, returns 0 if it can go on
+static int CheckDecodeControl(const DecodeControl* control)
+{
+    if(!control)
+    {
+        return 0;
+    }
+
+    if(control->cancelToken && atomic_load(control->cancelToken))
+    {
+        return DECODE_CANCELLED;
+    }
+
+    if(control->deadline > 0 && GetTimeSeconds() > control->deadline)
+    {
+        return DECODE_TIMED_OUT;
+    }
+
+    return 0;
+}
+
+// Function to call the row batch hook of a decode, the only place a decode can be preempted
+static void YieldDecodeControl(const DecodeControl* control)
+{
+    if(control && control->rowBatchHook)
+    {
+        control->rowBatchHook(control->rowBatchContext);
+    }
+}
+
+// Function to report how far a stopped decode got
+static void ReportDecodeProgress(const DecodeControl* control, const int status)
+{
+    const char* stageNames[] = {"reading chunks", "parsing header", "inflating", "done"};
+
+    fprintf(stderr, "Error: Decode %s while %s (%u chunks read, %lu bytes inflated)!\n",
+        status == DECODE_CANCELLED ? "cancelled" : "timed out", stageNames[control->stage], control->chunksRead, control->bytesInflated);
+}
+
 // Function to get the size of a file
-int GetFileSize(FILE* file)
+static int GetFileSize(FILE* file, const char* path)
 {
     // Open the file in binary mode
-    if(fopen_s(&file, PNG_PATH, "rb") != 0)
+    if(fopen_s(&file, path, "rb") != 0)
     {
         fprintf(stderr, "Error: Can't open the file!\n");
         return -1;
@@ -50,12 +339,12 @@ int GetFileSize(FILE* file)
 }
 
 // Function to fill a buffer with the contents of a file
-int FillBuffer(FILE* file, unsigned char* buffer, const int fileSize, unsigned int* cursor)
+static int FillBuffer(FILE* file, const char* path, unsigned char* buffer, const int fileSize, unsigned int* cursor)
 {
     const unsigned char pngSignature[] = {137, 80, 78, 71, 13, 10, 26, 10};
 
     // Open the file in binary mode
-    if(fopen_s(&file, PNG_PATH, "rb") != 0)
+    if(fopen_s(&file, path, "rb") != 0)
     {
         fprintf(stderr, "Error: Can't open the file!\n");
         return -1;
@@ -87,7 +376,7 @@ int FillBuffer(FILE* file, unsigned char* buffer, const int fileSize, unsigned i
 }
 
 // Function to determine if the system is little-endian
-bool IsLittleEndian()
+static bool IsLittleEndian()
 {
     union
     {
@@ -101,14 +390,38 @@ bool IsLittleEndian()
 }
 
 // Function to convert a value to little-endian
-unsigned int ToLittleEndian(const unsigned int value)
+static unsigned int ToLittleEndian(const unsigned int value)
 {
     return ((value & 0xFF000000) >> 24) | ((value & 0x00FF0000) >> 8) | ((value & 0x0000FF00) << 8) | ((value & 0x000000FF) << 24);
 }
 
-// Function to read a PNG chunk
-int ReadChunk(const unsigned char* buffer, unsigned int* cursor, Chunk* chunk, const bool isLittleEndian)
+// Function to write a 32 bits value in network byte order
+ALWAYS_INLINE void StoreBigEndian(unsigned char* destination, const uint32_t value)
+{
+    destination[0] = (unsigned char)(value >> 24);
+    destination[1] = (unsigned char)(value >> 16);
+    destination[2] = (unsigned char)(value >> 8);
+    destination[3] = (unsigned char)value;
+}
+
+// Function to write a 32 bits value in little-endian byte order
+ALWAYS_INLINE void StoreLittleEndian(unsigned char* destination, const uint32_t value)
 {
+    destination[0] = (unsigned char)value;
+    destination[1] = (unsigned char)(value >> 8);
+    destination[2] = (unsigned char)(value >> 16);
+    destination[3] = (unsigned char)(value >> 24);
+}
+
+// Function to read a PNG chunk, the caller keeps ownership of the buffer
+static int ReadChunk(const unsigned char* buffer, const unsigned long bufferSize, unsigned int* cursor, Chunk* chunk, const bool isLittleEndian)
+{
+    if(bufferSize < CHUNK_DATA_LENGTH + CHUNK_TYPE_LENGTH || *cursor > bufferSize - CHUNK_DATA_LENGTH - CHUNK_TYPE_LENGTH)
+    {
+        fprintf(stderr, "Error: Truncated chunk header!\n");
+        return -1;
+    }
+
     // Read data length
     memcpy(&chunk->dataLength, buffer + *cursor, CHUNK_DATA_LENGTH);
     if(isLittleEndian)
@@ -122,11 +435,16 @@ int ReadChunk(const unsigned char* buffer, unsigned int* cursor, Chunk* chunk, c
     chunk->type[CHUNK_TYPE_LENGTH] = '\0';
     *cursor += CHUNK_TYPE_LENGTH;
 
+    if(chunk->dataLength > bufferSize - *cursor || CHUNK_CRC_LENGTH > bufferSize - *cursor - chunk->dataLength)
+    {
+        fprintf(stderr, "Error: Truncated %s chunk!\n", chunk->type);
+        return -1;
+    }
+
     // Allocate memory for chunk data
-    chunk->data = (unsigned char*)malloc(chunk->dataLength);
+    chunk->data = (unsigned char*)malloc(chunk->dataLength ? chunk->dataLength : 1);
     if(!chunk->data)
     {
-        free((unsigned char*)buffer);
         fprintf(stderr, "Error: Unable to allocate enough memory for chunk data!\n");
         return -1;
     }
@@ -135,6 +453,7 @@ int ReadChunk(const unsigned char* buffer, unsigned int* cursor, Chunk* chunk, c
     memcpy(chunk->data, buffer + *cursor, chunk->dataLength);
     *cursor += chunk->dataLength;
     
+#if PNG_CHECK_CRC
     // Read CRC
     unsigned int crc;
     memcpy(&crc, buffer + *cursor, CHUNK_CRC_LENGTH);
@@ -151,17 +470,20 @@ int ReadChunk(const unsigned char* buffer, unsigned int* cursor, Chunk* chunk, c
 
     if(crc != checksum)
     {
-        free((unsigned char*)buffer);
         free(chunk->data);
         fprintf(stderr, "Error: Checksum failed! %u != %u\n", crc, checksum);
         return -1;
     }
+#else
+    // Builds without checking step over the CRC
+    *cursor += CHUNK_CRC_LENGTH;
+#endif
 
     return 0;
 }
 
 // Function to append a chunk to the dynamic array
-int AppendChunk(Chunk** chunkDynamicArray, const unsigned int arraySize, const Chunk* chunk)
+static int AppendChunk(Chunk** chunkDynamicArray, const unsigned int arraySize, const Chunk* chunk)
 {
     *chunkDynamicArray = realloc(*chunkDynamicArray, arraySize * sizeof(Chunk));
     if(!*chunkDynamicArray)
@@ -198,8 +520,25 @@ typedef struct Ihdr
     char interlaceMethod;
 } Ihdr;
 
+// Function to tell whether the color type, bit depth and interlace method of a valid header were built in
+static bool IsFormatBuilt(const Ihdr* ihdr)
+{
+    const bool colorTypeBuilt = (ihdr->colorType == GRAYSCALE && PNG_SUPPORT_GRAYSCALE) || (ihdr->colorType == TRUECOLOR && PNG_SUPPORT_TRUECOLOR) ||
+        (ihdr->colorType == INDEXED_COLOR && PNG_SUPPORT_INDEXED_COLOR) || (ihdr->colorType == GRAYSCALE_WITH_ALPHA && PNG_SUPPORT_GRAYSCALE_WITH_ALPHA) ||
+        (ihdr->colorType == TRUECOLOR_WITH_ALPHA && PNG_SUPPORT_TRUECOLOR_WITH_ALPHA);
+    const bool bitDepthBuilt = ihdr->bitDepth == 8 || (ihdr->bitDepth < 8 && PNG_SUPPORT_LOW_BIT_DEPTHS) || (ihdr->bitDepth == 16 && PNG_SUPPORT_16_BIT_DEPTH);
+
+    return colorTypeBuilt && bitDepthBuilt && (ihdr->interlaceMethod == 0 || PNG_SUPPORT_INTERLACE);
+}
+
+// Function to tell whether an image is stored in Adam7 passes, builds without interlacing never see one
+static bool IsInterlaced(const Ihdr* ihdr)
+{
+    return PNG_SUPPORT_INTERLACE && ihdr->interlaceMethod != 0;
+}
+
 // Function to get data from IHDR chunk
-int GetIhdrChunkData(const Chunk* ihdrChunk, Ihdr* ihdr, const bool isLittleEndian)
+static int GetIhdrChunkData(const Chunk* ihdrChunk, Ihdr* ihdr, const bool isLittleEndian)
 {
     if(ihdrChunk->dataLength < IHDR_LENGTH)
     {
@@ -232,7 +571,7 @@ int GetIhdrChunkData(const Chunk* ihdrChunk, Ihdr* ihdr, const bool isLittleEndi
     }
 
     // Read bit depth
-    memcpy(&ihdr->bitDepth, ihdrChunk->data + index, IHDR_OTHER_BYTES);    
+    ihdr->bitDepth = ihdrChunk->data[index];
     if(ihdr->bitDepth != 1 && ihdr->bitDepth != 2 && ihdr->bitDepth != 4 && ihdr->bitDepth != 8 && ihdr->bitDepth != 16)
     {
         fprintf(stderr, "Error: Invalid IHDR bit depth!\n");
@@ -241,7 +580,7 @@ int GetIhdrChunkData(const Chunk* ihdrChunk, Ihdr* ihdr, const bool isLittleEndi
     index += IHDR_OTHER_BYTES;
 
     // Read color type and verify if there are misconfigurations
-    memcpy(&ihdr->colorType, ihdrChunk->data + index, IHDR_OTHER_BYTES);
+    ihdr->colorType = (ColorType)ihdrChunk->data[index];
     if(ihdr->colorType != GRAYSCALE && ihdr->colorType != TRUECOLOR && ihdr->colorType != INDEXED_COLOR && ihdr->colorType != GRAYSCALE_WITH_ALPHA && ihdr->colorType != TRUECOLOR_WITH_ALPHA)
     {
         fprintf(stderr, "Error: Invalid IHDR color type!\n");
@@ -306,156 +645,9412 @@ int GetIhdrChunkData(const Chunk* ihdrChunk, Ihdr* ihdr, const bool isLittleEndi
         return -1;
     }
 
+    // Valid headers can still need what this build left out
+    if(!IsFormatBuilt(ihdr))
+    {
+        fprintf(stderr, "Error: IHDR format not supported by this build!\n");
+        return -1;
+    }
+
     return 0;
 }
 
-// Function to decompress IDAT chunks
-int DecompressIdatChuncks(Chunk* chunkDynamicArray, const unsigned int chunkArraySize, unsigned char* uncompressedDestination, unsigned long* uncompressedSize)
+// Function to get the number of samples per pixel of a color type
+static unsigned int GetChannelCount(const ColorType colorType)
 {
-    unsigned char* compressedSource = malloc(ULONG_MAX);
-    if(!compressedSource)
+    switch((int)colorType)
     {
-        fprintf(stderr, "Error: Unable to allocate enough memory for compressed source!\n");
-        return -1;
+        case TRUECOLOR:
+            return 3;
+        case GRAYSCALE_WITH_ALPHA:
+            return 2;
+        case TRUECOLOR_WITH_ALPHA:
+            return 4;
+        default:
+            return 1;
+    }
+}
+
+// Function to get the number of bytes of a filtered scanline, filter type byte excluded
+static unsigned long GetRowBytes(const Ihdr* ihdr, const unsigned int width)
+{
+    return ((unsigned long)width * GetChannelCount(ihdr->colorType) * ihdr->bitDepth + 7) / 8;
+}
+
+// Adam7 pass origins and steps, the last entry is the whole non-interlaced image
+static const unsigned int ADAM7_X_START[] = {0, 4, 0, 2, 0, 1, 0, 0};
+static const unsigned int ADAM7_Y_START[] = {0, 0, 4, 0, 2, 0, 1, 0};
+static const unsigned int ADAM7_X_STEP[] = {8, 8, 4, 4, 2, 2, 1, 1};
+static const unsigned int ADAM7_Y_STEP[] = {8, 8, 8, 4, 4, 2, 2, 1};
+#define NON_INTERLACED_PASS 7
+
+// Function to get the size in pixels of an Adam7 pass, zero if the pass is empty
+static void GetPassSize(const Ihdr* ihdr, const int pass, unsigned int* passWidth, unsigned int* passHeight)
+{
+    if(ihdr->width <= ADAM7_X_START[pass] || ihdr->height <= ADAM7_Y_START[pass])
+    {
+        *passWidth = 0;
+        *passHeight = 0;
+        return;
     }
-    unsigned int compressedSourceIndex = 0;
-    unsigned long compressedSize = 0;
-    // Collect all compressed data from IDAT chunks
-    for(int i = 0; i < chunkArraySize; i++)
+
+    *passWidth = (ihdr->width - ADAM7_X_START[pass] + ADAM7_X_STEP[pass] - 1) / ADAM7_X_STEP[pass];
+    *passHeight = (ihdr->height - ADAM7_Y_START[pass] + ADAM7_Y_STEP[pass] - 1) / ADAM7_Y_STEP[pass];
+}
+
+// Function to get the size of the whole inflated IDAT stream
+static unsigned long GetRawImageSize(const Ihdr* ihdr)
+{
+    const int firstPass = IsInterlaced(ihdr) ? 0 : NON_INTERLACED_PASS;
+    const int lastPass = IsInterlaced(ihdr) ? NON_INTERLACED_PASS - 1 : NON_INTERLACED_PASS;
+
+    // An empty pass has no filter type bytes either
+    unsigned long size = 0;
+    for(int pass = firstPass; pass <= lastPass; pass++)
     {
-        if(strcmp((const char*)(chunkDynamicArray + i)->type, DATA_CHUNK_TYPE) == 0)
+        unsigned int passWidth, passHeight;
+        GetPassSize(ihdr, pass, &passWidth, &passHeight);
+        if(passWidth > 0)
         {
-            memcpy(compressedSource + compressedSourceIndex, (chunkDynamicArray + i)->data, (chunkDynamicArray + i)->dataLength);
-            compressedSize += (chunkDynamicArray + i)->dataLength;
-            compressedSourceIndex++;
+            size += (unsigned long)passHeight * (GetRowBytes(ihdr, passWidth) + 1);
         }
     }
-    realloc(compressedSource, compressedSize);
 
-    // Decompress the collected data
-    uncompressedDestination = malloc(ULONG_MAX);
-    if(!uncompressedDestination)
+    return size;
+}
+
+// Function to decompress IDAT chunks into a destination of exactly the expected size, the stream must be initialized
+static int DecompressIdatChuncks(const Chunk* chunkDynamicArray, const unsigned int chunkArraySize, unsigned char* uncompressedDestination, const unsigned long uncompressedSize, z_stream* stream, DecodeControl* control)
+{
+    if(inflateReset(stream) != Z_OK)
     {
-        free(compressedSource);
-        fprintf(stderr, "Error: Unable to allocate enough memory for uncompressed destination!\n");
+        fprintf(stderr, "Error: Cannot reset the decompressor!\n");
         return -1;
     }
-    int result = uncompress(uncompressedDestination, uncompressedSize, compressedSource, compressedSize);
-    if(result != Z_OK)
+    stream->next_out = uncompressedDestination;
+
+    // Feed each IDAT chunk straight to inflate, giving it at most checkInterval bytes of output at a time
+    // and never crossing a row batch boundary, so the decode can yield there
+    unsigned long nextRowBatch = control->rowBatchBytes;
+    unsigned char overflow;
+    int result = Z_OK;
+    int status = 0;
+    for(unsigned int i = 0; i < chunkArraySize && result != Z_STREAM_END && status == 0; i++)
+    {
+        if(strcmp((const char*)(chunkDynamicArray + i)->type, DATA_CHUNK_TYPE) != 0)
+        {
+            continue;
+        }
+
+        stream->next_in = (chunkDynamicArray + i)->data;
+        stream->avail_in = (chunkDynamicArray + i)->dataLength;
+        while(stream->avail_in > 0 && result != Z_STREAM_END)
+        {
+            status = CheckDecodeControl(control);
+            if(status != 0)
+            {
+                break;
+            }
+
+            // Once the destination is full only the zlib trailer may be left, anything else is an error
+            const unsigned long remaining = uncompressedSize - stream->total_out;
+            if(remaining == 0)
+            {
+                stream->next_out = &overflow;
+                stream->avail_out = 1;
+            }
+            else
+            {
+                stream->avail_out = remaining < control->checkInterval ? remaining : control->checkInterval;
+                if(nextRowBatch > 0 && stream->avail_out > nextRowBatch - stream->total_out)
+                {
+                    stream->avail_out = nextRowBatch - stream->total_out;
+                }
+            }
+
+            result = inflate(stream, Z_NO_FLUSH);
+            control->bytesInflated = stream->total_out;
+            if((result != Z_OK && result != Z_STREAM_END) || stream->total_out > uncompressedSize)
+            {
+                status = -1;
+                break;
+            }
+            if(nextRowBatch > 0 && stream->total_out == nextRowBatch)
+            {
+                YieldDecodeControl(control);
+                nextRowBatch += control->rowBatchBytes;
+            }
+        }
+    }
+
+    if(status == 0 && (result != Z_STREAM_END || stream->total_out != uncompressedSize))
+    {
+        status = -1;
+    }
+    if(status == -1)
     {
-        free(compressedSource);
         fprintf(stderr, "Error: Cannot decompress!\n");
-        return -1;
     }
 
-    free(compressedSource);
-    realloc(uncompressedDestination, *uncompressedSize);
+    return status;
+}
 
-    return 0;
+// Function to free every chunk and the dynamic array holding them
+static void FreeChunks(Chunk* chunkDynamicArray, const unsigned int chunkArraySize)
+{
+    for(unsigned int i = 0; i < chunkArraySize; i++)
+    {
+        free((chunkDynamicArray + i)->data);
+    }
+    free(chunkDynamicArray);
 }
 
-int main(int argc, char** argv, char** envs)
+// Structure to represent the PLTE chunk data, entries are expanded to RGBA
+typedef struct Palette
 {
-    bool isLittleEndian = IsLittleEndian();
+    unsigned int count;
+    unsigned char entries[MAX_PALETTE_ENTRIES][4];
+} Palette;
 
-    // Get the size of the file
-    FILE* file;
-    const int fileSize = GetFileSize(file);
-    if(fileSize == -1)
+// Function to get data from PLTE chunk
+static int GetPaletteChunkData(const Chunk* paletteChunk, Palette* palette)
+{
+    if(paletteChunk->dataLength % 3 != 0 || paletteChunk->dataLength / 3 > MAX_PALETTE_ENTRIES)
     {
+        fprintf(stderr, "Error: Invalid PLTE chunk length!\n");
         return -1;
     }
 
-    // Allocate a buffer to hold the file content
-    const unsigned char* buffer = (unsigned char*)malloc(fileSize);
-    if(!buffer)
+    palette->count = paletteChunk->dataLength / 3;
+    for(unsigned int i = 0; i < palette->count; i++)
     {
-        fprintf(stderr, "Error: Unable to allocate enough memory!\n");
-        return -1;
+        memcpy(palette->entries[i], paletteChunk->data + i * 3, 3);
+        palette->entries[i][3] = 255;
     }
 
-    // Fill the buffer with file content and validate PNG signature
-    unsigned int cursor;
-    if(FillBuffer(file, (unsigned char*)buffer, fileSize, &cursor) == -1)
+    return 0;
+}
+
+#if PNG_SUPPORT_ANCILLARY_CHUNKS
+// Function to get data from the tRNS chunk of a palette image, the entries it leaves out stay opaque
+static int GetTransparencyChunkData(const Chunk* transparencyChunk, Palette* palette)
+{
+    if(transparencyChunk->dataLength > palette->count)
     {
+        fprintf(stderr, "Error: Invalid tRNS chunk length!\n");
         return -1;
     }
 
-    Chunk* chunkDynamicArray = NULL;
-    unsigned int chunkArraySize = 0;
-    // Read chunks until the last chunk is encountered
-    for(;;)
+    for(unsigned int i = 0; i < transparencyChunk->dataLength; i++)
     {
-        Chunk chunk;
-        // Read the next chunk
-        if(ReadChunk(buffer, &cursor, &chunk, isLittleEndian) == -1)
+        palette->entries[i][3] = transparencyChunk->data[i];
+    }
+
+    return 0;
+}
+#endif
+
+// Enumeration for the EXIF orientations, each names where the first stored row and column belong when displayed
+typedef enum Orientation
+{
+    ORIENTATION_NONE,               // Unknown, the image is left as stored
+    ORIENTATION_TOP_LEFT,           // Already upright
+    ORIENTATION_TOP_RIGHT,          // Mirrored left to right
+    ORIENTATION_BOTTOM_RIGHT,       // Turned by 180 degrees
+    ORIENTATION_BOTTOM_LEFT,        // Mirrored top to bottom
+    ORIENTATION_LEFT_TOP,           // Transposed
+    ORIENTATION_RIGHT_TOP,          // Needs turning 90 degrees clockwise
+    ORIENTATION_RIGHT_BOTTOM,       // Transposed along the other diagonal
+    ORIENTATION_LEFT_BOTTOM         // Needs turning 90 degrees counterclockwise
+} Orientation;
+
+#if PNG_SUPPORT_ANCILLARY_CHUNKS
+// Function to read a 16 or 32 bits value of an EXIF block in its byte order
+static uint32_t ReadExifValue(const unsigned char* data, const unsigned int length, const bool bigEndian)
+{
+    uint32_t value = 0;
+    for(unsigned int i = 0; i < length; i++)
+    {
+        value |= (uint32_t)data[bigEndian ? i : length - 1 - i] << ((length - 1 - i) * 8);
+    }
+
+    return value;
+}
+
+// Function to get the orientation tag from the first IFD of an eXIf chunk, ORIENTATION_NONE when there is none
+static Orientation GetExifOrientation(const Chunk* exifChunk)
+{
+    const unsigned char* data = exifChunk->data;
+    const unsigned long length = exifChunk->dataLength;
+    if(!data || length < 8 || (memcmp(data, "II*\0", 4) != 0 && memcmp(data, "MM\0*", 4) != 0))
+    {
+        return ORIENTATION_NONE;
+    }
+
+    const bool bigEndian = data[0] == 'M';
+    const unsigned long directory = ReadExifValue(data + 4, 4, bigEndian);
+    if(directory > length - 2)
+    {
+        return ORIENTATION_NONE;
+    }
+    const unsigned int entryCount = ReadExifValue(data + directory, 2, bigEndian);
+    for(unsigned long entry = directory + 2, i = 0; i < entryCount && entry + 12 <= length; i++, entry += 12)
+    {
+        // A single SHORT sits in the first bytes of the value field
+        if(ReadExifValue(data + entry, 2, bigEndian) == EXIF_ORIENTATION_TAG && ReadExifValue(data + entry + 2, 2, bigEndian) == 3)
         {
-            return -1;
+            const uint32_t orientation = ReadExifValue(data + entry + 8, 2, bigEndian);
+            return orientation >= ORIENTATION_TOP_LEFT && orientation <= ORIENTATION_LEFT_BOTTOM ? (Orientation)orientation : ORIENTATION_NONE;
         }
+    }
 
-        // Append the chunk to the dynamic array
-        if(AppendChunk(&chunkDynamicArray, ++chunkArraySize, &chunk) == -1)
-        {
-            for(int i = 0; i < chunkArraySize - 1; i++)
-            {
-                free((chunkDynamicArray + i)->data);
-            }
-            free(chunkDynamicArray);
-            free(chunk.data);
-            free((unsigned char*)buffer);
-            return -1;
-        }      
+    return ORIENTATION_NONE;
+}
+#endif
 
-        // Break the loop if the last chunk is reached
-        if(strcmp((const char*)chunk.type, LAST_CHUNK_TYPE_SIGNATURE) == 0)
-        {
-            free((unsigned char*)buffer);
-            break;
-        } 
+// Enumeration for what alpha is flattened onto while rows are written
+typedef enum BackgroundMode
+{
+    BACKGROUND_NONE,                // Alpha is kept
+    BACKGROUND_COLOR,               // The colour of the options
+    BACKGROUND_FILE                 // The bKGD chunk, or the colour of the options when there is none
+} BackgroundMode;
+
+// Enumeration for what is done with the precision an sBIT chunk declares
+typedef enum SignificantBitsMode
+{
+    SIGNIFICANT_BITS_IGNORE,        // Samples are scaled as if every bit counted
+    SIGNIFICANT_BITS_SHIFT,         // Samples keep only their significant bits, right aligned
+    SIGNIFICANT_BITS_RESCALE        // The significant bits are rescaled to the full output range
+} SignificantBitsMode;
+
+// Enumeration for the pixel layouts the decoder can output
+typedef enum PixelFormat
+{
+    FORMAT_RGBA8,
+    FORMAT_RGBA16,                  // Native endian 16 bits channels, nothing of a 16 bits image is lost
+    FORMAT_INDEXED8,                // One palette index per byte, palette images only, the palette comes with the image
+    FORMAT_PACKED                   // Samples as stored once unfiltered, big endian and sub-byte ones from the high bit down
+} PixelFormat;
+
+// Function to get the bytes a pixel takes in a format
+static unsigned int GetPixelBytes(const PixelFormat format)
+{
+    switch(format)
+    {
+        case FORMAT_RGBA16:
+            return 8;
+        case FORMAT_INDEXED8:
+            return 1;
+        case FORMAT_PACKED:
+            return 0;               // Packed pixels don't take whole bytes, their rows are sized by GetRowBytes
+        default:
+            return 4;
     }
+}
 
-    Ihdr ihdr;
-    // Get information from the IHDR chunk
-    if(GetIhdrChunkData(&chunkDynamicArray[0], &ihdr, isLittleEndian) == -1)
+// Function to get the bytes the pixels of an image take in a format, false when they don't fit an unsigned long
+static bool GetImageBytes(const Ihdr* ihdr, const PixelFormat format, unsigned long* imageBytes)
+{
+    // Packed rows are as wide as the stored samples, at most 64 bits a pixel so a row always fits 64 bits
+    const unsigned long long rowBytes = format == FORMAT_PACKED ? ((unsigned long long)ihdr->width * GetChannelCount(ihdr->colorType) * ihdr->bitDepth + 7) / 8 :
+        (unsigned long long)ihdr->width * GetPixelBytes(format);
+    if(rowBytes > ULONG_MAX / ihdr->height)
+    {
+        return false;
+    }
+    *imageBytes = (unsigned long)(rowBytes * ihdr->height);
+
+    return true;
+}
+
+// Structure to represent a decoded image
+typedef struct Image
+{
+    unsigned int width;
+    unsigned int height;
+    unsigned long stride;
+    PixelFormat format;
+    unsigned long size;
+    unsigned char* pixels;
+    int sharedFile;                 // Sealed memfd backing the pixels, -1 for heap pixels
+    unsigned char* mapping;         // Whole mapping the pixels live in, NULL for heap pixels
+    unsigned long mappingSize;
+    ColorType colorType;            // How FORMAT_PACKED samples are laid out
+    unsigned int bitDepth;
+    Palette palette;                // PLTE with tRNS alpha of a palette image, empty otherwise
+    bool hasColorKey;               // tRNS colour of a greyscale or truecolour image, in stored sample values
+    uint16_t colorKey[3];
+} Image;
+
+// Structure describing how to map a shared image, sent along with its file descriptor
+typedef struct ImageLayout
+{
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+    uint32_t format;
+    uint64_t offset;
+    uint64_t size;
+} ImageLayout;
+
+// Structure to receive the rows of a decode top to bottom as they are reconstructed, instead of the image keeping them
+typedef struct RowSink
+{
+    int (*consumeRow)(void* context, const Image* image, unsigned int y, const unsigned char* pixels);
+    void* context;
+} RowSink;
+
+// Structure to represent the caller choices of a decode
+typedef struct DecodeOptions
+{
+    bool sharedOutput;              // Allocate the pixels in a memfd sealed once decoding is done
+    PixelFormat format;
+    const RowSink* rowSink;         // Optional, a non-interlaced image then only holds the row being handed over
+    Orientation orientation;        // Applied while rows are written, ORIENTATION_NONE leaves the image as stored
+    bool applyExifOrientation;      // An orientation tag in the eXIf chunk takes precedence
+    BackgroundMode background;      // Composited pixels come out opaque
+    uint16_t backgroundColor[3];    // 16 bits RGB, rounded for 8 bits output
+    SignificantBitsMode significantBits;    // Applies to RGBA output of greyscale and truecolour images
+} DecodeOptions;
+
+// Function to tell if the rows of a decode go to its sink as they are reconstructed, interlaced images need every pass first
+static bool StreamsRowsToSink(const Ihdr* ihdr, const DecodeOptions* options)
+{
+    return options && options->rowSink && !IsInterlaced(ihdr);
+}
+
+// Function to allocate the pixels of an image, on the heap or in a memfd
+static int AllocateImagePixels(Image* image, const DecodeOptions* options)
+{
+    image->sharedFile = -1;
+    image->mapping = NULL;
+    if(!options || !options->sharedOutput)
     {
-        for(int i = 0; i < chunkArraySize; i++)
+        image->pixels = malloc(image->size);
+        if(!image->pixels)
         {
-            free((chunkDynamicArray + i)->data);
+            fprintf(stderr, "Error: Unable to allocate enough memory for the image!\n");
+            return -1;
         }
-        free(chunkDynamicArray);
-        return -1;
+        return 0;
     }
 
-    unsigned char* uncompressedDestination;
-    unsigned long uncompressedSize = ULONG_MAX;
-    // Decompress IDAT chunks
-    if(DecompressIdatChuncks(chunkDynamicArray, chunkArraySize, uncompressedDestination, &uncompressedSize) == -1)
+#ifdef __linux__
+    const int memoryFile = memfd_create("png-pixels", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if(memoryFile < 0 || ftruncate(memoryFile, (off_t)image->size) < 0)
     {
-        free(uncompressedDestination);
-        for(int i = 0; i < chunkArraySize; i++)
+        if(memoryFile >= 0)
         {
-            free((chunkDynamicArray + i)->data);
+            close(memoryFile);
         }
-        free(chunkDynamicArray);
+        fprintf(stderr, "Error: Can't create shared memory for the image!\n");
         return -1;
     }
-     // Clean up allocated memory
-    for(int i = 0; i < chunkArraySize; i++)
+
+    unsigned char* mapping = mmap(NULL, image->size, PROT_READ | PROT_WRITE, MAP_SHARED, memoryFile, 0);
+    if(mapping == MAP_FAILED)
     {
-        free((chunkDynamicArray + i)->data);
+        close(memoryFile);
+        fprintf(stderr, "Error: Can't map shared memory for the image!\n");
+        return -1;
     }
-    free(chunkDynamicArray);
+    image->pixels = mapping;
+    image->sharedFile = memoryFile;
+    image->mapping = mapping;
+    image->mappingSize = image->size;
+
+    return 0;
+#else
+    fprintf(stderr, "Error: Shared image output is only available on Linux!\n");
+    return -1;
+#endif
+}
+
+// Function to make a shared image immutable, the decoder keeps a read-only view
+static int SealSharedImage(Image* image)
+{
+#ifdef __linux__
+    // Writes can only be sealed once no shared mapping is left
+    munmap(image->mapping, image->mappingSize);
+    image->pixels = NULL;
+    image->mapping = NULL;
+    if(fcntl(image->sharedFile, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0)
+    {
+        fprintf(stderr, "Error: Can't seal shared memory for the image!\n");
+        return -1;
+    }
+
+    image->pixels = mmap(NULL, image->size, PROT_READ, MAP_SHARED, image->sharedFile, 0);
+    if(image->pixels == MAP_FAILED)
+    {
+        image->pixels = NULL;
+        fprintf(stderr, "Error: Can't map shared memory for the image!\n");
+        return -1;
+    }
+    image->mapping = image->pixels;
+#else
+    (void)image;
+#endif
+
+    return 0;
+}
 
-    for(int i = 0; i < uncompressedSize; i+= ihdr.width * 4)
+// Function to free the pixels of an image, wherever they live
+static void FreeImage(Image* image)
+{
+#ifdef __linux__
+    if(image->mapping)
+    {
+        munmap(image->mapping, image->mappingSize);
+        image->mapping = NULL;
+        image->pixels = NULL;
+    }
+    if(image->sharedFile >= 0)
+    {
+        close(image->sharedFile);
+        image->sharedFile = -1;
+    }
+#endif
+
+    free(image->pixels);
+    image->pixels = NULL;
+}
+
+#if PNG_SUPPORT_DAEMON
+// Function to describe the memory layout of an image for a consumer mapping it
+static void GetImageLayout(const Image* image, ImageLayout* layout)
+{
+    layout->width = image->width;
+    layout->height = image->height;
+    layout->stride = (uint32_t)image->stride;
+    layout->format = (uint32_t)image->format;
+    layout->offset = 0;
+    layout->size = image->size;
+}
+#endif
+
+// Structure holding the decoder state that can be kept warm between decodes
+typedef struct DecodeWorkspace
+{
+    z_stream stream;
+    unsigned char* raw;
+    unsigned long rawCapacity;
+} DecodeWorkspace;
+
+// Function to initialize a decode workspace
+static int InitDecodeWorkspace(DecodeWorkspace* workspace)
+{
+    memset(workspace, 0, sizeof(*workspace));
+    if(inflateInit(&workspace->stream) != Z_OK)
+    {
+        fprintf(stderr, "Error: Cannot initialize the decompressor!\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+// Function to free a decode workspace
+static void FreeDecodeWorkspace(DecodeWorkspace* workspace)
+{
+    inflateEnd(&workspace->stream);
+    free(workspace->raw);
+    workspace->raw = NULL;
+    workspace->rawCapacity = 0;
+}
+
+// Function to make sure the workspace can hold the inflated IDAT stream
+static int ReserveRawBuffer(DecodeWorkspace* workspace, const unsigned long size)
+{
+    if(size <= workspace->rawCapacity)
     {
-        printf("%hhu\n", *(uncompressedDestination + i));
+        return 0;
     }
 
-    //const unsigned int bytesPerPixel = 4;
-    //for(int i = 0; i < ihdr.height * ihdr.width; i+= ihdr.width * bytesPerPixel)
-    //{
-    //    printf("%u\n", *(uncompressedDestination + i));
-    //}
+    unsigned char* raw = realloc(workspace->raw, size);
+    if(!raw)
+    {
+        fprintf(stderr, "Error: Unable to allocate enough memory for uncompressed destination!\n");
+        return -1;
+    }
+    workspace->raw = raw;
+    workspace->rawCapacity = size;
 
     return 0;
-}
\ No newline at end of file
+}
+
+// Function to get the Paeth predictor of three neighbouring bytes
+static unsigned char PaethPredictor(const unsigned char left, const unsigned char up, const unsigned char upLeft)
+{
+    const int estimate = left + up - upLeft;
+    const int distanceLeft = abs(estimate - left);
+    const int distanceUp = abs(estimate - up);
+    const int distanceUpLeft = abs(estimate - upLeft);
+
+    if(distanceLeft <= distanceUp && distanceLeft <= distanceUpLeft)
+    {
+        return left;
+    }
+
+    return distanceUp <= distanceUpLeft ? up : upLeft;
+}
+
+// Function to reverse the filter of a scanline in place, previousRow is NULL for the first row of a pass. It is inlined into
+// the row decoders with a constant bytesPerPixel, and the first pixel is split off rather than tested for at every byte
+ALWAYS_INLINE int UnfilterRow(unsigned char* row, const unsigned char* previousRow, const unsigned long rowBytes, const unsigned int bytesPerPixel)
+{
+    const unsigned char filterType = row[0];
+    unsigned char* current = row + 1;
+    const unsigned char* previous = previousRow ? previousRow + 1 : NULL;
+    const unsigned long firstBytes = bytesPerPixel < rowBytes ? bytesPerPixel : rowBytes;
+
+    switch(filterType)
+    {
+        case 0:
+            break;
+        case 1:
+            for(unsigned long i = bytesPerPixel; i < rowBytes; i++)
+            {
+                current[i] += current[i - bytesPerPixel];
+            }
+            break;
+        case 2:
+            for(unsigned long i = 0; previous && i < rowBytes; i++)
+            {
+                current[i] += previous[i];
+            }
+            break;
+        case 3:
+            if(!previous)
+            {
+                for(unsigned long i = bytesPerPixel; i < rowBytes; i++)
+                {
+                    current[i] += (unsigned char)(current[i - bytesPerPixel] / 2);
+                }
+                break;
+            }
+            for(unsigned long i = 0; i < firstBytes; i++)
+            {
+                current[i] += (unsigned char)(previous[i] / 2);
+            }
+            for(unsigned long i = bytesPerPixel; i < rowBytes; i++)
+            {
+                current[i] += (unsigned char)((current[i - bytesPerPixel] + previous[i]) / 2);
+            }
+            break;
+        case 4:
+            // Without a row above the predictor is always the left byte, and for the first pixel it is always the byte above
+            if(!previous)
+            {
+                for(unsigned long i = bytesPerPixel; i < rowBytes; i++)
+                {
+                    current[i] += current[i - bytesPerPixel];
+                }
+                break;
+            }
+            for(unsigned long i = 0; i < firstBytes; i++)
+            {
+                current[i] += previous[i];
+            }
+            for(unsigned long i = bytesPerPixel; i < rowBytes; i++)
+            {
+                current[i] += PaethPredictor(current[i - bytesPerPixel], previous[i], previous[i - bytesPerPixel]);
+            }
+            break;
+        default:
+            fprintf(stderr, "Error: Invalid filter type %u!\n", filterType);
+            return -1;
+    }
+
+    return 0;
+}
+
+// Function to read the sample at index of an unfiltered scanline, whatever the bit depth
+static unsigned int GetSample(const unsigned char* samples, const unsigned long index, const unsigned int bitDepth)
+{
+    switch(bitDepth)
+    {
+        case 16:
+            return (samples[index * 2] << 8) | samples[index * 2 + 1];
+        case 8:
+            return samples[index];
+        default:
+        {
+            const unsigned long bit = index * bitDepth;
+            const unsigned int shift = 8 - bitDepth - (unsigned int)(bit % 8);
+            return (samples[bit / 8] >> shift) & ((1u << bitDepth) - 1);
+        }
+    }
+}
+
+// Function to write the sample at index of a scanline, whatever the bit depth, sub-byte rows have to start zeroed
+static void SetSample(unsigned char* samples, const unsigned long index, const unsigned int bitDepth, const unsigned int value)
+{
+    switch(bitDepth)
+    {
+        case 16:
+            samples[index * 2] = (unsigned char)(value >> 8);
+            samples[index * 2 + 1] = (unsigned char)value;
+            break;
+        case 8:
+            samples[index] = (unsigned char)value;
+            break;
+        default:
+        {
+            const unsigned long bit = index * bitDepth;
+            samples[bit / 8] |= (unsigned char)(value << (8 - bitDepth - (unsigned int)(bit % 8)));
+            break;
+        }
+    }
+}
+
+// Function to scale a sample of any bit depth to 8 bits
+static unsigned char ScaleSampleTo8(const unsigned int sample, const unsigned int bitDepth)
+{
+    if(bitDepth == 16)
+    {
+        return (unsigned char)(sample >> 8);
+    }
+
+    return (unsigned char)(sample * 255 / ((1u << bitDepth) - 1));
+}
+
+// Function to convert an unfiltered scanline to RGBA8 pixels, writing every xStep pixel of the destination row. It is inlined
+// into the row decoders with a constant colour type and bit depth, so the switches fold away
+ALWAYS_INLINE void ConvertRowToRgba8(const ColorType colorType, const unsigned int bitDepth, const Palette* palette, const unsigned char* samples, const unsigned int width, unsigned char* destination, const unsigned int xStep)
+{
+    const unsigned int channels = GetChannelCount(colorType);
+    if(colorType == TRUECOLOR_WITH_ALPHA && bitDepth == 8 && xStep == 1)
+    {
+        memcpy(destination, samples, (unsigned long)width * 4);
+        return;
+    }
+
+    for(unsigned int x = 0; x < width; x++)
+    {
+        unsigned char* pixel = destination + (unsigned long)x * xStep * 4;
+        const unsigned long index = (unsigned long)x * channels;
+
+        switch((int)colorType)
+        {
+            case GRAYSCALE:
+                pixel[0] = pixel[1] = pixel[2] = ScaleSampleTo8(GetSample(samples, index, bitDepth), bitDepth);
+                pixel[3] = 255;
+                break;
+            case GRAYSCALE_WITH_ALPHA:
+                pixel[0] = pixel[1] = pixel[2] = ScaleSampleTo8(GetSample(samples, index, bitDepth), bitDepth);
+                pixel[3] = ScaleSampleTo8(GetSample(samples, index + 1, bitDepth), bitDepth);
+                break;
+            case INDEXED_COLOR:
+            {
+                const unsigned int entry = GetSample(samples, index, bitDepth);
+                if(palette && entry < palette->count)
+                {
+                    memcpy(pixel, palette->entries[entry], 4);
+                }
+                else
+                {
+                    memset(pixel, 0, 4);
+                }
+                break;
+            }
+            case TRUECOLOR:
+                for(unsigned int channel = 0; channel < 3; channel++)
+                {
+                    pixel[channel] = ScaleSampleTo8(GetSample(samples, index + channel, bitDepth), bitDepth);
+                }
+                pixel[3] = 255;
+                break;
+            case TRUECOLOR_WITH_ALPHA:
+                for(unsigned int channel = 0; channel < 4; channel++)
+                {
+                    pixel[channel] = ScaleSampleTo8(GetSample(samples, index + channel, bitDepth), bitDepth);
+                }
+                break;
+        }
+    }
+}
+
+// Function to scale a sample of any bit depth to 16 bits
+static uint16_t ScaleSampleTo16(const unsigned int sample, const unsigned int bitDepth)
+{
+    if(bitDepth == 16)
+    {
+        return (uint16_t)sample;
+    }
+
+    return (uint16_t)(sample * 65535 / ((1u << bitDepth) - 1));
+}
+
+// Function to convert an unfiltered scanline to RGBA16 pixels, writing every xStep pixel of the destination row. It is
+// inlined into the row decoders like the RGBA8 conversion
+ALWAYS_INLINE void ConvertRowToRgba16(const ColorType colorType, const unsigned int bitDepth, const Palette* palette, const unsigned char* samples, const unsigned int width, uint16_t* destination, const unsigned int xStep)
+{
+    const unsigned int channels = GetChannelCount(colorType);
+
+    for(unsigned int x = 0; x < width; x++)
+    {
+        uint16_t* pixel = destination + (unsigned long)x * xStep * 4;
+        const unsigned long index = (unsigned long)x * channels;
+
+        switch((int)colorType)
+        {
+            case GRAYSCALE:
+                pixel[0] = pixel[1] = pixel[2] = ScaleSampleTo16(GetSample(samples, index, bitDepth), bitDepth);
+                pixel[3] = 65535;
+                break;
+            case GRAYSCALE_WITH_ALPHA:
+                pixel[0] = pixel[1] = pixel[2] = ScaleSampleTo16(GetSample(samples, index, bitDepth), bitDepth);
+                pixel[3] = ScaleSampleTo16(GetSample(samples, index + 1, bitDepth), bitDepth);
+                break;
+            case INDEXED_COLOR:
+            {
+                const unsigned int entry = GetSample(samples, index, bitDepth);
+                for(unsigned int channel = 0; channel < 4; channel++)
+                {
+                    pixel[channel] = palette && entry < palette->count ? palette->entries[entry][channel] * 257 : 0;
+                }
+                break;
+            }
+            case TRUECOLOR:
+                for(unsigned int channel = 0; channel < 3; channel++)
+                {
+                    pixel[channel] = ScaleSampleTo16(GetSample(samples, index + channel, bitDepth), bitDepth);
+                }
+                pixel[3] = 65535;
+                break;
+            case TRUECOLOR_WITH_ALPHA:
+                for(unsigned int channel = 0; channel < 4; channel++)
+                {
+                    pixel[channel] = ScaleSampleTo16(GetSample(samples, index + channel, bitDepth), bitDepth);
+                }
+                break;
+        }
+    }
+}
+
+// Function pointer types of the row routines specialised for one colour type and bit depth
+typedef int (*UnfilterRowFunction)(unsigned char* row, const unsigned char* previousRow, const unsigned long rowBytes);
+typedef void (*ConvertRowToRgba8Function)(const Palette* palette, const unsigned char* samples, const unsigned int width, unsigned char* destination, const unsigned int xStep);
+typedef void (*ConvertRowToRgba16Function)(const Palette* palette, const unsigned char* samples, const unsigned int width, uint16_t* destination, const unsigned int xStep);
+
+// Structure to hold the row routines of one colour type and bit depth, the conversions are indexed by the interlace method
+typedef struct RowDecoder
+{
+    ColorType colorType;
+    unsigned int bitDepth;
+    UnfilterRowFunction unfilterRow;
+    ConvertRowToRgba8Function convertRowToRgba8[2];
+    ConvertRowToRgba16Function convertRowToRgba16[2];
+} RowDecoder;
+
+// Macro to instantiate the row routines of one colour type and bit depth, rows of non-interlaced images always step one pixel
+#define DEFINE_ROW_DECODER(name, colorType, channels, bitDepth) \
+    static int UnfilterRow##name(unsigned char* row, const unsigned char* previousRow, const unsigned long rowBytes) \
+    { \
+        return UnfilterRow(row, previousRow, rowBytes, ((channels) * (bitDepth) + 7) / 8); \
+    } \
+    static void ConvertRowToRgba8##name(const Palette* palette, const unsigned char* samples, const unsigned int width, unsigned char* destination, const unsigned int xStep) \
+    { \
+        (void)xStep; \
+        ConvertRowToRgba8(colorType, bitDepth, palette, samples, width, destination, 1); \
+    } \
+    static void ConvertRowToRgba16##name(const Palette* palette, const unsigned char* samples, const unsigned int width, uint16_t* destination, const unsigned int xStep) \
+    { \
+        (void)xStep; \
+        ConvertRowToRgba16(colorType, bitDepth, palette, samples, width, destination, 1); \
+    } \
+    DEFINE_ADAM7_ROW_DECODER(name, colorType, bitDepth)
+
+// Macro to instantiate the conversions of interlaced rows, which step ADAM7_X_STEP pixels, only when interlacing is built
+#if PNG_SUPPORT_INTERLACE
+#define DEFINE_ADAM7_ROW_DECODER(name, colorType, bitDepth) \
+    static void ConvertRowToRgba8##name##Adam7(const Palette* palette, const unsigned char* samples, const unsigned int width, unsigned char* destination, const unsigned int xStep) \
+    { \
+        ConvertRowToRgba8(colorType, bitDepth, palette, samples, width, destination, xStep); \
+    } \
+    static void ConvertRowToRgba16##name##Adam7(const Palette* palette, const unsigned char* samples, const unsigned int width, uint16_t* destination, const unsigned int xStep) \
+    { \
+        ConvertRowToRgba16(colorType, bitDepth, palette, samples, width, destination, xStep); \
+    }
+#define ADAM7_ROW_CONVERSION(function) function##Adam7
+#else
+#define DEFINE_ADAM7_ROW_DECODER(name, colorType, bitDepth)
+#define ADAM7_ROW_CONVERSION(function) NULL
+#endif
+
+// Macro to fill the table entry of the row routines instantiated under name
+#define ROW_DECODER(name, colorType, bitDepth) \
+    {colorType, bitDepth, UnfilterRow##name, {ConvertRowToRgba8##name, ADAM7_ROW_CONVERSION(ConvertRowToRgba8##name)}, \
+        {ConvertRowToRgba16##name, ADAM7_ROW_CONVERSION(ConvertRowToRgba16##name)}}
+
+// Every colour type and bit depth pair GetIhdrChunkData accepts and the build supports
+#if PNG_SUPPORT_GRAYSCALE && PNG_SUPPORT_LOW_BIT_DEPTHS
+DEFINE_ROW_DECODER(Gray1, GRAYSCALE, 1, 1)
+DEFINE_ROW_DECODER(Gray2, GRAYSCALE, 1, 2)
+DEFINE_ROW_DECODER(Gray4, GRAYSCALE, 1, 4)
+#endif
+#if PNG_SUPPORT_GRAYSCALE
+DEFINE_ROW_DECODER(Gray8, GRAYSCALE, 1, 8)
+#endif
+#if PNG_SUPPORT_GRAYSCALE && PNG_SUPPORT_16_BIT_DEPTH
+DEFINE_ROW_DECODER(Gray16, GRAYSCALE, 1, 16)
+#endif
+#if PNG_SUPPORT_TRUECOLOR
+DEFINE_ROW_DECODER(Rgb8, TRUECOLOR, 3, 8)
+#endif
+#if PNG_SUPPORT_TRUECOLOR && PNG_SUPPORT_16_BIT_DEPTH
+DEFINE_ROW_DECODER(Rgb16, TRUECOLOR, 3, 16)
+#endif
+#if PNG_SUPPORT_INDEXED_COLOR && PNG_SUPPORT_LOW_BIT_DEPTHS
+DEFINE_ROW_DECODER(Indexed1, INDEXED_COLOR, 1, 1)
+DEFINE_ROW_DECODER(Indexed2, INDEXED_COLOR, 1, 2)
+DEFINE_ROW_DECODER(Indexed4, INDEXED_COLOR, 1, 4)
+#endif
+#if PNG_SUPPORT_INDEXED_COLOR
+DEFINE_ROW_DECODER(Indexed8, INDEXED_COLOR, 1, 8)
+#endif
+#if PNG_SUPPORT_GRAYSCALE_WITH_ALPHA
+DEFINE_ROW_DECODER(GrayAlpha8, GRAYSCALE_WITH_ALPHA, 2, 8)
+#endif
+#if PNG_SUPPORT_GRAYSCALE_WITH_ALPHA && PNG_SUPPORT_16_BIT_DEPTH
+DEFINE_ROW_DECODER(GrayAlpha16, GRAYSCALE_WITH_ALPHA, 2, 16)
+#endif
+#if PNG_SUPPORT_TRUECOLOR_WITH_ALPHA
+DEFINE_ROW_DECODER(Rgba8, TRUECOLOR_WITH_ALPHA, 4, 8)
+#endif
+#if PNG_SUPPORT_TRUECOLOR_WITH_ALPHA && PNG_SUPPORT_16_BIT_DEPTH
+DEFINE_ROW_DECODER(Rgba16, TRUECOLOR_WITH_ALPHA, 4, 16)
+#endif
+
+static const RowDecoder ROW_DECODERS[] =
+{
+#if PNG_SUPPORT_GRAYSCALE && PNG_SUPPORT_LOW_BIT_DEPTHS
+    ROW_DECODER(Gray1, GRAYSCALE, 1),
+    ROW_DECODER(Gray2, GRAYSCALE, 2),
+    ROW_DECODER(Gray4, GRAYSCALE, 4),
+#endif
+#if PNG_SUPPORT_GRAYSCALE
+    ROW_DECODER(Gray8, GRAYSCALE, 8),
+#endif
+#if PNG_SUPPORT_GRAYSCALE && PNG_SUPPORT_16_BIT_DEPTH
+    ROW_DECODER(Gray16, GRAYSCALE, 16),
+#endif
+#if PNG_SUPPORT_TRUECOLOR
+    ROW_DECODER(Rgb8, TRUECOLOR, 8),
+#endif
+#if PNG_SUPPORT_TRUECOLOR && PNG_SUPPORT_16_BIT_DEPTH
+    ROW_DECODER(Rgb16, TRUECOLOR, 16),
+#endif
+#if PNG_SUPPORT_INDEXED_COLOR && PNG_SUPPORT_LOW_BIT_DEPTHS
+    ROW_DECODER(Indexed1, INDEXED_COLOR, 1),
+    ROW_DECODER(Indexed2, INDEXED_COLOR, 2),
+    ROW_DECODER(Indexed4, INDEXED_COLOR, 4),
+#endif
+#if PNG_SUPPORT_INDEXED_COLOR
+    ROW_DECODER(Indexed8, INDEXED_COLOR, 8),
+#endif
+#if PNG_SUPPORT_GRAYSCALE_WITH_ALPHA
+    ROW_DECODER(GrayAlpha8, GRAYSCALE_WITH_ALPHA, 8),
+#endif
+#if PNG_SUPPORT_GRAYSCALE_WITH_ALPHA && PNG_SUPPORT_16_BIT_DEPTH
+    ROW_DECODER(GrayAlpha16, GRAYSCALE_WITH_ALPHA, 16),
+#endif
+#if PNG_SUPPORT_TRUECOLOR_WITH_ALPHA
+    ROW_DECODER(Rgba8, TRUECOLOR_WITH_ALPHA, 8),
+#endif
+#if PNG_SUPPORT_TRUECOLOR_WITH_ALPHA && PNG_SUPPORT_16_BIT_DEPTH
+    ROW_DECODER(Rgba16, TRUECOLOR_WITH_ALPHA, 16),
+#endif
+};
+
+// Function to pick the row routines of an image once, the header has already been validated
+static const RowDecoder* GetRowDecoder(const Ihdr* ihdr)
+{
+    for(unsigned int i = 0; i < sizeof(ROW_DECODERS) / sizeof(ROW_DECODERS[0]); i++)
+    {
+        if(ROW_DECODERS[i].colorType == ihdr->colorType && ROW_DECODERS[i].bitDepth == ihdr->bitDepth)
+        {
+            return &ROW_DECODERS[i];
+        }
+    }
+
+    fprintf(stderr, "Error: No row decoder for the color type and bit depth!\n");
+    return NULL;
+}
+
+// Structure to carry where the reconstructed rows of one decode go and how they are turned on the way
+typedef struct RowOutput
+{
+    Image* image;
+    const DecodeOptions* options;
+    const RowDecoder* rowDecoder;   // Unfilter and conversion routines of the colour type and bit depth
+    Orientation orientation;        // From the options, or from the eXIf chunk when it is honoured
+    unsigned char* band;            // Converted rows waiting to become columns of a transposed image
+    unsigned int bandRows;
+    uint16_t background[3];         // From the options, or from the bKGD chunk when it is honoured
+    bool hasColorKey;               // From the tRNS chunk of a greyscale or truecolour image
+    uint16_t colorKey[3];
+    bool hasSignificantBits;        // From the sBIT chunk when the options honour it
+    unsigned char significantBits[4];
+    unsigned int significantShifts[4];
+    uint16_t* significantTables[4]; // Significant part of each sample of a pixel to its output value, one allocation
+} RowOutput;
+
+// Function to initialize the output of a decode into image
+static void InitRowOutput(RowOutput* output, Image* image, const DecodeOptions* options)
+{
+    memset(output, 0, sizeof(*output));
+    output->image = image;
+    output->options = options;
+    output->orientation = options ? options->orientation : ORIENTATION_NONE;
+    if(options)
+    {
+        memcpy(output->background, options->backgroundColor, sizeof(output->background));
+    }
+}
+
+// Function to free what the output of a decode needed besides the image
+static void FreeRowOutput(RowOutput* output)
+{
+    free(output->band);
+    output->band = NULL;
+    free(output->significantTables[0]);
+    output->significantTables[0] = NULL;
+}
+
+#if PNG_SUPPORT_ANCILLARY_CHUNKS
+// Function to take the orientation of an eXIf chunk when the options ask for it
+static void ReadExifOrientation(RowOutput* output, const Chunk* exifChunk)
+{
+    if(output->options && output->options->applyExifOrientation)
+    {
+        const Orientation orientation = GetExifOrientation(exifChunk);
+        if(orientation != ORIENTATION_NONE)
+        {
+            output->orientation = orientation;
+        }
+    }
+}
+#endif
+
+// Function to tell if an orientation moves any pixel
+static bool IsReoriented(const Orientation orientation)
+{
+    return orientation > ORIENTATION_TOP_LEFT;
+}
+
+// Function to tell if an orientation turns stored rows into columns
+static bool IsTransposed(const Orientation orientation)
+{
+    return orientation >= ORIENTATION_LEFT_TOP;
+}
+
+// Function to lay the image out for its header, a transposed image swaps its sides unless it is interlaced, those are only
+// turned once every pass is in
+static int LayoutRowOutput(RowOutput* output, const Ihdr* ihdr)
+{
+    const DecodeOptions* options = output->options;
+    const PixelFormat format = options ? options->format : FORMAT_RGBA8;
+    if(options && options->rowSink && IsReoriented(output->orientation))
+    {
+        fprintf(stderr, "Error: Rows handed to a sink can't be reoriented!\n");
+        return -1;
+    }
+    if(format == FORMAT_INDEXED8 && ihdr->colorType != INDEXED_COLOR)
+    {
+        fprintf(stderr, "Error: Only palette images can be output as indexes!\n");
+        return -1;
+    }
+    if(format == FORMAT_PACKED && IsReoriented(output->orientation))
+    {
+        fprintf(stderr, "Error: Packed rows can't be reoriented!\n");
+        return -1;
+    }
+    if((format == FORMAT_INDEXED8 || format == FORMAT_PACKED) && options->background != BACKGROUND_NONE)
+    {
+        fprintf(stderr, "Error: Only RGBA output can be composited!\n");
+        return -1;
+    }
+#if !PNG_SUPPORT_ANCILLARY_CHUNKS
+    if(options && options->background != BACKGROUND_NONE)
+    {
+        fprintf(stderr, "Error: Compositing is not built in!\n");
+        return -1;
+    }
+#endif
+
+    Image* image = output->image;
+    const bool swapSides = IsTransposed(output->orientation) && !IsInterlaced(ihdr);
+    image->width = swapSides ? ihdr->height : ihdr->width;
+    image->height = swapSides ? ihdr->width : ihdr->height;
+    image->format = format;
+    image->stride = format == FORMAT_PACKED ? GetRowBytes(ihdr, image->width) : (unsigned long)image->width * GetPixelBytes(format);
+    image->size = image->stride * (StreamsRowsToSink(ihdr, options) ? 1 : image->height);
+    image->colorType = ihdr->colorType;
+    image->bitDepth = ihdr->bitDepth;
+    image->palette.count = 0;
+    image->hasColorKey = output->hasColorKey;
+    memcpy(image->colorKey, output->colorKey, sizeof(image->colorKey));
+
+    return 0;
+}
+
+#if PNG_SUPPORT_ANCILLARY_CHUNKS
+// Function to build the tables that map the significant part of every stored sample to its output value, exact integer
+// rounding when rescaling to the full output range
+static int BuildSignificantTables(RowOutput* output, const Ihdr* ihdr)
+{
+    const unsigned int channels = GetChannelCount(ihdr->colorType);
+    const unsigned int outputMaximum = output->image->format == FORMAT_RGBA16 ? 65535 : 255;
+    const bool rescale = output->options->significantBits == SIGNIFICANT_BITS_RESCALE;
+    unsigned long entries = 0;
+    for(unsigned int channel = 0; channel < channels; channel++)
+    {
+        if(!rescale && (1u << output->significantBits[channel]) - 1 > outputMaximum)
+        {
+            fprintf(stderr, "Error: Significant bits don't fit the output format!\n");
+            return -1;
+        }
+        entries += 1ul << output->significantBits[channel];
+    }
+
+    uint16_t* tables = malloc(entries * sizeof(uint16_t));
+    if(!tables)
+    {
+        fprintf(stderr, "Error: Unable to allocate enough memory for the significant bit tables!\n");
+        return -1;
+    }
+    for(unsigned int channel = 0; channel < channels; channel++)
+    {
+        const unsigned int maximum = (1u << output->significantBits[channel]) - 1;
+        output->significantTables[channel] = tables;
+        output->significantShifts[channel] = ihdr->bitDepth - output->significantBits[channel];
+        for(unsigned int value = 0; value <= maximum; value++)
+        {
+            tables[value] = (uint16_t)(rescale ? (value * outputMaximum + maximum / 2) / maximum : value);
+        }
+        tables += maximum + 1;
+    }
+
+    return 0;
+}
+#endif
+
+// Function to allocate the image and, for a transposed image, the band of rows that become its columns
+static int AllocateRowOutput(RowOutput* output, const Ihdr* ihdr, const Palette* palette)
+{
+    Image* image = output->image;
+    output->rowDecoder = GetRowDecoder(ihdr);
+    if(!output->rowDecoder || AllocateImagePixels(image, output->options) == -1)
+    {
+        return -1;
+    }
+    if(ihdr->colorType == INDEXED_COLOR)
+    {
+        image->palette = *palette;
+    }
+
+    // Interlaced passes set packed samples bit by bit
+    if(image->format == FORMAT_PACKED && IsInterlaced(ihdr))
+    {
+        memset(image->pixels, 0, image->size);
+    }
+
+#if PNG_SUPPORT_ANCILLARY_CHUNKS
+    if(output->hasSignificantBits && (image->format == FORMAT_RGBA8 || image->format == FORMAT_RGBA16) && BuildSignificantTables(output, ihdr) == -1)
+    {
+        return -1;
+    }
+#endif
+
+    if(IsTransposed(output->orientation) && !IsInterlaced(ihdr))
+    {
+        const unsigned int bandRows = ihdr->height < ORIENTATION_BAND_ROWS ? ihdr->height : ORIENTATION_BAND_ROWS;
+        output->band = malloc((unsigned long)ihdr->width * GetPixelBytes(image->format) * bandRows);
+        if(!output->band)
+        {
+            fprintf(stderr, "Error: Unable to allocate enough memory for the orientation band!\n");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+#if PNG_SUPPORT_ANCILLARY_CHUNKS
+// Function to take the precision of an sBIT chunk when the options honour it, palette images and malformed chunks are left
+// as they are
+static void ReadSignificantBitsChunk(RowOutput* output, const Chunk* significantBitsChunk, const Ihdr* ihdr)
+{
+    if(!output->options || output->options->significantBits == SIGNIFICANT_BITS_IGNORE || ihdr->colorType == INDEXED_COLOR)
+    {
+        return;
+    }
+
+    const unsigned int channels = GetChannelCount(ihdr->colorType);
+    if(significantBitsChunk->dataLength != channels)
+    {
+        return;
+    }
+    for(unsigned int channel = 0; channel < channels; channel++)
+    {
+        const unsigned char bits = significantBitsChunk->data[channel];
+        if(bits == 0 || bits > ihdr->bitDepth)
+        {
+            return;
+        }
+    }
+    memcpy(output->significantBits, significantBitsChunk->data, channels);
+    output->hasSignificantBits = true;
+}
+
+// Function to take the colour of a bKGD chunk when the options composite onto the file's background, a malformed or
+// unusable chunk leaves the colour of the options
+static void ReadBackgroundChunk(RowOutput* output, const Chunk* backgroundChunk, const Ihdr* ihdr, const Palette* palette)
+{
+    if(!output->options || output->options->background != BACKGROUND_FILE)
+    {
+        return;
+    }
+
+    const unsigned char* data = backgroundChunk->data;
+    switch((int)ihdr->colorType)
+    {
+        case GRAYSCALE:
+        case GRAYSCALE_WITH_ALPHA:
+            if(backgroundChunk->dataLength == 2)
+            {
+                const uint16_t gray = ScaleSampleTo16(((unsigned int)data[0] << 8 | data[1]) & ((1u << ihdr->bitDepth) - 1), ihdr->bitDepth);
+                output->background[0] = output->background[1] = output->background[2] = gray;
+            }
+            break;
+        case TRUECOLOR:
+        case TRUECOLOR_WITH_ALPHA:
+            if(backgroundChunk->dataLength == 6)
+            {
+                for(int channel = 0; channel < 3; channel++)
+                {
+                    const unsigned int sample = (unsigned int)data[channel * 2] << 8 | data[channel * 2 + 1];
+                    output->background[channel] = ScaleSampleTo16(sample & ((1u << ihdr->bitDepth) - 1), ihdr->bitDepth);
+                }
+            }
+            break;
+        case INDEXED_COLOR:
+            if(backgroundChunk->dataLength == 1 && data[0] < palette->count)
+            {
+                for(int channel = 0; channel < 3; channel++)
+                {
+                    output->background[channel] = palette->entries[data[0]][channel] * 257;
+                }
+            }
+            break;
+    }
+}
+
+// Function to read a tRNS chunk, the alpha of palette entries or the colour key of a greyscale or truecolour image, images
+// with an alpha channel can't have one and ignore it
+static int ReadTransparencyChunk(RowOutput* output, const Chunk* transparencyChunk, const Ihdr* ihdr, Palette* palette)
+{
+    if(ihdr->colorType == INDEXED_COLOR)
+    {
+        return GetTransparencyChunkData(transparencyChunk, palette);
+    }
+    if(ihdr->colorType != GRAYSCALE && ihdr->colorType != TRUECOLOR)
+    {
+        return 0;
+    }
+
+    const unsigned int samples = ihdr->colorType == GRAYSCALE ? 1 : 3;
+    if(transparencyChunk->dataLength != samples * 2)
+    {
+        fprintf(stderr, "Error: Invalid tRNS chunk length!\n");
+        return -1;
+    }
+    for(unsigned int channel = 0; channel < 3; channel++)
+    {
+        const unsigned char* sample = transparencyChunk->data + (samples == 1 ? 0 : channel * 2);
+        output->colorKey[channel] = (uint16_t)(((unsigned int)sample[0] << 8 | sample[1]) & ((1u << ihdr->bitDepth) - 1));
+    }
+    output->hasColorKey = true;
+
+    return 0;
+}
+
+// Function to convert an unfiltered scanline to RGBA through the significant bit tables, big endian samples are read and
+// native ones written in the same pass, writing every xStep pixel of the destination row
+static void ConvertRowSignificant(const Ihdr* ihdr, const RowOutput* output, const unsigned char* samples, const unsigned int width, unsigned char* destination, const unsigned int xStep)
+{
+    const unsigned int channels = GetChannelCount(ihdr->colorType);
+    const bool wide = output->image->format == FORMAT_RGBA16;
+    const bool gray = ihdr->colorType == GRAYSCALE || ihdr->colorType == GRAYSCALE_WITH_ALPHA;
+    const bool hasAlpha = ihdr->colorType == GRAYSCALE_WITH_ALPHA || ihdr->colorType == TRUECOLOR_WITH_ALPHA;
+
+    for(unsigned int x = 0; x < width; x++)
+    {
+        uint16_t values[4];
+        for(unsigned int channel = 0; channel < channels; channel++)
+        {
+            const unsigned int sample = GetSample(samples, (unsigned long)x * channels + channel, ihdr->bitDepth);
+            values[channel] = output->significantTables[channel][sample >> output->significantShifts[channel]];
+        }
+
+        uint16_t pixel[4];
+        pixel[0] = values[0];
+        pixel[1] = gray ? values[0] : values[1];
+        pixel[2] = gray ? values[0] : values[2];
+        pixel[3] = hasAlpha ? values[channels - 1] : (wide ? 65535 : 255);
+        if(wide)
+        {
+            memcpy(destination + (unsigned long)x * xStep * 8, pixel, 8);
+            continue;
+        }
+        for(int channel = 0; channel < 4; channel++)
+        {
+            destination[(unsigned long)x * xStep * 4 + channel] = (unsigned char)pixel[channel];
+        }
+    }
+}
+
+// Function to clear the alpha of RGBA8 pixels whose colour is the key, every xStep pixel is one of the row
+static void ApplyColorKeyRgba8(unsigned char* pixels, const unsigned int count, const unsigned int xStep, const unsigned char* key)
+{
+    unsigned int x = 0;
+#ifdef USE_SSE2
+    if(xStep == 1)
+    {
+        // Whole pixels compare at once, the mask of the matches is the alpha to clear
+        const __m128i colorMask = _mm_set1_epi32(0x00FFFFFF);
+        const __m128i alphaMask = _mm_set1_epi32((int)0xFF000000);
+        const __m128i keyPixels = _mm_set1_epi32((int)((uint32_t)key[2] << 16 | (uint32_t)key[1] << 8 | key[0]));
+        for(; x + 4 <= count; x += 4)
+        {
+            unsigned char* pixel = pixels + (unsigned long)x * 4;
+            const __m128i source = _mm_loadu_si128((const __m128i*)pixel);
+            const __m128i matches = _mm_cmpeq_epi32(_mm_and_si128(source, colorMask), keyPixels);
+            _mm_storeu_si128((__m128i*)pixel, _mm_andnot_si128(_mm_and_si128(matches, alphaMask), source));
+        }
+    }
+#endif
+    for(; x < count; x++)
+    {
+        unsigned char* pixel = pixels + (unsigned long)x * xStep * 4;
+        if(pixel[0] == key[0] && pixel[1] == key[1] && pixel[2] == key[2])
+        {
+            pixel[3] = 0;
+        }
+    }
+}
+
+// Function to clear the alpha of RGBA16 pixels whose colour is the key, every xStep pixel is one of the row
+static void ApplyColorKeyRgba16(uint16_t* pixels, const unsigned int count, const unsigned int xStep, const uint16_t* key)
+{
+    unsigned int x = 0;
+#ifdef USE_SSE2
+    if(xStep == 1)
+    {
+        // A pixel matches when both of its 32 bits halves do
+        const __m128i colorMask = _mm_set_epi16(0, -1, -1, -1, 0, -1, -1, -1);
+        const __m128i alphaMask = _mm_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0);
+        const __m128i keyPixels = _mm_set_epi16(0, (short)key[2], (short)key[1], (short)key[0], 0, (short)key[2], (short)key[1], (short)key[0]);
+        for(; x + 2 <= count; x += 2)
+        {
+            uint16_t* pixel = pixels + (unsigned long)x * 4;
+            const __m128i source = _mm_loadu_si128((const __m128i*)pixel);
+            const __m128i halves = _mm_cmpeq_epi32(_mm_and_si128(source, colorMask), keyPixels);
+            const __m128i matches = _mm_and_si128(halves, _mm_shuffle_epi32(halves, _MM_SHUFFLE(2, 3, 0, 1)));
+            _mm_storeu_si128((__m128i*)pixel, _mm_andnot_si128(_mm_and_si128(matches, alphaMask), source));
+        }
+    }
+#endif
+    for(; x < count; x++)
+    {
+        uint16_t* pixel = pixels + (unsigned long)x * xStep * 4;
+        if(pixel[0] == key[0] && pixel[1] == key[1] && pixel[2] == key[2])
+        {
+            pixel[3] = 0;
+        }
+    }
+}
+
+// Function to turn the colour key of a greyscale or truecolour image into alpha for a converted row, scaling keeps samples
+// apart except 16 bits down to 8 or through significant bits, which compare the stored samples instead
+static void ApplyColorKey(const Ihdr* ihdr, const RowOutput* output, const unsigned char* samples, const unsigned int width, unsigned char* destination, const unsigned int xStep)
+{
+    const bool wide = output->image->format == FORMAT_RGBA16;
+    if(wide && !output->significantTables[0])
+    {
+        uint16_t key[3];
+        for(int channel = 0; channel < 3; channel++)
+        {
+            key[channel] = ScaleSampleTo16(output->colorKey[channel], ihdr->bitDepth);
+        }
+        ApplyColorKeyRgba16((uint16_t*)destination, width, xStep, key);
+        return;
+    }
+    if(!wide && ihdr->bitDepth != 16 && !output->significantTables[0])
+    {
+        unsigned char key[3];
+        for(int channel = 0; channel < 3; channel++)
+        {
+            key[channel] = ScaleSampleTo8(output->colorKey[channel], ihdr->bitDepth);
+        }
+        ApplyColorKeyRgba8(destination, width, xStep, key);
+        return;
+    }
+
+    const unsigned int channels = GetChannelCount(ihdr->colorType);
+    for(unsigned int x = 0; x < width; x++)
+    {
+        const unsigned long index = (unsigned long)x * channels;
+        bool matches = true;
+        for(unsigned int channel = 0; channel < channels; channel++)
+        {
+            matches &= GetSample(samples, index + channel, ihdr->bitDepth) == output->colorKey[channel];
+        }
+        if(matches && wide)
+        {
+            ((uint16_t*)destination)[(unsigned long)x * xStep * 4 + 3] = 0;
+        }
+        else if(matches)
+        {
+            destination[(unsigned long)x * xStep * 4 + 3] = 0;
+        }
+    }
+}
+
+// Function to flatten RGBA8 pixels onto an opaque background, every xStep pixel is one of the row
+static void CompositeRowRgba8(unsigned char* pixels, const unsigned int count, const unsigned int xStep, const uint16_t* background)
+{
+    unsigned char color[3];
+    for(int channel = 0; channel < 3; channel++)
+    {
+        color[channel] = (unsigned char)((background[channel] * 255u + 32767) / 65535);
+    }
+
+    unsigned int x = 0;
+#ifdef USE_SSE2
+    if(xStep == 1)
+    {
+        // Four pixels at a time, runs that are wholly opaque or wholly transparent skip the blend
+        const __m128i alphaMask = _mm_set1_epi32((int)0xFF000000);
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i backgroundPixels = _mm_set1_epi32((int)(0xFF000000u | (uint32_t)color[2] << 16 | (uint32_t)color[1] << 8 | color[0]));
+        const __m128i backgroundWords = _mm_unpacklo_epi8(backgroundPixels, zero);
+        const __m128i maximum = _mm_set1_epi16(255);
+        const __m128i rounding = _mm_set1_epi16(128);
+        for(; x + 4 <= count; x += 4)
+        {
+            unsigned char* pixel = pixels + (unsigned long)x * 4;
+            const __m128i source = _mm_loadu_si128((const __m128i*)pixel);
+            const __m128i alpha = _mm_and_si128(source, alphaMask);
+            if(_mm_movemask_epi8(_mm_cmpeq_epi8(alpha, alphaMask)) == 0xFFFF)
+            {
+                continue;
+            }
+            if(_mm_movemask_epi8(_mm_cmpeq_epi8(alpha, zero)) == 0xFFFF)
+            {
+                _mm_storeu_si128((__m128i*)pixel, backgroundPixels);
+                continue;
+            }
+
+            // (c * a + b * (255 - a) + 127) / 255 exactly, through the add-and-shift division
+            __m128i halves[2] = {_mm_unpacklo_epi8(source, zero), _mm_unpackhi_epi8(source, zero)};
+            for(int i = 0; i < 2; i++)
+            {
+                const __m128i weights = _mm_shufflehi_epi16(_mm_shufflelo_epi16(halves[i], _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+                const __m128i blend = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(halves[i], weights), _mm_mullo_epi16(backgroundWords, _mm_sub_epi16(maximum, weights))), rounding);
+                halves[i] = _mm_srli_epi16(_mm_add_epi16(blend, _mm_srli_epi16(blend, 8)), 8);
+            }
+            _mm_storeu_si128((__m128i*)pixel, _mm_or_si128(_mm_packus_epi16(halves[0], halves[1]), alphaMask));
+        }
+    }
+#endif
+    for(; x < count; x++)
+    {
+        unsigned char* pixel = pixels + (unsigned long)x * xStep * 4;
+        const unsigned int alpha = pixel[3];
+        for(int channel = 0; channel < 3; channel++)
+        {
+            pixel[channel] = (unsigned char)((pixel[channel] * alpha + color[channel] * (255 - alpha) + 127) / 255);
+        }
+        pixel[3] = 255;
+    }
+}
+
+// Function to flatten RGBA16 pixels onto an opaque background, every xStep pixel is one of the row
+static void CompositeRowRgba16(uint16_t* pixels, const unsigned int count, const unsigned int xStep, const uint16_t* background)
+{
+    unsigned int x = 0;
+#ifdef USE_SSE2
+    if(xStep == 1)
+    {
+        // Two pixels at a time, the 32 bits products come from the low and high halves of each multiply
+        const __m128i alphaMask = _mm_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0);
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i backgroundPixels = _mm_set_epi16(-1, (short)background[2], (short)background[1], (short)background[0], -1, (short)background[2], (short)background[1], (short)background[0]);
+        const __m128i rounding = _mm_set1_epi32(32768);
+        const __m128i bias = _mm_set1_epi16((short)0x8000);
+        for(; x + 2 <= count; x += 2)
+        {
+            uint16_t* pixel = pixels + (unsigned long)x * 4;
+            const __m128i source = _mm_loadu_si128((const __m128i*)pixel);
+            const __m128i alpha = _mm_and_si128(source, alphaMask);
+            if(_mm_movemask_epi8(_mm_cmpeq_epi16(alpha, alphaMask)) == 0xFFFF)
+            {
+                continue;
+            }
+            if(_mm_movemask_epi8(_mm_cmpeq_epi16(alpha, zero)) == 0xFFFF)
+            {
+                _mm_storeu_si128((__m128i*)pixel, backgroundPixels);
+                continue;
+            }
+
+            const __m128i weights = _mm_shufflehi_epi16(_mm_shufflelo_epi16(source, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+            const __m128i inverse = _mm_xor_si128(weights, _mm_set1_epi16(-1));
+            const __m128i colorLow = _mm_mullo_epi16(source, weights), colorHigh = _mm_mulhi_epu16(source, weights);
+            const __m128i backgroundLow = _mm_mullo_epi16(backgroundPixels, inverse), backgroundHigh = _mm_mulhi_epu16(backgroundPixels, inverse);
+            __m128i blends[2] =
+            {
+                _mm_add_epi32(_mm_add_epi32(_mm_unpacklo_epi16(colorLow, colorHigh), _mm_unpacklo_epi16(backgroundLow, backgroundHigh)), rounding),
+                _mm_add_epi32(_mm_add_epi32(_mm_unpackhi_epi16(colorLow, colorHigh), _mm_unpackhi_epi16(backgroundLow, backgroundHigh)), rounding)
+            };
+            for(int i = 0; i < 2; i++)
+            {
+                // Biased so the signed pack keeps every 16 bits value
+                blends[i] = _mm_sub_epi32(_mm_srli_epi32(_mm_add_epi32(blends[i], _mm_srli_epi32(blends[i], 16)), 16), rounding);
+            }
+            const __m128i result = _mm_xor_si128(_mm_packs_epi32(blends[0], blends[1]), bias);
+            _mm_storeu_si128((__m128i*)pixel, _mm_or_si128(result, alphaMask));
+        }
+    }
+#endif
+    for(; x < count; x++)
+    {
+        uint16_t* pixel = pixels + (unsigned long)x * xStep * 4;
+        const uint32_t alpha = pixel[3];
+        for(int channel = 0; channel < 3; channel++)
+        {
+            pixel[channel] = (uint16_t)((pixel[channel] * alpha + background[channel] * (65535 - alpha) + 32767) / 65535);
+        }
+        pixel[3] = 65535;
+    }
+}
+
+// Function to flatten pixels converted through shift mode significant bits onto the background, every sample and the alpha
+// are right aligned in their own significant range, so the background is brought to each range and alpha weighs by its own
+static void CompositeRowSignificant(const Ihdr* ihdr, const RowOutput* output, unsigned char* destination, const unsigned int width, const unsigned int xStep)
+{
+    const bool wide = output->image->format == FORMAT_RGBA16;
+    const bool gray = ihdr->colorType == GRAYSCALE || ihdr->colorType == GRAYSCALE_WITH_ALPHA;
+    const bool hasAlpha = ihdr->colorType == GRAYSCALE_WITH_ALPHA || ihdr->colorType == TRUECOLOR_WITH_ALPHA;
+    unsigned int maxima[4];
+    unsigned int background[3];
+    for(int channel = 0; channel < 3; channel++)
+    {
+        maxima[channel] = (1u << output->significantBits[gray ? 0 : channel]) - 1;
+        background[channel] = (output->background[channel] * maxima[channel] + 32767) / 65535;
+    }
+    // Without an alpha channel alpha is opaque at the full output range, or cleared by the colour key
+    maxima[3] = hasAlpha ? (1u << output->significantBits[GetChannelCount(ihdr->colorType) - 1]) - 1 : (wide ? 65535 : 255);
+
+    for(unsigned int x = 0; x < width; x++)
+    {
+        uint16_t pixel[4];
+        unsigned char* target = destination + (unsigned long)x * xStep * (wide ? 8 : 4);
+        for(int channel = 0; channel < 4; channel++)
+        {
+            pixel[channel] = wide ? ((uint16_t*)target)[channel] : target[channel];
+        }
+        const uint64_t alpha = pixel[3];
+        for(int channel = 0; channel < 3; channel++)
+        {
+            pixel[channel] = (uint16_t)((pixel[channel] * alpha + background[channel] * (maxima[3] - alpha) + maxima[3] / 2) / maxima[3]);
+        }
+        pixel[3] = (uint16_t)maxima[3];
+        for(int channel = 0; channel < 4; channel++)
+        {
+            if(wide)
+            {
+                ((uint16_t*)target)[channel] = pixel[channel];
+            }
+            else
+            {
+                target[channel] = (unsigned char)pixel[channel];
+            }
+        }
+    }
+}
+#endif
+
+// Function to mirror a row of pixels in place
+static void MirrorRow(unsigned char* row, const unsigned int width, const unsigned int pixelBytes)
+{
+    unsigned char pixel[8];
+    for(unsigned int x = 0; x < width / 2; x++)
+    {
+        unsigned char* left = row + (unsigned long)x * pixelBytes;
+        unsigned char* right = row + (unsigned long)(width - 1 - x) * pixelBytes;
+        memcpy(pixel, left, pixelBytes);
+        memcpy(left, right, pixelBytes);
+        memcpy(right, pixel, pixelBytes);
+    }
+}
+
+// Function to write a band of stored rows as columns of a transposed image, RGBA8 goes through 4x4 tiles turned in
+// registers so every destination row receives runs of pixels rather than single ones
+static void TransposeRows(Image* image, const Orientation orientation, const unsigned char* rows, const unsigned long rowStride, const unsigned int firstY, const unsigned int rowCount)
+{
+    // The stored image is the destination on its side
+    const unsigned int sourceWidth = image->height;
+    const unsigned int sourceHeight = image->width;
+    const unsigned int pixelBytes = GetPixelBytes(image->format);
+    const bool flipRows = orientation == ORIENTATION_RIGHT_BOTTOM || orientation == ORIENTATION_LEFT_BOTTOM;
+    const bool flipColumns = orientation == ORIENTATION_RIGHT_TOP || orientation == ORIENTATION_RIGHT_BOTTOM;
+
+    unsigned int x = 0;
+#ifdef USE_SSE2
+    for(; pixelBytes == 4 && x + 4 <= sourceWidth; x += 4)
+    {
+        unsigned int r = 0;
+        for(; r + 4 <= rowCount; r += 4)
+        {
+            const unsigned char* source = rows + (unsigned long)r * rowStride + (unsigned long)x * 4;
+            __m128 columns[4];
+            for(int i = 0; i < 4; i++)
+            {
+                columns[i] = _mm_castsi128_ps(_mm_loadu_si128((const __m128i*)(source + i * rowStride)));
+            }
+            _MM_TRANSPOSE4_PS(columns[0], columns[1], columns[2], columns[3]);
+
+            const unsigned int column = flipColumns ? sourceHeight - 4 - (firstY + r) : firstY + r;
+            for(unsigned int i = 0; i < 4; i++)
+            {
+                const __m128 run = flipColumns ? _mm_shuffle_ps(columns[i], columns[i], _MM_SHUFFLE(0, 1, 2, 3)) : columns[i];
+                const unsigned int y = flipRows ? sourceWidth - 1 - (x + i) : x + i;
+                _mm_storeu_si128((__m128i*)(image->pixels + (unsigned long)y * image->stride + (unsigned long)column * 4), _mm_castps_si128(run));
+            }
+        }
+        for(; r < rowCount; r++)
+        {
+            const unsigned int column = flipColumns ? sourceHeight - 1 - (firstY + r) : firstY + r;
+            for(unsigned int i = 0; i < 4; i++)
+            {
+                const unsigned int y = flipRows ? sourceWidth - 1 - (x + i) : x + i;
+                memcpy(image->pixels + (unsigned long)y * image->stride + (unsigned long)column * 4, rows + (unsigned long)r * rowStride + (unsigned long)(x + i) * 4, 4);
+            }
+        }
+    }
+#endif
+    for(; x < sourceWidth; x++)
+    {
+        unsigned char* destination = image->pixels + (unsigned long)(flipRows ? sourceWidth - 1 - x : x) * image->stride;
+        for(unsigned int r = 0; r < rowCount; r++)
+        {
+            const unsigned int column = flipColumns ? sourceHeight - 1 - (firstY + r) : firstY + r;
+            memcpy(destination + (unsigned long)column * pixelBytes, rows + (unsigned long)r * rowStride + (unsigned long)x * pixelBytes, pixelBytes);
+        }
+    }
+}
+
+// Function to turn an image stored as decoded into its orientation, only interlaced images need this extra pass
+static int OrientImage(RowOutput* output)
+{
+    Image* image = output->image;
+    const unsigned int pixelBytes = GetPixelBytes(image->format);
+    const Orientation orientation = output->orientation;
+    Image oriented = *image;
+    if(IsTransposed(orientation))
+    {
+        oriented.width = image->height;
+        oriented.height = image->width;
+        oriented.stride = (unsigned long)oriented.width * pixelBytes;
+    }
+    if(AllocateImagePixels(&oriented, output->options) == -1)
+    {
+        return -1;
+    }
+
+    for(unsigned int y = 0; y < image->height; y += ORIENTATION_BAND_ROWS)
+    {
+        const unsigned int rowCount = image->height - y < ORIENTATION_BAND_ROWS ? image->height - y : ORIENTATION_BAND_ROWS;
+        const unsigned char* rows = image->pixels + (unsigned long)y * image->stride;
+        if(IsTransposed(orientation))
+        {
+            TransposeRows(&oriented, orientation, rows, image->stride, y, rowCount);
+            continue;
+        }
+        for(unsigned int r = 0; r < rowCount; r++)
+        {
+            const unsigned int orientedY = orientation == ORIENTATION_BOTTOM_RIGHT || orientation == ORIENTATION_BOTTOM_LEFT ? image->height - 1 - (y + r) : y + r;
+            unsigned char* destination = oriented.pixels + (unsigned long)orientedY * oriented.stride;
+            memcpy(destination, rows + (unsigned long)r * image->stride, image->stride);
+            if(orientation != ORIENTATION_BOTTOM_LEFT)
+            {
+                MirrorRow(destination, oriented.width, pixelBytes);
+            }
+        }
+    }
+    FreeImage(image);
+    *image = oriented;
+
+    return 0;
+}
+
+// Function to copy the palette indexes of an unfiltered scanline one per byte, writing every xStep pixel of the destination row
+static void ConvertRowToIndexes(const Ihdr* ihdr, const unsigned char* samples, const unsigned int width, unsigned char* destination, const unsigned int xStep)
+{
+    if(ihdr->bitDepth == 8 && xStep == 1)
+    {
+        memcpy(destination, samples, width);
+        return;
+    }
+
+    for(unsigned int x = 0; x < width; x++)
+    {
+        destination[(unsigned long)x * xStep] = (unsigned char)GetSample(samples, x, ihdr->bitDepth);
+    }
+}
+
+// Function to copy the samples of an unfiltered scanline into a packed row at every xStep pixel from firstX, the unused
+// low bits of a row are left zero
+static void CopyPackedRow(const Ihdr* ihdr, const unsigned char* samples, const unsigned int width, unsigned char* row, const unsigned int firstX, const unsigned int xStep)
+{
+    const unsigned int channels = GetChannelCount(ihdr->colorType);
+    if(xStep == 1)
+    {
+        const unsigned long rowBytes = GetRowBytes(ihdr, width);
+        const unsigned int usedBits = (unsigned int)(((unsigned long)width * channels * ihdr->bitDepth) % 8);
+        memcpy(row, samples, rowBytes);
+        if(usedBits != 0)
+        {
+            row[rowBytes - 1] &= (unsigned char)(0xFF << (8 - usedBits));
+        }
+        return;
+    }
+
+    for(unsigned int x = 0; x < width; x++)
+    {
+        for(unsigned int channel = 0; channel < channels; channel++)
+        {
+            const unsigned long index = ((unsigned long)firstX + (unsigned long)x * xStep) * channels + channel;
+            SetSample(row, index, ihdr->bitDepth, GetSample(samples, (unsigned long)x * channels + channel, ihdr->bitDepth));
+        }
+    }
+}
+
+// Function to convert an unfiltered row of a pass into its pixels of the image, or hand it to the sink
+static int OutputRow(const Ihdr* ihdr, const Palette* palette, RowOutput* output, const int pass, const unsigned int passY, const unsigned char* samples, const unsigned int passWidth)
+{
+    Image* image = output->image;
+    const DecodeOptions* options = output->options;
+    const unsigned int pixelBytes = GetPixelBytes(image->format);
+    const unsigned int imageY = ADAM7_Y_START[pass] + passY * ADAM7_Y_STEP[pass];
+    const bool toSink = StreamsRowsToSink(ihdr, options);
+
+    // Interlaced images are turned once complete, other rows go straight to their place or through the band
+    const Orientation orientation = IsInterlaced(ihdr) ? ORIENTATION_NONE : output->orientation;
+    unsigned char* row = image->pixels + (toSink ? 0 : (unsigned long)imageY * image->stride);
+    if(IsTransposed(orientation))
+    {
+        row = output->band + (unsigned long)output->bandRows * ihdr->width * pixelBytes;
+    }
+    else if(orientation == ORIENTATION_BOTTOM_RIGHT || orientation == ORIENTATION_BOTTOM_LEFT)
+    {
+        row = image->pixels + (unsigned long)(image->height - 1 - imageY) * image->stride;
+    }
+    unsigned char* destination = row + ADAM7_X_START[pass] * pixelBytes;
+    // Significant bit tables only exist for RGBA output
+#if PNG_SUPPORT_ANCILLARY_CHUNKS
+    if(output->significantTables[0])
+    {
+        ConvertRowSignificant(ihdr, output, samples, passWidth, destination, ADAM7_X_STEP[pass]);
+    }
+    else
+#endif
+    {
+        switch(image->format)
+        {
+            case FORMAT_RGBA16:
+                output->rowDecoder->convertRowToRgba16[IsInterlaced(ihdr)](palette, samples, passWidth, (uint16_t*)destination, ADAM7_X_STEP[pass]);
+                break;
+            case FORMAT_INDEXED8:
+                ConvertRowToIndexes(ihdr, samples, passWidth, destination, ADAM7_X_STEP[pass]);
+                break;
+            case FORMAT_PACKED:
+                CopyPackedRow(ihdr, samples, passWidth, row, ADAM7_X_START[pass], ADAM7_X_STEP[pass]);
+                break;
+            default:
+                output->rowDecoder->convertRowToRgba8[IsInterlaced(ihdr)](palette, samples, passWidth, destination, ADAM7_X_STEP[pass]);
+                break;
+        }
+    }
+
+    // Only the pixels of this pass are keyed and flattened, earlier passes already were
+#if PNG_SUPPORT_ANCILLARY_CHUNKS
+    if(output->hasColorKey && (image->format == FORMAT_RGBA8 || image->format == FORMAT_RGBA16))
+    {
+        ApplyColorKey(ihdr, output, samples, passWidth, destination, ADAM7_X_STEP[pass]);
+    }
+    if(options && options->background != BACKGROUND_NONE)
+    {
+        // Rescaled significant bits already span the output range, shifted ones don't
+        if(output->significantTables[0] && options->significantBits == SIGNIFICANT_BITS_SHIFT)
+        {
+            CompositeRowSignificant(ihdr, output, destination, passWidth, ADAM7_X_STEP[pass]);
+        }
+        else if(image->format == FORMAT_RGBA16)
+        {
+            CompositeRowRgba16((uint16_t*)destination, passWidth, ADAM7_X_STEP[pass], output->background);
+        }
+        else
+        {
+            CompositeRowRgba8(destination, passWidth, ADAM7_X_STEP[pass], output->background);
+        }
+    }
+#endif
+
+    if(toSink)
+    {
+        return options->rowSink->consumeRow(options->rowSink->context, image, imageY, row);
+    }
+    if(orientation == ORIENTATION_TOP_RIGHT || orientation == ORIENTATION_BOTTOM_RIGHT)
+    {
+        MirrorRow(row, image->width, pixelBytes);
+    }
+    else if(IsTransposed(orientation) && (++output->bandRows == ORIENTATION_BAND_ROWS || imageY + 1 == ihdr->height))
+    {
+        TransposeRows(image, orientation, output->band, (unsigned long)ihdr->width * pixelBytes, imageY + 1 - output->bandRows, output->bandRows);
+        output->bandRows = 0;
+    }
+
+    return 0;
+}
+
+// Function to hand every row of a fully reconstructed image to the sink of the options
+static int FeedImageToSink(const Image* image, const DecodeOptions* options)
+{
+    for(unsigned int y = 0; y < image->height; y++)
+    {
+        if(options->rowSink->consumeRow(options->rowSink->context, image, y, image->pixels + (unsigned long)y * image->stride) != 0)
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Function to complete the output once every row is reconstructed, interlaced images are only now turned or handed over
+static int FinishRowOutput(RowOutput* output, const Ihdr* ihdr)
+{
+    const DecodeOptions* options = output->options;
+    if(IsInterlaced(ihdr) && IsReoriented(output->orientation) && OrientImage(output) == -1)
+    {
+        return -1;
+    }
+    if(options && options->rowSink && !StreamsRowsToSink(ihdr, options))
+    {
+        return FeedImageToSink(output->image, options);
+    }
+
+    return 0;
+}
+
+// Function to unfilter the inflated IDAT stream in place and convert it into the image
+static int ReconstructImage(const Ihdr* ihdr, const Palette* palette, unsigned char* raw, RowOutput* output, const DecodeControl* control)
+{
+    const UnfilterRowFunction unfilterRow = output->rowDecoder->unfilterRow;
+    const int firstPass = IsInterlaced(ihdr) ? 0 : NON_INTERLACED_PASS;
+    const int lastPass = IsInterlaced(ihdr) ? NON_INTERLACED_PASS - 1 : NON_INTERLACED_PASS;
+
+    unsigned char* row = raw;
+    for(int pass = firstPass; pass <= lastPass; pass++)
+    {
+        unsigned int passWidth, passHeight;
+        GetPassSize(ihdr, pass, &passWidth, &passHeight);
+        if(passWidth == 0)
+        {
+            continue;
+        }
+
+        const unsigned long rowBytes = GetRowBytes(ihdr, passWidth);
+        const unsigned char* previousRow = NULL;
+        for(unsigned int y = 0; y < passHeight; y++)
+        {
+            if(unfilterRow(row, previousRow, rowBytes) == -1)
+            {
+                return -1;
+            }
+
+            if(OutputRow(ihdr, palette, output, pass, y, row + 1, passWidth) != 0)
+            {
+                return -1;
+            }
+            if((y + 1) % DECODE_ROW_BATCH == 0)
+            {
+                YieldDecodeControl(control);
+            }
+
+            previousRow = row;
+            row += rowBytes + 1;
+        }
+    }
+
+    return 0;
+}
+
+// Function to decode a PNG held in memory, the workspace may be NULL for a one-off decode
+static int DecodePngBuffer(const unsigned char* buffer, const unsigned long bufferSize, Image* image, const DecodeOptions* options, DecodeWorkspace* workspace, DecodeControl* control)
+{
+    const unsigned char pngSignature[] = {137, 80, 78, 71, 13, 10, 26, 10};
+    const bool isLittleEndian = IsLittleEndian();
+
+    image->pixels = NULL;
+    image->sharedFile = -1;
+    image->mapping = NULL;
+    RowOutput output;
+    InitRowOutput(&output, image, options);
+    if(bufferSize < PNG_SIGNATURE_LENGTH || memcmp(pngSignature, buffer, PNG_SIGNATURE_LENGTH) != 0)
+    {
+        fprintf(stderr, "Error: Invalid PNG signature!\n");
+        return -1;
+    }
+
+    DecodeWorkspace localWorkspace;
+    if(!workspace)
+    {
+        if(InitDecodeWorkspace(&localWorkspace) == -1)
+        {
+            return -1;
+        }
+        workspace = &localWorkspace;
+    }
+
+    Chunk* chunkDynamicArray = NULL;
+    unsigned int chunkArraySize = 0;
+    unsigned int cursor = PNG_SIGNATURE_LENGTH;
+    int status = 0;
+    // Read chunks until the last chunk is encountered
+    control->stage = STAGE_READING_CHUNKS;
+    for(;;)
+    {
+        // Stop at chunk boundaries if cancelled or out of time
+        status = CheckDecodeControl(control);
+        if(status != 0)
+        {
+            break;
+        }
+
+        Chunk chunk;
+        if(ReadChunk(buffer, bufferSize, &cursor, &chunk, isLittleEndian) == -1)
+        {
+            status = -1;
+            break;
+        }
+
+        if(AppendChunk(&chunkDynamicArray, ++chunkArraySize, &chunk) == -1)
+        {
+            free(chunk.data);
+            chunkArraySize = 0;
+            status = -1;
+            break;
+        }
+        control->chunksRead = chunkArraySize;
+
+        if(strcmp((const char*)chunk.type, LAST_CHUNK_TYPE_SIGNATURE) == 0)
+        {
+            break;
+        }
+    }
+
+    Ihdr ihdr;
+    Palette palette = {0};
+    if(status == 0)
+    {
+        control->stage = STAGE_PARSING_HEADER;
+        if(strcmp((const char*)chunkDynamicArray[0].type, HEADER_CHUNK_TYPE) != 0)
+        {
+            fprintf(stderr, "Error: First chunk is not IHDR!\n");
+            status = -1;
+        }
+        else
+        {
+            status = GetIhdrChunkData(&chunkDynamicArray[0], &ihdr, isLittleEndian);
+        }
+        // Like the stream decoder, ancillary chunks only count before the image data
+        bool beforeData = true;
+        for(unsigned int i = 1; i < chunkArraySize && status == 0; i++)
+        {
+            const char* type = (const char*)(chunkDynamicArray + i)->type;
+            if(strcmp(type, PALETTE_CHUNK_TYPE) == 0)
+            {
+                status = GetPaletteChunkData(chunkDynamicArray + i, &palette);
+            }
+#if PNG_SUPPORT_ANCILLARY_CHUNKS
+            else if(strcmp(type, TRANSPARENCY_CHUNK_TYPE) == 0 && beforeData)
+            {
+                status = ReadTransparencyChunk(&output, chunkDynamicArray + i, &ihdr, &palette);
+            }
+            else if(strcmp(type, EXIF_CHUNK_TYPE) == 0 && beforeData)
+            {
+                ReadExifOrientation(&output, chunkDynamicArray + i);
+            }
+            else if(strcmp(type, BACKGROUND_CHUNK_TYPE) == 0 && beforeData)
+            {
+                ReadBackgroundChunk(&output, chunkDynamicArray + i, &ihdr, &palette);
+            }
+            else if(strcmp(type, SIGNIFICANT_BITS_CHUNK_TYPE) == 0 && beforeData)
+            {
+                ReadSignificantBitsChunk(&output, chunkDynamicArray + i, &ihdr);
+            }
+#endif
+            beforeData &= strcmp(type, DATA_CHUNK_TYPE) != 0;
+        }
+    }
+
+    // Guard every size computation against overflow, long is only 32 bits on Windows
+    unsigned long rawSize = 0;
+    if(status == 0)
+    {
+        const PixelFormat format = options ? options->format : FORMAT_RGBA8;
+        const unsigned long long rawRowBytes = ((unsigned long long)ihdr.width * GetChannelCount(ihdr.colorType) * ihdr.bitDepth + 7) / 8 + 1;
+        unsigned long pixelBytes;
+        if(!GetImageBytes(&ihdr, format, &pixelBytes) || rawRowBytes > ULONG_MAX / 2 / ihdr.height)
+        {
+            fprintf(stderr, "Error: Image too large!\n");
+            status = -1;
+        }
+        else
+        {
+            rawSize = GetRawImageSize(&ihdr);
+            control->rowBatchBytes = DECODE_ROW_BATCH * (GetRowBytes(&ihdr, ihdr.width) + 1);
+            status = LayoutRowOutput(&output, &ihdr);
+        }
+        if(status == 0)
+        {
+            status = ReserveRawBuffer(workspace, rawSize);
+        }
+    }
+
+    if(status == 0)
+    {
+        control->stage = STAGE_INFLATING;
+        status = DecompressIdatChuncks(chunkDynamicArray, chunkArraySize, workspace->raw, rawSize, &workspace->stream, control);
+    }
+    FreeChunks(chunkDynamicArray, chunkArraySize);
+
+    // Rows are reconstructed straight into the final storage, shared or not
+    if(status == 0)
+    {
+        status = AllocateRowOutput(&output, &ihdr, &palette);
+    }
+
+    if(status == 0)
+    {
+        status = ReconstructImage(&ihdr, &palette, workspace->raw, &output, control);
+    }
+
+    if(status == 0)
+    {
+        status = FinishRowOutput(&output, &ihdr);
+    }
+    FreeRowOutput(&output);
+
+    if(status == 0 && image->sharedFile >= 0)
+    {
+        status = SealSharedImage(image);
+    }
+
+    if(workspace == &localWorkspace)
+    {
+        FreeDecodeWorkspace(&localWorkspace);
+    }
+
+    if(status != 0)
+    {
+        FreeImage(image);
+        if(status != -1)
+        {
+            ReportDecodeProgress(control, status);
+        }
+        return status;
+    }
+    control->stage = STAGE_DONE;
+
+    return 0;
+}
+
+// Enumeration for where the stream decoder is in the PNG byte stream
+typedef enum StreamState
+{
+    STREAM_SIGNATURE,
+    STREAM_CHUNK_HEADER,
+    STREAM_CHUNK_DATA,
+    STREAM_CHUNK_CRC,
+    STREAM_DONE
+} StreamState;
+
+// Structure to decode a PNG fed in pieces of any size, nothing but the current and previous scanline is kept
+typedef struct StreamDecoder
+{
+    StreamState state;
+    unsigned char pending[PNG_SIGNATURE_LENGTH];    // Signature, chunk header or CRC bytes gathered so far
+    unsigned int pendingLength;
+    Chunk chunk;
+    unsigned long chunkDone;
+    unsigned long chunkKept;                        // Leading bytes of the chunk data kept in chunk.data
+    unsigned int checksum;
+    unsigned int chunksRead;
+    bool isLittleEndian;
+    bool haveHeader;
+    Ihdr ihdr;
+    Palette palette;
+    z_stream stream;
+    bool streamEnded;
+    unsigned char* inflated;
+    int pass;
+    unsigned int passWidth;
+    unsigned int passHeight;
+    unsigned int passY;
+    unsigned long rowBytes;
+    unsigned char* rows[2];
+    unsigned int currentRow;
+    unsigned long rowFilled;
+    bool hasPreviousRow;
+    Image* image;
+    const DecodeOptions* options;
+    RowOutput output;
+    DecodeControl* control;
+} StreamDecoder;
+
+// Function to initialize a stream decoder writing into image
+static int InitStreamDecoder(StreamDecoder* decoder, Image* image, const DecodeOptions* options, DecodeControl* control)
+{
+    memset(decoder, 0, sizeof(*decoder));
+    decoder->isLittleEndian = IsLittleEndian();
+    decoder->image = image;
+    decoder->options = options;
+    decoder->control = control;
+    InitRowOutput(&decoder->output, image, options);
+    image->pixels = NULL;
+    image->sharedFile = -1;
+    image->mapping = NULL;
+
+    decoder->inflated = malloc(STREAM_INFLATE_BUFFER_SIZE);
+    if(!decoder->inflated || inflateInit(&decoder->stream) != Z_OK)
+    {
+        // The decoder is still freed by callers after a failed init
+        free(decoder->inflated);
+        decoder->inflated = NULL;
+        fprintf(stderr, "Error: Cannot initialize the stream decoder!\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+// Function to free a stream decoder, also after a failed init, the image is only freed if decoding did not finish
+static void FreeStreamDecoder(StreamDecoder* decoder)
+{
+    inflateEnd(&decoder->stream);
+    free(decoder->inflated);
+    free(decoder->chunk.data);
+    free(decoder->rows[0]);
+    free(decoder->rows[1]);
+    FreeRowOutput(&decoder->output);
+    if(decoder->state != STREAM_DONE)
+    {
+        FreeImage(decoder->image);
+    }
+}
+
+// Function to move the stream decoder to the next non-empty pass, returns false when all rows are done
+static bool StartNextStreamPass(StreamDecoder* decoder)
+{
+    const int lastPass = IsInterlaced(&decoder->ihdr) ? NON_INTERLACED_PASS - 1 : NON_INTERLACED_PASS;
+
+    do
+    {
+        decoder->pass++;
+        if(decoder->pass > lastPass)
+        {
+            return false;
+        }
+        GetPassSize(&decoder->ihdr, decoder->pass, &decoder->passWidth, &decoder->passHeight);
+    } while(decoder->passWidth == 0);
+
+    decoder->passY = 0;
+    decoder->rowBytes = GetRowBytes(&decoder->ihdr, decoder->passWidth);
+    decoder->rowFilled = 0;
+    decoder->hasPreviousRow = false;
+
+    return true;
+}
+
+// Function to set the stream decoder up once IHDR and the chunks before IDAT are known
+static int StartStreamImage(StreamDecoder* decoder)
+{
+    const Ihdr* ihdr = &decoder->ihdr;
+    const PixelFormat format = decoder->options ? decoder->options->format : FORMAT_RGBA8;
+    unsigned long pixelBytes;
+    if(!GetImageBytes(ihdr, format, &pixelBytes))
+    {
+        fprintf(stderr, "Error: Image too large!\n");
+        return -1;
+    }
+
+    if(LayoutRowOutput(&decoder->output, ihdr) == -1 || AllocateRowOutput(&decoder->output, ihdr, &decoder->palette) == -1)
+    {
+        return -1;
+    }
+
+    // The first pass, or the whole image, has the widest rows
+    const unsigned long maxRowBytes = GetRowBytes(ihdr, ihdr->width) + 1;
+    decoder->rows[0] = malloc(maxRowBytes);
+    decoder->rows[1] = malloc(maxRowBytes);
+    if(!decoder->rows[0] || !decoder->rows[1])
+    {
+        fprintf(stderr, "Error: Unable to allocate enough memory for the scanlines!\n");
+        return -1;
+    }
+    decoder->pass = IsInterlaced(ihdr) ? -1 : NON_INTERLACED_PASS - 1;
+    StartNextStreamPass(decoder);
+
+    return 0;
+}
+
+// Function to split inflated bytes into scanlines and reconstruct each one as soon as it is complete
+static int FeedStreamRows(StreamDecoder* decoder, const unsigned char* data, unsigned long length)
+{
+    while(length > 0)
+    {
+        if(decoder->pass > NON_INTERLACED_PASS)
+        {
+            fprintf(stderr, "Error: More image data than the header allows!\n");
+            return -1;
+        }
+
+        unsigned char* row = decoder->rows[decoder->currentRow];
+        const unsigned long needed = decoder->rowBytes + 1 - decoder->rowFilled;
+        const unsigned long count = length < needed ? length : needed;
+        memcpy(row + decoder->rowFilled, data, count);
+        decoder->rowFilled += count;
+        data += count;
+        length -= count;
+        if(decoder->rowFilled < decoder->rowBytes + 1)
+        {
+            continue;
+        }
+
+        const unsigned char* previousRow = decoder->hasPreviousRow ? decoder->rows[decoder->currentRow ^ 1] : NULL;
+        if(decoder->output.rowDecoder->unfilterRow(row, previousRow, decoder->rowBytes) == -1)
+        {
+            return -1;
+        }
+        if(OutputRow(&decoder->ihdr, &decoder->palette, &decoder->output, decoder->pass, decoder->passY, row + 1, decoder->passWidth) != 0)
+        {
+            return -1;
+        }
+
+        decoder->currentRow ^= 1;
+        decoder->hasPreviousRow = true;
+        decoder->rowFilled = 0;
+        if(++decoder->passY % DECODE_ROW_BATCH == 0)
+        {
+            YieldDecodeControl(decoder->control);
+        }
+        if(decoder->passY == decoder->passHeight && !StartNextStreamPass(decoder))
+        {
+            decoder->pass = NON_INTERLACED_PASS + 1;
+        }
+    }
+
+    return 0;
+}
+
+// Function to inflate a piece of IDAT data straight into scanlines
+static int FeedStreamIdat(StreamDecoder* decoder, const unsigned char* data, const unsigned long length)
+{
+    if(!decoder->image->pixels && StartStreamImage(decoder) == -1)
+    {
+        return -1;
+    }
+    if(decoder->streamEnded)
+    {
+        return 0;
+    }
+
+    decoder->stream.next_in = (unsigned char*)data;
+    decoder->stream.avail_in = length;
+    while(decoder->stream.avail_in > 0)
+    {
+        const int status = CheckDecodeControl(decoder->control);
+        if(status != 0)
+        {
+            return status;
+        }
+
+        decoder->stream.next_out = decoder->inflated;
+        decoder->stream.avail_out = STREAM_INFLATE_BUFFER_SIZE;
+        const int result = inflate(&decoder->stream, Z_NO_FLUSH);
+        if(result != Z_OK && result != Z_STREAM_END)
+        {
+            fprintf(stderr, "Error: Cannot decompress!\n");
+            return -1;
+        }
+        decoder->control->bytesInflated = decoder->stream.total_out;
+        if(FeedStreamRows(decoder, decoder->inflated, STREAM_INFLATE_BUFFER_SIZE - decoder->stream.avail_out) == -1)
+        {
+            return -1;
+        }
+        if(result == Z_STREAM_END)
+        {
+            decoder->streamEnded = true;
+            break;
+        }
+    }
+
+    return 0;
+}
+
+// Function to act on a complete chunk whose CRC matched
+static int FinishStreamChunk(StreamDecoder* decoder)
+{
+    Chunk* chunk = &decoder->chunk;
+    decoder->control->chunksRead = ++decoder->chunksRead;
+
+    if(!decoder->haveHeader)
+    {
+        if(strcmp((const char*)chunk->type, HEADER_CHUNK_TYPE) != 0)
+        {
+            fprintf(stderr, "Error: First chunk is not IHDR!\n");
+            return -1;
+        }
+        decoder->control->stage = STAGE_PARSING_HEADER;
+        if(GetIhdrChunkData(chunk, &decoder->ihdr, decoder->isLittleEndian) == -1)
+        {
+            return -1;
+        }
+        decoder->haveHeader = true;
+        decoder->control->stage = STAGE_INFLATING;
+    }
+    else if(strcmp((const char*)chunk->type, PALETTE_CHUNK_TYPE) == 0)
+    {
+        if(GetPaletteChunkData(chunk, &decoder->palette) == -1)
+        {
+            return -1;
+        }
+    }
+#if PNG_SUPPORT_ANCILLARY_CHUNKS
+    else if(strcmp((const char*)chunk->type, TRANSPARENCY_CHUNK_TYPE) == 0 && !decoder->image->pixels)
+    {
+        if(ReadTransparencyChunk(&decoder->output, chunk, &decoder->ihdr, &decoder->palette) == -1)
+        {
+            return -1;
+        }
+    }
+    else if(strcmp((const char*)chunk->type, EXIF_CHUNK_TYPE) == 0 && !decoder->image->pixels)
+    {
+        // A large eXIf chunk is only kept up to its first bytes, which hold the TIFF header and the first IFD
+        Chunk kept = *chunk;
+        kept.dataLength = decoder->chunkKept;
+        ReadExifOrientation(&decoder->output, &kept);
+    }
+    else if(strcmp((const char*)chunk->type, BACKGROUND_CHUNK_TYPE) == 0 && !decoder->image->pixels)
+    {
+        ReadBackgroundChunk(&decoder->output, chunk, &decoder->ihdr, &decoder->palette);
+    }
+    else if(strcmp((const char*)chunk->type, SIGNIFICANT_BITS_CHUNK_TYPE) == 0 && !decoder->image->pixels)
+    {
+        ReadSignificantBitsChunk(&decoder->output, chunk, &decoder->ihdr);
+    }
+#endif
+    else if(strcmp((const char*)chunk->type, LAST_CHUNK_TYPE_SIGNATURE) == 0)
+    {
+        if(!decoder->streamEnded || decoder->pass <= NON_INTERLACED_PASS)
+        {
+            fprintf(stderr, "Error: Image data ends early!\n");
+            return -1;
+        }
+        if(FinishRowOutput(&decoder->output, &decoder->ihdr) != 0)
+        {
+            return -1;
+        }
+        decoder->state = STREAM_DONE;
+        decoder->control->stage = STAGE_DONE;
+    }
+
+    free(chunk->data);
+    chunk->data = NULL;
+
+    return 0;
+}
+
+// Function to feed the next bytes of a PNG file to the stream decoder
+static int FeedStreamDecoder(StreamDecoder* decoder, const unsigned char* data, unsigned long length)
+{
+    const unsigned char pngSignature[] = {137, 80, 78, 71, 13, 10, 26, 10};
+
+    while(length > 0 && decoder->state != STREAM_DONE)
+    {
+        switch(decoder->state)
+        {
+            case STREAM_SIGNATURE:
+            case STREAM_CHUNK_HEADER:
+            case STREAM_CHUNK_CRC:
+            {
+                // Gather fixed-size fields that may straddle two reads
+                const unsigned int wanted = decoder->state == STREAM_SIGNATURE ? PNG_SIGNATURE_LENGTH :
+                    decoder->state == STREAM_CHUNK_HEADER ? CHUNK_DATA_LENGTH + CHUNK_TYPE_LENGTH : CHUNK_CRC_LENGTH;
+                const unsigned int count = length < wanted - decoder->pendingLength ? (unsigned int)length : wanted - decoder->pendingLength;
+                memcpy(decoder->pending + decoder->pendingLength, data, count);
+                decoder->pendingLength += count;
+                data += count;
+                length -= count;
+                if(decoder->pendingLength < wanted)
+                {
+                    break;
+                }
+                decoder->pendingLength = 0;
+
+                if(decoder->state == STREAM_SIGNATURE)
+                {
+                    if(memcmp(pngSignature, decoder->pending, PNG_SIGNATURE_LENGTH) != 0)
+                    {
+                        fprintf(stderr, "Error: Invalid PNG signature!\n");
+                        return -1;
+                    }
+                    decoder->state = STREAM_CHUNK_HEADER;
+                }
+                else if(decoder->state == STREAM_CHUNK_HEADER)
+                {
+                    // Chunks boundaries are where a decode gets stopped
+                    const int status = CheckDecodeControl(decoder->control);
+                    if(status != 0)
+                    {
+                        return status;
+                    }
+
+                    Chunk* chunk = &decoder->chunk;
+                    memcpy(&chunk->dataLength, decoder->pending, CHUNK_DATA_LENGTH);
+                    if(decoder->isLittleEndian)
+                    {
+                        chunk->dataLength = ToLittleEndian(chunk->dataLength);
+                    }
+                    memcpy(chunk->type, decoder->pending + CHUNK_DATA_LENGTH, CHUNK_TYPE_LENGTH);
+                    chunk->type[CHUNK_TYPE_LENGTH] = '\0';
+                    decoder->chunkDone = 0;
+#if PNG_CHECK_CRC
+                    decoder->checksum = crc32(crc32(0L, Z_NULL, 0), chunk->type, CHUNK_TYPE_LENGTH);
+#endif
+
+                    // Only the small chunks the decoder needs are kept, IDAT is inflated as it arrives
+                    const bool isExif = strcmp((const char*)chunk->type, EXIF_CHUNK_TYPE) == 0;
+                    decoder->chunkKept = 0;
+                    if(strcmp((const char*)chunk->type, DATA_CHUNK_TYPE) != 0 && (chunk->dataLength <= STREAM_MAX_KEPT_CHUNK || isExif))
+                    {
+                        decoder->chunkKept = chunk->dataLength < STREAM_MAX_KEPT_CHUNK ? chunk->dataLength : STREAM_MAX_KEPT_CHUNK;
+                        chunk->data = malloc(decoder->chunkKept ? decoder->chunkKept : 1);
+                        if(!chunk->data)
+                        {
+                            fprintf(stderr, "Error: Unable to allocate enough memory for chunk data!\n");
+                            return -1;
+                        }
+                    }
+                    else if(!decoder->haveHeader)
+                    {
+                        fprintf(stderr, "Error: First chunk is not IHDR!\n");
+                        return -1;
+                    }
+                    decoder->state = chunk->dataLength > 0 ? STREAM_CHUNK_DATA : STREAM_CHUNK_CRC;
+                }
+                else
+                {
+#if PNG_CHECK_CRC
+                    unsigned int crc;
+                    memcpy(&crc, decoder->pending, CHUNK_CRC_LENGTH);
+                    if(decoder->isLittleEndian)
+                    {
+                        crc = ToLittleEndian(crc);
+                    }
+                    if(crc != decoder->checksum)
+                    {
+                        fprintf(stderr, "Error: Checksum failed! %u != %u\n", crc, decoder->checksum);
+                        return -1;
+                    }
+#endif
+                    decoder->state = STREAM_CHUNK_HEADER;
+                    if(FinishStreamChunk(decoder) == -1)
+                    {
+                        return -1;
+                    }
+                }
+                break;
+            }
+            case STREAM_CHUNK_DATA:
+            {
+                Chunk* chunk = &decoder->chunk;
+                const unsigned long remaining = chunk->dataLength - decoder->chunkDone;
+                const unsigned long count = length < remaining ? length : remaining;
+#if PNG_CHECK_CRC
+                decoder->checksum = crc32(decoder->checksum, data, count);
+#endif
+                if(chunk->data)
+                {
+                    if(decoder->chunkDone < decoder->chunkKept)
+                    {
+                        const unsigned long kept = decoder->chunkKept - decoder->chunkDone;
+                        memcpy(chunk->data + decoder->chunkDone, data, count < kept ? count : kept);
+                    }
+                }
+                else if(strcmp((const char*)chunk->type, DATA_CHUNK_TYPE) == 0)
+                {
+                    const int status = FeedStreamIdat(decoder, data, count);
+                    if(status != 0)
+                    {
+                        return status;
+                    }
+                }
+                decoder->chunkDone += count;
+                data += count;
+                length -= count;
+                if(decoder->chunkDone == chunk->dataLength)
+                {
+                    decoder->state = STREAM_CHUNK_CRC;
+                }
+                break;
+            }
+            default:
+                break;
+        }
+    }
+
+    return 0;
+}
+
+#ifdef __linux__
+// Structure to represent the reader thread filling two aligned buffers in turn
+typedef struct DirectReader
+{
+    int descriptor;
+    bool bypassesCache;             // False when O_DIRECT was refused and pages are dropped after use instead
+    unsigned char* buffers[2];
+    long lengths[2];
+    bool ready[2];
+    bool stopping;
+    mtx_t lock;
+    cnd_t changed;
+} DirectReader;
+
+// Function run by the reader thread, an empty buffer marks the end of the file and a negative length an error
+static int DirectReadWorker(void* argument)
+{
+    DirectReader* reader = argument;
+    off_t offset = 0;
+
+    for(unsigned int index = 0;; index ^= 1)
+    {
+        mtx_lock(&reader->lock);
+        while(reader->ready[index] && !reader->stopping)
+        {
+            cnd_wait(&reader->changed, &reader->lock);
+        }
+        const bool stopping = reader->stopping;
+        mtx_unlock(&reader->lock);
+        if(stopping)
+        {
+            break;
+        }
+
+        // Full-size reads until the end of the file, only an empty read ends a cached file but an O_DIRECT one also ends
+        // with a short read off the alignment, past which the next read would be refused
+        long filled = 0;
+        while(filled < DIRECT_IO_BUFFER_SIZE)
+        {
+            const ssize_t count = pread(reader->descriptor, reader->buffers[index] + filled, DIRECT_IO_BUFFER_SIZE - filled, offset + filled);
+            if(count < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if(count <= 0)
+            {
+                if(count < 0)
+                {
+                    filled = -1;
+                }
+                break;
+            }
+            filled += count;
+            if(reader->bypassesCache && filled % DIRECT_IO_ALIGNMENT != 0)
+            {
+                break;
+            }
+        }
+        if(!reader->bypassesCache && filled > 0)
+        {
+            posix_fadvise(reader->descriptor, offset, filled, POSIX_FADV_DONTNEED);
+        }
+        offset += filled > 0 ? filled : 0;
+
+        mtx_lock(&reader->lock);
+        reader->lengths[index] = filled;
+        reader->ready[index] = true;
+        cnd_broadcast(&reader->changed);
+        mtx_unlock(&reader->lock);
+        if(filled < DIRECT_IO_BUFFER_SIZE)
+        {
+            break;
+        }
+    }
+
+    return 0;
+}
+
+// Function to decode a huge PNG read around the page cache, parsing one buffer while the next is read
+static int DecodePngFileDirect(const char* path, Image* image, const DecodeOptions* options, DecodeControl* control)
+{
+    DirectReader reader = {0};
+    reader.bypassesCache = true;
+    reader.descriptor = open(path, O_RDONLY | O_CLOEXEC | O_DIRECT);
+    if(reader.descriptor < 0 && errno == EINVAL)
+    {
+        // Some file systems refuse O_DIRECT, dropping the pages after use keeps the cache almost as clean
+        reader.bypassesCache = false;
+        reader.descriptor = open(path, O_RDONLY | O_CLOEXEC);
+    }
+    if(reader.descriptor < 0)
+    {
+        fprintf(stderr, "Error: Can't open the file!\n");
+        return -1;
+    }
+    if(!reader.bypassesCache)
+    {
+        posix_fadvise(reader.descriptor, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+
+    StreamDecoder decoder;
+    int status = InitStreamDecoder(&decoder, image, options, control);
+    for(int i = 0; i < 2 && status == 0; i++)
+    {
+        if(posix_memalign((void**)&reader.buffers[i], DIRECT_IO_ALIGNMENT, DIRECT_IO_BUFFER_SIZE) != 0)
+        {
+            reader.buffers[i] = NULL;
+            fprintf(stderr, "Error: Unable to allocate enough memory for the read buffers!\n");
+            status = -1;
+        }
+    }
+
+    thrd_t readerThread;
+    bool readerStarted = false;
+    if(status == 0)
+    {
+        mtx_init(&reader.lock, mtx_plain);
+        cnd_init(&reader.changed);
+        readerStarted = thrd_create(&readerThread, DirectReadWorker, &reader) == thrd_success;
+        if(!readerStarted)
+        {
+            fprintf(stderr, "Error: Can't start the reader!\n");
+            status = -1;
+        }
+    }
+
+    for(unsigned int index = 0; status == 0 && decoder.state != STREAM_DONE; index ^= 1)
+    {
+        mtx_lock(&reader.lock);
+        while(!reader.ready[index])
+        {
+            cnd_wait(&reader.changed, &reader.lock);
+        }
+        const long length = reader.lengths[index];
+        mtx_unlock(&reader.lock);
+
+        if(length <= 0)
+        {
+            fprintf(stderr, length < 0 ? "Error: Something in the reading went wrong!\n" : "Error: Truncated PNG!\n");
+            status = -1;
+            break;
+        }
+        status = FeedStreamDecoder(&decoder, reader.buffers[index], (unsigned long)length);
+        if(status == 0 && decoder.state != STREAM_DONE && length < DIRECT_IO_BUFFER_SIZE)
+        {
+            // A short read was the end of the file, the reader has stopped
+            fprintf(stderr, "Error: Truncated PNG!\n");
+            status = -1;
+        }
+
+        // Hand the buffer back so the reader refills it while the other one is parsed
+        mtx_lock(&reader.lock);
+        reader.ready[index] = false;
+        cnd_broadcast(&reader.changed);
+        mtx_unlock(&reader.lock);
+    }
+
+    if(readerStarted)
+    {
+        mtx_lock(&reader.lock);
+        reader.stopping = true;
+        cnd_broadcast(&reader.changed);
+        mtx_unlock(&reader.lock);
+        thrd_join(readerThread, NULL);
+        cnd_destroy(&reader.changed);
+        mtx_destroy(&reader.lock);
+    }
+    free(reader.buffers[0]);
+    free(reader.buffers[1]);
+    close(reader.descriptor);
+
+    if(status == 0 && image->sharedFile >= 0)
+    {
+        status = SealSharedImage(image);
+        if(status != 0)
+        {
+            decoder.state = STREAM_CHUNK_HEADER;
+        }
+    }
+    FreeStreamDecoder(&decoder);
+    if(status != 0 && status != -1)
+    {
+        ReportDecodeProgress(control, status);
+    }
+
+    return status;
+}
+#else
+// Function to report that direct reads are only available on Linux
+static int DecodePngFileDirect(const char* path, Image* image, const DecodeOptions* options, DecodeControl* control)
+{
+    (void)path;
+    (void)image;
+    (void)options;
+    (void)control;
+    fprintf(stderr, "Error: Direct reads are only available on Linux!\n");
+    return -1;
+}
+#endif
+
+#if PNG_SUPPORT_QOI
+// Structure to encode RGBA8 rows into QOI as they arrive, only the output grows with the image
+typedef struct QoiEncoder
+{
+    unsigned char index[QOI_INDEX_SIZE][4];
+    unsigned char previous[4];
+    unsigned int run;
+    unsigned char* output;
+    unsigned long outputSize;
+    unsigned long capacity;
+} QoiEncoder;
+
+// Function to initialize a QOI encoder
+static void InitQoiEncoder(QoiEncoder* encoder)
+{
+    memset(encoder, 0, sizeof(*encoder));
+    encoder->previous[3] = 255;
+}
+
+// Function to make room for more QOI output, the capacity doubles so appends stay amortised
+static int ReserveQoiOutput(QoiEncoder* encoder, const unsigned long length)
+{
+    if(length <= encoder->capacity - encoder->outputSize)
+    {
+        return 0;
+    }
+    if(length > ULONG_MAX / 2 - encoder->outputSize)
+    {
+        fprintf(stderr, "Error: Image too large!\n");
+        return -1;
+    }
+
+    unsigned long capacity = encoder->capacity > 0 ? encoder->capacity : STREAM_INFLATE_BUFFER_SIZE;
+    while(capacity - encoder->outputSize < length)
+    {
+        capacity *= 2;
+    }
+    unsigned char* output = realloc(encoder->output, capacity);
+    if(!output)
+    {
+        fprintf(stderr, "Error: Unable to allocate enough memory for the QOI output!\n");
+        return -1;
+    }
+    encoder->output = output;
+    encoder->capacity = capacity;
+
+    return 0;
+}
+
+// Function to hash a pixel into the QOI index of recently seen pixels
+static unsigned int GetQoiIndexPosition(const unsigned char* pixel)
+{
+    return (pixel[0] * 3 + pixel[1] * 5 + pixel[2] * 7 + pixel[3] * 11) % QOI_INDEX_SIZE;
+}
+
+// Function to encode a row of RGBA8 pixels, the header goes out with the first row, usable as a row sink
+static int EncodeQoiRow(void* context, const Image* image, const unsigned int y, const unsigned char* pixels)
+{
+    QoiEncoder* encoder = context;
+    if(image->format != FORMAT_RGBA8)
+    {
+        fprintf(stderr, "Error: Only RGBA8 rows can be encoded to QOI!\n");
+        return -1;
+    }
+
+    // A pixel takes at most five bytes and a pending run one more
+    if(ReserveQoiOutput(encoder, (y == 0 ? QOI_HEADER_LENGTH : 0) + (unsigned long)image->width * 5 + 1) == -1)
+    {
+        return -1;
+    }
+    unsigned char* output = encoder->output + encoder->outputSize;
+    if(y == 0)
+    {
+        memcpy(output, QOI_MAGIC, 4);
+        StoreBigEndian(output + 4, image->width);
+        StoreBigEndian(output + 8, image->height);
+        output[12] = 4;
+        output[13] = 0;
+        output += QOI_HEADER_LENGTH;
+    }
+
+    for(unsigned int x = 0; x < image->width; x++)
+    {
+        const unsigned char* pixel = pixels + (unsigned long)x * 4;
+        if(memcmp(pixel, encoder->previous, 4) == 0)
+        {
+            if(++encoder->run == QOI_MAX_RUN)
+            {
+                *output++ = QOI_OP_RUN | (unsigned char)(encoder->run - 1);
+                encoder->run = 0;
+            }
+            continue;
+        }
+        if(encoder->run > 0)
+        {
+            *output++ = QOI_OP_RUN | (unsigned char)(encoder->run - 1);
+            encoder->run = 0;
+        }
+
+        const unsigned int position = GetQoiIndexPosition(pixel);
+        if(memcmp(encoder->index[position], pixel, 4) == 0)
+        {
+            *output++ = QOI_OP_INDEX | (unsigned char)position;
+        }
+        else if(pixel[3] != encoder->previous[3])
+        {
+            output[0] = QOI_OP_RGBA;
+            memcpy(output + 1, pixel, 4);
+            output += 5;
+        }
+        else
+        {
+            // Differences wrap around like the decoder adds them
+            const signed char redDifference = (signed char)(pixel[0] - encoder->previous[0]);
+            const signed char greenDifference = (signed char)(pixel[1] - encoder->previous[1]);
+            const signed char blueDifference = (signed char)(pixel[2] - encoder->previous[2]);
+            const int redGreen = redDifference - greenDifference;
+            const int blueGreen = blueDifference - greenDifference;
+            if(redDifference >= -2 && redDifference <= 1 && greenDifference >= -2 && greenDifference <= 1 && blueDifference >= -2 && blueDifference <= 1)
+            {
+                *output++ = QOI_OP_DIFF | (unsigned char)((redDifference + 2) << 4 | (greenDifference + 2) << 2 | (blueDifference + 2));
+            }
+            else if(greenDifference >= -32 && greenDifference <= 31 && redGreen >= -8 && redGreen <= 7 && blueGreen >= -8 && blueGreen <= 7)
+            {
+                output[0] = QOI_OP_LUMA | (unsigned char)(greenDifference + 32);
+                output[1] = (unsigned char)((redGreen + 8) << 4 | (blueGreen + 8));
+                output += 2;
+            }
+            else
+            {
+                output[0] = QOI_OP_RGB;
+                memcpy(output + 1, pixel, 3);
+                output += 4;
+            }
+        }
+        memcpy(encoder->index[position], pixel, 4);
+        memcpy(encoder->previous, pixel, 4);
+    }
+    encoder->outputSize = (unsigned long)(output - encoder->output);
+
+    return 0;
+}
+
+// Function to end a QOI stream, the encoder gives its output up to the caller
+static int FinishQoiEncoder(QoiEncoder* encoder, unsigned char** qoi, unsigned long* qoiSize)
+{
+    const unsigned char endMarker[QOI_END_LENGTH] = {0, 0, 0, 0, 0, 0, 0, 1};
+    if(ReserveQoiOutput(encoder, 1 + QOI_END_LENGTH) == -1)
+    {
+        return -1;
+    }
+    if(encoder->run > 0)
+    {
+        encoder->output[encoder->outputSize++] = QOI_OP_RUN | (unsigned char)(encoder->run - 1);
+        encoder->run = 0;
+    }
+    memcpy(encoder->output + encoder->outputSize, endMarker, QOI_END_LENGTH);
+    *qoi = encoder->output;
+    *qoiSize = encoder->outputSize + QOI_END_LENGTH;
+    encoder->output = NULL;
+
+    return 0;
+}
+
+// Function to decode a QOI image held in memory into RGBA8 pixels
+static int DecodeQoiBuffer(const unsigned char* buffer, const unsigned long bufferSize, Image* image)
+{
+    image->pixels = NULL;
+    image->sharedFile = -1;
+    image->mapping = NULL;
+    if(bufferSize < QOI_HEADER_LENGTH + QOI_END_LENGTH || memcmp(buffer, QOI_MAGIC, 4) != 0)
+    {
+        fprintf(stderr, "Error: Invalid QOI header!\n");
+        return -1;
+    }
+
+    const unsigned int width = ((unsigned int)buffer[4] << 24) | (buffer[5] << 16) | (buffer[6] << 8) | buffer[7];
+    const unsigned int height = ((unsigned int)buffer[8] << 24) | (buffer[9] << 16) | (buffer[10] << 8) | buffer[11];
+    if(width == 0 || height == 0 || width > QOI_MAX_DIMENSION || height > QOI_MAX_DIMENSION || width > ULONG_MAX / 4 / height ||
+       buffer[12] < 3 || buffer[12] > 4 || buffer[13] > 1)
+    {
+        fprintf(stderr, "Error: Invalid QOI header!\n");
+        return -1;
+    }
+    image->width = width;
+    image->height = height;
+    image->format = FORMAT_RGBA8;
+    image->stride = (unsigned long)width * 4;
+    image->size = image->stride * height;
+    if(AllocateImagePixels(image, NULL) == -1)
+    {
+        return -1;
+    }
+
+    unsigned char index[QOI_INDEX_SIZE][4] = {{0}};
+    unsigned char pixel[4] = {0, 0, 0, 255};
+    unsigned int run = 0;
+    unsigned long cursor = QOI_HEADER_LENGTH;
+    const unsigned long dataEnd = bufferSize - QOI_END_LENGTH;
+    for(unsigned long offset = 0; offset < image->size; offset += 4)
+    {
+        if(run > 0)
+        {
+            run--;
+        }
+        else if(cursor < dataEnd)
+        {
+            const unsigned char tag = buffer[cursor++];
+            if(tag == QOI_OP_RGB || tag == QOI_OP_RGBA)
+            {
+                const unsigned long length = tag == QOI_OP_RGB ? 3 : 4;
+                if(length > dataEnd - cursor)
+                {
+                    break;
+                }
+                memcpy(pixel, buffer + cursor, length);
+                cursor += length;
+            }
+            else if((tag & QOI_MASK) == QOI_OP_INDEX)
+            {
+                memcpy(pixel, index[tag], 4);
+            }
+            else if((tag & QOI_MASK) == QOI_OP_DIFF)
+            {
+                pixel[0] += ((tag >> 4) & 3) - 2;
+                pixel[1] += ((tag >> 2) & 3) - 2;
+                pixel[2] += (tag & 3) - 2;
+            }
+            else if((tag & QOI_MASK) == QOI_OP_LUMA)
+            {
+                if(cursor >= dataEnd)
+                {
+                    break;
+                }
+                const int greenDifference = (tag & 0x3F) - 32;
+                const unsigned char second = buffer[cursor++];
+                pixel[0] += greenDifference - 8 + (second >> 4);
+                pixel[1] += greenDifference;
+                pixel[2] += greenDifference - 8 + (second & 0x0F);
+            }
+            else
+            {
+                run = tag & 0x3F;
+            }
+            memcpy(index[GetQoiIndexPosition(pixel)], pixel, 4);
+        }
+        else
+        {
+            break;
+        }
+        memcpy(image->pixels + offset, pixel, 4);
+        if(offset + 4 == image->size)
+        {
+            return 0;
+        }
+    }
+
+    FreeImage(image);
+    fprintf(stderr, "Error: Truncated QOI data!\n");
+    return -1;
+}
+#endif
+
+#if PNG_SUPPORT_QOI || PNG_SUPPORT_BCN || PNG_SUPPORT_MIPS || PNG_SUPPORT_YUV
+// Function to decode a PNG file into a row sink, pieces of the file go through the stream decoder so neither the PNG
+// nor its pixels are ever held whole
+static int StreamPngFileToSink(const char* path, const RowSink* sink, const PixelFormat format, DecodeControl* control)
+{
+    FILE* file = NULL;
+    if(fopen_s(&file, path, "rb") != 0)
+    {
+        fprintf(stderr, "Error: Can't open %s!\n", path);
+        return -1;
+    }
+
+    const DecodeOptions options = {.format = format, .rowSink = sink};
+    Image image;
+    StreamDecoder decoder;
+    unsigned char* piece = malloc(STREAM_INFLATE_BUFFER_SIZE);
+    int status = piece ? InitStreamDecoder(&decoder, &image, &options, control) : -1;
+    if(!piece)
+    {
+        fprintf(stderr, "Error: Unable to allocate enough memory for the read buffer!\n");
+    }
+    else if(status == 0)
+    {
+        while(status == 0 && decoder.state != STREAM_DONE)
+        {
+            const size_t length = fread(piece, 1, STREAM_INFLATE_BUFFER_SIZE, file);
+            if(length == 0)
+            {
+                fprintf(stderr, "Error: Truncated PNG!\n");
+                status = -1;
+                break;
+            }
+            status = FeedStreamDecoder(&decoder, piece, (unsigned long)length);
+        }
+        FreeStreamDecoder(&decoder);
+        if(status == 0)
+        {
+            FreeImage(&image);
+        }
+    }
+    free(piece);
+    fclose(file);
+
+    if(status != 0 && status != -1)
+    {
+        ReportDecodeProgress(control, status);
+    }
+
+    return status;
+}
+#endif
+
+#if PNG_SUPPORT_QOI
+// Function to transcode a PNG file to QOI, every row goes straight from the stream decoder into the encoder
+static int TranscodePngFileToQoi(const char* path, DecodeControl* control, unsigned char** qoi, unsigned long* qoiSize)
+{
+    QoiEncoder encoder;
+    InitQoiEncoder(&encoder);
+    const RowSink sink = {EncodeQoiRow, &encoder};
+    int status = StreamPngFileToSink(path, &sink, FORMAT_RGBA8, control);
+    if(status == 0)
+    {
+        status = FinishQoiEncoder(&encoder, qoi, qoiSize);
+    }
+    free(encoder.output);
+
+    return status;
+}
+#endif
+
+#if PNG_SUPPORT_BCN
+// Enumeration for the block-compressed texture formats the decoder can emit
+typedef enum BlockFormat
+{
+    BLOCK_BC1,                      // RGB in 8 bytes, alpha is dropped
+    BLOCK_BC3,                      // BC1 colour plus interpolated alpha in 16 bytes
+    BLOCK_BC7                       // RGBA in 16 bytes, mode 6 only
+} BlockFormat;
+
+// Structure to encode RGBA8 rows into 4x4 blocks as they arrive, only a band of four rows and the output are held
+typedef struct BlockEncoder
+{
+    BlockFormat format;
+    unsigned char* band;
+    unsigned int bandRows;
+    unsigned int width;
+    unsigned int height;
+    unsigned int blocksWide;
+    unsigned int blocksHigh;
+    unsigned char* output;
+    unsigned long outputSize;
+} BlockEncoder;
+
+// Function to get the bytes of a 4x4 block in a format
+static unsigned int GetBlockBytes(const BlockFormat format)
+{
+    return format == BLOCK_BC1 ? 8 : 16;
+}
+
+// Function to copy a 4x4 block out of a band, columns past the right edge repeat the last pixel
+static void LoadBandBlock(const unsigned char* band, const unsigned int width, const unsigned int blockX, unsigned char block[16][4])
+{
+    for(unsigned int y = 0; y < 4; y++)
+    {
+        for(unsigned int x = 0; x < 4; x++)
+        {
+            const unsigned int imageX = blockX * 4 + x < width ? blockX * 4 + x : width - 1;
+            memcpy(block[y * 4 + x], band + ((unsigned long)y * width + imageX) * 4, 4);
+        }
+    }
+}
+
+// Function to pick two endpoints spanning a block, the bounding box diagonal that follows the colour correlation,
+// inset a little since the extremes rarely need to be hit exactly
+static void ChooseBlockEndpoints(const unsigned char block[16][4], const unsigned int channels, int low[4], int high[4])
+{
+    int mean[4] = {0, 0, 0, 0};
+    for(unsigned int channel = 0; channel < channels; channel++)
+    {
+        low[channel] = 255;
+        high[channel] = 0;
+        for(int i = 0; i < 16; i++)
+        {
+            low[channel] = block[i][channel] < low[channel] ? block[i][channel] : low[channel];
+            high[channel] = block[i][channel] > high[channel] ? block[i][channel] : high[channel];
+            mean[channel] += block[i][channel];
+        }
+    }
+
+    // Every other channel runs against green when it falls as green rises
+    for(unsigned int channel = 0; channel < channels; channel++)
+    {
+        if(channel == 1)
+        {
+            continue;
+        }
+        int covariance = 0;
+        for(int i = 0; i < 16; i++)
+        {
+            covariance += (block[i][channel] * 16 - mean[channel]) * (block[i][1] * 16 - mean[1]) / 256;
+        }
+        if(covariance < 0)
+        {
+            const int swap = low[channel];
+            low[channel] = high[channel];
+            high[channel] = swap;
+        }
+    }
+
+    for(unsigned int channel = 0; channel < channels; channel++)
+    {
+        const int inset = (high[channel] - low[channel]) / 16;
+        low[channel] += inset;
+        high[channel] -= inset;
+    }
+    for(unsigned int channel = channels; channel < 4; channel++)
+    {
+        low[channel] = high[channel] = 0;
+    }
+}
+
+// Function to project the pixels of a block on the axis between two endpoints, as dot products from the first one
+static void ProjectBlock(const unsigned char block[16][4], const int origin[4], const int axis[4], int dots[16])
+{
+#ifdef USE_SSE2
+    // Two pixels per register as 16 bits lanes, the multiply-add leaves two partial sums per pixel
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i origins = _mm_setr_epi16((short)origin[0], (short)origin[1], (short)origin[2], (short)origin[3],
+        (short)origin[0], (short)origin[1], (short)origin[2], (short)origin[3]);
+    const __m128i axes = _mm_setr_epi16((short)axis[0], (short)axis[1], (short)axis[2], (short)axis[3],
+        (short)axis[0], (short)axis[1], (short)axis[2], (short)axis[3]);
+    for(int i = 0; i < 16; i += 4)
+    {
+        const __m128i pixels = _mm_loadu_si128((const __m128i*)block[i]);
+        const __m128i low = _mm_madd_epi16(_mm_sub_epi16(_mm_unpacklo_epi8(pixels, zero), origins), axes);
+        const __m128i high = _mm_madd_epi16(_mm_sub_epi16(_mm_unpackhi_epi8(pixels, zero), origins), axes);
+        const __m128i evens = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(low), _mm_castsi128_ps(high), _MM_SHUFFLE(2, 0, 2, 0)));
+        const __m128i odds = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(low), _mm_castsi128_ps(high), _MM_SHUFFLE(3, 1, 3, 1)));
+        _mm_storeu_si128((__m128i*)(dots + i), _mm_add_epi32(evens, odds));
+    }
+#else
+    for(int i = 0; i < 16; i++)
+    {
+        dots[i] = 0;
+        for(int channel = 0; channel < 4; channel++)
+        {
+            dots[i] += (block[i][channel] - origin[channel]) * axis[channel];
+        }
+    }
+#endif
+}
+
+// Function to find for every pixel of a block the nearest of evenly spread steps between two decoded endpoints
+static void QuantizeBlockSteps(const unsigned char block[16][4], const int first[4], const int last[4], const int steps, int positions[16])
+{
+    int axis[4];
+    int lengthSquared = 0;
+    for(int channel = 0; channel < 4; channel++)
+    {
+        axis[channel] = last[channel] - first[channel];
+        lengthSquared += axis[channel] * axis[channel];
+    }
+
+    int dots[16];
+    ProjectBlock(block, first, axis, dots);
+    for(int i = 0; i < 16; i++)
+    {
+        const long long scaled = lengthSquared > 0 ? ((long long)dots[i] * (steps - 1) * 2 + lengthSquared) / (2LL * lengthSquared) : 0;
+        positions[i] = scaled < 0 ? 0 : scaled > steps - 1 ? steps - 1 : (int)scaled;
+    }
+}
+
+// Function to refit the endpoints of a block by least squares to the steps its pixels were given
+static void RefineBlockEndpoints(const unsigned char block[16][4], const int positions[16], const int steps, const unsigned int channels, int first[4], int last[4])
+{
+    // With t the step and u what is left of the line, each channel solves the same 2x2 system
+    const long long span = steps - 1;
+    long long uu = 0, ut = 0, tt = 0;
+    for(int i = 0; i < 16; i++)
+    {
+        const long long t = positions[i];
+        const long long u = span - t;
+        uu += u * u;
+        ut += u * t;
+        tt += t * t;
+    }
+    const long long determinant = uu * tt - ut * ut;
+    if(determinant == 0)
+    {
+        return;
+    }
+
+    for(unsigned int channel = 0; channel < channels; channel++)
+    {
+        long long up = 0, tp = 0;
+        for(int i = 0; i < 16; i++)
+        {
+            up += (span - positions[i]) * block[i][channel];
+            tp += positions[i] * block[i][channel];
+        }
+        const long long firstValue = span * (tt * up - ut * tp) / determinant;
+        const long long lastValue = span * (uu * tp - ut * up) / determinant;
+        first[channel] = firstValue < 0 ? 0 : firstValue > 255 ? 255 : (int)firstValue;
+        last[channel] = lastValue < 0 ? 0 : lastValue > 255 ? 255 : (int)lastValue;
+    }
+}
+
+// Function to pack an 8 bits colour into RGB565 and give back what it decodes to
+static unsigned int PackRgb565(const int color[4], int decoded[4])
+{
+    const unsigned int red = (unsigned int)(color[0] * 31 + 127) / 255;
+    const unsigned int green = (unsigned int)(color[1] * 63 + 127) / 255;
+    const unsigned int blue = (unsigned int)(color[2] * 31 + 127) / 255;
+    decoded[0] = (int)((red << 3) | (red >> 2));
+    decoded[1] = (int)((green << 2) | (green >> 4));
+    decoded[2] = (int)((blue << 3) | (blue >> 2));
+    decoded[3] = 0;
+
+    return (red << 11) | (green << 5) | blue;
+}
+
+// Function to encode the colour of a block as BC1 in its four colour mode
+static void EncodeBc1Block(const unsigned char block[16][4], unsigned char* output)
+{
+    int low[4], high[4];
+    ChooseBlockEndpoints(block, 3, low, high);
+    int first[4], last[4];
+    int positions[16];
+    PackRgb565(high, first);
+    PackRgb565(low, last);
+    QuantizeBlockSteps(block, first, last, 4, positions);
+    RefineBlockEndpoints(block, positions, 4, 3, high, low);
+    unsigned int color0 = PackRgb565(high, first);
+    unsigned int color1 = PackRgb565(low, last);
+
+    // Four colours need the first endpoint to compare greater, a step position runs from the first to the last one
+    unsigned int indices = 0;
+    if(color0 != color1)
+    {
+        if(color0 < color1)
+        {
+            const unsigned int swap = color0;
+            color0 = color1;
+            color1 = swap;
+            for(int channel = 0; channel < 3; channel++)
+            {
+                const int value = first[channel];
+                first[channel] = last[channel];
+                last[channel] = value;
+            }
+        }
+        const unsigned int stepIndices[4] = {0, 2, 3, 1};
+        QuantizeBlockSteps(block, first, last, 4, positions);
+        for(int i = 0; i < 16; i++)
+        {
+            indices |= stepIndices[positions[i]] << (i * 2);
+        }
+    }
+
+    output[0] = (unsigned char)color0;
+    output[1] = (unsigned char)(color0 >> 8);
+    output[2] = (unsigned char)color1;
+    output[3] = (unsigned char)(color1 >> 8);
+    for(int i = 0; i < 4; i++)
+    {
+        output[4 + i] = (unsigned char)(indices >> (i * 8));
+    }
+}
+
+// Function to encode the alpha of a block as a BC3 alpha block with eight interpolated values
+static void EncodeBc3AlphaBlock(const unsigned char block[16][4], unsigned char* output)
+{
+    int highest = 0, lowest = 255;
+    for(int i = 0; i < 16; i++)
+    {
+        highest = block[i][3] > highest ? block[i][3] : highest;
+        lowest = block[i][3] < lowest ? block[i][3] : lowest;
+    }
+    output[0] = (unsigned char)highest;
+    output[1] = (unsigned char)lowest;
+
+    uint64_t indices = 0;
+    if(highest != lowest)
+    {
+        const int first[4] = {0, 0, 0, highest};
+        const int last[4] = {0, 0, 0, lowest};
+        const unsigned int stepIndices[8] = {0, 2, 3, 4, 5, 6, 7, 1};
+        int positions[16];
+        QuantizeBlockSteps(block, first, last, 8, positions);
+        for(int i = 0; i < 16; i++)
+        {
+            indices |= (uint64_t)stepIndices[positions[i]] << (i * 3);
+        }
+    }
+    for(int i = 0; i < 6; i++)
+    {
+        output[2 + i] = (unsigned char)(indices >> (i * 8));
+    }
+}
+
+// Function to append bits to a 128 bits block, least significant first
+static void PutBlockBits(unsigned char* block, unsigned int* position, const unsigned int value, const unsigned int count)
+{
+    for(unsigned int i = 0; i < count; i++, (*position)++)
+    {
+        block[*position / 8] |= (unsigned char)(((value >> i) & 1) << (*position % 8));
+    }
+}
+
+// Function to quantize an endpoint to seven bits per channel and a shared low bit, keeping the closer of both low bits
+static unsigned int QuantizeBc7Endpoint(const int endpoint[4], unsigned int quantized[4], int decoded[4])
+{
+    unsigned int bestBit = 0;
+    int bestError = -1;
+    for(unsigned int bit = 0; bit < 2; bit++)
+    {
+        int error = 0;
+        unsigned int values[4];
+        for(int channel = 0; channel < 4; channel++)
+        {
+            const int value = (endpoint[channel] - (int)bit + 1) / 2;
+            values[channel] = value < 0 ? 0 : value > 127 ? 127 : (unsigned int)value;
+            const int difference = endpoint[channel] - (int)((values[channel] << 1) | bit);
+            error += difference * difference;
+        }
+        if(bestError == -1 || error < bestError)
+        {
+            bestError = error;
+            bestBit = bit;
+            for(int channel = 0; channel < 4; channel++)
+            {
+                quantized[channel] = values[channel];
+                decoded[channel] = (int)((values[channel] << 1) | bit);
+            }
+        }
+    }
+
+    return bestBit;
+}
+
+// Function to encode a block as BC7 mode 6, one RGBA line with sixteen steps
+static void EncodeBc7Block(const unsigned char block[16][4], unsigned char* output)
+{
+    int low[4], high[4];
+    ChooseBlockEndpoints(block, 4, low, high);
+    unsigned int quantized[2][4];
+    int decoded[2][4];
+    unsigned int lowBits[2];
+    int positions[16];
+    for(int pass = 0; pass < 2; pass++)
+    {
+        if(pass > 0)
+        {
+            RefineBlockEndpoints(block, positions, 16, 4, low, high);
+        }
+        lowBits[0] = QuantizeBc7Endpoint(low, quantized[0], decoded[0]);
+        lowBits[1] = QuantizeBc7Endpoint(high, quantized[1], decoded[1]);
+        QuantizeBlockSteps(block, decoded[0], decoded[1], 16, positions);
+    }
+
+    // The top bit of the first index is implied zero, swapping the endpoints mirrors every index
+    const unsigned int first = positions[0] >= 8 ? 1 : 0;
+    memset(output, 0, 16);
+    unsigned int position = 0;
+    PutBlockBits(output, &position, 1u << 6, 7);
+    for(int channel = 0; channel < 4; channel++)
+    {
+        PutBlockBits(output, &position, quantized[first][channel], 7);
+        PutBlockBits(output, &position, quantized[first ^ 1][channel], 7);
+    }
+    PutBlockBits(output, &position, lowBits[first], 1);
+    PutBlockBits(output, &position, lowBits[first ^ 1], 1);
+    for(int i = 0; i < 16; i++)
+    {
+        const unsigned int index = first ? 15 - (unsigned int)positions[i] : (unsigned int)positions[i];
+        PutBlockBits(output, &position, index, i == 0 ? 3 : 4);
+    }
+}
+
+// Function to encode the blocks of a full band of four rows
+static void EncodeBlockBand(BlockEncoder* encoder, const unsigned int width, const unsigned int bandY)
+{
+    const unsigned int blockBytes = GetBlockBytes(encoder->format);
+    unsigned char* output = encoder->output + (unsigned long)bandY * encoder->blocksWide * blockBytes;
+    unsigned char block[16][4];
+    for(unsigned int blockX = 0; blockX < encoder->blocksWide; blockX++, output += blockBytes)
+    {
+        LoadBandBlock(encoder->band, width, blockX, block);
+        switch(encoder->format)
+        {
+            case BLOCK_BC1:
+                EncodeBc1Block(block, output);
+                break;
+            case BLOCK_BC3:
+                EncodeBc3AlphaBlock(block, output);
+                EncodeBc1Block(block, output + 8);
+                break;
+            case BLOCK_BC7:
+                EncodeBc7Block(block, output);
+                break;
+        }
+    }
+}
+
+// Function to add a row of RGBA8 pixels to the band, which is encoded once it has four rows, usable as a row sink
+static int EncodeBlockRow(void* context, const Image* image, const unsigned int y, const unsigned char* pixels)
+{
+    BlockEncoder* encoder = context;
+    if(image->format != FORMAT_RGBA8)
+    {
+        fprintf(stderr, "Error: Only RGBA8 rows can be block compressed!\n");
+        return -1;
+    }
+
+    // Everything is sized on the first row
+    const unsigned long rowBytes = (unsigned long)image->width * 4;
+    if(y == 0)
+    {
+        encoder->width = image->width;
+        encoder->height = image->height;
+        encoder->blocksWide = (image->width + 3) / 4;
+        encoder->blocksHigh = (image->height + 3) / 4;
+        const unsigned long long outputBytes = (unsigned long long)encoder->blocksWide * encoder->blocksHigh * GetBlockBytes(encoder->format);
+        if(outputBytes > ULONG_MAX || rowBytes > ULONG_MAX / 4)
+        {
+            fprintf(stderr, "Error: Image too large!\n");
+            return -1;
+        }
+        encoder->outputSize = (unsigned long)outputBytes;
+        encoder->output = malloc(encoder->outputSize);
+        encoder->band = malloc(rowBytes * 4);
+        if(!encoder->output || !encoder->band)
+        {
+            fprintf(stderr, "Error: Unable to allocate enough memory for the block output!\n");
+            return -1;
+        }
+    }
+
+    memcpy(encoder->band + (unsigned long)(y % 4) * rowBytes, pixels, rowBytes);
+    encoder->bandRows = y % 4 + 1;
+
+    // The last band of an image whose height is not a multiple of four repeats its last row
+    if(encoder->bandRows < 4 && y + 1 == image->height)
+    {
+        for(unsigned int row = encoder->bandRows; row < 4; row++)
+        {
+            memcpy(encoder->band + row * rowBytes, pixels, rowBytes);
+        }
+        encoder->bandRows = 4;
+    }
+    if(encoder->bandRows == 4)
+    {
+        EncodeBlockBand(encoder, image->width, y / 4);
+        encoder->bandRows = 0;
+    }
+
+    return 0;
+}
+
+// Function to decode a PNG file straight into block-compressed texture data, rows reach the encoder four at a time while
+// they are still in cache
+static int DecodePngFileToBlocks(const char* path, const BlockFormat format, DecodeControl* control, unsigned char** blocks, unsigned long* blocksSize, unsigned int* width, unsigned int* height)
+{
+    BlockEncoder encoder;
+    memset(&encoder, 0, sizeof(encoder));
+    encoder.format = format;
+    const RowSink sink = {EncodeBlockRow, &encoder};
+    const int status = StreamPngFileToSink(path, &sink, FORMAT_RGBA8, control);
+    free(encoder.band);
+    if(status != 0)
+    {
+        free(encoder.output);
+        return status;
+    }
+
+    *blocks = encoder.output;
+    *blocksSize = encoder.outputSize;
+    *width = encoder.width;
+    *height = encoder.height;
+
+    return 0;
+}
+
+// Function to write block-compressed texture data as a DDS file, BC7 needs the DX10 header extension
+static int WriteDdsFile(const char* path, const BlockFormat format, const unsigned int width, const unsigned int height, const unsigned char* blocks, const unsigned long blocksSize)
+{
+    unsigned char header[DDS_HEADER_LENGTH + DDS_DX10_HEADER_LENGTH] = {0};
+    memcpy(header, "DDS ", 4);
+    StoreLittleEndian(header + 4, DDS_HEADER_LENGTH - 4);
+    StoreLittleEndian(header + 8, DDS_FLAGS);
+    StoreLittleEndian(header + 12, height);
+    StoreLittleEndian(header + 16, width);
+    StoreLittleEndian(header + 20, (uint32_t)blocksSize);
+    StoreLittleEndian(header + 76, DDS_PIXEL_FORMAT_LENGTH);
+    StoreLittleEndian(header + 80, DDS_FOURCC_FLAG);
+    memcpy(header + 84, format == BLOCK_BC1 ? "DXT1" : format == BLOCK_BC3 ? "DXT5" : "DX10", 4);
+    StoreLittleEndian(header + 108, DDS_TEXTURE_CAPS);
+    const unsigned long headerLength = format == BLOCK_BC7 ? DDS_HEADER_LENGTH + DDS_DX10_HEADER_LENGTH : DDS_HEADER_LENGTH;
+    if(format == BLOCK_BC7)
+    {
+        StoreLittleEndian(header + DDS_HEADER_LENGTH, DXGI_FORMAT_BC7_UNORM);
+        StoreLittleEndian(header + DDS_HEADER_LENGTH + 4, DDS_TEXTURE_2D);
+        StoreLittleEndian(header + DDS_HEADER_LENGTH + 12, 1);
+    }
+
+    FILE* file = NULL;
+    if(fopen_s(&file, path, "wb") != 0)
+    {
+        fprintf(stderr, "Error: Can't create %s!\n", path);
+        return -1;
+    }
+    const bool written = fwrite(header, 1, headerLength, file) == headerLength && fwrite(blocks, 1, blocksSize, file) == blocksSize;
+    if(fclose(file) != 0 || !written)
+    {
+        fprintf(stderr, "Error: Can't write %s!\n", path);
+        return -1;
+    }
+
+    return 0;
+}
+#endif
+
+#if PNG_SUPPORT_MIPS
+// Enumeration for how a mip level is reduced from the one above
+typedef enum MipFilter
+{
+    MIP_BOX,                        // 2x2 average of the stored values
+    MIP_SRGB                        // 2x2 average of the colours in linear light, alpha stays linear
+} MipFilter;
+
+// Structure to build a mip chain while an image decodes, each level is reduced from the last two rows of the level above
+// as soon as they exist, so no level is ever read back whole
+typedef struct MipChain
+{
+    MipFilter filter;
+    unsigned int levelCount;
+    Image levels[MIP_MAX_LEVELS];
+} MipChain;
+
+// Linear light of every sRGB code in 16 bits fixed point
+static const uint16_t srgbToLinear[256] =
+{
+    0, 20, 40, 60, 80, 99, 119, 139, 159, 179, 199, 219, 241, 264, 288, 313,
+    340, 367, 396, 427, 458, 491, 526, 562, 599, 637, 677, 718, 761, 805, 851, 898,
+    947, 997, 1048, 1101, 1156, 1212, 1270, 1330, 1391, 1453, 1517, 1583, 1651, 1720, 1790, 1863,
+    1937, 2013, 2090, 2170, 2250, 2333, 2418, 2504, 2592, 2681, 2773, 2866, 2961, 3058, 3157, 3258,
+    3360, 3464, 3570, 3678, 3788, 3900, 4014, 4129, 4247, 4366, 4488, 4611, 4736, 4864, 4993, 5124,
+    5257, 5392, 5530, 5669, 5810, 5953, 6099, 6246, 6395, 6547, 6700, 6856, 7014, 7174, 7335, 7500,
+    7666, 7834, 8004, 8177, 8352, 8528, 8708, 8889, 9072, 9258, 9445, 9635, 9828, 10022, 10219, 10417,
+    10619, 10822, 11028, 11235, 11446, 11658, 11873, 12090, 12309, 12530, 12754, 12980, 13209, 13440, 13673, 13909,
+    14146, 14387, 14629, 14874, 15122, 15371, 15623, 15878, 16135, 16394, 16656, 16920, 17187, 17456, 17727, 18001,
+    18277, 18556, 18837, 19121, 19407, 19696, 19987, 20281, 20577, 20876, 21177, 21481, 21787, 22096, 22407, 22721,
+    23038, 23357, 23678, 24002, 24329, 24658, 24990, 25325, 25662, 26001, 26344, 26688, 27036, 27386, 27739, 28094,
+    28452, 28813, 29176, 29542, 29911, 30282, 30656, 31033, 31412, 31794, 32179, 32567, 32957, 33350, 33745, 34143,
+    34544, 34948, 35355, 35764, 36176, 36591, 37008, 37429, 37852, 38278, 38706, 39138, 39572, 40009, 40449, 40891,
+    41337, 41785, 42236, 42690, 43147, 43606, 44069, 44534, 45002, 45473, 45947, 46423, 46903, 47385, 47871, 48359,
+    48850, 49344, 49841, 50341, 50844, 51349, 51858, 52369, 52884, 53401, 53921, 54445, 54971, 55500, 56032, 56567,
+    57105, 57646, 58190, 58737, 59287, 59840, 60396, 60955, 61517, 62082, 62650, 63221, 63795, 64372, 64952, 65535,
+};
+
+// sRGB code nearest to every linear value, indexed by its top 12 bits
+static unsigned char linearToSrgb[1 << MIP_LINEAR_BITS];
+static once_flag linearToSrgbOnce = ONCE_FLAG_INIT;
+
+// Function to invert the sRGB table, the middle of each linear bucket goes to the nearest code
+static void InitLinearToSrgb(void)
+{
+    unsigned int code = 0;
+    for(unsigned int i = 0; i < (1u << MIP_LINEAR_BITS); i++)
+    {
+        const unsigned int linear = (i << (16 - MIP_LINEAR_BITS)) + (1u << (15 - MIP_LINEAR_BITS));
+        while(code < 255 && srgbToLinear[code + 1] <= linear)
+        {
+            code++;
+        }
+        linearToSrgb[i] = (unsigned char)(code < 255 && srgbToLinear[code + 1] - linear < linear - srgbToLinear[code] ? code + 1 : code);
+    }
+}
+
+// Function to initialize an empty mip chain
+static void InitMipChain(MipChain* chain, const MipFilter filter)
+{
+    memset(chain, 0, sizeof(*chain));
+    chain->filter = filter;
+    call_once(&linearToSrgbOnce, InitLinearToSrgb);
+}
+
+// Function to free every level of a mip chain
+static void FreeMipChain(MipChain* chain)
+{
+    for(unsigned int level = 0; level < chain->levelCount; level++)
+    {
+        FreeImage(&chain->levels[level]);
+    }
+    chain->levelCount = 0;
+}
+
+// Function to size and allocate every level of a chain, down to a single pixel
+static int AllocateMipChain(MipChain* chain, const unsigned int width, const unsigned int height)
+{
+    unsigned int levelWidth = width, levelHeight = height;
+    for(;;)
+    {
+        Image* level = &chain->levels[chain->levelCount++];
+        level->width = levelWidth;
+        level->height = levelHeight;
+        level->format = FORMAT_RGBA8;
+        level->stride = (unsigned long)levelWidth * 4;
+        level->size = level->stride * levelHeight;
+        if(AllocateImagePixels(level, NULL) == -1)
+        {
+            chain->levelCount--;
+            FreeMipChain(chain);
+            return -1;
+        }
+        if(levelWidth == 1 && levelHeight == 1)
+        {
+            return 0;
+        }
+        levelWidth = levelWidth > 1 ? levelWidth / 2 : 1;
+        levelHeight = levelHeight > 1 ? levelHeight / 2 : 1;
+    }
+}
+
+// Function to reduce two rows of a level into one row of the next with a box filter, an odd last column is dropped
+static void ReduceMipRowBox(const unsigned char* top, const unsigned char* bottom, const unsigned int sourceWidth, unsigned char* destination, const unsigned int width)
+{
+    unsigned int x = 0;
+#ifdef USE_SSE2
+    // Four source pixels give two, sums are exact in 16 bits lanes
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i rounding = _mm_set1_epi16(2);
+    for(; sourceWidth > 1 && x + 2 <= width; x += 2)
+    {
+        const __m128i upper = _mm_loadu_si128((const __m128i*)(top + (unsigned long)x * 8));
+        const __m128i lower = _mm_loadu_si128((const __m128i*)(bottom + (unsigned long)x * 8));
+        const __m128i left = _mm_add_epi16(_mm_unpacklo_epi8(upper, zero), _mm_unpacklo_epi8(lower, zero));
+        const __m128i right = _mm_add_epi16(_mm_unpackhi_epi8(upper, zero), _mm_unpackhi_epi8(lower, zero));
+        const __m128i sums = _mm_unpacklo_epi64(_mm_add_epi16(left, _mm_srli_si128(left, 8)), _mm_add_epi16(right, _mm_srli_si128(right, 8)));
+        const __m128i averages = _mm_srli_epi16(_mm_add_epi16(sums, rounding), 2);
+        _mm_storel_epi64((__m128i*)(destination + (unsigned long)x * 4), _mm_packus_epi16(averages, zero));
+    }
+#endif
+    for(; x < width; x++)
+    {
+        const unsigned long first = (unsigned long)x * 2 * 4;
+        const unsigned long second = sourceWidth > 1 ? first + 4 : first;
+        for(int channel = 0; channel < 4; channel++)
+        {
+            destination[x * 4 + channel] = (unsigned char)((top[first + channel] + top[second + channel] + bottom[first + channel] + bottom[second + channel] + 2) / 4);
+        }
+    }
+}
+
+// Function to reduce two rows of a level into one row of the next in linear light, an odd last column is dropped
+static void ReduceMipRowSrgb(const unsigned char* top, const unsigned char* bottom, const unsigned int sourceWidth, unsigned char* destination, const unsigned int width)
+{
+    for(unsigned int x = 0; x < width; x++)
+    {
+        const unsigned long first = (unsigned long)x * 2 * 4;
+        const unsigned long second = sourceWidth > 1 ? first + 4 : first;
+        for(int channel = 0; channel < 3; channel++)
+        {
+            const unsigned int linear = (srgbToLinear[top[first + channel]] + srgbToLinear[top[second + channel]] +
+                srgbToLinear[bottom[first + channel]] + srgbToLinear[bottom[second + channel]] + 2) / 4;
+            destination[x * 4 + channel] = linearToSrgb[linear >> (16 - MIP_LINEAR_BITS)];
+        }
+        destination[x * 4 + 3] = (unsigned char)((top[first + 3] + top[second + 3] + bottom[first + 3] + bottom[second + 3] + 2) / 4);
+    }
+}
+
+// Function to store a row of a level, and once it completes a pair, cascade the reduced row down the chain
+static void PushMipRow(MipChain* chain, const unsigned int levelIndex, const unsigned int y, const unsigned char* pixels)
+{
+    Image* level = &chain->levels[levelIndex];
+    unsigned char* row = level->pixels + (unsigned long)y * level->stride;
+    if(row != pixels)
+    {
+        memcpy(row, pixels, level->stride);
+    }
+    if(levelIndex + 1 == chain->levelCount)
+    {
+        return;
+    }
+
+    // Single-row levels pair the row with itself, an odd last row has no pair and is dropped
+    if(level->height > 1 && y % 2 == 0)
+    {
+        return;
+    }
+    const unsigned char* top = level->height > 1 ? row - level->stride : row;
+    Image* next = &chain->levels[levelIndex + 1];
+    unsigned char* reduced = next->pixels + (unsigned long)(y / 2) * next->stride;
+    if(chain->filter == MIP_SRGB)
+    {
+        ReduceMipRowSrgb(top, row, level->width, reduced, next->width);
+    }
+    else
+    {
+        ReduceMipRowBox(top, row, level->width, reduced, next->width);
+    }
+    PushMipRow(chain, levelIndex + 1, y / 2, reduced);
+}
+
+// Function to take a decoded row into the chain, usable as a row sink
+static int ConsumeMipRow(void* context, const Image* image, const unsigned int y, const unsigned char* pixels)
+{
+    MipChain* chain = context;
+    if(image->format != FORMAT_RGBA8)
+    {
+        fprintf(stderr, "Error: Only RGBA8 rows can be mipmapped!\n");
+        return -1;
+    }
+    if(y == 0 && AllocateMipChain(chain, image->width, image->height) == -1)
+    {
+        return -1;
+    }
+
+    PushMipRow(chain, 0, y, pixels);
+
+    return 0;
+}
+
+// Function to decode a PNG file into its full mip chain in a single pass
+static int DecodePngFileToMipChain(const char* path, const MipFilter filter, DecodeControl* control, MipChain* chain)
+{
+    InitMipChain(chain, filter);
+    const RowSink sink = {ConsumeMipRow, chain};
+    const int status = StreamPngFileToSink(path, &sink, FORMAT_RGBA8, control);
+    if(status != 0)
+    {
+        FreeMipChain(chain);
+    }
+
+    return status;
+}
+#endif
+
+#if PNG_SUPPORT_YUV
+// Enumeration for the colour matrices of YCbCr output
+typedef enum YuvMatrix
+{
+    YUV_BT601,
+    YUV_BT709
+} YuvMatrix;
+
+// Enumeration for the value ranges of YCbCr output
+typedef enum YuvRange
+{
+    YUV_FULL,                       // 0-255 for every plane
+    YUV_LIMITED                     // 16-235 for luma and 16-240 for chroma, as video encoders expect
+} YuvRange;
+
+// Enumeration for the chroma layouts of YCbCr output
+typedef enum YuvSubsampling
+{
+    YUV_444,
+    YUV_420                         // One chroma sample per 2x2 block, odd edges are sampled from a half block
+} YuvSubsampling;
+
+// Structure to hold planar YCbCr output, the three planes share one allocation
+typedef struct YuvImage
+{
+    unsigned int width;
+    unsigned int height;
+    unsigned int chromaWidth;
+    unsigned int chromaHeight;
+    unsigned long strides[3];
+    unsigned char* planes[3];
+} YuvImage;
+
+// Structure to convert decoded rows to YCbCr, alpha is ignored
+typedef struct YuvConverter
+{
+    YuvSubsampling subsampling;
+    int16_t weights[3][4];          // Fixed point RGBA weights of Y, Cb and Cr
+    int bases[3];                   // Values the planes are centred on
+    uint16_t* chromaSums;           // RGBA sums of the current 2x2 blocks
+    YuvImage* image;
+} YuvConverter;
+
+// Function to round a weight to the fixed point of the converter
+static int16_t ToYuvWeight(const double weight)
+{
+    return (int16_t)(weight * (1 << YUV_WEIGHT_BITS) + (weight < 0 ? -0.5 : 0.5));
+}
+
+// Function to derive the fixed point weights of a matrix and range, each plane's weights sum exactly so that greys stay
+// grey and white reaches the top of the range
+static void InitYuvConverter(YuvConverter* converter, const YuvMatrix matrix, const YuvRange range, const YuvSubsampling subsampling, YuvImage* image)
+{
+    memset(converter, 0, sizeof(*converter));
+    converter->subsampling = subsampling;
+    converter->image = image;
+
+    const double red = matrix == YUV_BT709 ? 0.2126 : 0.299;
+    const double blue = matrix == YUV_BT709 ? 0.0722 : 0.114;
+    const double lumaScale = range == YUV_LIMITED ? 219.0 / 255.0 : 1.0;
+    const double chromaScale = range == YUV_LIMITED ? 224.0 / 255.0 : 1.0;
+
+    int16_t* luma = converter->weights[0];
+    luma[0] = ToYuvWeight(red * lumaScale);
+    luma[2] = ToYuvWeight(blue * lumaScale);
+    luma[1] = (int16_t)(ToYuvWeight(lumaScale) - luma[0] - luma[2]);
+
+    int16_t* cb = converter->weights[1];
+    cb[0] = ToYuvWeight(-red / (2.0 * (1.0 - blue)) * chromaScale);
+    cb[2] = ToYuvWeight(0.5 * chromaScale);
+    cb[1] = (int16_t)(-cb[0] - cb[2]);
+
+    int16_t* cr = converter->weights[2];
+    cr[0] = ToYuvWeight(0.5 * chromaScale);
+    cr[2] = ToYuvWeight(-blue / (2.0 * (1.0 - red)) * chromaScale);
+    cr[1] = (int16_t)(-cr[0] - cr[2]);
+
+    converter->bases[0] = range == YUV_LIMITED ? 16 : 0;
+    converter->bases[1] = 128;
+    converter->bases[2] = 128;
+}
+
+#ifdef USE_SSE2
+// Function to weigh four RGBA pixels held as 16 bits lanes, two per register, into four 32 bits sums
+static inline __m128i WeighPixelsSse2(const __m128i first, const __m128i second, const __m128i weights)
+{
+    const __m128 pairs = _mm_castsi128_ps(_mm_madd_epi16(first, weights));
+    const __m128 nextPairs = _mm_castsi128_ps(_mm_madd_epi16(second, weights));
+    const __m128i redGreen = _mm_castps_si128(_mm_shuffle_ps(pairs, nextPairs, _MM_SHUFFLE(2, 0, 2, 0)));
+    const __m128i blueAlpha = _mm_castps_si128(_mm_shuffle_ps(pairs, nextPairs, _MM_SHUFFLE(3, 1, 3, 1)));
+
+    return _mm_add_epi32(redGreen, blueAlpha);
+}
+
+// Function to round, shift and saturate eight weighted sums into bytes
+static inline void StoreYuvSamplesSse2(const __m128i first, const __m128i second, const __m128i offset, const int shift, unsigned char* samples)
+{
+    const __m128i count = _mm_cvtsi32_si128(shift);
+    const __m128i low = _mm_sra_epi32(_mm_add_epi32(first, offset), count);
+    const __m128i high = _mm_sra_epi32(_mm_add_epi32(second, offset), count);
+    const __m128i words = _mm_packs_epi32(low, high);
+    _mm_storel_epi64((__m128i*)samples, _mm_packus_epi16(words, words));
+}
+#endif
+
+// Function to saturate a weighted sum into a sample
+static inline unsigned char FinishYuvSample(const int sum, const int offset, const int shift)
+{
+    const int value = (sum + offset) >> shift;
+
+    return (unsigned char)(value < 0 ? 0 : value > 255 ? 255 : value);
+}
+
+// Function to convert one row of RGBA8 pixels into one plane row
+static void ConvertYuvRow(const unsigned char* pixels, const unsigned int count, const int16_t* weights, const int base, unsigned char* samples)
+{
+    const int offset = (base << YUV_WEIGHT_BITS) + (1 << (YUV_WEIGHT_BITS - 1));
+    unsigned int x = 0;
+#ifdef USE_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i weightVector = _mm_set_epi16(0, weights[2], weights[1], weights[0], 0, weights[2], weights[1], weights[0]);
+    const __m128i offsetVector = _mm_set1_epi32(offset);
+    for(; x + 8 <= count; x += 8)
+    {
+        const __m128i first = _mm_loadu_si128((const __m128i*)(pixels + (unsigned long)x * 4));
+        const __m128i second = _mm_loadu_si128((const __m128i*)(pixels + (unsigned long)x * 4 + 16));
+        const __m128i low = WeighPixelsSse2(_mm_unpacklo_epi8(first, zero), _mm_unpackhi_epi8(first, zero), weightVector);
+        const __m128i high = WeighPixelsSse2(_mm_unpacklo_epi8(second, zero), _mm_unpackhi_epi8(second, zero), weightVector);
+        StoreYuvSamplesSse2(low, high, offsetVector, YUV_WEIGHT_BITS, samples + x);
+    }
+#endif
+    for(; x < count; x++)
+    {
+        const unsigned char* pixel = pixels + (unsigned long)x * 4;
+        samples[x] = FinishYuvSample(weights[0] * pixel[0] + weights[1] * pixel[1] + weights[2] * pixel[2], offset, YUV_WEIGHT_BITS);
+    }
+}
+
+// Function to convert one row of 2x2 RGBA sums into one subsampled plane row, the sums carry two extra bits
+static void ConvertYuvSumRow(const uint16_t* sums, const unsigned int count, const int16_t* weights, const int base, unsigned char* samples)
+{
+    const int shift = YUV_WEIGHT_BITS + 2;
+    const int offset = (base << shift) + (1 << (shift - 1));
+    unsigned int x = 0;
+#ifdef USE_SSE2
+    const __m128i weightVector = _mm_set_epi16(0, weights[2], weights[1], weights[0], 0, weights[2], weights[1], weights[0]);
+    const __m128i offsetVector = _mm_set1_epi32(offset);
+    for(; x + 8 <= count; x += 8)
+    {
+        const __m128i* lanes = (const __m128i*)(sums + (unsigned long)x * 4);
+        const __m128i low = WeighPixelsSse2(_mm_loadu_si128(lanes), _mm_loadu_si128(lanes + 1), weightVector);
+        const __m128i high = WeighPixelsSse2(_mm_loadu_si128(lanes + 2), _mm_loadu_si128(lanes + 3), weightVector);
+        StoreYuvSamplesSse2(low, high, offsetVector, shift, samples + x);
+    }
+#endif
+    for(; x < count; x++)
+    {
+        const uint16_t* sum = sums + (unsigned long)x * 4;
+        samples[x] = FinishYuvSample(weights[0] * sum[0] + weights[1] * sum[1] + weights[2] * sum[2], offset, shift);
+    }
+}
+
+// Function to add the horizontal pairs of a row into the 2x2 sums, a missing right pixel repeats the left one
+static void AccumulateChromaSums(const unsigned char* pixels, const unsigned int width, uint16_t* sums, const unsigned int count, const bool reset)
+{
+    for(unsigned int x = 0; x < count; x++)
+    {
+        const unsigned char* left = pixels + (unsigned long)x * 8;
+        const unsigned char* right = x * 2 + 1 < width ? left + 4 : left;
+        for(int channel = 0; channel < 4; channel++)
+        {
+            const uint16_t pair = (uint16_t)(left[channel] + right[channel]);
+            sums[x * 4 + channel] = reset ? pair : (uint16_t)(sums[x * 4 + channel] + pair);
+        }
+    }
+}
+
+// Function to allocate the planes of a YCbCr image
+static int AllocateYuvImage(YuvImage* image, const unsigned int width, const unsigned int height, const YuvSubsampling subsampling)
+{
+    image->width = width;
+    image->height = height;
+    image->chromaWidth = subsampling == YUV_420 ? (width + 1) / 2 : width;
+    image->chromaHeight = subsampling == YUV_420 ? (height + 1) / 2 : height;
+    image->strides[0] = width;
+    image->strides[1] = image->strides[2] = image->chromaWidth;
+
+    const unsigned long long lumaSize = (unsigned long long)width * height;
+    const unsigned long long chromaSize = (unsigned long long)image->chromaWidth * image->chromaHeight;
+    if(lumaSize + chromaSize * 2 > ULONG_MAX)
+    {
+        fprintf(stderr, "Error: Image too large!\n");
+        return -1;
+    }
+    image->planes[0] = malloc((unsigned long)(lumaSize + chromaSize * 2));
+    if(!image->planes[0])
+    {
+        fprintf(stderr, "Error: Unable to allocate enough memory for the YCbCr planes!\n");
+        return -1;
+    }
+    image->planes[1] = image->planes[0] + lumaSize;
+    image->planes[2] = image->planes[1] + chromaSize;
+
+    return 0;
+}
+
+// Function to free the planes of a YCbCr image
+static void FreeYuvImage(YuvImage* image)
+{
+    free(image->planes[0]);
+    memset(image, 0, sizeof(*image));
+}
+
+// Function to convert a decoded row into the planes, usable as a row sink, subsampled chroma is written once the second
+// row of a block arrives
+static int ConsumeYuvRow(void* context, const Image* image, const unsigned int y, const unsigned char* pixels)
+{
+    YuvConverter* converter = context;
+    YuvImage* output = converter->image;
+    if(image->format != FORMAT_RGBA8)
+    {
+        fprintf(stderr, "Error: Only RGBA8 rows can be converted to YCbCr!\n");
+        return -1;
+    }
+    if(y == 0)
+    {
+        if(AllocateYuvImage(output, image->width, image->height, converter->subsampling) == -1)
+        {
+            return -1;
+        }
+        if(converter->subsampling == YUV_420)
+        {
+            converter->chromaSums = malloc((unsigned long)output->chromaWidth * 4 * sizeof(uint16_t));
+            if(!converter->chromaSums)
+            {
+                fprintf(stderr, "Error: Unable to allocate enough memory for the chroma rows!\n");
+                return -1;
+            }
+        }
+    }
+
+    ConvertYuvRow(pixels, output->width, converter->weights[0], converter->bases[0], output->planes[0] + (unsigned long)y * output->strides[0]);
+    if(converter->subsampling == YUV_444)
+    {
+        for(int plane = 1; plane < 3; plane++)
+        {
+            ConvertYuvRow(pixels, output->width, converter->weights[plane], converter->bases[plane], output->planes[plane] + (unsigned long)y * output->strides[plane]);
+        }
+        return 0;
+    }
+
+    // An odd last row stands in for its missing pair
+    AccumulateChromaSums(pixels, output->width, converter->chromaSums, output->chromaWidth, y % 2 == 0);
+    if(y % 2 == 0 && y + 1 == output->height)
+    {
+        AccumulateChromaSums(pixels, output->width, converter->chromaSums, output->chromaWidth, false);
+    }
+    else if(y % 2 == 0)
+    {
+        return 0;
+    }
+    for(int plane = 1; plane < 3; plane++)
+    {
+        ConvertYuvSumRow(converter->chromaSums, output->chromaWidth, converter->weights[plane], converter->bases[plane], output->planes[plane] + (unsigned long)(y / 2) * output->strides[plane]);
+    }
+
+    return 0;
+}
+
+// Function to decode a PNG file straight into planar YCbCr, every row is converted as soon as it is reconstructed
+static int DecodePngFileToYuv(const char* path, const YuvMatrix matrix, const YuvRange range, const YuvSubsampling subsampling, DecodeControl* control, YuvImage* image)
+{
+    YuvConverter converter;
+    memset(image, 0, sizeof(*image));
+    InitYuvConverter(&converter, matrix, range, subsampling, image);
+    const RowSink sink = {ConsumeYuvRow, &converter};
+    const int status = StreamPngFileToSink(path, &sink, FORMAT_RGBA8, control);
+    free(converter.chromaSums);
+    if(status != 0)
+    {
+        FreeYuvImage(image);
+    }
+
+    return status;
+}
+
+// Function to write the planes of a YCbCr image back to back, as raw video tools read them
+static int WriteYuvFile(const char* path, const YuvImage* image)
+{
+    FILE* file = NULL;
+    if(fopen_s(&file, path, "wb") != 0)
+    {
+        fprintf(stderr, "Error: Can't create %s!\n", path);
+        return -1;
+    }
+    const unsigned long lumaSize = (unsigned long)image->width * image->height;
+    const unsigned long chromaSize = (unsigned long)image->chromaWidth * image->chromaHeight;
+    const bool written = fwrite(image->planes[0], 1, lumaSize + chromaSize * 2, file) == lumaSize + chromaSize * 2;
+    if(fclose(file) != 0 || !written)
+    {
+        fprintf(stderr, "Error: Can't write %s!\n", path);
+        return -1;
+    }
+
+    return 0;
+}
+#endif
+
+// Function to read a whole PNG file into a newly allocated buffer
+static int ReadPngFile(const char* path, unsigned char** buffer, unsigned long* bufferSize)
+{
+    // Get the size of the file
+    FILE* file = NULL;
+    const int fileSize = GetFileSize(file, path);
+    if(fileSize == -1)
+    {
+        return -1;
+    }
+
+    // Allocate a buffer to hold the file content
+    *buffer = (unsigned char*)malloc(fileSize);
+    if(!*buffer)
+    {
+        fprintf(stderr, "Error: Unable to allocate enough memory!\n");
+        return -1;
+    }
+
+    // Fill the buffer with file content and validate PNG signature
+    unsigned int cursor;
+    if(FillBuffer(file, path, *buffer, fileSize, &cursor) == -1)
+    {
+        *buffer = NULL;
+        return -1;
+    }
+    *bufferSize = (unsigned long)fileSize;
+
+    return 0;
+}
+
+#if PNG_SUPPORT_ENCODER || PNG_SUPPORT_QOI
+// Function to write a buffer to a file
+static int WritePngFile(const char* path, const unsigned char* buffer, const unsigned long bufferSize)
+{
+    FILE* file = NULL;
+    if(fopen_s(&file, path, "wb") != 0)
+    {
+        fprintf(stderr, "Error: Can't create %s!\n", path);
+        return -1;
+    }
+
+    const bool written = fwrite(buffer, 1, bufferSize, file) == bufferSize;
+    if(fclose(file) != 0 || !written)
+    {
+        fprintf(stderr, "Error: Can't write %s!\n", path);
+        return -1;
+    }
+
+    return 0;
+}
+#endif
+
+// Function to decode a PNG held in memory over and over with one workspace, printing the features of this build with the best
+// and mean times so differently configured builds can be compared on the same file
+static int BenchmarkDecode(const unsigned char* buffer, const unsigned long bufferSize, const DecodeOptions* options, const unsigned int iterations)
+{
+    printf("features: grayscale %d truecolor %d indexed %d grayscale-alpha %d truecolor-alpha %d low-depths %d 16-bit %d interlace %d ancillary %d crc %d\n",
+        PNG_SUPPORT_GRAYSCALE, PNG_SUPPORT_TRUECOLOR, PNG_SUPPORT_INDEXED_COLOR, PNG_SUPPORT_GRAYSCALE_WITH_ALPHA, PNG_SUPPORT_TRUECOLOR_WITH_ALPHA,
+        PNG_SUPPORT_LOW_BIT_DEPTHS, PNG_SUPPORT_16_BIT_DEPTH, PNG_SUPPORT_INTERLACE, PNG_SUPPORT_ANCILLARY_CHUNKS, PNG_CHECK_CRC);
+    printf("tools: cache %d batch %d daemon %d encoder %d optimizer %d qoi %d bcn %d mips %d yuv %d\n", PNG_SUPPORT_CACHE, PNG_SUPPORT_BATCH,
+        PNG_SUPPORT_DAEMON, PNG_SUPPORT_ENCODER, PNG_SUPPORT_OPTIMIZER, PNG_SUPPORT_QOI, PNG_SUPPORT_BCN, PNG_SUPPORT_MIPS, PNG_SUPPORT_YUV);
+
+    DecodeWorkspace workspace;
+    if(InitDecodeWorkspace(&workspace) == -1)
+    {
+        return -1;
+    }
+
+    double best = 0.0;
+    double total = 0.0;
+    unsigned long pixelBytes = 0;
+    int status = 0;
+    for(unsigned int i = 0; i < iterations && status == 0; i++)
+    {
+        Image image;
+        DecodeControl control;
+        InitDecodeControl(&control, 0, NULL);
+        const double start = GetTimeSeconds();
+        status = DecodePngBuffer(buffer, bufferSize, &image, options, &workspace, &control);
+        const double seconds = GetTimeSeconds() - start;
+        if(status == 0)
+        {
+            pixelBytes = image.size;
+            FreeImage(&image);
+            best = i == 0 || seconds < best ? seconds : best;
+            total += seconds;
+        }
+    }
+    FreeDecodeWorkspace(&workspace);
+    if(status != 0)
+    {
+        return status;
+    }
+
+    printf("%u decodes, best %.3f ms, mean %.3f ms, %.1f MB/s of pixels\n", iterations, best * 1000.0, total * 1000.0 / iterations,
+        best > 0.0 ? (double)pixelBytes / best / 1e6 : 0.0);
+
+    return 0;
+}
+
+#if PNG_SUPPORT_CACHE
+// Function to hash bytes with four independent lanes so the multiplies overlap
+static uint64_t HashBytes(uint64_t seed, const unsigned char* data, unsigned long length)
+{
+    const uint64_t multiplier = 0x9E3779B97F4A7C15ull;
+    uint64_t lanes[4] = {seed, seed ^ 0xC2B2AE3D27D4EB4Full, seed ^ 0x165667B19E3779F9ull, seed ^ 0x85EBCA77C2B2AE63ull};
+
+    while(length >= 32)
+    {
+        for(int lane = 0; lane < 4; lane++)
+        {
+            uint64_t word;
+            memcpy(&word, data + lane * 8, 8);
+            lanes[lane] = (lanes[lane] ^ word) * multiplier;
+            lanes[lane] ^= lanes[lane] >> 29;
+        }
+        data += 32;
+        length -= 32;
+    }
+
+    uint64_t hash = lanes[0] ^ (lanes[1] * 3) ^ (lanes[2] * 5) ^ (lanes[3] * 7);
+    while(length > 0)
+    {
+        uint64_t word = 0;
+        const unsigned long count = length < 8 ? length : 8;
+        memcpy(&word, data, count);
+        hash = (hash ^ word ^ ((uint64_t)count << 59)) * multiplier;
+        hash ^= hash >> 32;
+        data += count;
+        length -= count;
+    }
+
+    return hash;
+}
+
+// Enumeration for what the decode cache key covers
+typedef enum CacheKeyMode
+{
+    CACHE_KEY_FILE,                 // Every byte of the file
+    CACHE_KEY_CONTENT               // Only the chunks that change pixels, so metadata-only edits still hit
+} CacheKeyMode;
+
+// Function to gather the chunks of a PNG that change its pixels without checking them, lengths included so chunk data that
+// happens to hold a chunk type can't be taken for a chunk boundary, content may be NULL to only get the length
+static int GetPngContent(const unsigned char* buffer, const unsigned long bufferSize, unsigned char* content, unsigned long* contentLength)
+{
+    const char* pixelChunkTypes[] = {HEADER_CHUNK_TYPE, PALETTE_CHUNK_TYPE, TRANSPARENCY_CHUNK_TYPE, DATA_CHUNK_TYPE, EXIF_CHUNK_TYPE, BACKGROUND_CHUNK_TYPE,
+        SIGNIFICANT_BITS_CHUNK_TYPE};
+    const int pixelChunkCount = sizeof(pixelChunkTypes) / sizeof(pixelChunkTypes[0]);
+    const bool isLittleEndian = IsLittleEndian();
+
+    *contentLength = 0;
+    unsigned long cursor = PNG_SIGNATURE_LENGTH;
+    while(bufferSize >= CHUNK_DATA_LENGTH + CHUNK_TYPE_LENGTH && cursor <= bufferSize - CHUNK_DATA_LENGTH - CHUNK_TYPE_LENGTH)
+    {
+        unsigned int dataLength;
+        memcpy(&dataLength, buffer + cursor, CHUNK_DATA_LENGTH);
+        if(isLittleEndian)
+        {
+            dataLength = ToLittleEndian(dataLength);
+        }
+        const unsigned char* chunk = buffer + cursor;
+        const unsigned char* type = chunk + CHUNK_DATA_LENGTH;
+        cursor += CHUNK_DATA_LENGTH + CHUNK_TYPE_LENGTH;
+        if(dataLength > bufferSize - cursor)
+        {
+            break;
+        }
+
+        for(int i = 0; i < pixelChunkCount; i++)
+        {
+            if(memcmp(type, pixelChunkTypes[i], CHUNK_TYPE_LENGTH) == 0)
+            {
+                if(content)
+                {
+                    memcpy(content + *contentLength, chunk, CHUNK_DATA_LENGTH + CHUNK_TYPE_LENGTH + dataLength);
+                }
+                *contentLength += CHUNK_DATA_LENGTH + CHUNK_TYPE_LENGTH + dataLength;
+                break;
+            }
+        }
+
+        if(memcmp(type, LAST_CHUNK_TYPE_SIGNATURE, CHUNK_TYPE_LENGTH) == 0)
+        {
+            return 0;
+        }
+        cursor += dataLength + CHUNK_CRC_LENGTH;
+    }
+
+    fprintf(stderr, "Error: Truncated PNG while reading its content!\n");
+    return -1;
+}
+
+// Function to fold the decode options that change the output into the cache key
+static uint32_t GetDecodeVariant(const DecodeOptions* options)
+{
+    uint32_t variant = options ? (uint32_t)options->format : FORMAT_RGBA8;
+    if(options)
+    {
+        variant |= (uint32_t)options->orientation << 8;
+        variant |= options->applyExifOrientation ? 1u << 12 : 0;
+        variant |= (uint32_t)options->background << 13;
+        variant |= (uint32_t)options->significantBits << 15;
+    }
+    if(options && options->sharedOutput)
+    {
+        variant |= 1u << 31;
+    }
+
+    return variant;
+}
+
+// Function to fold the options that do not fit the variant into a cache key
+static uint64_t SaltDecodeKey(const uint64_t key, const DecodeOptions* options)
+{
+    if(!options || options->background == BACKGROUND_NONE)
+    {
+        return key;
+    }
+
+    return HashBytes(key, (const unsigned char*)options->backgroundColor, sizeof(options->backgroundColor));
+}
+
+// Structure to represent a cached, read-only and reference-counted decoded image
+typedef struct CachedImage
+{
+    uint64_t hash;
+    uint32_t variant;
+    unsigned char* key;             // The bytes the hash was taken of, compared on every hit so hash collisions never match
+    unsigned long keyLength;
+    Image image;
+    atomic_uint references;
+    struct CachedImage* newer;
+    struct CachedImage* older;
+    struct CachedImage* nextInBucket;
+} CachedImage;
+
+// Structure to represent one shard of the cache, each with its own lock and LRU list
+typedef struct CacheShard
+{
+    mtx_t lock;
+    CachedImage* buckets[CACHE_BUCKET_COUNT];
+    CachedImage* newest;
+    CachedImage* oldest;
+    unsigned long long bytes;
+} CacheShard;
+
+// Structure to represent the decoded image cache, bounded by the bytes of pixels it holds
+typedef struct DecodeCache
+{
+    CacheKeyMode keyMode;
+    unsigned long long shardCapacity;
+    atomic_ullong hits;
+    atomic_ullong misses;
+    atomic_ullong evictions;
+    CacheShard shards[CACHE_SHARD_COUNT];
+} DecodeCache;
+
+// Function to initialize the decode cache
+static int InitDecodeCache(DecodeCache* cache, const unsigned long long capacityBytes, const CacheKeyMode keyMode)
+{
+    memset(cache, 0, sizeof(*cache));
+    cache->keyMode = keyMode;
+    cache->shardCapacity = capacityBytes / CACHE_SHARD_COUNT;
+    for(int i = 0; i < CACHE_SHARD_COUNT; i++)
+    {
+        if(mtx_init(&cache->shards[i].lock, mtx_plain) != thrd_success)
+        {
+            fprintf(stderr, "Error: Cannot initialize the cache locks!\n");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Function to drop a reference to a cached image, the last one frees it
+static void ReleaseCachedImage(CachedImage* entry)
+{
+    if(atomic_fetch_sub(&entry->references, 1) == 1)
+    {
+        FreeImage(&entry->image);
+        free(entry->key);
+        free(entry);
+    }
+}
+
+// Function to unlink an entry from its shard, the caller holds the shard lock
+static void UnlinkCachedImage(CacheShard* shard, CachedImage* entry)
+{
+    CachedImage** link = &shard->buckets[entry->hash % CACHE_BUCKET_COUNT];
+    while(*link != entry)
+    {
+        link = &(*link)->nextInBucket;
+    }
+    *link = entry->nextInBucket;
+
+    if(entry->newer)
+    {
+        entry->newer->older = entry->older;
+    }
+    else
+    {
+        shard->newest = entry->older;
+    }
+    if(entry->older)
+    {
+        entry->older->newer = entry->newer;
+    }
+    else
+    {
+        shard->oldest = entry->newer;
+    }
+    shard->bytes -= entry->image.size + entry->keyLength;
+}
+
+// Function to link an entry as the most recently used of its shard, the caller holds the shard lock
+static void LinkCachedImage(CacheShard* shard, CachedImage* entry)
+{
+    entry->nextInBucket = shard->buckets[entry->hash % CACHE_BUCKET_COUNT];
+    shard->buckets[entry->hash % CACHE_BUCKET_COUNT] = entry;
+
+    entry->older = shard->newest;
+    entry->newer = NULL;
+    if(shard->newest)
+    {
+        shard->newest->newer = entry;
+    }
+    shard->newest = entry;
+    if(!shard->oldest)
+    {
+        shard->oldest = entry;
+    }
+    shard->bytes += entry->image.size + entry->keyLength;
+}
+
+// Function to tell if an entry was decoded from exactly the given key bytes with the same options
+static bool MatchesCachedImage(const CachedImage* entry, const uint64_t hash, const uint32_t variant, const unsigned char* key, const unsigned long keyLength)
+{
+    return entry->hash == hash && entry->variant == variant && entry->keyLength == keyLength && memcmp(entry->key, key, keyLength) == 0;
+}
+
+// Function to find an entry and take a reference to it, NULL on a miss
+static CachedImage* AcquireCachedImage(DecodeCache* cache, const uint64_t hash, const uint32_t variant, const unsigned char* key, const unsigned long keyLength)
+{
+    CacheShard* shard = &cache->shards[(hash >> 56) % CACHE_SHARD_COUNT];
+
+    mtx_lock(&shard->lock);
+    CachedImage* entry = shard->buckets[hash % CACHE_BUCKET_COUNT];
+    while(entry && !MatchesCachedImage(entry, hash, variant, key, keyLength))
+    {
+        entry = entry->nextInBucket;
+    }
+    if(entry)
+    {
+        // Move it to the front of the LRU list
+        UnlinkCachedImage(shard, entry);
+        LinkCachedImage(shard, entry);
+        atomic_fetch_add(&entry->references, 1);
+    }
+    mtx_unlock(&shard->lock);
+
+    return entry;
+}
+
+// Function to insert a freshly decoded image, returns the entry to use, which may be an older duplicate
+static CachedImage* InsertCachedImage(DecodeCache* cache, CachedImage* entry)
+{
+    CacheShard* shard = &cache->shards[(entry->hash >> 56) % CACHE_SHARD_COUNT];
+
+    // An image bigger than a whole shard is handed out without being cached
+    if(entry->image.size + entry->keyLength > cache->shardCapacity)
+    {
+        return entry;
+    }
+
+    mtx_lock(&shard->lock);
+    CachedImage* existing = shard->buckets[entry->hash % CACHE_BUCKET_COUNT];
+    while(existing && !MatchesCachedImage(existing, entry->hash, entry->variant, entry->key, entry->keyLength))
+    {
+        existing = existing->nextInBucket;
+    }
+    if(existing)
+    {
+        // Another thread decoded the same image first
+        atomic_fetch_add(&existing->references, 1);
+        mtx_unlock(&shard->lock);
+        ReleaseCachedImage(entry);
+        return existing;
+    }
+
+    // The cache holds its own reference
+    atomic_fetch_add(&entry->references, 1);
+    LinkCachedImage(shard, entry);
+    while(shard->bytes > cache->shardCapacity && shard->oldest != entry)
+    {
+        CachedImage* victim = shard->oldest;
+        UnlinkCachedImage(shard, victim);
+        ReleaseCachedImage(victim);
+        atomic_fetch_add(&cache->evictions, 1);
+    }
+    mtx_unlock(&shard->lock);
+
+    return entry;
+}
+
+// Function to decode a PNG through the cache, the result must be given back with ReleaseCachedImage
+static int DecodePngCached(DecodeCache* cache, const unsigned char* buffer, const unsigned long bufferSize, const DecodeOptions* options, DecodeWorkspace* workspace, DecodeControl* control, CachedImage** result)
+{
+    if(options && options->rowSink)
+    {
+        fprintf(stderr, "Error: Rows handed to a sink cannot be cached!\n");
+        return -1;
+    }
+
+    // The key holds everything the hash was taken of, the whole file or only its pixel chunks, and the background colour
+    unsigned long contentLength = bufferSize;
+    if(cache->keyMode == CACHE_KEY_CONTENT && GetPngContent(buffer, bufferSize, NULL, &contentLength) == -1)
+    {
+        return -1;
+    }
+    const bool salted = options && options->background != BACKGROUND_NONE;
+    const unsigned long keyLength = contentLength + (salted ? sizeof(options->backgroundColor) : 0);
+    unsigned char* key = malloc(keyLength ? keyLength : 1);
+    if(!key)
+    {
+        fprintf(stderr, "Error: Unable to allocate enough memory for the cache key!\n");
+        return -1;
+    }
+    if(cache->keyMode == CACHE_KEY_CONTENT)
+    {
+        GetPngContent(buffer, bufferSize, key, &contentLength);
+    }
+    else
+    {
+        memcpy(key, buffer, bufferSize);
+    }
+    if(salted)
+    {
+        memcpy(key + contentLength, options->backgroundColor, sizeof(options->backgroundColor));
+    }
+    const uint64_t hash = HashBytes(0, key, keyLength);
+    const uint32_t variant = GetDecodeVariant(options);
+
+    *result = AcquireCachedImage(cache, hash, variant, key, keyLength);
+    if(*result)
+    {
+        free(key);
+        atomic_fetch_add(&cache->hits, 1);
+        return 0;
+    }
+    atomic_fetch_add(&cache->misses, 1);
+
+    CachedImage* entry = calloc(1, sizeof(CachedImage));
+    if(!entry)
+    {
+        free(key);
+        fprintf(stderr, "Error: Unable to allocate enough memory for the cache entry!\n");
+        return -1;
+    }
+    entry->hash = hash;
+    entry->variant = variant;
+    entry->key = key;
+    entry->keyLength = keyLength;
+    atomic_init(&entry->references, 1);
+
+    const int status = DecodePngBuffer(buffer, bufferSize, &entry->image, options, workspace, control);
+    if(status != 0)
+    {
+        free(entry->key);
+        free(entry);
+        return status;
+    }
+    *result = InsertCachedImage(cache, entry);
+
+    return 0;
+}
+
+// Function to free the decode cache, images still referenced elsewhere stay alive until released
+static void FreeDecodeCache(DecodeCache* cache)
+{
+    for(int i = 0; i < CACHE_SHARD_COUNT; i++)
+    {
+        CacheShard* shard = &cache->shards[i];
+        while(shard->oldest)
+        {
+            CachedImage* victim = shard->oldest;
+            UnlinkCachedImage(shard, victim);
+            ReleaseCachedImage(victim);
+        }
+        mtx_destroy(&shard->lock);
+    }
+}
+
+// Function to append a chunk with its length, type, data and CRC to a PNG put together in memory, returns the new size
+static unsigned long AppendPngChunk(unsigned char* png, unsigned long size, const char* type, const unsigned char* data, const unsigned int dataLength)
+{
+    StoreBigEndian(png + size, dataLength);
+    memcpy(png + size + CHUNK_DATA_LENGTH, type, CHUNK_TYPE_LENGTH);
+    if(dataLength > 0)
+    {
+        memcpy(png + size + CHUNK_DATA_LENGTH + CHUNK_TYPE_LENGTH, data, dataLength);
+    }
+    const uLong crc = crc32(0, png + size + CHUNK_DATA_LENGTH, CHUNK_TYPE_LENGTH + dataLength);
+    StoreBigEndian(png + size + CHUNK_DATA_LENGTH + CHUNK_TYPE_LENGTH + dataLength, (uint32_t)crc);
+
+    return size + CHUNK_DATA_LENGTH + CHUNK_TYPE_LENGTH + dataLength + CHUNK_CRC_LENGTH;
+}
+
+// Function to check the content keyed cache on two 1x1 greyscale files whose pixel chunks run together into the same bytes,
+// one has a single IDAT after an eXIf ending in "IDAT" and a zlib stream, the other splits that eXIf into an eXIf and an
+// IDAT so its image comes from the other stream, each must get its own entry and its own pixel, returns -1 otherwise
+static int CheckDecodeCache(void)
+{
+    const unsigned char pngSignature[] = {137, 80, 78, 71, 13, 10, 26, 10};
+    const unsigned char samples[2] = {0x11, 0xEE};
+    unsigned char streams[2][32];
+    uLongf streamSizes[2];
+    for(int i = 0; i < 2; i++)
+    {
+        const unsigned char row[2] = {0, samples[i]};
+        streamSizes[i] = sizeof(streams[i]);
+        if(compress(streams[i], &streamSizes[i], row, sizeof(row)) != Z_OK)
+        {
+            fprintf(stderr, "Error: Unable to compress the cache check rows!\n");
+            return -1;
+        }
+    }
+
+    unsigned char ihdr[13] = {0};
+    StoreBigEndian(ihdr, 1);
+    StoreBigEndian(ihdr + 4, 1);
+    ihdr[8] = 8;
+    const unsigned char tiff[4] = {'M', 'M', 0, '*'};
+    unsigned char exif[sizeof(tiff) + CHUNK_TYPE_LENGTH + sizeof(streams[1])];
+    memcpy(exif, tiff, sizeof(tiff));
+    memcpy(exif + sizeof(tiff), DATA_CHUNK_TYPE, CHUNK_TYPE_LENGTH);
+    memcpy(exif + sizeof(tiff) + CHUNK_TYPE_LENGTH, streams[1], streamSizes[1]);
+
+    // Both files hold "eXIf" MM\0* "IDAT" stream 1 "IDAT" stream 0 once lengths are left out, the first decodes stream 0 and
+    // the second stream 1
+    unsigned char pngs[2][256];
+    unsigned long pngSizes[2];
+    for(int i = 0; i < 2; i++)
+    {
+        memcpy(pngs[i], pngSignature, PNG_SIGNATURE_LENGTH);
+        pngSizes[i] = AppendPngChunk(pngs[i], PNG_SIGNATURE_LENGTH, HEADER_CHUNK_TYPE, ihdr, sizeof(ihdr));
+    }
+    pngSizes[0] = AppendPngChunk(pngs[0], pngSizes[0], EXIF_CHUNK_TYPE, exif, sizeof(tiff) + CHUNK_TYPE_LENGTH + streamSizes[1]);
+    pngSizes[1] = AppendPngChunk(pngs[1], pngSizes[1], EXIF_CHUNK_TYPE, tiff, sizeof(tiff));
+    pngSizes[1] = AppendPngChunk(pngs[1], pngSizes[1], DATA_CHUNK_TYPE, streams[1], streamSizes[1]);
+    for(int i = 0; i < 2; i++)
+    {
+        pngSizes[i] = AppendPngChunk(pngs[i], pngSizes[i], DATA_CHUNK_TYPE, streams[0], streamSizes[0]);
+        pngSizes[i] = AppendPngChunk(pngs[i], pngSizes[i], LAST_CHUNK_TYPE_SIGNATURE, NULL, 0);
+    }
+
+    DecodeCache* cache = malloc(sizeof(DecodeCache));
+    if(!cache || InitDecodeCache(cache, 1 << 20, CACHE_KEY_CONTENT) == -1)
+    {
+        free(cache);
+        fprintf(stderr, "Error: Unable to set up the cache check!\n");
+        return -1;
+    }
+
+    DecodeControl control;
+    InitDecodeControl(&control, 0, NULL);
+    unsigned int failed = 0;
+    for(int round = 0; round < 2; round++)
+    {
+        for(int i = 0; i < 2; i++)
+        {
+            CachedImage* entry;
+            if(DecodePngCached(cache, pngs[i], pngSizes[i], NULL, NULL, &control, &entry) != 0)
+            {
+                failed++;
+                continue;
+            }
+            if(entry->image.pixels[0] != samples[i])
+            {
+                fprintf(stderr, "Error: Cached file %d decoded to %hhu instead of %hhu!\n", i, entry->image.pixels[0], samples[i]);
+                failed++;
+            }
+            ReleaseCachedImage(entry);
+        }
+    }
+
+    // The second round must be served from the two entries of the first
+    const unsigned long long hits = atomic_load(&cache->hits), misses = atomic_load(&cache->misses);
+    if(hits != 2 || misses != 2)
+    {
+        fprintf(stderr, "Error: The cache check got %llu hits and %llu misses instead of 2 and 2!\n", hits, misses);
+        failed++;
+    }
+    FreeDecodeCache(cache);
+    free(cache);
+
+    printf("cache check %s\n", failed == 0 ? "passed" : "failed");
+    return failed == 0 ? 0 : -1;
+}
+
+// Structure at the start of every raster file of the disk cache, pixels follow at pixelOffset
+typedef struct RasterFileHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t variant;
+    uint64_t key;
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;                // Rows are padded to RASTER_ROW_ALIGNMENT bytes
+    uint32_t format;
+    uint32_t compressed;            // Zero for raw rows that can be mapped, one for a zlib stream
+    uint32_t reserved;
+    uint64_t pixelOffset;           // Page aligned so raw rows can be mapped in place
+    uint64_t storedSize;
+    uint64_t pixelSize;
+} RasterFileHeader;
+
+// Function to build the disk cache key from the file identity, so hits never read the PNG
+static int GetDiskCacheKey(const char* path, uint64_t* key)
+{
+    struct stat status;
+    if(stat(path, &status) != 0)
+    {
+        fprintf(stderr, "Error: Can't get the identity of %s!\n", path);
+        return -1;
+    }
+
+    // Whole seconds miss a rewrite of the same size within one second, the nanoseconds and the change time catch it
+#ifdef __linux__
+    const uint64_t identity[] = {(uint64_t)status.st_size, (uint64_t)status.st_mtim.tv_sec, (uint64_t)status.st_mtim.tv_nsec, (uint64_t)status.st_ctim.tv_sec,
+        (uint64_t)status.st_ctim.tv_nsec, (uint64_t)status.st_ino, (uint64_t)status.st_dev};
+#else
+    const uint64_t identity[] = {(uint64_t)status.st_size, (uint64_t)status.st_mtime, (uint64_t)status.st_ctime, (uint64_t)status.st_ino, (uint64_t)status.st_dev};
+#endif
+    *key = HashBytes(HashBytes(0, (const unsigned char*)path, strlen(path)), (const unsigned char*)identity, sizeof(identity));
+
+    return 0;
+}
+
+// Function to build the path of a raster file of the disk cache
+static void GetRasterFilePath(const char* directory, const uint64_t key, const uint32_t variant, char* rasterPath, const size_t length)
+{
+    snprintf(rasterPath, length, "%s/%016llx-%08x.raw", directory, (unsigned long long)key, (unsigned int)variant);
+}
+
+// Function to tell if the header of a raster file describes pixels of the wanted kind that the file really holds, the sizes
+// are 32 bits fields so their products cannot overflow 64 bits
+static bool IsRasterHeaderValid(const RasterFileHeader* header, const uint64_t key, const uint32_t variant, const PixelFormat format, const uint64_t fileSize)
+{
+    if(memcmp(header->magic, RASTER_FILE_MAGIC, sizeof(header->magic)) != 0 || header->version != RASTER_FILE_VERSION || header->key != key ||
+        header->variant != variant || header->compressed > 1)
+    {
+        return false;
+    }
+
+    // Only RGBA rasters are stored, and always in the format they were asked for
+    if((header->format != FORMAT_RGBA8 && header->format != FORMAT_RGBA16) || header->format != (uint32_t)format)
+    {
+        return false;
+    }
+    if(header->width == 0 || header->height == 0 || header->stride < (uint64_t)header->width * GetPixelBytes(format) ||
+        header->pixelSize != (uint64_t)header->stride * header->height || header->pixelSize > ULONG_MAX)
+    {
+        return false;
+    }
+
+    return (header->compressed || header->storedSize == header->pixelSize) && header->pixelOffset <= fileSize && header->storedSize <= fileSize - header->pixelOffset;
+}
+
+// Function to load a raster from the disk cache, returns 1 on a miss
+static int LoadRasterFile(const char* directory, const uint64_t key, const uint32_t variant, const PixelFormat format, Image* image)
+{
+    char rasterPath[1024];
+    GetRasterFilePath(directory, key, variant, rasterPath, sizeof(rasterPath));
+
+    FILE* file = NULL;
+    if(fopen_s(&file, rasterPath, "rb") != 0)
+    {
+        return 1;
+    }
+
+    // A header that does not match is treated as a miss, the raster gets rewritten
+    RasterFileHeader header;
+    struct stat fileStatus;
+    if(fread_s(&header, sizeof(header), sizeof(header), 1, file) != 1 || fstat(fileno(file), &fileStatus) != 0 ||
+        !IsRasterHeaderValid(&header, key, variant, format, (uint64_t)fileStatus.st_size))
+    {
+        fclose(file);
+        return 1;
+    }
+
+    image->width = header.width;
+    image->height = header.height;
+    image->stride = header.stride;
+    image->format = (PixelFormat)header.format;
+    image->size = (unsigned long)header.pixelSize;
+    image->sharedFile = -1;
+    image->mapping = NULL;
+    image->pixels = NULL;
+
+#ifdef __linux__
+    // Raw rows are used in place, straight from the page cache
+    if(!header.compressed)
+    {
+        unsigned char* mapping = mmap(NULL, header.pixelOffset + header.pixelSize, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+        fclose(file);
+        if(mapping == MAP_FAILED)
+        {
+            fprintf(stderr, "Error: Can't map %s!\n", rasterPath);
+            return -1;
+        }
+        image->mapping = mapping;
+        image->mappingSize = (unsigned long)(header.pixelOffset + header.pixelSize);
+        image->pixels = mapping + header.pixelOffset;
+
+        return 0;
+    }
+#endif
+
+    // Raw rows are read straight into the image, compressed ones go through a staging buffer
+    image->pixels = malloc(image->size);
+    unsigned char* stored = header.compressed ? malloc(header.storedSize ? header.storedSize : 1) : image->pixels;
+    int status = stored && image->pixels ? 0 : -1;
+    if(status == 0 && (fseek(file, (long)header.pixelOffset, SEEK_SET) != 0 || fread_s(stored, header.storedSize, 1, header.storedSize, file) != header.storedSize))
+    {
+        status = -1;
+    }
+    fclose(file);
+
+    if(status == 0 && header.compressed)
+    {
+        uLongf pixelSize = image->size;
+        status = uncompress(image->pixels, &pixelSize, stored, (uLong)header.storedSize) == Z_OK && pixelSize == image->size ? 0 : -1;
+    }
+    if(stored != image->pixels)
+    {
+        free(stored);
+    }
+
+    if(status != 0)
+    {
+        FreeImage(image);
+        fprintf(stderr, "Error: Can't read %s!\n", rasterPath);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Function to store a raster in the disk cache, written aside then renamed so readers never see half a file
+static int StoreRasterFile(const char* directory, const uint64_t key, const uint32_t variant, const Image* image, const bool compress)
+{
+    RasterFileHeader header = {0};
+    memcpy(header.magic, RASTER_FILE_MAGIC, sizeof(header.magic));
+    header.version = RASTER_FILE_VERSION;
+    header.variant = variant;
+    header.key = key;
+    header.width = image->width;
+    header.height = image->height;
+    header.stride = (uint32_t)((image->stride + RASTER_ROW_ALIGNMENT - 1) / RASTER_ROW_ALIGNMENT * RASTER_ROW_ALIGNMENT);
+    header.format = image->format;
+    header.pixelOffset = RASTER_FILE_ALIGNMENT;
+    header.pixelSize = (uint64_t)header.stride * header.height;
+    if(header.pixelSize > ULONG_MAX)
+    {
+        return -1;
+    }
+
+    // Lay the rows out with the padded stride
+    unsigned char* pixels = calloc(1, (size_t)header.pixelSize);
+    if(!pixels)
+    {
+        fprintf(stderr, "Error: Unable to allocate enough memory for the raster file!\n");
+        return -1;
+    }
+    const unsigned long rowBytes = image->stride < header.stride ? image->stride : header.stride;
+    for(unsigned int y = 0; y < image->height; y++)
+    {
+        memcpy(pixels + (size_t)y * header.stride, image->pixels + (size_t)y * image->stride, rowBytes);
+    }
+
+    unsigned char* stored = pixels;
+    header.storedSize = header.pixelSize;
+    if(compress)
+    {
+        uLongf storedSize = compressBound((uLong)header.pixelSize);
+        stored = malloc(storedSize);
+        if(stored && compress2(stored, &storedSize, pixels, (uLong)header.pixelSize, Z_BEST_SPEED) == Z_OK)
+        {
+            header.compressed = 1;
+            header.storedSize = storedSize;
+        }
+        else
+        {
+            free(stored);
+            stored = pixels;
+        }
+    }
+
+    char rasterPath[1024];
+    char temporaryPath[1100];
+    GetRasterFilePath(directory, key, variant, rasterPath, sizeof(rasterPath));
+    static atomic_uint temporaryCounter;
+    struct timespec salt;
+    timespec_get(&salt, TIME_UTC);
+    snprintf(temporaryPath, sizeof(temporaryPath), "%s.%u.%lld%09ld.tmp", rasterPath, atomic_fetch_add(&temporaryCounter, 1), (long long)salt.tv_sec, (long)salt.tv_nsec);
+
+    FILE* file = NULL;
+    int status = 0;
+    if(fopen_s(&file, temporaryPath, "wb") != 0)
+    {
+        status = -1;
+    }
+    else
+    {
+        unsigned char padding[RASTER_FILE_ALIGNMENT] = {0};
+        if(fwrite(&header, sizeof(header), 1, file) != 1 ||
+            fwrite(padding, 1, RASTER_FILE_ALIGNMENT - sizeof(header), file) != RASTER_FILE_ALIGNMENT - sizeof(header) ||
+            fwrite(stored, 1, (size_t)header.storedSize, file) != header.storedSize)
+        {
+            status = -1;
+        }
+        if(fclose(file) != 0)
+        {
+            status = -1;
+        }
+    }
+
+    if(stored != pixels)
+    {
+        free(stored);
+    }
+    free(pixels);
+
+    // rename does not replace an existing file on Windows, a concurrent writer stored the same raster anyway
+    if(status == 0 && rename(temporaryPath, rasterPath) != 0)
+    {
+        remove(rasterPath);
+        if(rename(temporaryPath, rasterPath) != 0)
+        {
+            status = -1;
+        }
+    }
+    if(status != 0)
+    {
+        remove(temporaryPath);
+        fprintf(stderr, "Error: Can't write %s!\n", rasterPath);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Function to decode a PNG file through the disk cache, a hit neither reads nor inflates the PNG
+static int DecodePngFileCached(const char* directory, const char* path, const bool compress, Image* image, const DecodeOptions* options, DecodeWorkspace* workspace, DecodeControl* control)
+{
+    if(options && options->rowSink)
+    {
+        fprintf(stderr, "Error: Rows handed to a sink cannot be cached!\n");
+        return -1;
+    }
+    if(options && options->format != FORMAT_RGBA8 && options->format != FORMAT_RGBA16)
+    {
+        fprintf(stderr, "Error: Raster files only hold RGBA pixels!\n");
+        return -1;
+    }
+
+    uint64_t key;
+    if(GetDiskCacheKey(path, &key) == -1)
+    {
+        return -1;
+    }
+    key = SaltDecodeKey(key, options);
+    const uint32_t variant = GetDecodeVariant(options);
+
+    // Shared output needs a memfd, which a mapped raster file cannot provide
+    if(!options || !options->sharedOutput)
+    {
+        const int loaded = LoadRasterFile(directory, key, variant, options ? options->format : FORMAT_RGBA8, image);
+        if(loaded != 1)
+        {
+            return loaded;
+        }
+    }
+
+    unsigned char* buffer;
+    unsigned long bufferSize;
+    if(ReadPngFile(path, &buffer, &bufferSize) == -1)
+    {
+        return -1;
+    }
+    const int status = DecodePngBuffer(buffer, bufferSize, image, options, workspace, control);
+    free(buffer);
+    if(status != 0)
+    {
+        return status;
+    }
+
+    // A failed store only costs the next start a decode
+    StoreRasterFile(directory, key, variant, image, compress);
+
+    return 0;
+}
+#endif
+
+// Token set by Ctrl+C so a running decode stops at the next check
+static atomic_bool interruptToken;
+
+// Function to cancel the running decode on interrupt
+static void HandleInterrupt(int signalNumber)
+{
+    (void)signalNumber;
+    atomic_store(&interruptToken, true);
+}
+
+#if PNG_SUPPORT_BATCH
+// Structure to represent a file read by the ingestion stage and waiting to be decoded
+typedef struct IngestedFile
+{
+    unsigned int index;
+    unsigned char* buffer;
+    unsigned long bufferSize;
+    unsigned long long reservedBytes;   // Counted against the bytes in flight until decoded
+    bool mapped;                        // The buffer is a file mapping rather than heap memory
+} IngestedFile;
+
+// Structure to represent one cell of the ingestion queue, the sequence tells producers and consumers whose turn it is
+typedef struct IngestCell
+{
+    atomic_size_t sequence;
+    IngestedFile file;
+} IngestCell;
+
+// Structure to represent the lock-free bounded multi-producer multi-consumer queue between ingestion and decoding
+typedef struct IngestQueue
+{
+    IngestCell* cells;
+    size_t mask;
+    unsigned long long byteLimit;
+    alignas(CACHE_LINE_SIZE) atomic_size_t enqueuePosition;
+    alignas(CACHE_LINE_SIZE) atomic_size_t dequeuePosition;
+    alignas(CACHE_LINE_SIZE) atomic_ullong bytesInFlight;
+    atomic_bool closed;
+} IngestQueue;
+
+// Structure to represent the outcome of one file of a batch
+typedef struct BatchResult
+{
+    int status;
+    unsigned int width;
+    unsigned int height;
+    double decodeSeconds;
+} BatchResult;
+
+// Structure to let threads sleep until the ingestion queues change, the queues stay lock-free while nobody sleeps
+typedef struct IngestSignal
+{
+    atomic_uint events;             // Bumped on every change, a sleeper waits for it to move past what it last saw
+    atomic_uint sleepers;
+    mtx_t lock;
+    cnd_t changed;
+} IngestSignal;
+
+// Structure to receive each image of a batch once decoded, called from the decoder threads, the image is the callee's to free
+typedef struct BatchImageSink
+{
+    int (*consumeImage)(void* context, const char* path, unsigned int index, Image* image);
+    void* context;
+} BatchImageSink;
+
+// Structure to represent a multi-file decode
+typedef struct Batch
+{
+    const char** paths;
+    unsigned int pathCount;
+    const DecodeOptions* options;   // Shared by every file, NULL for plain RGBA8
+    double budgetSeconds;           // Per file, 0 for no deadline
+    const BatchImageSink* imageSink;    // NULL drops each image once its size is noted
+    unsigned int window;            // Files read ahead of the decoders at most
+    bool mapInput;                  // Read files by mapping them instead of copying them
+    BatchResult* results;
+    IngestQueue queue;
+    atomic_uint nextPath;           // Used by the thread-based ingestion
+    unsigned int* retries;          // Files io_uring could not read, read again by the thread-based ingestion
+    unsigned int retryCount;
+    atomic_uint nextRetry;
+    IngestSignal filesReady;        // Idle decoders sleep on it until a file is pushed or the queues close
+} Batch;
+
+
+// Function to back off while waiting on the lock-free queue, spinning first then yielding then sleeping
+static void WaitForIngestQueue(unsigned int* spins)
+{
+    if(*spins < 64)
+    {
+        (*spins)++;
+    }
+    else if(*spins < 128)
+    {
+        (*spins)++;
+        thrd_yield();
+    }
+    else
+    {
+        const struct timespec pause = {0, 100000};
+        thrd_sleep(&pause, NULL);
+    }
+}
+
+// Function to initialize an ingestion signal
+static int InitIngestSignal(IngestSignal* signal)
+{
+    atomic_init(&signal->events, 0);
+    atomic_init(&signal->sleepers, 0);
+    if(mtx_init(&signal->lock, mtx_plain) != thrd_success)
+    {
+        return -1;
+    }
+    if(cnd_init(&signal->changed) != thrd_success)
+    {
+        mtx_destroy(&signal->lock);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Function to free an ingestion signal
+static void FreeIngestSignal(IngestSignal* signal)
+{
+    cnd_destroy(&signal->changed);
+    mtx_destroy(&signal->lock);
+}
+
+// Function to sleep until the signal moves past the events seen before the queues were last found empty
+static void WaitForIngestSignal(IngestSignal* signal, const unsigned int seenEvents)
+{
+    mtx_lock(&signal->lock);
+    atomic_fetch_add(&signal->sleepers, 1);
+    while(atomic_load(&signal->events) == seenEvents)
+    {
+        cnd_wait(&signal->changed, &signal->lock);
+    }
+    atomic_fetch_sub(&signal->sleepers, 1);
+    mtx_unlock(&signal->lock);
+}
+
+// Function to wake one sleeper, or all of them, after a change to the queues, the lock is only taken when someone sleeps
+static void NotifyIngestSignal(IngestSignal* signal, const bool all)
+{
+    atomic_fetch_add(&signal->events, 1);
+    if(atomic_load(&signal->sleepers) > 0)
+    {
+        mtx_lock(&signal->lock);
+        if(all)
+        {
+            cnd_broadcast(&signal->changed);
+        }
+        else
+        {
+            cnd_signal(&signal->changed);
+        }
+        mtx_unlock(&signal->lock);
+    }
+}
+
+// Function to initialize the ingestion queue, the capacity is rounded up to a power of two
+static int InitIngestQueue(IngestQueue* queue, const unsigned int capacity, const unsigned long long byteLimit)
+{
+    size_t cellCount = 2;
+    while(cellCount < capacity)
+    {
+        cellCount *= 2;
+    }
+
+    queue->cells = malloc(cellCount * sizeof(IngestCell));
+    if(!queue->cells)
+    {
+        fprintf(stderr, "Error: Unable to allocate enough memory for the ingestion queue!\n");
+        return -1;
+    }
+    for(size_t i = 0; i < cellCount; i++)
+    {
+        atomic_init(&queue->cells[i].sequence, i);
+    }
+    queue->mask = cellCount - 1;
+    queue->byteLimit = byteLimit;
+    atomic_init(&queue->enqueuePosition, 0);
+    atomic_init(&queue->dequeuePosition, 0);
+    atomic_init(&queue->bytesInFlight, 0);
+    atomic_init(&queue->closed, false);
+
+    return 0;
+}
+
+// Function to free the ingestion queue
+static void FreeIngestQueue(IngestQueue* queue)
+{
+    free(queue->cells);
+}
+
+// Function to count a file against the bytes in flight if it fits, one file always fits
+static bool TryReserveIngestBytes(IngestQueue* queue, const unsigned long long bytes)
+{
+    unsigned long long inFlight = atomic_load(&queue->bytesInFlight);
+    while(inFlight == 0 || inFlight + bytes <= queue->byteLimit)
+    {
+        if(atomic_compare_exchange_weak(&queue->bytesInFlight, &inFlight, inFlight + bytes))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Function to wait until a file fits in the bytes in flight
+static void ReserveIngestBytes(IngestQueue* queue, const unsigned long long bytes)
+{
+    unsigned int spins = 0;
+    while(!TryReserveIngestBytes(queue, bytes))
+    {
+        WaitForIngestQueue(&spins);
+    }
+}
+
+// Function to give back the bytes of a decoded file
+static void ReleaseIngestBytes(IngestQueue* queue, const unsigned long long bytes)
+{
+    atomic_fetch_sub(&queue->bytesInFlight, bytes);
+}
+
+// Function to try to queue a read file, fails when the queue is full
+static bool TryPushIngestedFile(IngestQueue* queue, const IngestedFile* file)
+{
+    size_t position = atomic_load_explicit(&queue->enqueuePosition, memory_order_relaxed);
+    for(;;)
+    {
+        IngestCell* cell = &queue->cells[position & queue->mask];
+        const size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        const intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+        if(difference == 0)
+        {
+            if(atomic_compare_exchange_weak_explicit(&queue->enqueuePosition, &position, position + 1, memory_order_relaxed, memory_order_relaxed))
+            {
+                cell->file = *file;
+                atomic_store_explicit(&cell->sequence, position + 1, memory_order_release);
+                return true;
+            }
+        }
+        else if(difference < 0)
+        {
+            return false;
+        }
+        else
+        {
+            position = atomic_load_explicit(&queue->enqueuePosition, memory_order_relaxed);
+        }
+    }
+}
+
+// Function to try to take a read file, fails when the queue is empty
+static bool TryPopIngestedFile(IngestQueue* queue, IngestedFile* file)
+{
+    size_t position = atomic_load_explicit(&queue->dequeuePosition, memory_order_relaxed);
+    for(;;)
+    {
+        IngestCell* cell = &queue->cells[position & queue->mask];
+        const size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        const intptr_t difference = (intptr_t)sequence - (intptr_t)(position + 1);
+        if(difference == 0)
+        {
+            if(atomic_compare_exchange_weak_explicit(&queue->dequeuePosition, &position, position + 1, memory_order_relaxed, memory_order_relaxed))
+            {
+                *file = cell->file;
+                atomic_store_explicit(&cell->sequence, position + queue->mask + 1, memory_order_release);
+                return true;
+            }
+        }
+        else if(difference < 0)
+        {
+            return false;
+        }
+        else
+        {
+            position = atomic_load_explicit(&queue->dequeuePosition, memory_order_relaxed);
+        }
+    }
+}
+
+// Function to hand a read file to the decode pool, waits while the queue is full
+static void PushIngestedFile(IngestQueue* queue, const IngestedFile* file)
+{
+    unsigned int spins = 0;
+    while(!TryPushIngestedFile(queue, file))
+    {
+        WaitForIngestQueue(&spins);
+    }
+}
+
+// Function to tell the decode pool that no more files will come
+static void CloseIngestQueue(IngestQueue* queue)
+{
+    atomic_store(&queue->closed, true);
+}
+
+// Function to release the buffer of an ingested file and its share of the bytes in flight
+static void FreeIngestedFile(IngestQueue* queue, IngestedFile* file)
+{
+#ifdef __linux__
+    if(file->mapped)
+    {
+        munmap(file->buffer, file->bufferSize);
+    }
+    else
+#endif
+    {
+        free(file->buffer);
+    }
+    file->buffer = NULL;
+    ReleaseIngestBytes(queue, file->reservedBytes);
+}
+
+// Function to hand a read file to the decoders and wake one of them for it
+static void PushBatchFile(Batch* batch, const IngestedFile* file)
+{
+    PushIngestedFile(&batch->queue, file);
+    NotifyIngestSignal(&batch->filesReady, false);
+}
+
+// Function to take the next read file of a batch, false once the queue is closed and drained
+static bool PopBatchFile(Batch* batch, IngestedFile* file)
+{
+    unsigned int spins = 0;
+
+    for(;;)
+    {
+        // Closing is checked before the last pass, files pushed before it are still drained
+        const unsigned int seenEvents = atomic_load(&batch->filesReady.events);
+        const bool closed = atomic_load(&batch->queue.closed);
+        if(TryPopIngestedFile(&batch->queue, file))
+        {
+            return true;
+        }
+        if(closed)
+        {
+            return false;
+        }
+
+        // A short spin catches files pushed right behind, after that the decoder sleeps until a push or the close
+        if(spins < 128)
+        {
+            WaitForIngestQueue(&spins);
+        }
+        else
+        {
+            WaitForIngestSignal(&batch->filesReady, seenEvents);
+        }
+    }
+}
+
+// Function run by each decoder of a batch, the workspace is allocated once and reused for every file
+static int BatchDecodeWorker(void* argument)
+{
+    Batch* batch = argument;
+    DecodeWorkspace workspace;
+    if(InitDecodeWorkspace(&workspace) == -1)
+    {
+        return -1;
+    }
+
+    IngestedFile file;
+    while(PopBatchFile(batch, &file))
+    {
+        BatchResult* result = &batch->results[file.index];
+        const double start = GetTimeSeconds();
+        DecodeControl control;
+        InitDecodeControl(&control, batch->budgetSeconds, &interruptToken);
+
+        Image image;
+        result->status = DecodePngBuffer(file.buffer, file.bufferSize, &image, batch->options, &workspace, &control);
+        FreeIngestedFile(&batch->queue, &file);
+        result->decodeSeconds = GetTimeSeconds() - start;
+        if(result->status == 0)
+        {
+            result->width = image.width;
+            result->height = image.height;
+            if(batch->imageSink)
+            {
+                result->status = batch->imageSink->consumeImage(batch->imageSink->context, batch->paths[file.index], file.index, &image);
+            }
+            else
+            {
+                FreeImage(&image);
+            }
+        }
+    }
+
+    FreeDecodeWorkspace(&workspace);
+
+    return 0;
+}
+
+// Function to read one file of a batch once its bytes fit in flight, by mapping or copying it
+static int ReadIngestedFile(Batch* batch, IngestedFile* file)
+{
+    const char* path = batch->paths[file->index];
+    struct stat fileStatus;
+    if(stat(path, &fileStatus) != 0 || fileStatus.st_size <= 0 || (unsigned long long)fileStatus.st_size > ULONG_MAX)
+    {
+        fprintf(stderr, "Error: Can't get the size of %s!\n", path);
+        return -1;
+    }
+    file->reservedBytes = (unsigned long long)fileStatus.st_size;
+    IngestQueue* queue = &batch->queue;
+    ReserveIngestBytes(queue, file->reservedBytes);
+
+#ifdef __linux__
+    // Populating the mapping here keeps the page faults on the reader, not on the decoder
+    if(batch->mapInput)
+    {
+        const int descriptor = open(path, O_RDONLY | O_CLOEXEC);
+        void* mapping = descriptor < 0 ? MAP_FAILED : mmap(NULL, (size_t)fileStatus.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, descriptor, 0);
+        if(descriptor >= 0)
+        {
+            close(descriptor);
+        }
+        if(mapping != MAP_FAILED)
+        {
+            file->buffer = mapping;
+            file->bufferSize = (unsigned long)fileStatus.st_size;
+            file->mapped = true;
+            return 0;
+        }
+    }
+#endif
+
+    if(ReadPngFile(path, &file->buffer, &file->bufferSize) == -1)
+    {
+        ReleaseIngestBytes(queue, file->reservedBytes);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Function run by each reader of the thread-based ingestion
+static int BatchReadWorker(void* argument)
+{
+    Batch* batch = argument;
+
+    for(;;)
+    {
+        // Files handed back by io_uring go first, they were taken from the paths already
+        const unsigned int retry = atomic_fetch_add(&batch->nextRetry, 1);
+        const unsigned int index = retry < batch->retryCount ? batch->retries[retry] : atomic_fetch_add(&batch->nextPath, 1);
+        if(index >= batch->pathCount)
+        {
+            break;
+        }
+
+        IngestedFile file = {index, NULL, 0, 0, false};
+        if(ReadIngestedFile(batch, &file) == -1)
+        {
+            batch->results[index].status = -1;
+            continue;
+        }
+        PushBatchFile(batch, &file);
+    }
+
+    return 0;
+}
+
+// Function to read every file of a batch with blocking reads spread over window threads
+static int IngestWithThreads(Batch* batch)
+{
+    thrd_t* readers = malloc(batch->window * sizeof(thrd_t));
+    if(!readers)
+    {
+        fprintf(stderr, "Error: Unable to allocate enough memory for the readers!\n");
+        return -1;
+    }
+
+    // Carries on from where the io_uring ingestion stopped, if it ran at all
+    unsigned int started = 0;
+    for(; started < batch->window && started < batch->pathCount + batch->retryCount; started++)
+    {
+        if(thrd_create(&readers[started], BatchReadWorker, batch) != thrd_success)
+        {
+            break;
+        }
+    }
+    for(unsigned int i = 0; i < started; i++)
+    {
+        thrd_join(readers[i], NULL);
+    }
+    free(readers);
+
+    return started > 0 ? 0 : -1;
+}
+
+#ifdef __linux__
+// Structure to represent an io_uring instance mapped without liburing
+typedef struct Uring
+{
+    int ringFile;
+    unsigned int* submitHead;
+    unsigned int* submitTail;
+    unsigned int* submitMask;
+    unsigned int* submitArray;
+    struct io_uring_sqe* submitEntries;
+    unsigned int* completeHead;
+    unsigned int* completeTail;
+    unsigned int* completeMask;
+    struct io_uring_cqe* completeEntries;
+    void* submitRing;
+    size_t submitRingSize;
+    void* completeRing;
+    size_t completeRingSize;
+    size_t submitEntriesSize;
+    unsigned int pending;           // Queued but not submitted yet
+    unsigned int outstanding;       // Queued or submitted, not completed yet
+} Uring;
+
+// Function to set up an io_uring instance, fails cleanly on kernels or sandboxes without it
+static int InitUring(Uring* ring, const unsigned int entries)
+{
+    struct io_uring_params parameters;
+    memset(&parameters, 0, sizeof(parameters));
+    memset(ring, 0, sizeof(*ring));
+
+    ring->ringFile = (int)syscall(__NR_io_uring_setup, entries, &parameters);
+    if(ring->ringFile < 0)
+    {
+        return -1;
+    }
+
+    ring->submitRingSize = parameters.sq_off.array + parameters.sq_entries * sizeof(unsigned int);
+    ring->completeRingSize = parameters.cq_off.cqes + parameters.cq_entries * sizeof(struct io_uring_cqe);
+    if(parameters.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if(ring->completeRingSize > ring->submitRingSize)
+        {
+            ring->submitRingSize = ring->completeRingSize;
+        }
+        ring->completeRingSize = ring->submitRingSize;
+    }
+
+    ring->submitRing = mmap(NULL, ring->submitRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ringFile, IORING_OFF_SQ_RING);
+    if(ring->submitRing == MAP_FAILED)
+    {
+        close(ring->ringFile);
+        return -1;
+    }
+    if(parameters.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        ring->completeRing = ring->submitRing;
+    }
+    else
+    {
+        ring->completeRing = mmap(NULL, ring->completeRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ringFile, IORING_OFF_CQ_RING);
+        if(ring->completeRing == MAP_FAILED)
+        {
+            munmap(ring->submitRing, ring->submitRingSize);
+            close(ring->ringFile);
+            return -1;
+        }
+    }
+
+    ring->submitEntriesSize = parameters.sq_entries * sizeof(struct io_uring_sqe);
+    ring->submitEntries = mmap(NULL, ring->submitEntriesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ringFile, IORING_OFF_SQES);
+    if(ring->submitEntries == MAP_FAILED)
+    {
+        if(ring->completeRing != ring->submitRing)
+        {
+            munmap(ring->completeRing, ring->completeRingSize);
+        }
+        munmap(ring->submitRing, ring->submitRingSize);
+        close(ring->ringFile);
+        return -1;
+    }
+
+    unsigned char* submitBase = ring->submitRing;
+    unsigned char* completeBase = ring->completeRing;
+    ring->submitHead = (unsigned int*)(submitBase + parameters.sq_off.head);
+    ring->submitTail = (unsigned int*)(submitBase + parameters.sq_off.tail);
+    ring->submitMask = (unsigned int*)(submitBase + parameters.sq_off.ring_mask);
+    ring->submitArray = (unsigned int*)(submitBase + parameters.sq_off.array);
+    ring->completeHead = (unsigned int*)(completeBase + parameters.cq_off.head);
+    ring->completeTail = (unsigned int*)(completeBase + parameters.cq_off.tail);
+    ring->completeMask = (unsigned int*)(completeBase + parameters.cq_off.ring_mask);
+    ring->completeEntries = (struct io_uring_cqe*)(completeBase + parameters.cq_off.cqes);
+
+    return 0;
+}
+
+// Function to release an io_uring instance
+static void FreeUring(Uring* ring)
+{
+    munmap(ring->submitEntries, ring->submitEntriesSize);
+    if(ring->completeRing != ring->submitRing)
+    {
+        munmap(ring->completeRing, ring->completeRingSize);
+    }
+    munmap(ring->submitRing, ring->submitRingSize);
+    close(ring->ringFile);
+}
+
+// Function to get a blank submission entry, the ring is sized so it never runs out
+static struct io_uring_sqe* GetUringEntry(Uring* ring)
+{
+    const unsigned int tail = *ring->submitTail;
+    const unsigned int index = tail & *ring->submitMask;
+    struct io_uring_sqe* entry = &ring->submitEntries[index];
+
+    memset(entry, 0, sizeof(*entry));
+    ring->submitArray[index] = index;
+    __atomic_store_n(ring->submitTail, tail + 1, __ATOMIC_RELEASE);
+    ring->pending++;
+    ring->outstanding++;
+
+    return entry;
+}
+
+// Function to submit the queued entries and wait for at least one completion
+static int SubmitAndWaitUring(Uring* ring)
+{
+    int submitted;
+    do
+    {
+        submitted = (int)syscall(__NR_io_uring_enter, ring->ringFile, ring->pending, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+    } while(submitted < 0 && errno == EINTR);
+    if(submitted < 0)
+    {
+        return -1;
+    }
+    ring->pending -= submitted;
+
+    return 0;
+}
+
+// Enumeration for the steps of a file read through io_uring
+typedef enum UringSlotState
+{
+    SLOT_FREE,
+    SLOT_OPENING,
+    SLOT_WAITING_BYTES,
+    SLOT_READING
+} UringSlotState;
+
+// Structure to represent a file in flight through io_uring
+typedef struct UringSlot
+{
+    UringSlotState state;
+    int descriptor;
+    IngestedFile file;
+    unsigned long done;
+} UringSlot;
+
+// Function to queue the next read of a slot
+static void QueueSlotRead(Uring* ring, UringSlot* slot, const unsigned int slotIndex)
+{
+    struct io_uring_sqe* entry = GetUringEntry(ring);
+    entry->opcode = IORING_OP_READ;
+    entry->fd = slot->descriptor;
+    entry->addr = (uint64_t)(uintptr_t)(slot->file.buffer + slot->done);
+    entry->len = (unsigned int)(slot->file.bufferSize - slot->done);
+    entry->off = slot->done;
+    entry->user_data = slotIndex;
+}
+
+// Function to start reading an opened file once its bytes fit in flight, returns false on failure
+static bool StartSlotRead(Batch* batch, Uring* ring, UringSlot* slot, const unsigned int slotIndex)
+{
+    if(!TryReserveIngestBytes(&batch->queue, slot->file.bufferSize))
+    {
+        slot->state = SLOT_WAITING_BYTES;
+        return true;
+    }
+    slot->file.reservedBytes = slot->file.bufferSize;
+
+    slot->file.buffer = malloc(slot->file.bufferSize);
+    if(!slot->file.buffer)
+    {
+        return false;
+    }
+    slot->state = SLOT_READING;
+    QueueSlotRead(ring, slot, slotIndex);
+
+    return true;
+}
+
+// Function to drop a failed slot, the file is reported as not decoded
+static void FailSlot(Batch* batch, UringSlot* slot)
+{
+    fprintf(stderr, "Error: Can't read %s!\n", batch->paths[slot->file.index]);
+    batch->results[slot->file.index].status = -1;
+    if(slot->descriptor >= 0)
+    {
+        close(slot->descriptor);
+    }
+    FreeIngestedFile(&batch->queue, &slot->file);
+    slot->state = SLOT_FREE;
+}
+
+// Function to hand a slot back to the thread-based ingestion when the kernel can't do one of its operations
+static void RetrySlot(Batch* batch, UringSlot* slot)
+{
+    batch->retries[batch->retryCount++] = slot->file.index;
+    if(slot->descriptor >= 0)
+    {
+        close(slot->descriptor);
+    }
+    FreeIngestedFile(&batch->queue, &slot->file);
+    slot->state = SLOT_FREE;
+}
+
+// Function to read every file of a batch through io_uring, keeping window files in flight
+static int IngestWithUring(Batch* batch)
+{
+    Uring ring;
+    if(InitUring(&ring, batch->window) == -1)
+    {
+        return -1;
+    }
+
+    // Each file is retried at most once and only files in flight are, so the window bounds the retries
+    UringSlot* slots = calloc(batch->window, sizeof(UringSlot));
+    batch->retries = malloc(batch->window * sizeof(unsigned int));
+    if(!slots || !batch->retries)
+    {
+        free(slots);
+        FreeUring(&ring);
+        fprintf(stderr, "Error: Unable to allocate enough memory for the io_uring slots!\n");
+        return -1;
+    }
+
+    // An operation the kernel doesn't support stops new files, the ones in flight drain and the threads take over
+    unsigned int nextPath = atomic_load(&batch->nextPath);
+    unsigned int inFlight = 0;
+    unsigned int spins = 0;
+    bool unsupported = false;
+    while((nextPath < batch->pathCount && !unsupported) || inFlight > 0)
+    {
+        // Open new files until the window is full, each open is followed by its read as soon as it completes
+        for(unsigned int i = 0; i < batch->window && nextPath < batch->pathCount && !unsupported; i++)
+        {
+            if(slots[i].state != SLOT_FREE)
+            {
+                continue;
+            }
+            slots[i] = (UringSlot){SLOT_OPENING, -1, {nextPath++, NULL, 0, 0, false}, 0};
+            struct io_uring_sqe* entry = GetUringEntry(&ring);
+            entry->opcode = IORING_OP_OPENAT;
+            entry->fd = AT_FDCWD;
+            entry->addr = (uint64_t)(uintptr_t)batch->paths[slots[i].file.index];
+            entry->open_flags = O_RDONLY | O_CLOEXEC;
+            entry->user_data = i;
+            inFlight++;
+        }
+
+        // Files waiting for bytes start as soon as the decoders give some back, the ring can't wake us up for that
+        for(unsigned int i = 0; i < batch->window; i++)
+        {
+            if(slots[i].state == SLOT_WAITING_BYTES && !StartSlotRead(batch, &ring, &slots[i], i))
+            {
+                FailSlot(batch, &slots[i]);
+                inFlight--;
+            }
+        }
+        if(ring.outstanding == 0)
+        {
+            if(inFlight > 0)
+            {
+                WaitForIngestQueue(&spins);
+            }
+            continue;
+        }
+        spins = 0;
+
+        if(SubmitAndWaitUring(&ring) == -1)
+        {
+            // Files in flight are read again, the thread-based ingestion carries on with them and the rest
+            for(unsigned int i = 0; i < batch->window; i++)
+            {
+                if(slots[i].state != SLOT_FREE)
+                {
+                    RetrySlot(batch, &slots[i]);
+                }
+            }
+            atomic_store(&batch->nextPath, nextPath);
+            free(slots);
+            FreeUring(&ring);
+            return -1;
+        }
+
+        unsigned int head = *ring.completeHead;
+        const unsigned int tail = __atomic_load_n(ring.completeTail, __ATOMIC_ACQUIRE);
+        for(; head != tail; head++)
+        {
+            const struct io_uring_cqe* completion = &ring.completeEntries[head & *ring.completeMask];
+            const unsigned int slotIndex = (unsigned int)completion->user_data;
+            UringSlot* slot = &slots[slotIndex];
+            ring.outstanding--;
+
+            if(completion->res == -EINVAL || completion->res == -EOPNOTSUPP)
+            {
+                RetrySlot(batch, slot);
+                unsupported = true;
+                inFlight--;
+                continue;
+            }
+            if(completion->res < 0)
+            {
+                FailSlot(batch, slot);
+                inFlight--;
+                continue;
+            }
+
+            if(slot->state == SLOT_OPENING)
+            {
+                slot->descriptor = completion->res;
+                struct stat fileStatus;
+                if(fstat(slot->descriptor, &fileStatus) != 0 || fileStatus.st_size <= 0 || (unsigned long long)fileStatus.st_size > UINT_MAX)
+                {
+                    FailSlot(batch, slot);
+                    inFlight--;
+                    continue;
+                }
+                slot->file.bufferSize = (unsigned long)fileStatus.st_size;
+                if(!StartSlotRead(batch, &ring, slot, slotIndex))
+                {
+                    FailSlot(batch, slot);
+                    inFlight--;
+                }
+                continue;
+            }
+
+            // A short read is continued, an early end of file is an error
+            if(completion->res == 0)
+            {
+                FailSlot(batch, slot);
+                inFlight--;
+                continue;
+            }
+            slot->done += completion->res;
+            if(slot->done < slot->file.bufferSize)
+            {
+                QueueSlotRead(&ring, slot, slotIndex);
+                continue;
+            }
+
+            close(slot->descriptor);
+            PushBatchFile(batch, &slot->file);
+            slot->state = SLOT_FREE;
+            inFlight--;
+        }
+        __atomic_store_n(ring.completeHead, head, __ATOMIC_RELEASE);
+    }
+
+    free(slots);
+    FreeUring(&ring);
+    if(unsupported)
+    {
+        atomic_store(&batch->nextPath, nextPath);
+        return -1;
+    }
+
+    return 0;
+}
+#else
+// Function to report that io_uring is only available on Linux
+static int IngestWithUring(Batch* batch)
+{
+    (void)batch;
+    return -1;
+}
+#endif
+
+// Function to decode many files with the same options, reading ahead of a pool of decoders that hand each image to the sink
+static int DecodeBatch(const char** paths, const unsigned int pathCount, const DecodeOptions* options, const double budgetSeconds, const BatchImageSink* imageSink,
+    const unsigned int threadCount, const unsigned int window, const unsigned long long byteLimit, const bool useUring, const bool mapInput)
+{
+    // Mapped files never go through a read, so there would be nothing left for io_uring to do
+    if(mapInput && useUring)
+    {
+        fprintf(stderr, "Error: Mapped input can't be read through io_uring, add --no-io-uring to map the files!\n");
+        return -1;
+    }
+
+    Batch batch = {0};
+    batch.paths = paths;
+    batch.pathCount = pathCount;
+    batch.options = options;
+    batch.budgetSeconds = budgetSeconds;
+    batch.imageSink = imageSink;
+    batch.window = window > 0 ? window : 1;
+    batch.mapInput = mapInput;
+    atomic_init(&batch.nextPath, 0);
+    atomic_init(&batch.nextRetry, 0);
+    batch.results = calloc(pathCount, sizeof(BatchResult));
+    const bool queueReady = batch.results && InitIngestQueue(&batch.queue, batch.window, byteLimit) == 0;
+    if(!queueReady || InitIngestSignal(&batch.filesReady) == -1)
+    {
+        if(queueReady)
+        {
+            FreeIngestQueue(&batch.queue);
+        }
+        free(batch.results);
+        fprintf(stderr, "Error: Unable to allocate enough memory for the batch!\n");
+        return -1;
+    }
+
+    const double start = GetTimeSeconds();
+    thrd_t* decoders = malloc(threadCount * sizeof(thrd_t));
+    unsigned int started = 0;
+    for(; decoders && started < threadCount; started++)
+    {
+        if(thrd_create(&decoders[started], BatchDecodeWorker, &batch) != thrd_success)
+        {
+            break;
+        }
+    }
+
+    // Disk and CPU overlap, the ingestion stage only waits when the decoders fall behind on files or bytes
+    int status = 0;
+    if(started == 0)
+    {
+        fprintf(stderr, "Error: Can't start the decoders!\n");
+        status = -1;
+    }
+    else if(!useUring || IngestWithUring(&batch) == -1)
+    {
+        status = IngestWithThreads(&batch);
+    }
+    CloseIngestQueue(&batch.queue);
+    NotifyIngestSignal(&batch.filesReady, true);
+    for(unsigned int i = 0; i < started; i++)
+    {
+        thrd_join(decoders[i], NULL);
+    }
+    const double elapsed = GetTimeSeconds() - start;
+
+    unsigned int decoded = 0;
+    for(unsigned int i = 0; i < pathCount; i++)
+    {
+        if(batch.results[i].status == 0 && batch.results[i].width > 0)
+        {
+            printf("%s %u %u %.3f ms\n", paths[i], batch.results[i].width, batch.results[i].height, batch.results[i].decodeSeconds * 1000.0);
+            decoded++;
+        }
+        else
+        {
+            printf("%s failed\n", paths[i]);
+        }
+    }
+    printf("%u/%u decoded in %.3f ms\n", decoded, pathCount, elapsed * 1000.0);
+
+    free(decoders);
+    free(batch.results);
+    free(batch.retries);
+    FreeIngestQueue(&batch.queue);
+    FreeIngestSignal(&batch.filesReady);
+
+    return status == 0 && decoded == pathCount ? 0 : -1;
+}
+#endif
+
+#if PNG_SUPPORT_DAEMON
+// Function to estimate the work of a decode from its header and compressed size, without inflating anything
+static int EstimateDecodeCost(const unsigned char* buffer, const unsigned long bufferSize, unsigned long long* cost)
+{
+    const unsigned char pngSignature[] = {137, 80, 78, 71, 13, 10, 26, 10};
+    const bool isLittleEndian = IsLittleEndian();
+    if(bufferSize < PNG_SIGNATURE_LENGTH || memcmp(pngSignature, buffer, PNG_SIGNATURE_LENGTH) != 0)
+    {
+        fprintf(stderr, "Error: Invalid PNG signature!\n");
+        return -1;
+    }
+
+    unsigned int cursor = PNG_SIGNATURE_LENGTH;
+    Chunk chunk;
+    if(ReadChunk(buffer, bufferSize, &cursor, &chunk, isLittleEndian) == -1)
+    {
+        return -1;
+    }
+
+    Ihdr ihdr;
+    const int status = strcmp((const char*)chunk.type, HEADER_CHUNK_TYPE) == 0 ? GetIhdrChunkData(&chunk, &ihdr, isLittleEndian) : -1;
+    free(chunk.data);
+    if(status == -1)
+    {
+        fprintf(stderr, "Error: First chunk is not a valid IHDR!\n");
+        return -1;
+    }
+
+    // Unfiltering is linear in the raw bytes, inflating in the compressed ones
+    const unsigned long long bitsPerPixel = (unsigned long long)GetChannelCount(ihdr.colorType) * ihdr.bitDepth;
+    *cost = (unsigned long long)ihdr.width * ihdr.height * bitsPerPixel / 8 + bufferSize;
+
+    return 0;
+}
+
+// Enumeration for the scheduling classes of a decode, lower values run first
+typedef enum DecodePriority
+{
+    PRIORITY_INTERACTIVE,           // Someone is waiting on the result
+    PRIORITY_BATCH                  // Background work, preempted by interactive decodes
+} DecodePriority;
+
+// Structure to represent a decode waiting for or holding a slot of the scheduler
+typedef struct ScheduledDecode
+{
+    DecodePriority priority;
+    unsigned long long cost;
+    unsigned long long sequence;    // Arrival order, kept when preempted
+    double queuedTime;              // First queued, kept when preempted so the decode keeps aging
+    bool started;                   // Preempted decodes hold a partial raster and inflate state, they resume ahead of the class
+    struct DecodeScheduler* scheduler;
+    struct ScheduledDecode* next;
+} ScheduledDecode;
+
+// Structure to represent the scheduler sharing a fixed number of decode slots between concurrent requests
+typedef struct DecodeScheduler
+{
+    mtx_t lock;
+    cnd_t changed;
+    unsigned int freeSlots;
+    ScheduledDecode* waiting;
+    unsigned long long nextSequence;
+    atomic_uint waitingInteractive; // Read without the lock by running batch decodes at every row batch
+    atomic_ullong preemptions;
+} DecodeScheduler;
+
+// Function to initialize the decode scheduler
+static int InitDecodeScheduler(DecodeScheduler* scheduler, const unsigned int slotCount)
+{
+    memset(scheduler, 0, sizeof(*scheduler));
+    scheduler->freeSlots = slotCount;
+    if(mtx_init(&scheduler->lock, mtx_plain) != thrd_success || cnd_init(&scheduler->changed) != thrd_success)
+    {
+        fprintf(stderr, "Error: Cannot initialize the scheduler!\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+// Function to free the decode scheduler
+static void FreeDecodeScheduler(DecodeScheduler* scheduler)
+{
+    cnd_destroy(&scheduler->changed);
+    mtx_destroy(&scheduler->lock);
+}
+
+// Function to describe a decode for the scheduler, small images run with the interactive ones whatever their class
+static void InitScheduledDecode(ScheduledDecode* job, DecodeScheduler* scheduler, const DecodePriority priority, const unsigned long long cost)
+{
+    job->priority = cost <= SCHEDULER_SMALL_COST ? PRIORITY_INTERACTIVE : priority;
+    job->cost = cost;
+    job->sequence = 0;
+    job->queuedTime = 0;
+    job->started = false;
+    job->scheduler = scheduler;
+    job->next = NULL;
+}
+
+// Function to tell if a waiting decode goes before another, batch decodes waiting too long are aged into the interactive class
+static bool RunsBefore(const ScheduledDecode* job, const ScheduledDecode* other, const double now)
+{
+    const int jobClass = job->priority == PRIORITY_BATCH && now - job->queuedTime > SCHEDULER_AGING_SECONDS ? PRIORITY_INTERACTIVE : job->priority;
+    const int otherClass = other->priority == PRIORITY_BATCH && now - other->queuedTime > SCHEDULER_AGING_SECONDS ? PRIORITY_INTERACTIVE : other->priority;
+    if(jobClass != otherClass)
+    {
+        return jobClass < otherClass;
+    }
+    if(job->started != other->started)
+    {
+        return job->started;
+    }
+    if(job->cost != other->cost)
+    {
+        return job->cost < other->cost;
+    }
+
+    return job->sequence < other->sequence;
+}
+
+// Function to queue a decode, the caller holds the scheduler lock
+static void QueueScheduledDecode(DecodeScheduler* scheduler, ScheduledDecode* job)
+{
+    job->next = scheduler->waiting;
+    scheduler->waiting = job;
+    if(job->priority == PRIORITY_INTERACTIVE)
+    {
+        atomic_fetch_add(&scheduler->waitingInteractive, 1);
+    }
+}
+
+// Function to wait until a queued decode is the best one waiting and a slot is free, the caller holds the scheduler lock
+static void WaitForDecodeSlot(DecodeScheduler* scheduler, ScheduledDecode* job)
+{
+    for(;;)
+    {
+        // Few decodes ever wait at once, a scan is cheaper than keeping the aged order sorted
+        if(scheduler->freeSlots > 0)
+        {
+            const double now = GetTimeSeconds();
+            ScheduledDecode* best = scheduler->waiting;
+            for(ScheduledDecode* other = best->next; other; other = other->next)
+            {
+                if(RunsBefore(other, best, now))
+                {
+                    best = other;
+                }
+            }
+            if(best == job)
+            {
+                break;
+            }
+        }
+        cnd_wait(&scheduler->changed, &scheduler->lock);
+    }
+
+    ScheduledDecode** link = &scheduler->waiting;
+    while(*link != job)
+    {
+        link = &(*link)->next;
+    }
+    *link = job->next;
+    job->started = true;
+    scheduler->freeSlots--;
+    if(job->priority == PRIORITY_INTERACTIVE)
+    {
+        atomic_fetch_sub(&scheduler->waitingInteractive, 1);
+    }
+
+    // Another slot may still be free for the next best decode
+    cnd_broadcast(&scheduler->changed);
+}
+
+// Function to wait for a decode slot
+static void AcquireDecodeSlot(DecodeScheduler* scheduler, ScheduledDecode* job)
+{
+    mtx_lock(&scheduler->lock);
+    job->sequence = scheduler->nextSequence++;
+    job->queuedTime = GetTimeSeconds();
+    QueueScheduledDecode(scheduler, job);
+    WaitForDecodeSlot(scheduler, job);
+    mtx_unlock(&scheduler->lock);
+}
+
+// Function to give a decode slot back
+static void ReleaseDecodeSlot(DecodeScheduler* scheduler)
+{
+    mtx_lock(&scheduler->lock);
+    scheduler->freeSlots++;
+    cnd_broadcast(&scheduler->changed);
+    mtx_unlock(&scheduler->lock);
+}
+
+// Row batch hook of scheduled decodes, a batch decode hands its slot over while interactive decodes wait for one
+static void YieldScheduledDecode(void* context)
+{
+    ScheduledDecode* job = context;
+    DecodeScheduler* scheduler = job->scheduler;
+    if(job->priority != PRIORITY_BATCH || atomic_load(&scheduler->waitingInteractive) == 0)
+    {
+        return;
+    }
+
+    mtx_lock(&scheduler->lock);
+    if(scheduler->freeSlots == 0 && atomic_load(&scheduler->waitingInteractive) > 0)
+    {
+        atomic_fetch_add(&scheduler->preemptions, 1);
+        scheduler->freeSlots++;
+        QueueScheduledDecode(scheduler, job);
+        cnd_broadcast(&scheduler->changed);
+        WaitForDecodeSlot(scheduler, job);
+    }
+    mtx_unlock(&scheduler->lock);
+}
+
+// Function to attach a scheduled decode to a decode control, the decode must hold a slot when it starts
+static void ScheduleDecodeControl(DecodeControl* control, ScheduledDecode* job)
+{
+    control->rowBatchHook = YieldScheduledDecode;
+    control->rowBatchContext = job;
+}
+#endif
+
+#if PNG_SUPPORT_ENCODER
+// Enumeration for the row filters of the PNG format
+typedef enum FilterType
+{
+    FILTER_NONE,
+    FILTER_SUB,
+    FILTER_UP,
+    FILTER_AVERAGE,
+    FILTER_PAETH
+} FilterType;
+
+// Enumeration for how an encode trades ratio for speed
+typedef enum EncodeMode
+{
+    ENCODE_ZLIB,                    // Paeth rows through zlib deflate in parallel segments
+    ENCODE_FAST                     // Up or Paeth for the whole image through the in-tree single-pass deflate
+} EncodeMode;
+
+// Enumeration for how an encode picks the filter of each row
+typedef enum FilterStrategy
+{
+    FILTER_STRATEGY_DEFAULT,        // Paeth, or Up or Paeth sampled over the whole image in the fast mode
+    FILTER_STRATEGY_FIXED,          // The filter of the options on every row
+    FILTER_STRATEGY_SAD,            // Per row, lowest sum of absolute filtered bytes
+    FILTER_STRATEGY_ENTROPY,        // Per row, lowest estimated entropy of the filtered bytes
+    FILTER_STRATEGY_BRUTE_FORCE     // The fixed filters and both heuristics compressed in parallel, smallest wins
+} FilterStrategy;
+
+// Structure to represent the caller choices of an encode
+typedef struct EncodeOptions
+{
+    EncodeMode mode;
+    FilterStrategy filterStrategy;
+    FilterType filter;              // Used by the fixed strategy only
+    int level;                      // zlib level, Z_DEFAULT_COMPRESSION for its default
+    int zlibStrategy;               // Z_DEFAULT_STRATEGY, Z_FILTERED or Z_RLE
+    unsigned int threadCount;       // Deflate threads, one keeps the whole encode on the caller
+    unsigned long segmentBytes;     // Filtered bytes deflated by a thread at a time
+    unsigned long idatBytes;        // Data length of every IDAT chunk but the last
+} EncodeOptions;
+
+// Function to fill the encode options with their defaults
+static void InitEncodeOptions(EncodeOptions* options)
+{
+    options->mode = ENCODE_ZLIB;
+    options->filterStrategy = FILTER_STRATEGY_DEFAULT;
+    options->filter = FILTER_PAETH;
+    options->level = Z_DEFAULT_COMPRESSION;
+    options->zlibStrategy = Z_DEFAULT_STRATEGY;
+    options->threadCount = ENCODE_DEFAULT_THREADS;
+    options->segmentBytes = ENCODE_SEGMENT_BYTES;
+    options->idatBytes = ENCODE_IDAT_BYTES;
+}
+
+#ifdef USE_SSE2
+// Function to compute sixteen Paeth predictors at once in byte lanes, |a + b - 2c| is the sum of the other two distances
+// when a and b lie on the same side of c and their difference otherwise, saturating the sum leaves every comparison as is
+static __m128i PaethPredictorSse2(const __m128i left, const __m128i up, const __m128i upLeft)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i pa = _mm_or_si128(_mm_subs_epu8(up, upLeft), _mm_subs_epu8(upLeft, up));
+    const __m128i pb = _mm_or_si128(_mm_subs_epu8(left, upLeft), _mm_subs_epu8(upLeft, left));
+    const __m128i leftAbove = _mm_cmpeq_epi8(_mm_subs_epu8(upLeft, left), zero);
+    const __m128i upAbove = _mm_cmpeq_epi8(_mm_subs_epu8(upLeft, up), zero);
+    const __m128i sameSide = _mm_cmpeq_epi8(leftAbove, upAbove);
+    const __m128i sum = _mm_adds_epu8(pa, pb);
+    const __m128i difference = _mm_or_si128(_mm_subs_epu8(pa, pb), _mm_subs_epu8(pb, pa));
+    const __m128i pc = _mm_or_si128(_mm_and_si128(sameSide, sum), _mm_andnot_si128(sameSide, difference));
+
+    // Left when pa is the smallest, then up when pb is no larger than pc
+    const __m128i notLeft = _mm_xor_si128(_mm_cmpeq_epi8(_mm_min_epu8(pa, _mm_min_epu8(pb, pc)), pa), _mm_cmpeq_epi8(zero, zero));
+    const __m128i takeUp = _mm_cmpeq_epi8(_mm_min_epu8(pb, pc), pb);
+    const __m128i upOrUpLeft = _mm_or_si128(_mm_and_si128(takeUp, up), _mm_andnot_si128(takeUp, upLeft));
+
+    return _mm_or_si128(_mm_and_si128(notLeft, upOrUpLeft), _mm_andnot_si128(notLeft, left));
+}
+
+// Function to filter a row with Up or Paeth sixteen bytes at a time, every predictor input is known up front when encoding
+static unsigned long FilterRowSse2(const FilterType filterType, const unsigned char* row, const unsigned char* previousRow, const unsigned long rowBytes, const unsigned int bytesPerPixel, unsigned char* filtered)
+{
+    unsigned long i = filterType == FILTER_PAETH ? bytesPerPixel : 0;
+    for(; i + 16 <= rowBytes; i += 16)
+    {
+        const __m128i current = _mm_loadu_si128((const __m128i*)(row + i));
+        const __m128i up = _mm_loadu_si128((const __m128i*)(previousRow + i));
+        if(filterType == FILTER_UP)
+        {
+            _mm_storeu_si128((__m128i*)(filtered + i), _mm_sub_epi8(current, up));
+            continue;
+        }
+
+        const __m128i left = _mm_loadu_si128((const __m128i*)(row + i - bytesPerPixel));
+        const __m128i upLeft = _mm_loadu_si128((const __m128i*)(previousRow + i - bytesPerPixel));
+        _mm_storeu_si128((__m128i*)(filtered + i), _mm_sub_epi8(current, PaethPredictorSse2(left, up, upLeft)));
+    }
+
+    return i;
+}
+#endif
+
+// Function to filter a row of samples, the output starts with the filter type byte
+static void FilterRow(const FilterType filterType, const unsigned char* row, const unsigned char* previousRow, const unsigned long rowBytes, const unsigned int bytesPerPixel, unsigned char* output)
+{
+    output[0] = (unsigned char)filterType;
+    unsigned char* filtered = output + 1;
+
+    // The vector loop leaves the first pixel and the tail to the scalar code
+    unsigned long start = 0;
+#ifdef USE_SSE2
+    if(previousRow && (filterType == FILTER_UP || filterType == FILTER_PAETH))
+    {
+        start = FilterRowSse2(filterType, row, previousRow, rowBytes, bytesPerPixel, filtered);
+    }
+#endif
+
+    switch(filterType)
+    {
+        case FILTER_NONE:
+            memcpy(filtered, row, rowBytes);
+            break;
+        case FILTER_SUB:
+            for(unsigned long i = 0; i < rowBytes; i++)
+            {
+                filtered[i] = row[i] - (i >= bytesPerPixel ? row[i - bytesPerPixel] : 0);
+            }
+            break;
+        case FILTER_UP:
+            for(unsigned long i = start; i < rowBytes; i++)
+            {
+                filtered[i] = row[i] - (previousRow ? previousRow[i] : 0);
+            }
+            break;
+        case FILTER_AVERAGE:
+            for(unsigned long i = 0; i < rowBytes; i++)
+            {
+                const unsigned int left = i >= bytesPerPixel ? row[i - bytesPerPixel] : 0;
+                const unsigned int up = previousRow ? previousRow[i] : 0;
+                filtered[i] = row[i] - (unsigned char)((left + up) / 2);
+            }
+            break;
+        case FILTER_PAETH:
+            for(unsigned long i = 0; i < rowBytes; i++)
+            {
+                // Skip the bytes the vector loop did after the first pixel
+                if(i == bytesPerPixel && start > i)
+                {
+                    i = start;
+                    if(i == rowBytes)
+                    {
+                        break;
+                    }
+                }
+                const unsigned char left = i >= bytesPerPixel ? row[i - bytesPerPixel] : 0;
+                const unsigned char up = previousRow ? previousRow[i] : 0;
+                const unsigned char upLeft = previousRow && i >= bytesPerPixel ? previousRow[i - bytesPerPixel] : 0;
+                filtered[i] = row[i] - PaethPredictor(left, up, upLeft);
+            }
+            break;
+    }
+}
+
+// Function to filter one byte with every filter, adding the absolute filtered values to the costs
+static void FilterByteAllFilters(const unsigned char* row, const unsigned char* previousRow, const unsigned long i, const unsigned int bytesPerPixel, unsigned char** candidates, unsigned long long* costs)
+{
+    const unsigned char left = i >= bytesPerPixel ? row[i - bytesPerPixel] : 0;
+    const unsigned char up = previousRow[i];
+    const unsigned char upLeft = i >= bytesPerPixel ? previousRow[i - bytesPerPixel] : 0;
+    const unsigned char residuals[FILTER_TYPE_COUNT] = {row[i], (unsigned char)(row[i] - left), (unsigned char)(row[i] - up),
+        (unsigned char)(row[i] - (left + up) / 2), (unsigned char)(row[i] - PaethPredictor(left, up, upLeft))};
+    for(int filter = 0; filter < FILTER_TYPE_COUNT; filter++)
+    {
+        candidates[filter][i] = residuals[filter];
+        costs[filter] += (unsigned int)abs((signed char)residuals[filter]);
+    }
+}
+
+#ifdef USE_SSE2
+// Function to compute sixteen rounded down averages at once, _mm_avg_epu8 rounds up
+static __m128i AverageFloorSse2(const __m128i a, const __m128i b)
+{
+    return _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1)));
+}
+
+// Function to add the absolute values of sixteen filtered bytes, read as signed, to the two sums of a register
+static __m128i AccumulateAbsoluteSse2(const __m128i sums, const __m128i filtered)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i magnitudes = _mm_min_epu8(filtered, _mm_sub_epi8(zero, filtered));
+
+    return _mm_add_epi64(sums, _mm_sad_epu8(magnitudes, zero));
+}
+#endif
+
+// Function to filter a row with all five filters in a single pass, the costs are the sums of absolute filtered bytes
+// and the first row is expected with a zeroed previous row
+static void FilterRowAllFilters(const unsigned char* row, const unsigned char* previousRow, const unsigned long rowBytes, const unsigned int bytesPerPixel, unsigned char** candidates, unsigned long long* costs)
+{
+    memset(costs, 0, FILTER_TYPE_COUNT * sizeof(unsigned long long));
+    unsigned long i = 0;
+    for(; i < bytesPerPixel && i < rowBytes; i++)
+    {
+        FilterByteAllFilters(row, previousRow, i, bytesPerPixel, candidates, costs);
+    }
+
+#ifdef USE_SSE2
+    __m128i sums[FILTER_TYPE_COUNT];
+    for(int filter = 0; filter < FILTER_TYPE_COUNT; filter++)
+    {
+        sums[filter] = _mm_setzero_si128();
+    }
+    for(; i + 16 <= rowBytes; i += 16)
+    {
+        const __m128i current = _mm_loadu_si128((const __m128i*)(row + i));
+        const __m128i up = _mm_loadu_si128((const __m128i*)(previousRow + i));
+        const __m128i left = _mm_loadu_si128((const __m128i*)(row + i - bytesPerPixel));
+        const __m128i upLeft = _mm_loadu_si128((const __m128i*)(previousRow + i - bytesPerPixel));
+        const __m128i residuals[FILTER_TYPE_COUNT] = {current, _mm_sub_epi8(current, left), _mm_sub_epi8(current, up),
+            _mm_sub_epi8(current, AverageFloorSse2(left, up)), _mm_sub_epi8(current, PaethPredictorSse2(left, up, upLeft))};
+        for(int filter = 0; filter < FILTER_TYPE_COUNT; filter++)
+        {
+            _mm_storeu_si128((__m128i*)(candidates[filter] + i), residuals[filter]);
+            sums[filter] = AccumulateAbsoluteSse2(sums[filter], residuals[filter]);
+        }
+    }
+    for(int filter = 0; filter < FILTER_TYPE_COUNT; filter++)
+    {
+        uint64_t lanes[2];
+        _mm_storeu_si128((__m128i*)lanes, sums[filter]);
+        costs[filter] += lanes[0] + lanes[1];
+    }
+#endif
+
+    for(; i < rowBytes; i++)
+    {
+        FilterByteAllFilters(row, previousRow, i, bytesPerPixel, candidates, costs);
+    }
+}
+
+// Function to approximate the base 2 logarithm of a positive integer in fixed point, squaring the value normalised
+// to [1, 2) yields one fraction bit at a time
+static uint64_t Log2Fixed(const uint64_t value)
+{
+    unsigned int integer = 0;
+    while(integer < 63 && value >> (integer + 1))
+    {
+        integer++;
+    }
+
+    // 31 fraction bits keep the square within 64 bits
+    uint64_t normalised = integer >= 31 ? value >> (integer - 31) : value << (31 - integer);
+    uint64_t result = (uint64_t)integer << ENTROPY_FRACTION_BITS;
+    for(int bit = ENTROPY_FRACTION_BITS - 1; bit >= 0; bit--)
+    {
+        normalised = (normalised * normalised) >> 31;
+        if(normalised >= 1ULL << 32)
+        {
+            normalised >>= 1;
+            result |= 1ULL << bit;
+        }
+    }
+
+    return result;
+}
+
+// Function to estimate the bits an order-0 entropy coder needs for a filtered row, in fixed point
+static unsigned long long EstimateRowEntropy(const unsigned char* filtered, const unsigned long rowBytes)
+{
+    unsigned long counts[256] = {0};
+    for(unsigned long i = 0; i < rowBytes; i++)
+    {
+        counts[filtered[i]]++;
+    }
+
+    // Sum of count * log2(total / count), expanded so every logarithm is of an integer
+    unsigned long long bits = (unsigned long long)rowBytes * Log2Fixed(rowBytes > 0 ? rowBytes : 1);
+    for(int value = 0; value < 256; value++)
+    {
+        if(counts[value] > 0)
+        {
+            bits -= (unsigned long long)counts[value] * Log2Fixed(counts[value]);
+        }
+    }
+
+    return bits;
+}
+
+// Structure to represent a piece of the filtered rows deflated on its own
+typedef struct DeflateSegment
+{
+    const unsigned char* input;
+    unsigned long inputLength;
+    unsigned long dictionaryLength; // Bytes right before the input primed as history, so matches cross segments
+    bool last;
+    unsigned char* output;
+    unsigned long outputLength;
+    uLong checksum;                 // Adler-32 of the input alone, combined once every segment is done
+    int status;
+} DeflateSegment;
+
+// Structure to represent the deflate threads of an encode
+typedef struct ParallelDeflate
+{
+    DeflateSegment* segments;
+    unsigned int segmentCount;
+    int level;
+    int strategy;
+    atomic_uint nextSegment;
+} ParallelDeflate;
+
+// Function to deflate a segment into a raw deflate stream, ending on a byte boundary unless it is the last one
+static int DeflateSegmentData(DeflateSegment* segment, const int level, const int strategy)
+{
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if(deflateInit2(&stream, level, Z_DEFLATED, -MAX_WBITS, 8, strategy) != Z_OK)
+    {
+        return -1;
+    }
+    if(segment->dictionaryLength > 0 && deflateSetDictionary(&stream, segment->input - segment->dictionaryLength, (uInt)segment->dictionaryLength) != Z_OK)
+    {
+        deflateEnd(&stream);
+        return -1;
+    }
+
+    // The sync flush marker is five bytes more than the bound, the output grows if even that is not enough
+    unsigned long capacity = deflateBound(&stream, segment->inputLength) + 16;
+    segment->output = malloc(capacity);
+    stream.next_in = (unsigned char*)segment->input;
+    stream.avail_in = segment->inputLength;
+    stream.next_out = segment->output;
+    stream.avail_out = capacity;
+    const int flush = segment->last ? Z_FINISH : Z_SYNC_FLUSH;
+    int result = Z_OK;
+    while(segment->output)
+    {
+        result = deflate(&stream, flush);
+        if(result == Z_STREAM_ERROR || (segment->last ? result == Z_STREAM_END : stream.avail_out > 0))
+        {
+            break;
+        }
+        unsigned char* grown = realloc(segment->output, capacity * 2);
+        if(!grown)
+        {
+            free(segment->output);
+            segment->output = NULL;
+            break;
+        }
+        segment->output = grown;
+        stream.next_out = grown + capacity;
+        stream.avail_out = capacity;
+        capacity *= 2;
+    }
+    segment->outputLength = stream.total_out;
+    deflateEnd(&stream);
+    if(!segment->output || result == Z_STREAM_ERROR)
+    {
+        free(segment->output);
+        segment->output = NULL;
+        return -1;
+    }
+
+    segment->checksum = adler32(adler32(0L, Z_NULL, 0), segment->input, (uInt)segment->inputLength);
+
+    return 0;
+}
+
+// Function run by each deflate thread, segments are taken in order as threads free up
+static int ParallelDeflateWorker(void* argument)
+{
+    ParallelDeflate* deflater = argument;
+    for(;;)
+    {
+        const unsigned int index = atomic_fetch_add(&deflater->nextSegment, 1);
+        if(index >= deflater->segmentCount)
+        {
+            break;
+        }
+        deflater->segments[index].status = DeflateSegmentData(&deflater->segments[index], deflater->level, deflater->strategy);
+    }
+
+    return 0;
+}
+
+// Function to append a chunk to a PNG being written, the cursor moves past it
+static void WritePngChunk(unsigned char* png, unsigned long* cursor, const char* type, const unsigned char* data, const unsigned long dataLength)
+{
+    StoreBigEndian(png + *cursor, (uint32_t)dataLength);
+    memcpy(png + *cursor + CHUNK_DATA_LENGTH, type, CHUNK_TYPE_LENGTH);
+    if(dataLength > 0)
+    {
+        memcpy(png + *cursor + CHUNK_DATA_LENGTH + CHUNK_TYPE_LENGTH, data, dataLength);
+    }
+    const uLong crc = crc32(crc32(0L, Z_NULL, 0), png + *cursor + CHUNK_DATA_LENGTH, CHUNK_TYPE_LENGTH + dataLength);
+    StoreBigEndian(png + *cursor + CHUNK_DATA_LENGTH + CHUNK_TYPE_LENGTH + dataLength, (uint32_t)crc);
+    *cursor += CHUNK_DATA_LENGTH + CHUNK_TYPE_LENGTH + dataLength + CHUNK_CRC_LENGTH;
+}
+
+// Function to deflate filtered rows into a single zlib stream, segments are compressed in parallel and stitched together
+static int DeflateFilteredRows(const unsigned char* filtered, const unsigned long filteredSize, const EncodeOptions* options, unsigned char** zlibData, unsigned long* zlibSize)
+{
+    const unsigned long segmentBytes = options->segmentBytes > 0 ? options->segmentBytes : filteredSize;
+    ParallelDeflate deflater;
+    deflater.segmentCount = (unsigned int)((filteredSize + segmentBytes - 1) / segmentBytes);
+    deflater.level = options->level;
+    deflater.strategy = options->zlibStrategy;
+    atomic_init(&deflater.nextSegment, 0);
+    deflater.segments = calloc(deflater.segmentCount, sizeof(DeflateSegment));
+    if(!deflater.segments)
+    {
+        fprintf(stderr, "Error: Unable to allocate enough memory for the deflate segments!\n");
+        return -1;
+    }
+    for(unsigned int i = 0; i < deflater.segmentCount; i++)
+    {
+        DeflateSegment* segment = &deflater.segments[i];
+        const unsigned long offset = (unsigned long)i * segmentBytes;
+        segment->input = filtered + offset;
+        segment->inputLength = filteredSize - offset < segmentBytes ? filteredSize - offset : segmentBytes;
+        segment->dictionaryLength = offset < ENCODE_DICTIONARY_BYTES ? offset : ENCODE_DICTIONARY_BYTES;
+        segment->last = i + 1 == deflater.segmentCount;
+        segment->status = -1;
+    }
+
+    // The caller deflates too, so one thread means no thread is started
+    const unsigned int threadCount = options->threadCount < deflater.segmentCount ? options->threadCount : deflater.segmentCount;
+    thrd_t* threads = threadCount > 1 ? malloc((threadCount - 1) * sizeof(thrd_t)) : NULL;
+    unsigned int started = 0;
+    for(; threads && started < threadCount - 1; started++)
+    {
+        if(thrd_create(&threads[started], ParallelDeflateWorker, &deflater) != thrd_success)
+        {
+            break;
+        }
+    }
+    ParallelDeflateWorker(&deflater);
+    for(unsigned int i = 0; i < started; i++)
+    {
+        thrd_join(threads[i], NULL);
+    }
+    free(threads);
+
+    // Two bytes of zlib header, the raw segments back to back, then the Adler-32 of everything
+    int status = 0;
+    unsigned long size = 2 + 4;
+    uLong checksum = adler32(0L, Z_NULL, 0);
+    for(unsigned int i = 0; i < deflater.segmentCount; i++)
+    {
+        status = deflater.segments[i].status == 0 ? status : -1;
+        size += deflater.segments[i].outputLength;
+        checksum = adler32_combine(checksum, deflater.segments[i].checksum, (z_off_t)deflater.segments[i].inputLength);
+    }
+    *zlibData = status == 0 ? malloc(size) : NULL;
+    if(*zlibData)
+    {
+        const int level = options->level == Z_DEFAULT_COMPRESSION ? 6 : options->level;
+        const unsigned int levelFlag = level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3;
+        unsigned int header = (0x78 << 8) | (levelFlag << 6);
+        header += 31 - header % 31;
+        (*zlibData)[0] = (unsigned char)(header >> 8);
+        (*zlibData)[1] = (unsigned char)header;
+
+        unsigned long cursor = 2;
+        for(unsigned int i = 0; i < deflater.segmentCount; i++)
+        {
+            memcpy(*zlibData + cursor, deflater.segments[i].output, deflater.segments[i].outputLength);
+            cursor += deflater.segments[i].outputLength;
+        }
+        StoreBigEndian(*zlibData + cursor, (uint32_t)checksum);
+        *zlibSize = size;
+    }
+    else
+    {
+        fprintf(stderr, "Error: Cannot compress!\n");
+        status = -1;
+    }
+
+    for(unsigned int i = 0; i < deflater.segmentCount; i++)
+    {
+        free(deflater.segments[i].output);
+    }
+    free(deflater.segments);
+
+    return status;
+}
+
+// Function to add up the absolute values of filtered bytes, read as signed
+static unsigned long long SumAbsoluteFiltered(const unsigned char* filtered, const unsigned long length)
+{
+    unsigned long long sum = 0;
+    unsigned long i = 0;
+#ifdef USE_SSE2
+    __m128i sums = _mm_setzero_si128();
+    for(; i + 16 <= length; i += 16)
+    {
+        sums = AccumulateAbsoluteSse2(sums, _mm_loadu_si128((const __m128i*)(filtered + i)));
+    }
+    uint64_t lanes[2];
+    _mm_storeu_si128((__m128i*)lanes, sums);
+    sum = lanes[0] + lanes[1];
+#endif
+    for(; i < length; i++)
+    {
+        sum += (unsigned int)abs((signed char)filtered[i]);
+    }
+
+    return sum;
+}
+
+// Function to pick Up or Paeth for a whole image from a sample of its rows, lowest sum of absolute filtered bytes wins
+static FilterType ChooseImageFilter(const unsigned char* samples, const unsigned long sampleStride, const unsigned int height, const unsigned long rowBytes, const unsigned int bytesPerPixel, unsigned char* scratch)
+{
+    unsigned long long costs[2] = {0, 0};
+    const FilterType candidates[2] = {FILTER_UP, FILTER_PAETH};
+    for(unsigned int y = 1; y < height; y += FAST_FILTER_SAMPLE_STEP)
+    {
+        const unsigned char* row = samples + (unsigned long)y * sampleStride;
+        for(int candidate = 0; candidate < 2; candidate++)
+        {
+            FilterRow(candidates[candidate], row, row - sampleStride, rowBytes, bytesPerPixel, scratch);
+            costs[candidate] += SumAbsoluteFiltered(scratch + 1, rowBytes);
+        }
+    }
+
+    return costs[0] <= costs[1] ? FILTER_UP : FILTER_PAETH;
+}
+
+// Structure to represent the fixed Huffman codes of deflate, bit-reversed and merged with the extra bits where possible
+typedef struct FastDeflateTables
+{
+    uint32_t literalBits[286];
+    uint8_t literalLengths[286];
+    uint32_t matchBits[FAST_MAX_MATCH + 1];     // Length code followed by its extra bits, by match length
+    uint8_t matchLengths[FAST_MAX_MATCH + 1];
+    uint8_t distanceSymbols[512];               // Distances below 256 by value, the others by value >> 7
+} FastDeflateTables;
+
+static FastDeflateTables fastDeflateTables;
+static once_flag fastDeflateTablesOnce = ONCE_FLAG_INIT;
+
+// Function to reverse the lowest bits of a Huffman code, deflate sends codes starting from their top bit
+static uint32_t ReverseBits(uint32_t code, const unsigned int length)
+{
+    uint32_t reversed = 0;
+    for(unsigned int i = 0; i < length; i++)
+    {
+        reversed = (reversed << 1) | (code & 1);
+        code >>= 1;
+    }
+
+    return reversed;
+}
+
+// Function to build the fixed Huffman tables once for every thread
+static void InitFastDeflateTables(void)
+{
+    FastDeflateTables* tables = &fastDeflateTables;
+    for(unsigned int symbol = 0; symbol < 286; symbol++)
+    {
+        uint32_t code;
+        unsigned int length;
+        if(symbol < 144)
+        {
+            code = 0x30 + symbol;
+            length = 8;
+        }
+        else if(symbol < 256)
+        {
+            code = 0x190 + symbol - 144;
+            length = 9;
+        }
+        else if(symbol < 280)
+        {
+            code = symbol - 256;
+            length = 7;
+        }
+        else
+        {
+            code = 0xC0 + symbol - 280;
+            length = 8;
+        }
+        tables->literalBits[symbol] = ReverseBits(code, length);
+        tables->literalLengths[symbol] = (uint8_t)length;
+    }
+
+    const unsigned short lengthBases[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+    const unsigned char lengthExtras[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+    for(unsigned int code = 0; code < 29; code++)
+    {
+        const unsigned int last = code == 28 ? FAST_MAX_MATCH : lengthBases[code] + (1u << lengthExtras[code]) - 1;
+        for(unsigned int length = lengthBases[code]; length <= last && length <= FAST_MAX_MATCH; length++)
+        {
+            const unsigned int symbol = 257 + code;
+            tables->matchBits[length] = tables->literalBits[symbol] | (uint32_t)(length - lengthBases[code]) << tables->literalLengths[symbol];
+            tables->matchLengths[length] = (uint8_t)(tables->literalLengths[symbol] + lengthExtras[code]);
+        }
+    }
+
+    // Distance symbols come in pairs per power of two above four, as in zlib's _dist_code
+    for(unsigned int value = 0; value < 512; value++)
+    {
+        const unsigned int distance = value < 256 ? value : (value - 256) << 7;
+        unsigned int symbol = distance;
+        if(distance >= 4)
+        {
+            unsigned int highBit = 0;
+            while((distance >> (highBit + 1)) != 0)
+            {
+                highBit++;
+            }
+            symbol = 2 * highBit + ((distance >> (highBit - 1)) & 1);
+        }
+        tables->distanceSymbols[value] = (uint8_t)symbol;
+    }
+}
+
+// Structure to write deflate bits least significant first
+typedef struct BitWriter
+{
+    unsigned char* output;
+    unsigned long cursor;
+    uint64_t bits;
+    unsigned int count;
+} BitWriter;
+
+// Function to queue up to 32 bits, whole 32 bits words are written as soon as they are complete
+static void PutBits(BitWriter* writer, const uint32_t bits, const unsigned int count)
+{
+    writer->bits |= (uint64_t)bits << writer->count;
+    writer->count += count;
+    if(writer->count >= 32)
+    {
+        const uint32_t word = (uint32_t)writer->bits;
+        writer->output[writer->cursor] = (unsigned char)word;
+        writer->output[writer->cursor + 1] = (unsigned char)(word >> 8);
+        writer->output[writer->cursor + 2] = (unsigned char)(word >> 16);
+        writer->output[writer->cursor + 3] = (unsigned char)(word >> 24);
+        writer->cursor += 4;
+        writer->bits >>= 32;
+        writer->count -= 32;
+    }
+}
+
+// Function to write a match with the fixed codes
+static void PutMatch(BitWriter* writer, const unsigned int length, const unsigned int distance)
+{
+    const FastDeflateTables* tables = &fastDeflateTables;
+    PutBits(writer, tables->matchBits[length], tables->matchLengths[length]);
+
+    const unsigned int value = distance - 1;
+    const unsigned int symbol = tables->distanceSymbols[value < 256 ? value : 256 + (value >> 7)];
+    const unsigned int extraCount = symbol < 4 ? 0 : symbol / 2 - 1;
+    const unsigned int base = symbol < 4 ? symbol : (2u | (symbol & 1)) << extraCount;
+    PutBits(writer, ReverseBits(symbol, 5) | (value - base) << 5, 5 + extraCount);
+}
+
+// Function to read four bytes for match finding
+static uint32_t LoadWord(const unsigned char* data)
+{
+    uint32_t word;
+    memcpy(&word, data, sizeof(word));
+
+    return word;
+}
+
+// Function to extend a match past the bytes already known to agree, eight bytes at a time, the first difference of a
+// word is found from the lowest set bit of the two words XORed on little endian targets
+ALWAYS_INLINE unsigned int ExtendMatch(const unsigned char* data, const unsigned char* match, unsigned int length, const unsigned int limit)
+{
+    for(; length + 8 <= limit; length += 8)
+    {
+        uint64_t word, matchWord;
+        memcpy(&word, data + length, sizeof(word));
+        memcpy(&matchWord, match + length, sizeof(matchWord));
+        const uint64_t difference = word ^ matchWord;
+        if(difference != 0)
+        {
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+            return length + (unsigned int)__builtin_ctzll(difference) / 8;
+#elif defined(_MSC_VER) && defined(_M_X64)
+            unsigned long bit;
+            _BitScanForward64(&bit, difference);
+            return length + (unsigned int)bit / 8;
+#else
+            break;
+#endif
+        }
+    }
+    while(length < limit && data[length] == match[length])
+    {
+        length++;
+    }
+
+    return length;
+}
+
+// Structure to represent a fast deflate fed in pieces, positions count from the start of the stream
+typedef struct FastDeflater
+{
+    BitWriter writer;
+    uint32_t* head;                 // Last position of each hashed four bytes
+    unsigned long position;         // Next byte to encode
+    unsigned long misses;           // Positions without a match since the last one
+} FastDeflater;
+
+// Function to start a fast deflate of streamSize bytes into one fixed Huffman block
+static int InitFastDeflater(FastDeflater* deflater, const unsigned long streamSize)
+{
+    call_once(&fastDeflateTablesOnce, InitFastDeflateTables);
+
+    // A three bytes match far away takes 31 bits, that bounds the output, plus the header, the end of block code and the trailer
+    const unsigned long capacity = streamSize + streamSize / 2 + 64;
+    deflater->head = calloc(1u << FAST_HASH_BITS, sizeof(uint32_t));
+    deflater->writer = (BitWriter){malloc(capacity), 2, 0, 0};
+    deflater->position = 0;
+    deflater->misses = 0;
+    if(!deflater->head || !deflater->writer.output)
+    {
+        free(deflater->head);
+        free(deflater->writer.output);
+        fprintf(stderr, "Error: Unable to allocate enough memory for the fast deflate!\n");
+        return -1;
+    }
+    deflater->writer.output[0] = 0x78;
+    deflater->writer.output[1] = 0x01;
+
+    // Final block with fixed codes
+    PutBits(&deflater->writer, 1 | (1 << 1), 3);
+
+    return 0;
+}
+
+// Function to encode the stream up to end, window holds the bytes from windowStart on and must reach back FAST_WINDOW_SIZE
+// bytes before the next position, positions whose longest match could run past end wait for more data unless it's the last
+// piece
+// Runs of the previous byte are tried first, filtered rows are mostly runs of zeros, then one hashed earlier position
+static void FastDeflateBytes(FastDeflater* deflater, const unsigned char* window, const unsigned long windowStart, const unsigned long end, const bool last)
+{
+    const FastDeflateTables* tables = &fastDeflateTables;
+    const unsigned char* data = window - windowStart;
+    const unsigned long lookahead = last ? 4 : FAST_MAX_MATCH;
+    BitWriter* writer = &deflater->writer;
+    uint32_t* head = deflater->head;
+    unsigned long i = deflater->position;
+    unsigned long misses = deflater->misses;
+    while(i + lookahead <= end)
+    {
+        const unsigned long limit = end - i < FAST_MAX_MATCH ? end - i : FAST_MAX_MATCH;
+        unsigned int bestLength = 0;
+        unsigned int bestDistance = 0;
+
+        // Every byte of a run equals the one before it, so a run is a match at distance one
+        if(i > 0 && data[i] == data[i - 1])
+        {
+            bestLength = ExtendMatch(data + i, data + i - 1, 1, (unsigned int)limit);
+            bestDistance = 1;
+        }
+
+        const uint32_t word = LoadWord(data + i);
+        const uint32_t hash = (word * 2654435761u) >> (32 - FAST_HASH_BITS);
+        const unsigned long candidate = head[hash];
+        head[hash] = (uint32_t)i;
+        if(bestLength < limit && candidate < i && i - candidate <= FAST_WINDOW_SIZE && LoadWord(data + candidate) == word)
+        {
+            const unsigned int length = ExtendMatch(data + i, data + candidate, 4, (unsigned int)limit);
+            if(length > bestLength)
+            {
+                bestLength = length;
+                bestDistance = (unsigned int)(i - candidate);
+            }
+        }
+
+        if(bestLength >= 3)
+        {
+            PutMatch(writer, bestLength, bestDistance);
+            i += bestLength;
+            misses = 0;
+            continue;
+        }
+
+        // Noisy data is searched less and less often, as in LZ4, so it costs little more than copying literals
+        const unsigned long step = 1 + (misses++ >> FAST_SKIP_SHIFT);
+        for(const unsigned long stop = i + step < end ? i + step : end; i < stop; i++)
+        {
+            PutBits(writer, tables->literalBits[data[i]], tables->literalLengths[data[i]]);
+        }
+    }
+    for(; last && i < end; i++)
+    {
+        PutBits(writer, tables->literalBits[data[i]], tables->literalLengths[data[i]]);
+    }
+    deflater->position = i;
+    deflater->misses = misses;
+}
+
+// Function to close the block and add the Adler-32 of the stream, the zlib stream is handed over
+static void FinishFastDeflater(FastDeflater* deflater, const uint32_t checksum, unsigned char** zlibData, unsigned long* zlibSize)
+{
+    BitWriter* writer = &deflater->writer;
+    PutBits(writer, fastDeflateTables.literalBits[256], fastDeflateTables.literalLengths[256]);
+    free(deflater->head);
+
+    // Flush the last bits up to a byte boundary
+    while(writer->count > 0)
+    {
+        writer->output[writer->cursor++] = (unsigned char)writer->bits;
+        writer->bits >>= 8;
+        writer->count = writer->count > 8 ? writer->count - 8 : 0;
+    }
+    StoreBigEndian(writer->output + writer->cursor, checksum);
+    *zlibData = writer->output;
+    *zlibSize = writer->cursor + 4;
+}
+
+// Function to deflate filtered rows in a single pass into one fixed Huffman block, trading ratio for speed
+static int FastDeflateFilteredRows(const unsigned char* filtered, const unsigned long filteredSize, unsigned char** zlibData, unsigned long* zlibSize)
+{
+    FastDeflater deflater;
+    if(InitFastDeflater(&deflater, filteredSize) == -1)
+    {
+        return -1;
+    }
+    FastDeflateBytes(&deflater, filtered, 0, filteredSize, true);
+    FinishFastDeflater(&deflater, (uint32_t)adler32_z(adler32(0L, Z_NULL, 0), filtered, filteredSize), zlibData, zlibSize);
+
+    return 0;
+}
+
+// Function to get the filter of every row for the strategies that use one, scratch takes a filtered row
+static FilterType GetImageFilter(const Ihdr* ihdr, const unsigned char* samples, const unsigned long sampleStride, const EncodeOptions* options, unsigned char* scratch)
+{
+    if(options->filterStrategy != FILTER_STRATEGY_DEFAULT)
+    {
+        return options->filter;
+    }
+
+    // Paeth predicts photographic and synthetic content alike well enough for a fixed choice, the fast mode samples rows
+    // to pick between it and the cheaper Up
+    if(ihdr->bitDepth < 8)
+    {
+        return FILTER_NONE;
+    }
+    if(options->mode == ENCODE_FAST)
+    {
+        const unsigned int bytesPerPixel = (GetChannelCount(ihdr->colorType) * ihdr->bitDepth + 7) / 8;
+        return ChooseImageFilter(samples, sampleStride, ihdr->height, GetRowBytes(ihdr, ihdr->width), bytesPerPixel, scratch);
+    }
+
+    return FILTER_PAETH;
+}
+
+// Function to filter every row of an image as the strategy of the options asks
+static int FilterImageRows(const Ihdr* ihdr, const unsigned char* samples, const unsigned long sampleStride, const EncodeOptions* options, unsigned char* filtered)
+{
+    const unsigned long rowBytes = GetRowBytes(ihdr, ihdr->width);
+    const unsigned int bytesPerPixel = (GetChannelCount(ihdr->colorType) * ihdr->bitDepth + 7) / 8;
+    if(options->filterStrategy == FILTER_STRATEGY_SAD || options->filterStrategy == FILTER_STRATEGY_ENTROPY)
+    {
+        // Room for the five candidates of a row and a zeroed row above the first one
+        unsigned char* scratch = calloc(FILTER_TYPE_COUNT + 1, rowBytes + 1);
+        if(!scratch)
+        {
+            fprintf(stderr, "Error: Unable to allocate enough memory for the filter candidates!\n");
+            return -1;
+        }
+        const unsigned char* zeroRow = scratch + FILTER_TYPE_COUNT * (rowBytes + 1);
+        unsigned char* candidates[FILTER_TYPE_COUNT];
+        for(int filter = 0; filter < FILTER_TYPE_COUNT; filter++)
+        {
+            candidates[filter] = scratch + filter * (rowBytes + 1) + 1;
+            candidates[filter][-1] = (unsigned char)filter;
+        }
+
+        for(unsigned int y = 0; y < ihdr->height; y++)
+        {
+            const unsigned char* row = samples + (unsigned long)y * sampleStride;
+            unsigned long long costs[FILTER_TYPE_COUNT];
+            FilterRowAllFilters(row, y > 0 ? row - sampleStride : zeroRow, rowBytes, bytesPerPixel, candidates, costs);
+            if(options->filterStrategy == FILTER_STRATEGY_ENTROPY)
+            {
+                for(int filter = 0; filter < FILTER_TYPE_COUNT; filter++)
+                {
+                    costs[filter] = EstimateRowEntropy(candidates[filter], rowBytes);
+                }
+            }
+
+            int best = 0;
+            for(int filter = 1; filter < FILTER_TYPE_COUNT; filter++)
+            {
+                best = costs[filter] < costs[best] ? filter : best;
+            }
+            memcpy(filtered + (unsigned long)y * (rowBytes + 1), candidates[best] - 1, rowBytes + 1);
+        }
+        free(scratch);
+
+        return 0;
+    }
+
+    const FilterType filterType = GetImageFilter(ihdr, samples, sampleStride, options, filtered);
+    for(unsigned int y = 0; y < ihdr->height; y++)
+    {
+        const unsigned char* row = samples + (unsigned long)y * sampleStride;
+        FilterRow(filterType, row, y > 0 ? row - sampleStride : NULL, rowBytes, bytesPerPixel, filtered + (unsigned long)y * (rowBytes + 1));
+    }
+
+    return 0;
+}
+
+// Function to filter the rows of an image with one filter and deflate them as they come, only the deflate window and the
+// rows ahead of the next position are kept, which spares writing and faulting in the whole filtered image
+static int FastDeflateImageRows(const Ihdr* ihdr, const unsigned char* samples, const unsigned long sampleStride, const EncodeOptions* options, unsigned char** zlibData, unsigned long* zlibSize)
+{
+    const unsigned long rowBytes = GetRowBytes(ihdr, ihdr->width);
+    const unsigned int bytesPerPixel = (GetChannelCount(ihdr->colorType) * ihdr->bitDepth + 7) / 8;
+    const unsigned long filteredRowBytes = rowBytes + 1;
+    const unsigned long piece = filteredRowBytes > FAST_STREAM_BYTES ? filteredRowBytes : FAST_STREAM_BYTES;
+    const unsigned long capacity = FAST_WINDOW_SIZE + FAST_MAX_MATCH + piece;
+    unsigned char* window = malloc(capacity);
+    FastDeflater deflater;
+    if(!window || InitFastDeflater(&deflater, (unsigned long)ihdr->height * filteredRowBytes) == -1)
+    {
+        if(!window)
+        {
+            fprintf(stderr, "Error: Unable to allocate enough memory for the fast deflate window!\n");
+        }
+        free(window);
+        return -1;
+    }
+
+    const FilterType filterType = GetImageFilter(ihdr, samples, sampleStride, options, window);
+
+    // The window holds the stream from windowStart to end, once a row no longer fits the bytes matches can't reach are dropped
+    unsigned long windowStart = 0, end = 0;
+    uLong checksum = adler32(0L, Z_NULL, 0);
+    for(unsigned int y = 0; y < ihdr->height; y++)
+    {
+        if(end - windowStart + filteredRowBytes > capacity)
+        {
+            const unsigned long keep = deflater.position > FAST_WINDOW_SIZE ? deflater.position - FAST_WINDOW_SIZE : 0;
+            memmove(window, window + (keep - windowStart), end - keep);
+            windowStart = keep;
+        }
+
+        const unsigned char* row = samples + (unsigned long)y * sampleStride;
+        unsigned char* filtered = window + (end - windowStart);
+        FilterRow(filterType, row, y > 0 ? row - sampleStride : NULL, rowBytes, bytesPerPixel, filtered);
+        checksum = adler32_z(checksum, filtered, filteredRowBytes);
+        end += filteredRowBytes;
+        FastDeflateBytes(&deflater, window, windowStart, end, y + 1 == ihdr->height);
+    }
+    FinishFastDeflater(&deflater, (uint32_t)checksum, zlibData, zlibSize);
+    free(window);
+
+    return 0;
+}
+
+// Function to compress filtered rows into a zlib stream with the deflate of the encode mode
+static int CompressFilteredRows(const unsigned char* filtered, const unsigned long filteredSize, const EncodeOptions* options, unsigned char** zlibData, unsigned long* zlibSize)
+{
+    switch(options->mode)
+    {
+        case ENCODE_FAST:
+            return FastDeflateFilteredRows(filtered, filteredSize, zlibData, zlibSize);
+        case ENCODE_ZLIB:
+        default:
+            return DeflateFilteredRows(filtered, filteredSize, options, zlibData, zlibSize);
+    }
+}
+
+// Structure to represent one filtering of the image tried by the brute-force search
+typedef struct FilterTrial
+{
+    FilterStrategy strategy;
+    FilterType filter;
+    unsigned char* zlibData;
+    unsigned long zlibSize;
+    int status;
+} FilterTrial;
+
+// Structure to represent the filter trials of an encode, shared by the threads running them
+typedef struct FilterTrials
+{
+    const Ihdr* ihdr;
+    const unsigned char* samples;
+    unsigned long sampleStride;
+    unsigned long filteredSize;
+    EncodeOptions options;          // Every trial deflates on a single thread, the trials themselves run in parallel
+    FilterTrial trials[FILTER_TRIAL_COUNT];
+    atomic_uint nextTrial;
+} FilterTrials;
+
+// Function to filter and compress the image once per trial until every trial is taken
+static int FilterTrialWorker(void* argument)
+{
+    FilterTrials* search = argument;
+    for(;;)
+    {
+        const unsigned int index = atomic_fetch_add(&search->nextTrial, 1);
+        if(index >= FILTER_TRIAL_COUNT)
+        {
+            break;
+        }
+
+        FilterTrial* trial = &search->trials[index];
+        EncodeOptions options = search->options;
+        options.filterStrategy = trial->strategy;
+        options.filter = trial->filter;
+        unsigned char* filtered = malloc(search->filteredSize);
+        if(!filtered)
+        {
+            fprintf(stderr, "Error: Unable to allocate enough memory for the filtered rows!\n");
+            continue;
+        }
+        if(FilterImageRows(search->ihdr, search->samples, search->sampleStride, &options, filtered) == 0)
+        {
+            trial->status = CompressFilteredRows(filtered, search->filteredSize, &options, &trial->zlibData, &trial->zlibSize);
+        }
+        free(filtered);
+    }
+
+    return 0;
+}
+
+// Function to compress the image with every fixed filter and both per row heuristics, keeping the smallest stream
+static int BruteForceFilteredRows(const Ihdr* ihdr, const unsigned char* samples, const unsigned long sampleStride, const unsigned long filteredSize, const EncodeOptions* options, unsigned char** zlibData, unsigned long* zlibSize)
+{
+    FilterTrials search;
+    search.ihdr = ihdr;
+    search.samples = samples;
+    search.sampleStride = sampleStride;
+    search.filteredSize = filteredSize;
+    search.options = *options;
+    search.options.threadCount = 1;
+    atomic_init(&search.nextTrial, 0);
+    for(unsigned int i = 0; i < FILTER_TRIAL_COUNT; i++)
+    {
+        FilterTrial* trial = &search.trials[i];
+        trial->strategy = i < FILTER_TYPE_COUNT ? FILTER_STRATEGY_FIXED : i == FILTER_TYPE_COUNT ? FILTER_STRATEGY_SAD : FILTER_STRATEGY_ENTROPY;
+        trial->filter = i < FILTER_TYPE_COUNT ? (FilterType)i : FILTER_NONE;
+        trial->zlibData = NULL;
+        trial->status = -1;
+    }
+
+    // The caller runs trials too, so one thread means no thread is started
+    const unsigned int threadCount = options->threadCount < FILTER_TRIAL_COUNT ? options->threadCount : FILTER_TRIAL_COUNT;
+    thrd_t* threads = threadCount > 1 ? malloc((threadCount - 1) * sizeof(thrd_t)) : NULL;
+    unsigned int started = 0;
+    for(; threads && started < threadCount - 1; started++)
+    {
+        if(thrd_create(&threads[started], FilterTrialWorker, &search) != thrd_success)
+        {
+            break;
+        }
+    }
+    FilterTrialWorker(&search);
+    for(unsigned int i = 0; i < started; i++)
+    {
+        thrd_join(threads[i], NULL);
+    }
+    free(threads);
+
+    int best = -1;
+    for(int i = 0; i < FILTER_TRIAL_COUNT; i++)
+    {
+        if(search.trials[i].status == 0 && (best == -1 || search.trials[i].zlibSize < search.trials[best].zlibSize))
+        {
+            best = i;
+        }
+    }
+    for(int i = 0; i < FILTER_TRIAL_COUNT; i++)
+    {
+        if(i != best)
+        {
+            free(search.trials[i].zlibData);
+        }
+    }
+    if(best == -1)
+    {
+        return -1;
+    }
+    *zlibData = search.trials[best].zlibData;
+    *zlibSize = search.trials[best].zlibSize;
+
+    return 0;
+}
+
+// Structure to represent the ancillary chunks written along with a raster, in the sample values of its colour type
+typedef struct RasterChunks
+{
+    bool hasColorKey;               // tRNS of a greyscale or truecolour raster, the alpha of a palette goes in tRNS on its own
+    uint16_t colorKey[3];
+    bool hasBackground;             // bKGD, an indexed raster keeps the palette index in the first sample
+    uint16_t background[3];
+    unsigned int significantBitCount;   // sBIT, 0 when there is none
+    unsigned char significantBits[4];
+} RasterChunks;
+
+// Function to lay out the data of a tRNS or bKGD chunk of a greyscale or truecolour raster, returns its length
+static unsigned long StoreRasterColor(unsigned char* data, const Ihdr* ihdr, const uint16_t* color)
+{
+    const unsigned int samples = ihdr->colorType == GRAYSCALE || ihdr->colorType == GRAYSCALE_WITH_ALPHA ? 1 : 3;
+    for(unsigned int channel = 0; channel < samples; channel++)
+    {
+        data[channel * 2] = (unsigned char)(color[channel] >> 8);
+        data[channel * 2 + 1] = (unsigned char)color[channel];
+    }
+
+    return samples * 2;
+}
+
+// Function to encode rows of samples laid out as the header describes, non-interlaced, into a PNG in memory
+static int EncodePngRaster(const Ihdr* ihdr, const Palette* palette, const RasterChunks* chunks, const unsigned char* samples, const unsigned long sampleStride, const EncodeOptions* options, unsigned char** png, unsigned long* pngSize)
+{
+    EncodeOptions defaultOptions;
+    if(!options)
+    {
+        InitEncodeOptions(&defaultOptions);
+        options = &defaultOptions;
+    }
+
+    const unsigned long long filteredBytes = (unsigned long long)ihdr->height * (GetRowBytes(ihdr, ihdr->width) + 1);
+    if(filteredBytes > ULONG_MAX / 2)
+    {
+        fprintf(stderr, "Error: Image too large!\n");
+        return -1;
+    }
+    const unsigned long filteredSize = (unsigned long)filteredBytes;
+    unsigned char* zlibData;
+    unsigned long zlibSize;
+    if(options->filterStrategy == FILTER_STRATEGY_BRUTE_FORCE)
+    {
+        if(BruteForceFilteredRows(ihdr, samples, sampleStride, filteredSize, options, &zlibData, &zlibSize) != 0)
+        {
+            return -1;
+        }
+    }
+    else if(options->mode == ENCODE_FAST && options->filterStrategy != FILTER_STRATEGY_SAD && options->filterStrategy != FILTER_STRATEGY_ENTROPY)
+    {
+        if(FastDeflateImageRows(ihdr, samples, sampleStride, options, &zlibData, &zlibSize) != 0)
+        {
+            return -1;
+        }
+    }
+    else
+    {
+        unsigned char* filtered = malloc(filteredSize);
+        if(!filtered)
+        {
+            fprintf(stderr, "Error: Unable to allocate enough memory for the filtered rows!\n");
+            return -1;
+        }
+        int status = FilterImageRows(ihdr, samples, sampleStride, options, filtered);
+        if(status == 0)
+        {
+            status = CompressFilteredRows(filtered, filteredSize, options, &zlibData, &zlibSize);
+        }
+        free(filtered);
+        if(status != 0)
+        {
+            return -1;
+        }
+    }
+
+    // The palette alpha stops at the last entry that isn't opaque, the others are opaque by default
+    const bool writePalette = ihdr->colorType == INDEXED_COLOR && palette;
+    unsigned char transparency[MAX_PALETTE_ENTRIES];
+    unsigned long transparencyLength = 0;
+    for(unsigned int i = 0; writePalette && i < palette->count; i++)
+    {
+        transparency[i] = palette->entries[i][3];
+        transparencyLength = transparency[i] != 255 ? i + 1 : transparencyLength;
+    }
+    if(chunks && chunks->hasColorKey && !writePalette)
+    {
+        transparencyLength = StoreRasterColor(transparency, ihdr, chunks->colorKey);
+    }
+    unsigned char background[6];
+    unsigned long backgroundLength = 0;
+    if(chunks && chunks->hasBackground)
+    {
+        background[0] = (unsigned char)chunks->background[0];
+        backgroundLength = ihdr->colorType == INDEXED_COLOR ? 1 : StoreRasterColor(background, ihdr, chunks->background);
+    }
+    const unsigned long significantBitCount = chunks ? chunks->significantBitCount : 0;
+
+    // Signature, IHDR, sBIT, PLTE if indexed, tRNS, bKGD, the IDAT chunks and IEND
+    const unsigned long chunkOverhead = CHUNK_DATA_LENGTH + CHUNK_TYPE_LENGTH + CHUNK_CRC_LENGTH;
+    const unsigned long idatBytes = options->idatBytes > 0 ? options->idatBytes : zlibSize;
+    const unsigned long idatCount = (zlibSize + idatBytes - 1) / idatBytes;
+    *pngSize = PNG_SIGNATURE_LENGTH + chunkOverhead + IHDR_LENGTH + (writePalette ? chunkOverhead + palette->count * 3 : 0) +
+        (significantBitCount > 0 ? chunkOverhead + significantBitCount : 0) + (transparencyLength > 0 ? chunkOverhead + transparencyLength : 0) +
+        (backgroundLength > 0 ? chunkOverhead + backgroundLength : 0) + idatCount * chunkOverhead + zlibSize + chunkOverhead;
+    *png = malloc(*pngSize);
+    if(!*png)
+    {
+        free(zlibData);
+        fprintf(stderr, "Error: Unable to allocate enough memory for the PNG!\n");
+        return -1;
+    }
+
+    const unsigned char pngSignature[] = {137, 80, 78, 71, 13, 10, 26, 10};
+    memcpy(*png, pngSignature, PNG_SIGNATURE_LENGTH);
+    unsigned long cursor = PNG_SIGNATURE_LENGTH;
+
+    unsigned char header[IHDR_LENGTH];
+    StoreBigEndian(header, ihdr->width);
+    StoreBigEndian(header + IHDR_WIDTH_BYTES, ihdr->height);
+    header[8] = (unsigned char)ihdr->bitDepth;
+    header[9] = (unsigned char)ihdr->colorType;
+    header[10] = 0;
+    header[11] = 0;
+    header[12] = 0;
+    WritePngChunk(*png, &cursor, HEADER_CHUNK_TYPE, header, IHDR_LENGTH);
+    if(significantBitCount > 0)
+    {
+        WritePngChunk(*png, &cursor, SIGNIFICANT_BITS_CHUNK_TYPE, chunks->significantBits, significantBitCount);
+    }
+
+    if(writePalette)
+    {
+        unsigned char entries[MAX_PALETTE_ENTRIES * 3];
+        for(unsigned int i = 0; i < palette->count; i++)
+        {
+            memcpy(entries + i * 3, palette->entries[i], 3);
+        }
+        WritePngChunk(*png, &cursor, PALETTE_CHUNK_TYPE, entries, palette->count * 3);
+    }
+    if(transparencyLength > 0)
+    {
+        WritePngChunk(*png, &cursor, TRANSPARENCY_CHUNK_TYPE, transparency, transparencyLength);
+    }
+    if(backgroundLength > 0)
+    {
+        WritePngChunk(*png, &cursor, BACKGROUND_CHUNK_TYPE, background, backgroundLength);
+    }
+
+    for(unsigned long offset = 0; offset < zlibSize; offset += idatBytes)
+    {
+        WritePngChunk(*png, &cursor, DATA_CHUNK_TYPE, zlibData + offset, zlibSize - offset < idatBytes ? zlibSize - offset : idatBytes);
+    }
+    WritePngChunk(*png, &cursor, LAST_CHUNK_TYPE_SIGNATURE, NULL, 0);
+    free(zlibData);
+
+    return 0;
+}
+
+// Function to encode a decoded image into a PNG in memory
+static int EncodePng(const Image* image, const EncodeOptions* options, unsigned char** png, unsigned long* pngSize)
+{
+    if(image->format != FORMAT_RGBA8)
+    {
+        fprintf(stderr, "Error: Only RGBA8 images can be encoded!\n");
+        return -1;
+    }
+    const Ihdr ihdr = {image->width, image->height, 8, TRUECOLOR_WITH_ALPHA, 0, 0, 0};
+
+    return EncodePngRaster(&ihdr, NULL, NULL, image->pixels, image->stride, options, png, pngSize);
+}
+
+// Function to encode an image with every filter strategy, printing the size, the ratio to the raw pixels and the time of each
+static int BenchmarkFilterStrategies(const Image* image, const EncodeOptions* options)
+{
+    const char* names[] = {"none", "sub", "up", "average", "paeth", "sad", "entropy", "brute"};
+    const unsigned long long rawBytes = (unsigned long long)image->width * image->height * 4;
+    for(unsigned int i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+    {
+        EncodeOptions trialOptions = *options;
+        trialOptions.filterStrategy = i < FILTER_TYPE_COUNT ? FILTER_STRATEGY_FIXED : i == FILTER_TYPE_COUNT ? FILTER_STRATEGY_SAD :
+            i == FILTER_TYPE_COUNT + 1 ? FILTER_STRATEGY_ENTROPY : FILTER_STRATEGY_BRUTE_FORCE;
+        trialOptions.filter = i < FILTER_TYPE_COUNT ? (FilterType)i : FILTER_NONE;
+
+        unsigned char* png;
+        unsigned long pngSize;
+        const double start = GetTimeSeconds();
+        if(EncodePng(image, &trialOptions, &png, &pngSize) != 0)
+        {
+            return -1;
+        }
+        const double milliseconds = (GetTimeSeconds() - start) * 1000.0;
+        free(png);
+        printf("%-8s %10lu bytes %6.3f ratio %9.3f ms\n", names[i], pngSize, (double)rawBytes / pngSize, milliseconds);
+    }
+
+    return 0;
+}
+
+// Function to encode a raster of every colour type and bit depth in both encode modes and decode it back as packed samples,
+// the zlib mode deflates in several segments on several threads so the stitched stream is checked and the wide raster makes
+// the fast mode slide its window, returns -1 on a mismatch
+static int CheckEncodeRoundTrips(void)
+{
+    const struct
+    {
+        ColorType colorType;
+        unsigned int bitDepth;
+    } formats[] = {{GRAYSCALE, 1}, {GRAYSCALE, 2}, {GRAYSCALE, 4}, {GRAYSCALE, 8}, {GRAYSCALE, 16}, {TRUECOLOR, 8}, {TRUECOLOR, 16},
+        {INDEXED_COLOR, 1}, {INDEXED_COLOR, 2}, {INDEXED_COLOR, 4}, {INDEXED_COLOR, 8}, {GRAYSCALE_WITH_ALPHA, 8}, {GRAYSCALE_WITH_ALPHA, 16},
+        {TRUECOLOR_WITH_ALPHA, 8}, {TRUECOLOR_WITH_ALPHA, 16}};
+    const unsigned int sizes[][2] = {{97, 61}, {1, 1}, {4099, 40}};
+    const EncodeMode modes[] = {ENCODE_ZLIB, ENCODE_FAST};
+    unsigned int checked = 0, failed = 0;
+    for(unsigned int f = 0; f < sizeof(formats) / sizeof(formats[0]); f++)
+    {
+        for(unsigned int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+        {
+            const Ihdr ihdr = {sizes[s][0], sizes[s][1], formats[f].bitDepth, formats[f].colorType, 0, 0, 0};
+            const unsigned int channels = GetChannelCount(ihdr.colorType);
+            const unsigned long stride = GetRowBytes(&ihdr, ihdr.width);
+            unsigned char* samples = calloc(ihdr.height, stride);
+            if(!samples)
+            {
+                fprintf(stderr, "Error: Unable to allocate enough memory for the round trip samples!\n");
+                return -1;
+            }
+
+            // Runs in the upper rows give the fast deflate matches, noise in the lower rows gives it literals
+            Palette palette = {0};
+            palette.count = ihdr.colorType == INDEXED_COLOR ? 1u << ihdr.bitDepth : 0;
+            for(unsigned int i = 0; i < palette.count; i++)
+            {
+                const unsigned char entry[4] = {(unsigned char)i, (unsigned char)(i * 7), (unsigned char)(255 - i), (unsigned char)(i * 13)};
+                memcpy(palette.entries[i], entry, sizeof(entry));
+            }
+            const unsigned int mask = ihdr.bitDepth == 16 ? 0xFFFF : (1u << ihdr.bitDepth) - 1;
+            uint32_t noise = 12345;
+            for(unsigned int y = 0; y < ihdr.height; y++)
+            {
+                for(unsigned long i = 0; i < (unsigned long)ihdr.width * channels; i++)
+                {
+                    noise = noise * 1664525u + 1013904223u;
+                    const unsigned int value = y < ihdr.height / 2 ? (unsigned int)(i / (channels * 4) + y) : noise >> 8;
+                    SetSample(samples + (unsigned long)y * stride, i, ihdr.bitDepth, value & mask);
+                }
+            }
+
+            for(unsigned int m = 0; m < sizeof(modes) / sizeof(modes[0]); m++)
+            {
+                EncodeOptions options;
+                InitEncodeOptions(&options);
+                options.mode = modes[m];
+                options.segmentBytes = 1024;
+                options.idatBytes = 512;
+
+                unsigned char* png;
+                unsigned long pngSize;
+                bool same = false;
+                if(EncodePngRaster(&ihdr, ihdr.colorType == INDEXED_COLOR ? &palette : NULL, NULL, samples, stride, &options, &png, &pngSize) == 0)
+                {
+                    const DecodeOptions decodeOptions = {.format = FORMAT_PACKED};
+                    DecodeControl control;
+                    InitDecodeControl(&control, 0, NULL);
+                    Image image;
+                    if(DecodePngBuffer(png, pngSize, &image, &decodeOptions, NULL, &control) == 0)
+                    {
+                        same = image.width == ihdr.width && image.height == ihdr.height;
+                        for(unsigned int y = 0; same && y < ihdr.height; y++)
+                        {
+                            same = memcmp(image.pixels + (unsigned long)y * image.stride, samples + (unsigned long)y * stride, stride) == 0;
+                        }
+                        FreeImage(&image);
+                    }
+                    free(png);
+                }
+                if(!same)
+                {
+                    fprintf(stderr, "Error: Colour type %d at %u bits, %ux%u, %s mode does not round-trip!\n", (int)ihdr.colorType, ihdr.bitDepth,
+                        ihdr.width, ihdr.height, modes[m] == ENCODE_FAST ? "fast" : "zlib");
+                    failed++;
+                }
+                checked++;
+            }
+            free(samples);
+        }
+    }
+    printf("%u/%u encodes round-trip\n", checked - failed, checked);
+
+    return failed == 0 ? 0 : -1;
+}
+#endif
+
+#if PNG_SUPPORT_OPTIMIZER
+// Structure to represent what a decoded image can be reduced to without losing anything
+typedef struct ImageReductions
+{
+    bool fitsDepth8;                // Every 16 bits channel repeats its high byte
+    bool opaque;
+    bool gray;
+    bool hasColorKey;               // Alpha is all or nothing and the transparent pixels share a colour no opaque pixel has
+    uint16_t colorKey[3];
+    unsigned int colorCount;        // Distinct RGBA8 colours, MAX_PALETTE_ENTRIES + 1 once there are too many
+    Palette palette;
+    uint32_t colors[OPTIMIZE_COLOR_TABLE_SIZE];     // Open addressing table of the colours seen
+    unsigned short slots[OPTIMIZE_COLOR_TABLE_SIZE];  // Palette index + 1 of each colour, 0 for an empty slot
+} ImageReductions;
+
+// Function to find the palette index of a packed RGBA8 colour, adding it while the palette has room
+static int FindReducedColor(ImageReductions* reductions, const uint32_t color)
+{
+    unsigned int slot = (color * 2654435761u) >> (32 - OPTIMIZE_COLOR_BITS);
+    while(reductions->slots[slot] != 0)
+    {
+        if(reductions->colors[slot] == color)
+        {
+            return reductions->slots[slot] - 1;
+        }
+        slot = (slot + 1) & (OPTIMIZE_COLOR_TABLE_SIZE - 1);
+    }
+
+    if(reductions->colorCount >= MAX_PALETTE_ENTRIES)
+    {
+        reductions->colorCount = MAX_PALETTE_ENTRIES + 1;
+        return -1;
+    }
+    const unsigned int index = reductions->colorCount++;
+    reductions->colors[slot] = color;
+    reductions->slots[slot] = (unsigned short)(index + 1);
+    for(int channel = 0; channel < 4; channel++)
+    {
+        reductions->palette.entries[index][channel] = (unsigned char)(color >> (24 - channel * 8));
+    }
+    reductions->palette.count = reductions->colorCount;
+
+    return (int)index;
+}
+
+// Function to pack the high bytes of an RGBA16 pixel into a colour
+static uint32_t PackRgba16High(const uint16_t* pixel)
+{
+    return ((uint32_t)(pixel[0] >> 8) << 24) | ((uint32_t)(pixel[1] >> 8) << 16) | ((uint32_t)(pixel[2] >> 8) << 8) | (pixel[3] >> 8);
+}
+
+// Function to fold an RGBA16 pixel into the reductions an image allows
+static void AddReducedPixel(ImageReductions* reductions, const uint16_t* pixel)
+{
+    for(int channel = 0; channel < 4; channel++)
+    {
+        reductions->fitsDepth8 &= (pixel[channel] >> 8) == (pixel[channel] & 0xFF);
+    }
+    reductions->opaque &= pixel[3] == 65535;
+    reductions->gray &= pixel[0] == pixel[1] && pixel[1] == pixel[2];
+    if(reductions->colorCount <= MAX_PALETTE_ENTRIES)
+    {
+        FindReducedColor(reductions, PackRgba16High(pixel));
+    }
+}
+
+// Function to find which lossless reductions an RGBA16 image allows, the background has to fit them as well when not NULL
+static void AnalyzeImageReductions(const Image* image, const uint16_t* background, ImageReductions* reductions)
+{
+    memset(reductions, 0, sizeof(*reductions));
+    reductions->fitsDepth8 = true;
+    reductions->opaque = true;
+    reductions->gray = true;
+    bool binaryAlpha = true;
+    bool sharedKey = true;
+    bool keyFound = false;
+    for(unsigned int y = 0; y < image->height; y++)
+    {
+        const uint16_t* pixel = (const uint16_t*)(image->pixels + (unsigned long)y * image->stride);
+        for(unsigned int x = 0; x < image->width; x++, pixel += 4)
+        {
+            AddReducedPixel(reductions, pixel);
+            binaryAlpha &= pixel[3] == 0 || pixel[3] == 65535;
+            if(pixel[3] == 0)
+            {
+                sharedKey &= !keyFound || memcmp(reductions->colorKey, pixel, sizeof(reductions->colorKey)) == 0;
+                memcpy(reductions->colorKey, pixel, sizeof(reductions->colorKey));
+                keyFound = true;
+            }
+        }
+    }
+
+    // The background is an opaque colour, a palette needs an entry for it
+    if(background)
+    {
+        const uint16_t pixel[4] = {background[0], background[1], background[2], 65535};
+        const bool opaque = reductions->opaque;
+        AddReducedPixel(reductions, pixel);
+        reductions->opaque = opaque;
+    }
+
+    // A second pass makes sure no opaque pixel would turn transparent through the key
+    reductions->hasColorKey = keyFound && binaryAlpha && sharedKey;
+    for(unsigned int y = 0; reductions->hasColorKey && y < image->height; y++)
+    {
+        const uint16_t* pixel = (const uint16_t*)(image->pixels + (unsigned long)y * image->stride);
+        for(unsigned int x = 0; x < image->width; x++, pixel += 4)
+        {
+            if(pixel[3] != 0 && memcmp(reductions->colorKey, pixel, sizeof(reductions->colorKey)) == 0)
+            {
+                reductions->hasColorKey = false;
+                break;
+            }
+        }
+    }
+}
+
+// Structure to represent one sample layout the optimiser encodes an image in
+typedef struct OptimizeLayout
+{
+    Ihdr ihdr;
+    RasterChunks chunks;
+    unsigned char* samples;
+    unsigned long stride;
+} OptimizeLayout;
+
+// Function to lay an RGBA16 image out as the header of a layout describes
+static int BuildLayoutSamples(const Image* image, ImageReductions* reductions, OptimizeLayout* layout)
+{
+    const Ihdr* ihdr = &layout->ihdr;
+    const unsigned int channels = GetChannelCount(ihdr->colorType);
+    const bool gray = ihdr->colorType == GRAYSCALE || ihdr->colorType == GRAYSCALE_WITH_ALPHA;
+    layout->stride = GetRowBytes(ihdr, ihdr->width);
+    layout->samples = calloc(ihdr->height, layout->stride);
+    if(!layout->samples)
+    {
+        fprintf(stderr, "Error: Unable to allocate enough memory for the reduced samples!\n");
+        return -1;
+    }
+
+    for(unsigned int y = 0; y < ihdr->height; y++)
+    {
+        const uint16_t* pixel = (const uint16_t*)(image->pixels + (unsigned long)y * image->stride);
+        unsigned char* row = layout->samples + (unsigned long)y * layout->stride;
+        for(unsigned int x = 0; x < ihdr->width; x++, pixel += 4)
+        {
+            if(ihdr->colorType == INDEXED_COLOR)
+            {
+                SetSample(row, x, ihdr->bitDepth, (unsigned int)FindReducedColor(reductions, PackRgba16High(pixel)));
+                continue;
+            }
+
+            // Gray keeps the red channel, alpha is always the last sample
+            for(unsigned int channel = 0; channel < channels; channel++)
+            {
+                const uint16_t value = pixel[gray && channel == 1 ? 3 : channel];
+                SetSample(row, (unsigned long)x * channels + channel, ihdr->bitDepth, ihdr->bitDepth == 16 ? value : value >> 8);
+            }
+        }
+    }
+
+    return 0;
+}
+
+// Structure to represent one encode tried by the optimiser
+typedef struct OptimizeTrial
+{
+    unsigned int layout;
+    FilterStrategy filterStrategy;
+    FilterType filter;
+    int zlibStrategy;
+    unsigned char* png;
+    unsigned long pngSize;
+    int status;
+} OptimizeTrial;
+
+// Structure to represent the trials of an optimisation, shared by the threads running them
+typedef struct Optimizer
+{
+    const OptimizeLayout* layouts;
+    const Palette* palette;
+    OptimizeTrial* trials;
+    unsigned int trialCount;
+    atomic_uint nextTrial;
+} Optimizer;
+
+// Function to run optimisation trials until every trial is taken
+static int OptimizeWorker(void* argument)
+{
+    Optimizer* optimizer = argument;
+    for(;;)
+    {
+        const unsigned int index = atomic_fetch_add(&optimizer->nextTrial, 1);
+        if(index >= optimizer->trialCount)
+        {
+            break;
+        }
+
+        // Trials run in parallel, so each one deflates the whole stream on its own thread for the best ratio
+        OptimizeTrial* trial = &optimizer->trials[index];
+        const OptimizeLayout* layout = &optimizer->layouts[trial->layout];
+        EncodeOptions options;
+        InitEncodeOptions(&options);
+        options.level = OPTIMIZE_LEVEL;
+        options.threadCount = 1;
+        options.segmentBytes = 0;
+        options.filterStrategy = trial->filterStrategy;
+        options.filter = trial->filter;
+        options.zlibStrategy = trial->zlibStrategy;
+        trial->status = EncodePngRaster(&layout->ihdr, optimizer->palette, &layout->chunks, layout->samples, layout->stride, &options, &trial->png, &trial->pngSize);
+    }
+
+    return 0;
+}
+
+// Function to check that a PNG decodes to exactly the pixels of an RGBA16 image
+static bool VerifyOptimizedPng(const unsigned char* png, const unsigned long pngSize, const Image* reference)
+{
+    const DecodeOptions options = {.format = FORMAT_RGBA16};
+    DecodeControl control;
+    InitDecodeControl(&control, 0, NULL);
+    Image image;
+    if(DecodePngBuffer(png, pngSize, &image, &options, NULL, &control) != 0)
+    {
+        return false;
+    }
+
+    bool same = image.width == reference->width && image.height == reference->height;
+    for(unsigned int y = 0; same && y < image.height; y++)
+    {
+        same = memcmp(image.pixels + (unsigned long)y * image.stride, reference->pixels + (unsigned long)y * reference->stride, (unsigned long)image.width * 8) == 0;
+    }
+    FreeImage(&image);
+
+    return same;
+}
+
+// Structure to represent the bKGD and sBIT chunks of a PNG, converted by the optimiser to the colour type it picks
+typedef struct ConvertedChunks
+{
+    bool hasBackground;
+    uint16_t background[3];         // In 16 bits RGB, like the decoded pixels
+    bool hasSignificantBits;
+    bool significantBitsOfPalette;  // The decoder ignores sBIT on a palette image, so it only carries over to a palette
+    unsigned char significantBits[4];   // Of the red, green, blue and alpha samples, alpha is 0 without an alpha channel
+    bool hasProfile;
+    bool grayProfile;               // The iCCP profile is for GRAY data, any other profile only fits colour types with RGB samples
+} ConvertedChunks;
+
+// Function to check whether the compressed profile of an iCCP chunk is a GRAY one, only its header is inflated
+static bool IsGrayProfile(const unsigned char* data, const unsigned long dataLength)
+{
+    // A name of 1 to 79 bytes, its null terminator and the compression method come before the profile
+    const unsigned char* nameEnd = memchr(data, '\0', dataLength < 80 ? dataLength : 80);
+    if(!nameEnd || (unsigned long)(nameEnd - data) + 2 > dataLength || nameEnd[1] != 0)
+    {
+        return false;
+    }
+
+    unsigned char header[ICC_COLOR_SPACE_OFFSET + 4];
+    z_stream stream = {0};
+    if(inflateInit(&stream) != Z_OK)
+    {
+        return false;
+    }
+    stream.next_in = (Bytef*)(nameEnd + 2);
+    stream.avail_in = (uInt)(dataLength - (unsigned long)(nameEnd - data) - 2);
+    stream.next_out = header;
+    stream.avail_out = sizeof(header);
+    inflate(&stream, Z_SYNC_FLUSH);
+    const bool complete = stream.avail_out == 0;
+    inflateEnd(&stream);
+
+    return complete && memcmp(header + ICC_COLOR_SPACE_OFFSET, "GRAY", 4) == 0;
+}
+
+// Function to read the bKGD and sBIT chunks of a PNG the same way the decoder does, malformed ones are dropped
+static void ReadConvertedChunks(const Ihdr* ihdr, const unsigned char* palette, const unsigned long paletteLength, const unsigned char* background,
+    const unsigned long backgroundLength, const unsigned char* significantBits, const unsigned long significantBitsLength, ConvertedChunks* converted)
+{
+    const bool gray = ihdr->colorType == GRAYSCALE || ihdr->colorType == GRAYSCALE_WITH_ALPHA;
+    const unsigned int mask = (1u << ihdr->bitDepth) - 1;
+    if(background && ihdr->colorType == INDEXED_COLOR)
+    {
+        converted->hasBackground = backgroundLength == 1 && (unsigned long)background[0] * 3 < paletteLength;
+        for(int channel = 0; converted->hasBackground && channel < 3; channel++)
+        {
+            converted->background[channel] = palette[background[0] * 3 + channel] * 257;
+        }
+    }
+    else if(background)
+    {
+        converted->hasBackground = backgroundLength == (gray ? 2 : 6);
+        for(int channel = 0; converted->hasBackground && channel < 3; channel++)
+        {
+            const unsigned char* sample = background + (gray ? 0 : channel * 2);
+            converted->background[channel] = ScaleSampleTo16(((unsigned int)sample[0] << 8 | sample[1]) & mask, ihdr->bitDepth);
+        }
+    }
+
+    // Palette samples are always 8 bits, whatever the depth of the indices
+    const unsigned int channels = ihdr->colorType == INDEXED_COLOR ? 3 : GetChannelCount(ihdr->colorType);
+    const unsigned int sampleDepth = ihdr->colorType == INDEXED_COLOR ? 8 : ihdr->bitDepth;
+    converted->hasSignificantBits = significantBits && significantBitsLength == channels;
+    for(unsigned int channel = 0; converted->hasSignificantBits && channel < channels; channel++)
+    {
+        converted->hasSignificantBits = significantBits[channel] > 0 && significantBits[channel] <= sampleDepth;
+    }
+    if(converted->hasSignificantBits)
+    {
+        for(int channel = 0; channel < 3; channel++)
+        {
+            converted->significantBits[channel] = significantBits[gray ? 0 : channel];
+        }
+        const bool hasAlpha = ihdr->colorType == GRAYSCALE_WITH_ALPHA || ihdr->colorType == TRUECOLOR_WITH_ALPHA;
+        converted->significantBits[3] = hasAlpha ? significantBits[channels - 1] : 0;
+        converted->significantBitsOfPalette = ihdr->colorType == INDEXED_COLOR;
+    }
+}
+
+// Function to gather the chunks an optimised PNG carries over, the ones that change how its pixels are shown, along with
+// the ones that have to be converted to the colour type of the optimised PNG
+static int CollectKeptChunks(const unsigned char* buffer, const unsigned long bufferSize, unsigned char** kept, unsigned long* keptSize, ConvertedChunks* converted)
+{
+    const char* keptChunkTypes[] = {"cHRM", "gAMA", ICC_PROFILE_CHUNK_TYPE, "sRGB", "pHYs", "eXIf"};
+    const bool isLittleEndian = IsLittleEndian();
+
+    *kept = NULL;
+    *keptSize = 0;
+    memset(converted, 0, sizeof(*converted));
+    Ihdr ihdr = {0};
+    const unsigned char* palette = NULL;
+    const unsigned char* background = NULL;
+    const unsigned char* significantBits = NULL;
+    unsigned long paletteLength = 0, backgroundLength = 0, significantBitsLength = 0;
+    unsigned long cursor = PNG_SIGNATURE_LENGTH;
+    while(bufferSize >= CHUNK_DATA_LENGTH + CHUNK_TYPE_LENGTH && cursor <= bufferSize - CHUNK_DATA_LENGTH - CHUNK_TYPE_LENGTH)
+    {
+        unsigned int dataLength;
+        memcpy(&dataLength, buffer + cursor, CHUNK_DATA_LENGTH);
+        if(isLittleEndian)
+        {
+            dataLength = ToLittleEndian(dataLength);
+        }
+        const unsigned char* type = buffer + cursor + CHUNK_DATA_LENGTH;
+        const unsigned long chunkSize = CHUNK_DATA_LENGTH + CHUNK_TYPE_LENGTH + (unsigned long)dataLength + CHUNK_CRC_LENGTH;
+        if(dataLength > bufferSize - cursor - CHUNK_DATA_LENGTH - CHUNK_TYPE_LENGTH || chunkSize > bufferSize - cursor)
+        {
+            break;
+        }
+
+        const unsigned char* data = type + CHUNK_TYPE_LENGTH;
+        if(memcmp(type, HEADER_CHUNK_TYPE, CHUNK_TYPE_LENGTH) == 0 && dataLength == IHDR_LENGTH)
+        {
+            ihdr.bitDepth = data[8];
+            ihdr.colorType = (ColorType)data[9];
+        }
+        else if(memcmp(type, PALETTE_CHUNK_TYPE, CHUNK_TYPE_LENGTH) == 0)
+        {
+            palette = data;
+            paletteLength = dataLength;
+        }
+        else if(memcmp(type, BACKGROUND_CHUNK_TYPE, CHUNK_TYPE_LENGTH) == 0)
+        {
+            background = data;
+            backgroundLength = dataLength;
+        }
+        else if(memcmp(type, SIGNIFICANT_BITS_CHUNK_TYPE, CHUNK_TYPE_LENGTH) == 0)
+        {
+            significantBits = data;
+            significantBitsLength = dataLength;
+        }
+        else if(memcmp(type, ICC_PROFILE_CHUNK_TYPE, CHUNK_TYPE_LENGTH) == 0)
+        {
+            converted->hasProfile = true;
+            converted->grayProfile = IsGrayProfile(data, dataLength);
+        }
+        for(unsigned int i = 0; i < sizeof(keptChunkTypes) / sizeof(keptChunkTypes[0]); i++)
+        {
+            if(memcmp(type, keptChunkTypes[i], CHUNK_TYPE_LENGTH) == 0)
+            {
+                unsigned char* grown = realloc(*kept, *keptSize + chunkSize);
+                if(!grown)
+                {
+                    free(*kept);
+                    *kept = NULL;
+                    fprintf(stderr, "Error: Unable to allocate enough memory for the kept chunks!\n");
+                    return -1;
+                }
+                memcpy(grown + *keptSize, buffer + cursor, chunkSize);
+                *kept = grown;
+                *keptSize += chunkSize;
+                break;
+            }
+        }
+
+        if(memcmp(type, LAST_CHUNK_TYPE_SIGNATURE, CHUNK_TYPE_LENGTH) == 0)
+        {
+            break;
+        }
+        cursor += chunkSize;
+    }
+    if(ihdr.bitDepth > 0)
+    {
+        ReadConvertedChunks(&ihdr, palette, paletteLength, background, backgroundLength, significantBits, significantBitsLength, converted);
+    }
+
+    return 0;
+}
+
+// Function to express the converted chunks and the colour key in the samples of a layout
+static void BuildLayoutChunks(const ConvertedChunks* converted, ImageReductions* reductions, OptimizeLayout* layout)
+{
+    const Ihdr* ihdr = &layout->ihdr;
+    RasterChunks* chunks = &layout->chunks;
+    memset(chunks, 0, sizeof(*chunks));
+    const unsigned int shift = ihdr->bitDepth == 16 ? 0 : 8;
+    chunks->hasColorKey = reductions->hasColorKey && (ihdr->colorType == GRAYSCALE || ihdr->colorType == TRUECOLOR);
+    for(int channel = 0; channel < 3; channel++)
+    {
+        chunks->colorKey[channel] = reductions->colorKey[channel] >> shift;
+    }
+
+    chunks->hasBackground = converted->hasBackground;
+    if(ihdr->colorType == INDEXED_COLOR)
+    {
+        const uint16_t pixel[4] = {converted->background[0], converted->background[1], converted->background[2], 65535};
+        chunks->background[0] = converted->hasBackground ? (uint16_t)FindReducedColor(reductions, PackRgba16High(pixel)) : 0;
+    }
+    else
+    {
+        for(int channel = 0; channel < 3; channel++)
+        {
+            chunks->background[channel] = converted->background[channel] >> shift;
+        }
+    }
+
+    // The layouts are picked so the same samples stay significant, an alpha channel made up for a colour key counts whole
+    if(converted->hasSignificantBits && converted->significantBitsOfPalette == (ihdr->colorType == INDEXED_COLOR))
+    {
+        const unsigned char* bits = converted->significantBits;
+        const bool gray = ihdr->colorType == GRAYSCALE || ihdr->colorType == GRAYSCALE_WITH_ALPHA;
+        const bool hasAlpha = ihdr->colorType == GRAYSCALE_WITH_ALPHA || ihdr->colorType == TRUECOLOR_WITH_ALPHA;
+        const unsigned char alpha = bits[3] > 0 ? bits[3] : (unsigned char)ihdr->bitDepth;
+        const unsigned char wanted[4] = {bits[0], gray ? alpha : bits[1], bits[2], alpha};
+        chunks->significantBitCount = (gray ? 1 : 3) + (hasAlpha ? 1 : 0);
+        memcpy(chunks->significantBits, wanted, chunks->significantBitCount);
+    }
+}
+
+// Structure to represent what the optimiser did to a PNG
+typedef struct OptimizeReport
+{
+    bool keptOriginal;              // Nothing beat the input, or it cannot be re-encoded losslessly
+    unsigned int trialCount;
+    Ihdr ihdr;
+    FilterStrategy filterStrategy;
+    FilterType filter;
+    int zlibStrategy;
+} OptimizeReport;
+
+// Function to re-encode a PNG losslessly as small as possible, colour type reductions, filter strategies and zlib
+// strategies are tried in parallel and the smallest output that decodes to the exact same pixels is kept
+static int OptimizePng(const unsigned char* buffer, const unsigned long bufferSize, const unsigned int threadCount, unsigned char** png, unsigned long* pngSize, OptimizeReport* report)
+{
+    memset(report, 0, sizeof(*report));
+    *png = NULL;
+
+    // tRNS is in the decoded alpha, so the optimised PNG carries it as palette alpha, a colour key or an alpha channel
+    const DecodeOptions decodeOptions = {.format = FORMAT_RGBA16};
+    DecodeControl control;
+    InitDecodeControl(&control, 0, NULL);
+    Image image;
+    if(DecodePngBuffer(buffer, bufferSize, &image, &decodeOptions, NULL, &control) != 0)
+    {
+        return -1;
+    }
+
+    unsigned char* kept;
+    unsigned long keptSize;
+    ConvertedChunks converted;
+    if(CollectKeptChunks(buffer, bufferSize, &kept, &keptSize, &converted) == -1)
+    {
+        FreeImage(&image);
+        return -1;
+    }
+
+    ImageReductions* reductions = malloc(sizeof(ImageReductions));
+    OptimizeLayout layouts[2];
+    unsigned int layoutCount = 0;
+    int status = 0;
+    if(reductions)
+    {
+        // The smallest direct colour type is always worth trying, a palette competes with it when the colours fit
+        AnalyzeImageReductions(&image, converted.hasBackground ? converted.background : NULL, reductions);
+
+        // An sBIT chunk only carries over to layouts where it still picks out the same bits of the same samples
+        const unsigned char* bits = converted.significantBits;
+        const bool limitsSamples = converted.hasSignificantBits && !converted.significantBitsOfPalette;
+        const bool fitsDepth8 = reductions->fitsDepth8 && (!limitsSamples || (bits[0] <= 8 && bits[1] <= 8 && bits[2] <= 8 && bits[3] <= 8));
+        const bool gray = reductions->gray && (!limitsSamples || (bits[0] == bits[1] && bits[1] == bits[2]));
+
+        // The kept iCCP has to match the samples, a GRAY profile needs a grey colour type and any other profile RGB samples
+        const bool grayLayout = gray && (!converted.hasProfile || converted.grayProfile);
+        const bool noAlphaChannel = (reductions->opaque || reductions->hasColorKey) && (!limitsSamples || bits[3] == 0);
+        const ColorType directType = grayLayout ? (noAlphaChannel ? GRAYSCALE : GRAYSCALE_WITH_ALPHA) : (noAlphaChannel ? TRUECOLOR : TRUECOLOR_WITH_ALPHA);
+        layouts[layoutCount++] = (OptimizeLayout){{image.width, image.height, fitsDepth8 ? 8 : 16, directType, 0, 0, 0}, {0}, NULL, 0};
+        if(reductions->fitsDepth8 && reductions->colorCount <= MAX_PALETTE_ENTRIES && !limitsSamples && !converted.grayProfile)
+        {
+            const unsigned int count = reductions->colorCount;
+            const unsigned int indexDepth = count <= 2 ? 1 : count <= 4 ? 2 : count <= 16 ? 4 : 8;
+            layouts[layoutCount++] = (OptimizeLayout){{image.width, image.height, indexDepth, INDEXED_COLOR, 0, 0, 0}, {0}, NULL, 0};
+        }
+        for(unsigned int i = 0; i < layoutCount && status == 0; i++)
+        {
+            BuildLayoutChunks(&converted, reductions, &layouts[i]);
+            status = BuildLayoutSamples(&image, reductions, &layouts[i]);
+        }
+    }
+    else
+    {
+        fprintf(stderr, "Error: Unable to allocate enough memory for the colour analysis!\n");
+        status = -1;
+    }
+
+    // Every layout with every filter strategy and zlib strategy, all at OPTIMIZE_LEVEL since lower levels only ever won by a
+    // few bytes on noise
+    const FilterStrategy filterStrategies[] = {FILTER_STRATEGY_FIXED, FILTER_STRATEGY_FIXED, FILTER_STRATEGY_SAD, FILTER_STRATEGY_ENTROPY};
+    const FilterType filters[] = {FILTER_NONE, FILTER_PAETH, FILTER_NONE, FILTER_NONE};
+    const int zlibStrategies[] = {Z_DEFAULT_STRATEGY, Z_FILTERED, Z_RLE};
+    const unsigned int filterCount = sizeof(filters) / sizeof(filters[0]);
+    const unsigned int zlibCount = sizeof(zlibStrategies) / sizeof(zlibStrategies[0]);
+    Optimizer optimizer;
+    optimizer.layouts = layouts;
+    optimizer.palette = reductions ? &reductions->palette : NULL;
+    optimizer.trialCount = status == 0 ? layoutCount * filterCount * zlibCount : 0;
+    optimizer.trials = optimizer.trialCount > 0 ? calloc(optimizer.trialCount, sizeof(OptimizeTrial)) : NULL;
+    atomic_init(&optimizer.nextTrial, 0);
+    if(optimizer.trialCount > 0 && !optimizer.trials)
+    {
+        fprintf(stderr, "Error: Unable to allocate enough memory for the optimisation trials!\n");
+        optimizer.trialCount = 0;
+        status = -1;
+    }
+    for(unsigned int i = 0; i < optimizer.trialCount; i++)
+    {
+        OptimizeTrial* trial = &optimizer.trials[i];
+        trial->layout = i / (filterCount * zlibCount);
+        trial->filterStrategy = filterStrategies[i / zlibCount % filterCount];
+        trial->filter = filters[i / zlibCount % filterCount];
+        trial->zlibStrategy = zlibStrategies[i % zlibCount];
+        trial->status = -1;
+    }
+
+    // The caller runs trials too, so one thread means no thread is started
+    const unsigned int workerCount = threadCount < optimizer.trialCount ? threadCount : optimizer.trialCount;
+    thrd_t* threads = workerCount > 1 ? malloc((workerCount - 1) * sizeof(thrd_t)) : NULL;
+    unsigned int started = 0;
+    for(; threads && started < workerCount - 1; started++)
+    {
+        if(thrd_create(&threads[started], OptimizeWorker, &optimizer) != thrd_success)
+        {
+            break;
+        }
+    }
+    OptimizeWorker(&optimizer);
+    for(unsigned int i = 0; i < started; i++)
+    {
+        thrd_join(threads[i], NULL);
+    }
+    free(threads);
+    report->trialCount = optimizer.trialCount;
+
+    // Smallest first, a trial only wins once its pixels round-trip exactly
+    OptimizeTrial* best = NULL;
+    while(status == 0)
+    {
+        OptimizeTrial* smallest = NULL;
+        for(unsigned int i = 0; i < optimizer.trialCount; i++)
+        {
+            OptimizeTrial* trial = &optimizer.trials[i];
+            if(trial->status == 0 && (!smallest || trial->pngSize < smallest->pngSize))
+            {
+                smallest = trial;
+            }
+        }
+        if(!smallest || smallest->pngSize + keptSize >= bufferSize || VerifyOptimizedPng(smallest->png, smallest->pngSize, &image))
+        {
+            best = smallest && smallest->pngSize + keptSize < bufferSize ? smallest : NULL;
+            break;
+        }
+        fprintf(stderr, "Error: Optimised candidate does not round-trip, skipping it!\n");
+        smallest->status = -1;
+    }
+
+    // The kept chunks go right after IHDR
+    const unsigned long headerEnd = PNG_SIGNATURE_LENGTH + CHUNK_DATA_LENGTH + CHUNK_TYPE_LENGTH + IHDR_LENGTH + CHUNK_CRC_LENGTH;
+    if(status == 0)
+    {
+        *pngSize = best ? best->pngSize + keptSize : bufferSize;
+        *png = malloc(*pngSize);
+        if(!*png)
+        {
+            fprintf(stderr, "Error: Unable to allocate enough memory for the optimised PNG!\n");
+            status = -1;
+        }
+        else if(best)
+        {
+            memcpy(*png, best->png, headerEnd);
+            if(keptSize > 0)
+            {
+                memcpy(*png + headerEnd, kept, keptSize);
+            }
+            memcpy(*png + headerEnd + keptSize, best->png + headerEnd, best->pngSize - headerEnd);
+            report->ihdr = layouts[best->layout].ihdr;
+            report->filterStrategy = best->filterStrategy;
+            report->filter = best->filter;
+            report->zlibStrategy = best->zlibStrategy;
+        }
+        else
+        {
+            memcpy(*png, buffer, bufferSize);
+            report->keptOriginal = true;
+        }
+    }
+
+    for(unsigned int i = 0; i < optimizer.trialCount; i++)
+    {
+        free(optimizer.trials[i].png);
+    }
+    free(optimizer.trials);
+    for(unsigned int i = 0; i < layoutCount; i++)
+    {
+        free(layouts[i].samples);
+    }
+    free(reductions);
+    free(kept);
+    FreeImage(&image);
+
+    return status;
+}
+#endif
+
+#if PNG_SUPPORT_DAEMON
+#ifdef __linux__
+// Structure holding the counters served by the stats endpoint
+typedef struct DaemonStats
+{
+    atomic_ulong requests;
+    atomic_ulong decoded;
+    atomic_ulong failed;
+    atomic_ullong bytesOut;
+    atomic_ullong decodeMicroseconds;
+} DaemonStats;
+
+// Structure to represent the decode daemon, client connections wait in a bounded ring
+typedef struct Daemon
+{
+    int listenSocket;
+    double budgetSeconds;
+    double startTime;
+    int queue[DAEMON_QUEUE_LENGTH];
+    unsigned int queueHead;
+    unsigned int queueCount;
+    mtx_t lock;
+    cnd_t notEmpty;
+    cnd_t notFull;
+    atomic_bool stopping;           // Also read by workers serving a client, outside the lock
+    atomic_uint busyWorkers;
+    DaemonStats stats;
+    DecodeCache* cache;             // Optional, NULL when caching is disabled
+    DecodeScheduler scheduler;      // Fewer decode slots than workers, so urgent requests can overtake
+} Daemon;
+
+// Function to send one message to a client, with an optional file descriptor attached
+static int SendDaemonReply(const int client, const char* message, const int attachedFile)
+{
+    struct iovec part = {(void*)message, strlen(message)};
+    struct msghdr header = {0};
+    header.msg_iov = &part;
+    header.msg_iovlen = 1;
+
+    union
+    {
+        struct cmsghdr align;
+        char buffer[CMSG_SPACE(sizeof(int))];
+    } control;
+    if(attachedFile >= 0)
+    {
+        header.msg_control = control.buffer;
+        header.msg_controllen = sizeof(control.buffer);
+        struct cmsghdr* rights = CMSG_FIRSTHDR(&header);
+        rights->cmsg_level = SOL_SOCKET;
+        rights->cmsg_type = SCM_RIGHTS;
+        rights->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(rights), &attachedFile, sizeof(int));
+    }
+
+    return sendmsg(client, &header, MSG_NOSIGNAL) < 0 ? -1 : 0;
+}
+
+// Function to read a whole file descriptor into a newly allocated buffer
+static int ReadPngDescriptor(const int descriptor, unsigned char** buffer, unsigned long* bufferSize)
+{
+    struct stat status;
+    if(fstat(descriptor, &status) < 0 || status.st_size <= 0 || (unsigned long long)status.st_size > ULONG_MAX)
+    {
+        fprintf(stderr, "Error: Can't get the size of the passed file!\n");
+        return -1;
+    }
+
+    *buffer = malloc(status.st_size);
+    if(!*buffer)
+    {
+        fprintf(stderr, "Error: Unable to allocate enough memory!\n");
+        return -1;
+    }
+
+    unsigned long done = 0;
+    while(done < (unsigned long)status.st_size)
+    {
+        const ssize_t count = pread(descriptor, *buffer + done, status.st_size - done, done);
+        if(count <= 0)
+        {
+            free(*buffer);
+            *buffer = NULL;
+            fprintf(stderr, "Error: Something in the reading went wrong!\n");
+            return -1;
+        }
+        done += count;
+    }
+    *bufferSize = done;
+
+    return 0;
+}
+
+// Function to decode one PNG for a client and reply with its layout and the sealed memfd holding it
+static void ServeDecode(Daemon* daemon, DecodeWorkspace* workspace, const int client, const char* path, const int descriptor, const DecodePriority priority)
+{
+    const double start = GetTimeSeconds();
+    unsigned char* buffer = NULL;
+    unsigned long bufferSize = 0;
+    Image image = {0};
+    const DecodeOptions options = {.sharedOutput = true};
+    DecodeControl control;
+    InitDecodeControl(&control, daemon->budgetSeconds, NULL);
+
+    // Pixels are decoded straight into a sealed memfd, the client maps it without any copy
+    int status = path ? ReadPngFile(path, &buffer, &bufferSize) : ReadPngDescriptor(descriptor, &buffer, &bufferSize);
+    CachedImage* cached = NULL;
+    if(status == 0)
+    {
+        // A header that cannot be read fails the decode right after, its cost does not matter
+        unsigned long long cost;
+        if(EstimateDecodeCost(buffer, bufferSize, &cost) == -1)
+        {
+            cost = bufferSize;
+        }
+        ScheduledDecode job;
+        InitScheduledDecode(&job, &daemon->scheduler, priority, cost);
+        ScheduleDecodeControl(&control, &job);
+        AcquireDecodeSlot(&daemon->scheduler, &job);
+
+        // Cached images are sealed, so the same memfd can be handed to any number of clients
+        if(daemon->cache)
+        {
+            status = DecodePngCached(daemon->cache, buffer, bufferSize, &options, workspace, &control, &cached);
+            if(status == 0)
+            {
+                image = cached->image;
+            }
+        }
+        else
+        {
+            status = DecodePngBuffer(buffer, bufferSize, &image, &options, workspace, &control);
+        }
+        ReleaseDecodeSlot(&daemon->scheduler);
+        free(buffer);
+    }
+
+    if(status != 0)
+    {
+        atomic_fetch_add(&daemon->stats.failed, 1);
+        SendDaemonReply(client, status == DECODE_TIMED_OUT ? "ERR timeout\n" : "ERR decode\n", -1);
+        return;
+    }
+
+    ImageLayout layout;
+    GetImageLayout(&image, &layout);
+    char reply[160];
+    snprintf(reply, sizeof(reply), "OK %u %u %u %u %llu %llu\n", layout.width, layout.height, layout.stride, layout.format,
+        (unsigned long long)layout.size, (unsigned long long)layout.offset);
+    SendDaemonReply(client, reply, image.sharedFile);
+
+    atomic_fetch_add(&daemon->stats.decoded, 1);
+    atomic_fetch_add(&daemon->stats.bytesOut, image.size);
+    atomic_fetch_add(&daemon->stats.decodeMicroseconds, (unsigned long long)((GetTimeSeconds() - start) * 1e6));
+    if(cached)
+    {
+        ReleaseCachedImage(cached);
+    }
+    else
+    {
+        FreeImage(&image);
+    }
+}
+
+// Function to wait for the next request of a client, false once it stayed idle too long or the daemon is stopping. Idle
+// clients give their worker up sooner while others are queued, so a few of them cannot starve everyone else
+static bool WaitForClientRequest(Daemon* daemon, const int client)
+{
+    const double idleSince = GetTimeSeconds();
+    for(;;)
+    {
+        if(atomic_load(&daemon->stopping))
+        {
+            return false;
+        }
+
+        struct pollfd request = {client, POLLIN, 0};
+        const int ready = poll(&request, 1, DAEMON_POLL_MILLISECONDS);
+        if(ready > 0)
+        {
+            return true;
+        }
+        if(ready < 0 && errno != EINTR)
+        {
+            return false;
+        }
+
+        mtx_lock(&daemon->lock);
+        const bool contended = daemon->queueCount > 0;
+        mtx_unlock(&daemon->lock);
+        if(GetTimeSeconds() - idleSince > (contended ? DAEMON_CONTENDED_IDLE_SECONDS : DAEMON_IDLE_SECONDS))
+        {
+            return false;
+        }
+    }
+}
+
+// Function to serve every request of a client until it hangs up, goes idle or the daemon stops
+static void ServeClient(Daemon* daemon, DecodeWorkspace* workspace, const int client)
+{
+    char message[DAEMON_MESSAGE_LENGTH];
+    union
+    {
+        struct cmsghdr align;
+        char buffer[CMSG_SPACE(sizeof(int) * DAEMON_MAX_BATCH)];
+    } control;
+
+    while(WaitForClientRequest(daemon, client))
+    {
+        struct iovec part = {message, sizeof(message) - 1};
+        struct msghdr header = {0};
+        header.msg_iov = &part;
+        header.msg_iovlen = 1;
+        header.msg_control = control.buffer;
+        header.msg_controllen = sizeof(control.buffer);
+
+        const ssize_t length = recvmsg(client, &header, MSG_CMSG_CLOEXEC);
+        if(length <= 0)
+        {
+            return;
+        }
+        // Paths holding spaces are sent NUL separated, any NUL in the request switches it from spaces to NULs
+        message[length] = '\0';
+        const bool nulSeparated = strlen(message) < (size_t)length;
+        if(!nulSeparated)
+        {
+            message[strcspn(message, "\r\n")] = '\0';
+        }
+        const char* messageEnd = nulSeparated ? message + length : message + strlen(message);
+        atomic_fetch_add(&daemon->stats.requests, 1);
+
+        // Collect the descriptors passed along with the request, over every control message, those past a full batch are
+        // closed and fail the request, as do any the kernel had to drop for lack of control buffer room
+        int descriptors[DAEMON_MAX_BATCH];
+        unsigned int descriptorCount = 0;
+        bool tooManyDescriptors = (header.msg_flags & MSG_CTRUNC) != 0;
+        for(struct cmsghdr* rights = CMSG_FIRSTHDR(&header); rights; rights = CMSG_NXTHDR(&header, rights))
+        {
+            if(rights->cmsg_level != SOL_SOCKET || rights->cmsg_type != SCM_RIGHTS)
+            {
+                continue;
+            }
+            const unsigned int count = (rights->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for(unsigned int i = 0; i < count; i++)
+            {
+                int descriptor;
+                memcpy(&descriptor, CMSG_DATA(rights) + i * sizeof(int), sizeof(int));
+                if(descriptorCount < DAEMON_MAX_BATCH)
+                {
+                    descriptors[descriptorCount++] = descriptor;
+                }
+                else
+                {
+                    close(descriptor);
+                    tooManyDescriptors = true;
+                }
+            }
+        }
+
+        if(strcmp(message, "HEALTH") == 0)
+        {
+            mtx_lock(&daemon->lock);
+            const unsigned int queued = daemon->queueCount;
+            mtx_unlock(&daemon->lock);
+
+            char reply[128];
+            snprintf(reply, sizeof(reply), "OK uptime=%.0f workers=%d slots=%d busy=%u queued=%u\n",
+                GetTimeSeconds() - daemon->startTime, DAEMON_WORKER_COUNT, DAEMON_DECODE_SLOTS, atomic_load(&daemon->busyWorkers), queued);
+            SendDaemonReply(client, reply, -1);
+        }
+        else if(strcmp(message, "STATS") == 0)
+        {
+            const unsigned long decoded = atomic_load(&daemon->stats.decoded);
+            const unsigned long long microseconds = atomic_load(&daemon->stats.decodeMicroseconds);
+
+            unsigned long long cacheHits = 0, cacheMisses = 0, cacheEvictions = 0;
+            if(daemon->cache)
+            {
+                cacheHits = atomic_load(&daemon->cache->hits);
+                cacheMisses = atomic_load(&daemon->cache->misses);
+                cacheEvictions = atomic_load(&daemon->cache->evictions);
+            }
+
+            char reply[320];
+            snprintf(reply, sizeof(reply), "OK requests=%lu decoded=%lu failed=%lu bytes=%llu average_ms=%.3f cache_hits=%llu cache_misses=%llu cache_evictions=%llu preemptions=%llu\n",
+                atomic_load(&daemon->stats.requests), decoded, atomic_load(&daemon->stats.failed),
+                atomic_load(&daemon->stats.bytesOut), decoded ? microseconds / 1000.0 / decoded : 0.0,
+                cacheHits, cacheMisses, cacheEvictions, atomic_load(&daemon->scheduler.preemptions));
+            SendDaemonReply(client, reply, -1);
+        }
+        else if(strncmp(message, "DECODE ", 7) == 0 || strncmp(message, "BATCH ", 6) == 0)
+        {
+            // A batch of paths separated by spaces or NULs, one reply per path in order, BATCH marks background work
+            const DecodePriority priority = message[0] == 'B' ? PRIORITY_BATCH : PRIORITY_INTERACTIVE;
+            char* paths[DAEMON_MAX_BATCH + 1];
+            unsigned int batchSize = 0;
+            for(char* path = message + (priority == PRIORITY_BATCH ? 6 : 7); path < messageEnd && batchSize <= DAEMON_MAX_BATCH;)
+            {
+                char* pathEnd = nulSeparated ? path + strlen(path) : path + strcspn(path, " ");
+                *pathEnd = '\0';
+                if(pathEnd > path)
+                {
+                    paths[batchSize++] = path;
+                }
+                path = pathEnd + 1;
+            }
+
+            // A client waits for one reply per path, so a batch that can't be served whole gets a single error instead
+            if(batchSize == 0)
+            {
+                SendDaemonReply(client, "ERR empty batch\n", -1);
+            }
+            else if(batchSize > DAEMON_MAX_BATCH)
+            {
+                SendDaemonReply(client, "ERR batch too large\n", -1);
+            }
+            else
+            {
+                for(unsigned int i = 0; i < batchSize; i++)
+                {
+                    ServeDecode(daemon, workspace, client, paths[i], -1, priority);
+                }
+            }
+        }
+        else if((strcmp(message, "DECODEFD") == 0 || strcmp(message, "BATCHFD") == 0) && tooManyDescriptors)
+        {
+            SendDaemonReply(client, "ERR batch too large\n", -1);
+        }
+        else if((strcmp(message, "DECODEFD") == 0 || strcmp(message, "BATCHFD") == 0) && descriptorCount > 0)
+        {
+            // A batch of passed descriptors, one reply per descriptor in order
+            const DecodePriority priority = message[0] == 'B' ? PRIORITY_BATCH : PRIORITY_INTERACTIVE;
+            for(unsigned int i = 0; i < descriptorCount; i++)
+            {
+                ServeDecode(daemon, workspace, client, NULL, descriptors[i], priority);
+            }
+        }
+        else
+        {
+            SendDaemonReply(client, "ERR unknown request\n", -1);
+        }
+
+        for(unsigned int i = 0; i < descriptorCount; i++)
+        {
+            close(descriptors[i]);
+        }
+    }
+}
+
+// Function run by each daemon worker, every worker keeps its own warm workspace
+static int DaemonWorker(void* argument)
+{
+    Daemon* daemon = argument;
+    DecodeWorkspace workspace;
+    if(InitDecodeWorkspace(&workspace) == -1)
+    {
+        return -1;
+    }
+
+    for(;;)
+    {
+        mtx_lock(&daemon->lock);
+        while(daemon->queueCount == 0 && !daemon->stopping)
+        {
+            cnd_wait(&daemon->notEmpty, &daemon->lock);
+        }
+        if(daemon->queueCount == 0)
+        {
+            mtx_unlock(&daemon->lock);
+            break;
+        }
+        const int client = daemon->queue[daemon->queueHead];
+        daemon->queueHead = (daemon->queueHead + 1) % DAEMON_QUEUE_LENGTH;
+        daemon->queueCount--;
+        cnd_signal(&daemon->notFull);
+        mtx_unlock(&daemon->lock);
+
+        atomic_fetch_add(&daemon->busyWorkers, 1);
+        ServeClient(daemon, &workspace, client);
+        close(client);
+        atomic_fetch_sub(&daemon->busyWorkers, 1);
+    }
+
+    FreeDecodeWorkspace(&workspace);
+
+    return 0;
+}
+
+// Function to run the decode daemon on a Unix domain socket until interrupted
+static int RunDaemon(const char* socketPath, const double budgetSeconds, const unsigned long long cacheBytes)
+{
+    Daemon daemon = {0};
+    daemon.budgetSeconds = budgetSeconds;
+    daemon.startTime = GetTimeSeconds();
+    if(cacheBytes > 0)
+    {
+        daemon.cache = malloc(sizeof(DecodeCache));
+        if(!daemon.cache || InitDecodeCache(daemon.cache, cacheBytes, CACHE_KEY_CONTENT) == -1)
+        {
+            free(daemon.cache);
+            fprintf(stderr, "Error: Unable to create the decode cache!\n");
+            return -1;
+        }
+    }
+
+    struct sockaddr_un address = {0};
+    address.sun_family = AF_UNIX;
+    if(strlen(socketPath) >= sizeof(address.sun_path))
+    {
+        fprintf(stderr, "Error: Socket path too long!\n");
+        if(daemon.cache)
+        {
+            FreeDecodeCache(daemon.cache);
+            free(daemon.cache);
+        }
+        return -1;
+    }
+    strcpy(address.sun_path, socketPath);
+
+    // Message boundaries are kept, so every request and every reply is a single message
+    daemon.listenSocket = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    unlink(socketPath);
+    if(daemon.listenSocket < 0 || bind(daemon.listenSocket, (struct sockaddr*)&address, sizeof(address)) < 0 || listen(daemon.listenSocket, DAEMON_QUEUE_LENGTH) < 0)
+    {
+        if(daemon.listenSocket >= 0)
+        {
+            close(daemon.listenSocket);
+        }
+        fprintf(stderr, "Error: Can't listen on %s!\n", socketPath);
+        if(daemon.cache)
+        {
+            FreeDecodeCache(daemon.cache);
+            free(daemon.cache);
+        }
+        return -1;
+    }
+
+    // Whatever was set up is taken down again when a later step fails, the workers started are stopped and joined
+    int ready = InitDecodeScheduler(&daemon.scheduler, DAEMON_DECODE_SLOTS) == 0;
+    ready += ready == 1 && mtx_init(&daemon.lock, mtx_plain) == thrd_success;
+    ready += ready == 2 && cnd_init(&daemon.notEmpty) == thrd_success;
+    ready += ready == 3 && cnd_init(&daemon.notFull) == thrd_success;
+    thrd_t workers[DAEMON_WORKER_COUNT];
+    int started = 0;
+    for(; ready == 4 && started < DAEMON_WORKER_COUNT; started++)
+    {
+        if(thrd_create(&workers[started], DaemonWorker, &daemon) != thrd_success)
+        {
+            break;
+        }
+    }
+    const bool failed = ready < 4 || started < DAEMON_WORKER_COUNT;
+    if(failed)
+    {
+        fprintf(stderr, "Error: Can't start the daemon workers!\n");
+    }
+
+    // Accept clients until Ctrl+C, waking up regularly to check for it
+    while(!failed && !atomic_load(&interruptToken))
+    {
+        struct pollfd listener = {daemon.listenSocket, POLLIN, 0};
+        if(poll(&listener, 1, 250) <= 0)
+        {
+            continue;
+        }
+
+        const int client = accept4(daemon.listenSocket, NULL, NULL, SOCK_CLOEXEC);
+        if(client < 0)
+        {
+            continue;
+        }
+
+        // A full queue is waited out in steps, so Ctrl+C still gets through
+        mtx_lock(&daemon.lock);
+        while(daemon.queueCount == DAEMON_QUEUE_LENGTH && !atomic_load(&interruptToken))
+        {
+            struct timespec until;
+            timespec_get(&until, TIME_UTC);
+            until.tv_nsec += DAEMON_POLL_MILLISECONDS * 1000000L;
+            until.tv_sec += until.tv_nsec / 1000000000L;
+            until.tv_nsec %= 1000000000L;
+            cnd_timedwait(&daemon.notFull, &daemon.lock, &until);
+        }
+        if(daemon.queueCount == DAEMON_QUEUE_LENGTH)
+        {
+            mtx_unlock(&daemon.lock);
+            close(client);
+            break;
+        }
+        daemon.queue[(daemon.queueHead + daemon.queueCount) % DAEMON_QUEUE_LENGTH] = client;
+        daemon.queueCount++;
+        cnd_signal(&daemon.notEmpty);
+        mtx_unlock(&daemon.lock);
+    }
+
+    if(ready == 4)
+    {
+        mtx_lock(&daemon.lock);
+        daemon.stopping = true;
+        cnd_broadcast(&daemon.notEmpty);
+        mtx_unlock(&daemon.lock);
+    }
+    for(int i = 0; i < started; i++)
+    {
+        thrd_join(workers[i], NULL);
+    }
+
+    close(daemon.listenSocket);
+    unlink(socketPath);
+    if(ready >= 4)
+    {
+        cnd_destroy(&daemon.notFull);
+    }
+    if(ready >= 3)
+    {
+        cnd_destroy(&daemon.notEmpty);
+    }
+    if(ready >= 2)
+    {
+        mtx_destroy(&daemon.lock);
+    }
+    if(ready >= 1)
+    {
+        FreeDecodeScheduler(&daemon.scheduler);
+    }
+    if(daemon.cache)
+    {
+        FreeDecodeCache(daemon.cache);
+        free(daemon.cache);
+    }
+
+    return failed ? -1 : 0;
+}
+#else
+// Function to report that the daemon needs Unix domain sockets and memfd
+static int RunDaemon(const char* socketPath, const double budgetSeconds, const unsigned long long cacheBytes)
+{
+    (void)socketPath;
+    (void)budgetSeconds;
+    (void)cacheBytes;
+    fprintf(stderr, "Error: The decode daemon is only available on Linux!\n");
+    return -1;
+}
+#endif
+#endif
+
+// Structure to represent a tool picked on the command line and what of the decode settings it goes through
+typedef struct CommandTool
+{
+    const char* flag;
+    bool takesOptions;              // Decodes with the orientation, format and ancillary chunk options
+    bool takesInput;                // Reads the file through --direct-io or --disk-cache
+} CommandTool;
+
+// Function to get the flag of the first decode option that changes the pixels, NULL when they are all left as they are
+static const char* GetPixelOptionFlag(const DecodeOptions* options)
+{
+    if(IsReoriented(options->orientation))
+    {
+        return "--orientation";
+    }
+    if(options->format != FORMAT_RGBA8)
+    {
+        return "--format";
+    }
+    if(options->applyExifOrientation)
+    {
+        return "--exif-orientation";
+    }
+    if(options->background != BACKGROUND_NONE)
+    {
+        return "--background";
+    }
+
+    return options->significantBits != SIGNIFICANT_BITS_IGNORE ? "--sbit" : NULL;
+}
+
+int main(int argc, char** argv, char** envs)
+{
+    const char* path = PNG_PATH;
+    const char** paths = malloc(argc * sizeof(char*));
+    unsigned int pathCount = 0;
+    double budgetSeconds = 0;
+    bool directInput = false;
+    unsigned int decodeIterations = 0;
+    DecodeOptions decodeOptions = {0};
+#if PNG_SUPPORT_BATCH
+    unsigned int threadCount = BATCH_DEFAULT_THREADS;
+    unsigned int window = BATCH_DEFAULT_WINDOW;
+    bool useUring = true;
+    bool mapInput = false;
+    unsigned long long byteLimit = BATCH_DEFAULT_BYTE_LIMIT;
+#endif
+#if PNG_SUPPORT_DAEMON
+    const char* socketPath = NULL;
+    unsigned long long cacheBytes = 0;
+#endif
+#if PNG_SUPPORT_CACHE
+    const char* diskCacheDirectory = NULL;
+    bool compressDiskCache = false;
+    bool checkCache = false;
+#endif
+#if PNG_SUPPORT_ENCODER
+    const char* encodePath = NULL;
+    bool benchmarkEncode = false;
+    bool checkEncode = false;
+    EncodeOptions encodeOptions;
+    InitEncodeOptions(&encodeOptions);
+#endif
+#if PNG_SUPPORT_OPTIMIZER
+    const char* optimizePath = NULL;
+#endif
+#if PNG_SUPPORT_QOI
+    const char* qoiPath = NULL;
+#endif
+#if PNG_SUPPORT_BCN
+    const char* blockPath = NULL;
+    BlockFormat blockFormat = BLOCK_BC7;
+#endif
+#if PNG_SUPPORT_MIPS
+    bool buildMips = false;
+    MipFilter mipFilter = MIP_BOX;
+#endif
+#if PNG_SUPPORT_YUV
+    const char* yuvPath = NULL;
+    YuvSubsampling yuvSubsampling = YUV_420;
+    YuvMatrix yuvMatrix = YUV_BT601;
+    YuvRange yuvRange = YUV_FULL;
+#endif
+    for(int i = 1; i < argc; i++)
+    {
+        if(strcmp(argv[i], "--deadline-ms") == 0 && i + 1 < argc)
+        {
+            budgetSeconds = atof(argv[++i]) / 1000.0;
+        }
+#if PNG_SUPPORT_DAEMON
+        else if(strcmp(argv[i], "--daemon") == 0 && i + 1 < argc)
+        {
+            socketPath = argv[++i];
+        }
+        else if(strcmp(argv[i], "--cache-mb") == 0 && i + 1 < argc)
+        {
+            cacheBytes = strtoull(argv[++i], NULL, 10) * 1024 * 1024;
+        }
+#endif
+#if PNG_SUPPORT_CACHE
+        else if(strcmp(argv[i], "--disk-cache") == 0 && i + 1 < argc)
+        {
+            diskCacheDirectory = argv[++i];
+        }
+        else if(strcmp(argv[i], "--disk-cache-compress") == 0)
+        {
+            compressDiskCache = true;
+        }
+        else if(strcmp(argv[i], "--cache-check") == 0)
+        {
+            checkCache = true;
+        }
+#endif
+        else if(strcmp(argv[i], "--direct-io") == 0)
+        {
+            directInput = true;
+        }
+#if PNG_SUPPORT_BATCH || PNG_SUPPORT_ENCODER
+        else if(strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+        {
+            const unsigned int count = (unsigned int)atoi(argv[++i]);
+#if PNG_SUPPORT_BATCH
+            threadCount = count;
+#endif
+#if PNG_SUPPORT_ENCODER
+            encodeOptions.threadCount = count > 0 ? count : 1;
+#endif
+        }
+#endif
+#if PNG_SUPPORT_ENCODER
+        else if(strcmp(argv[i], "--encode") == 0 && i + 1 < argc)
+        {
+            encodePath = argv[++i];
+        }
+        else if(strcmp(argv[i], "--filter") == 0 && i + 1 < argc)
+        {
+            const char* filterNames[FILTER_TYPE_COUNT] = {"none", "sub", "up", "average", "paeth"};
+            const char* name = argv[++i];
+            bool known = strcmp(name, "sad") == 0 || strcmp(name, "entropy") == 0 || strcmp(name, "brute") == 0;
+            encodeOptions.filterStrategy = strcmp(name, "sad") == 0 ? FILTER_STRATEGY_SAD : strcmp(name, "entropy") == 0 ? FILTER_STRATEGY_ENTROPY :
+                strcmp(name, "brute") == 0 ? FILTER_STRATEGY_BRUTE_FORCE : FILTER_STRATEGY_DEFAULT;
+            for(int filter = 0; filter < FILTER_TYPE_COUNT; filter++)
+            {
+                if(strcmp(name, filterNames[filter]) == 0)
+                {
+                    encodeOptions.filterStrategy = FILTER_STRATEGY_FIXED;
+                    encodeOptions.filter = (FilterType)filter;
+                    known = true;
+                }
+            }
+            if(!known)
+            {
+                fprintf(stderr, "Error: Unknown filter %s!\n", name);
+                free(paths);
+                return -1;
+            }
+        }
+        else if(strcmp(argv[i], "--encode-benchmark") == 0)
+        {
+            benchmarkEncode = true;
+        }
+        else if(strcmp(argv[i], "--encode-check") == 0)
+        {
+            checkEncode = true;
+        }
+        else if(strcmp(argv[i], "--fast") == 0)
+        {
+            encodeOptions.mode = ENCODE_FAST;
+        }
+        else if(strcmp(argv[i], "--level") == 0 && i + 1 < argc)
+        {
+            encodeOptions.level = atoi(argv[++i]);
+        }
+        else if(strcmp(argv[i], "--segment-kb") == 0 && i + 1 < argc)
+        {
+            encodeOptions.segmentBytes = strtoul(argv[++i], NULL, 10) * 1024;
+        }
+        else if(strcmp(argv[i], "--idat-kb") == 0 && i + 1 < argc)
+        {
+            encodeOptions.idatBytes = strtoul(argv[++i], NULL, 10) * 1024;
+        }
+#endif
+#if PNG_SUPPORT_BCN
+        else if(strcmp(argv[i], "--bcn") == 0 && i + 2 < argc)
+        {
+            const char* name = argv[++i];
+            if(strcmp(name, "bc1") != 0 && strcmp(name, "bc3") != 0 && strcmp(name, "bc7") != 0)
+            {
+                fprintf(stderr, "Error: Unknown block format %s!\n", name);
+                free(paths);
+                return -1;
+            }
+            blockFormat = strcmp(name, "bc1") == 0 ? BLOCK_BC1 : strcmp(name, "bc3") == 0 ? BLOCK_BC3 : BLOCK_BC7;
+            blockPath = argv[++i];
+        }
+#endif
+        else if(strcmp(argv[i], "--orientation") == 0 && i + 1 < argc)
+        {
+            const char* value = argv[++i];
+            char* end;
+            const long orientation = strtol(value, &end, 10);
+            if(end == value || *end != '\0' || orientation < ORIENTATION_TOP_LEFT || orientation > ORIENTATION_LEFT_BOTTOM)
+            {
+                fprintf(stderr, "Error: Unknown orientation %s!\n", value);
+                free(paths);
+                return -1;
+            }
+            decodeOptions.orientation = (Orientation)orientation;
+        }
+        else if(strcmp(argv[i], "--format") == 0 && i + 1 < argc)
+        {
+            const char* format = argv[++i];
+            if(strcmp(format, "rgba8") != 0 && strcmp(format, "rgba16") != 0 && strcmp(format, "indexed") != 0 && strcmp(format, "packed") != 0)
+            {
+                fprintf(stderr, "Error: Unknown pixel format %s!\n", format);
+                free(paths);
+                return -1;
+            }
+            decodeOptions.format = strcmp(format, "rgba16") == 0 ? FORMAT_RGBA16 : strcmp(format, "indexed") == 0 ? FORMAT_INDEXED8 :
+                strcmp(format, "packed") == 0 ? FORMAT_PACKED : FORMAT_RGBA8;
+        }
+#if PNG_SUPPORT_ANCILLARY_CHUNKS
+        else if(strcmp(argv[i], "--background") == 0 && i + 1 < argc)
+        {
+            // Either the file's bKGD over white, or an RRGGBB colour
+            const char* background = argv[++i];
+            if(strcmp(background, "bkgd") != 0 && (strlen(background) != 6 || strspn(background, "0123456789abcdefABCDEF") != 6))
+            {
+                fprintf(stderr, "Error: Invalid background %s, expected bkgd or an RRGGBB colour!\n", background);
+                free(paths);
+                return -1;
+            }
+            const unsigned long color = strcmp(background, "bkgd") == 0 ? 0xFFFFFF : strtoul(background, NULL, 16);
+            decodeOptions.background = strcmp(background, "bkgd") == 0 ? BACKGROUND_FILE : BACKGROUND_COLOR;
+            for(int channel = 0; channel < 3; channel++)
+            {
+                decodeOptions.backgroundColor[channel] = (uint16_t)((color >> (16 - channel * 8) & 0xFF) * 257);
+            }
+        }
+        else if(strcmp(argv[i], "--sbit") == 0 && i + 1 < argc)
+        {
+            const char* mode = argv[++i];
+            if(strcmp(mode, "ignore") != 0 && strcmp(mode, "shift") != 0 && strcmp(mode, "rescale") != 0)
+            {
+                fprintf(stderr, "Error: Unknown sBIT mode %s!\n", mode);
+                free(paths);
+                return -1;
+            }
+            decodeOptions.significantBits = strcmp(mode, "shift") == 0 ? SIGNIFICANT_BITS_SHIFT : strcmp(mode, "rescale") == 0 ? SIGNIFICANT_BITS_RESCALE : SIGNIFICANT_BITS_IGNORE;
+        }
+        else if(strcmp(argv[i], "--exif-orientation") == 0)
+        {
+            decodeOptions.applyExifOrientation = true;
+        }
+#endif
+#if PNG_SUPPORT_MIPS
+        else if(strcmp(argv[i], "--mips") == 0 && i + 1 < argc)
+        {
+            const char* filter = argv[++i];
+            if(strcmp(filter, "box") != 0 && strcmp(filter, "srgb") != 0)
+            {
+                fprintf(stderr, "Error: Unknown mip filter %s!\n", filter);
+                free(paths);
+                return -1;
+            }
+            buildMips = true;
+            mipFilter = strcmp(filter, "srgb") == 0 ? MIP_SRGB : MIP_BOX;
+        }
+#endif
+#if PNG_SUPPORT_YUV
+        else if(strcmp(argv[i], "--yuv") == 0 && i + 4 < argc)
+        {
+            const char* subsampling = argv[++i];
+            const char* matrix = argv[++i];
+            const char* range = argv[++i];
+            if(strcmp(subsampling, "420") != 0 && strcmp(subsampling, "444") != 0)
+            {
+                fprintf(stderr, "Error: Unknown chroma subsampling %s!\n", subsampling);
+                free(paths);
+                return -1;
+            }
+            if(strcmp(matrix, "bt601") != 0 && strcmp(matrix, "bt709") != 0)
+            {
+                fprintf(stderr, "Error: Unknown YUV matrix %s!\n", matrix);
+                free(paths);
+                return -1;
+            }
+            if(strcmp(range, "full") != 0 && strcmp(range, "limited") != 0)
+            {
+                fprintf(stderr, "Error: Unknown YUV range %s!\n", range);
+                free(paths);
+                return -1;
+            }
+            yuvSubsampling = strcmp(subsampling, "444") == 0 ? YUV_444 : YUV_420;
+            yuvMatrix = strcmp(matrix, "bt709") == 0 ? YUV_BT709 : YUV_BT601;
+            yuvRange = strcmp(range, "limited") == 0 ? YUV_LIMITED : YUV_FULL;
+            yuvPath = argv[++i];
+        }
+#endif
+#if PNG_SUPPORT_QOI
+        else if(strcmp(argv[i], "--qoi") == 0 && i + 1 < argc)
+        {
+            qoiPath = argv[++i];
+        }
+#endif
+#if PNG_SUPPORT_OPTIMIZER
+        else if(strcmp(argv[i], "--optimize") == 0 && i + 1 < argc)
+        {
+            optimizePath = argv[++i];
+        }
+#endif
+        else if(strcmp(argv[i], "--decode-benchmark") == 0 && i + 1 < argc)
+        {
+            decodeIterations = (unsigned int)strtoul(argv[++i], NULL, 10);
+        }
+#if PNG_SUPPORT_BATCH
+        else if(strcmp(argv[i], "--io-window") == 0 && i + 1 < argc)
+        {
+            window = (unsigned int)atoi(argv[++i]);
+        }
+        else if(strcmp(argv[i], "--no-io-uring") == 0)
+        {
+            useUring = false;
+        }
+        else if(strcmp(argv[i], "--mmap-input") == 0)
+        {
+            mapInput = true;
+        }
+        else if(strcmp(argv[i], "--io-bytes-mb") == 0 && i + 1 < argc)
+        {
+            byteLimit = strtoull(argv[++i], NULL, 10) * 1024 * 1024;
+        }
+#endif
+        else if(strncmp(argv[i], "--", 2) == 0)
+        {
+            // Options of features left out of the build land here too, instead of being taken for paths
+            fprintf(stderr, "Error: Unknown option %s!\n", argv[i]);
+            free(paths);
+            return -1;
+        }
+        else if(paths)
+        {
+            paths[pathCount++] = argv[i];
+            path = argv[i];
+        }
+    }
+
+    atomic_init(&interruptToken, false);
+    signal(SIGINT, HandleInterrupt);
+
+#if PNG_SUPPORT_DAEMON
+    if(socketPath)
+    {
+        free(paths);
+        return RunDaemon(socketPath, budgetSeconds, cacheBytes);
+    }
+#endif
+
+#if PNG_SUPPORT_ENCODER
+    // The encoder check makes up its own rasters, no file is read
+    if(checkEncode)
+    {
+        free(paths);
+        return CheckEncodeRoundTrips();
+    }
+#endif
+
+#if PNG_SUPPORT_CACHE
+    // The cache check puts its own files together
+    if(checkCache)
+    {
+        free(paths);
+        return CheckDecodeCache();
+    }
+#endif
+
+#if PNG_SUPPORT_BATCH
+    // Several files go through the batch pipeline, which decodes with the same options but has no per-file output
+    if(pathCount > 1)
+    {
+        const char* singleFileFlag = decodeIterations > 0 ? "--decode-benchmark" : directInput ? "--direct-io" : NULL;
+#if PNG_SUPPORT_ENCODER
+        singleFileFlag = encodePath ? "--encode" : benchmarkEncode ? "--encode-benchmark" : singleFileFlag;
+#endif
+#if PNG_SUPPORT_OPTIMIZER
+        singleFileFlag = optimizePath ? "--optimize" : singleFileFlag;
+#endif
+#if PNG_SUPPORT_QOI
+        singleFileFlag = qoiPath ? "--qoi" : singleFileFlag;
+#endif
+#if PNG_SUPPORT_BCN
+        singleFileFlag = blockPath ? "--bcn" : singleFileFlag;
+#endif
+#if PNG_SUPPORT_MIPS
+        singleFileFlag = buildMips ? "--mips" : singleFileFlag;
+#endif
+#if PNG_SUPPORT_YUV
+        singleFileFlag = yuvPath ? "--yuv" : singleFileFlag;
+#endif
+#if PNG_SUPPORT_CACHE
+        singleFileFlag = diskCacheDirectory ? "--disk-cache" : singleFileFlag;
+#endif
+        if(singleFileFlag)
+        {
+            fprintf(stderr, "Error: %s takes a single file, %u were given!\n", singleFileFlag, pathCount);
+            free(paths);
+            return -1;
+        }
+        const int result = DecodeBatch(paths, pathCount, &decodeOptions, budgetSeconds, NULL, threadCount > 0 ? threadCount : 1, window, byteLimit, useUring, mapInput);
+        free(paths);
+        return result;
+    }
+#else
+    if(pathCount > 1)
+    {
+        fprintf(stderr, "Error: Decoding %u files needs the batch decoder, which is not built in!\n", pathCount);
+        free(paths);
+        return -1;
+    }
+#endif
+    free(paths);
+
+    // Only one tool runs, and the ones that decode the file as stored or read it themselves reject what they would drop
+    CommandTool tools[8];
+    unsigned int toolCount = 0;
+    if(decodeIterations > 0)
+    {
+        tools[toolCount++] = (CommandTool){"--decode-benchmark", true, false};
+    }
+#if PNG_SUPPORT_OPTIMIZER
+    if(optimizePath)
+    {
+        tools[toolCount++] = (CommandTool){"--optimize", false, false};
+    }
+#endif
+#if PNG_SUPPORT_QOI
+    if(qoiPath)
+    {
+        tools[toolCount++] = (CommandTool){"--qoi", false, false};
+    }
+#endif
+#if PNG_SUPPORT_MIPS
+    if(buildMips)
+    {
+        tools[toolCount++] = (CommandTool){"--mips", false, false};
+    }
+#endif
+#if PNG_SUPPORT_YUV
+    if(yuvPath)
+    {
+        tools[toolCount++] = (CommandTool){"--yuv", false, false};
+    }
+#endif
+#if PNG_SUPPORT_BCN
+    if(blockPath)
+    {
+        tools[toolCount++] = (CommandTool){"--bcn", false, false};
+    }
+#endif
+#if PNG_SUPPORT_ENCODER
+    if(benchmarkEncode)
+    {
+        tools[toolCount++] = (CommandTool){"--encode-benchmark", true, true};
+    }
+    if(encodePath)
+    {
+        tools[toolCount++] = (CommandTool){"--encode", true, true};
+    }
+#endif
+    if(toolCount > 1)
+    {
+        fprintf(stderr, "Error: %s can't be combined with %s!\n", tools[0].flag, tools[1].flag);
+        return -1;
+    }
+    if(toolCount == 1)
+    {
+        const char* droppedFlag = tools[0].takesOptions ? NULL : GetPixelOptionFlag(&decodeOptions);
+        if(!droppedFlag && !tools[0].takesInput)
+        {
+            droppedFlag = directInput ? "--direct-io" : NULL;
+#if PNG_SUPPORT_CACHE
+            droppedFlag = diskCacheDirectory ? "--disk-cache" : droppedFlag;
+#endif
+        }
+        if(droppedFlag)
+        {
+            fprintf(stderr, "Error: %s can't be combined with %s!\n", tools[0].flag, droppedFlag);
+            return -1;
+        }
+    }
+
+#if PNG_SUPPORT_OPTIMIZER
+    // The optimiser decodes on its own, the input bytes are all it needs
+    if(optimizePath)
+    {
+        unsigned char* buffer;
+        unsigned long bufferSize;
+        if(ReadPngFile(path, &buffer, &bufferSize) == -1)
+        {
+            return -1;
+        }
+
+        unsigned char* png = NULL;
+        unsigned long pngSize = 0;
+        OptimizeReport report;
+        const double start = GetTimeSeconds();
+        int result = OptimizePng(buffer, bufferSize, encodeOptions.threadCount, &png, &pngSize, &report);
+        free(buffer);
+        if(result == 0)
+        {
+            printf("%s %lu -> %lu bytes (%.2f%% saved), %u trials in %.3f ms\n", optimizePath, bufferSize, pngSize,
+                100.0 * (double)(bufferSize - pngSize) / (double)bufferSize, report.trialCount, (GetTimeSeconds() - start) * 1000.0);
+            if(!report.keptOriginal)
+            {
+                printf("colour type %d, bit depth %u, filter strategy %d (filter %d), zlib strategy %d\n", (int)report.ihdr.colorType,
+                    report.ihdr.bitDepth, (int)report.filterStrategy, (int)report.filter, report.zlibStrategy);
+            }
+            result = WritePngFile(optimizePath, png, pngSize);
+            free(png);
+        }
+        return result;
+    }
+#endif
+
+    // The benchmark times the decode alone, the file is read once up front
+    if(decodeIterations > 0)
+    {
+        unsigned char* buffer;
+        unsigned long bufferSize;
+        if(ReadPngFile(path, &buffer, &bufferSize) == -1)
+        {
+            return -1;
+        }
+
+        const int result = BenchmarkDecode(buffer, bufferSize, &decodeOptions, decodeIterations);
+        free(buffer);
+        return result;
+    }
+
+    DecodeControl control;
+    InitDecodeControl(&control, budgetSeconds, &interruptToken);
+
+#if PNG_SUPPORT_QOI
+    // Transcoding never builds the whole image, the QOI is decoded back to show what reading it costs
+    if(qoiPath)
+    {
+        unsigned char* qoi;
+        unsigned long qoiSize;
+        const double start = GetTimeSeconds();
+        int result = TranscodePngFileToQoi(path, &control, &qoi, &qoiSize);
+        if(result != 0)
+        {
+            return result;
+        }
+        const double transcoded = GetTimeSeconds();
+
+        Image image;
+        result = DecodeQoiBuffer(qoi, qoiSize, &image);
+        if(result == 0)
+        {
+            printf("%s %lu bytes, transcoded in %.3f ms, decodes in %.3f ms\n", qoiPath, qoiSize, (transcoded - start) * 1000.0,
+                (GetTimeSeconds() - transcoded) * 1000.0);
+            FreeImage(&image);
+            result = WritePngFile(qoiPath, qoi, qoiSize);
+        }
+        free(qoi);
+        return result;
+    }
+#endif
+
+#if PNG_SUPPORT_MIPS
+    // Every level is printed with its first pixel
+    if(buildMips)
+    {
+        MipChain chain;
+        const double start = GetTimeSeconds();
+        const int result = DecodePngFileToMipChain(path, mipFilter, &control, &chain);
+        if(result != 0)
+        {
+            return result;
+        }
+        printf("%u levels in %.3f ms\n", chain.levelCount, (GetTimeSeconds() - start) * 1000.0);
+        for(unsigned int level = 0; level < chain.levelCount; level++)
+        {
+            const unsigned char* pixel = chain.levels[level].pixels;
+            printf("%u %ux%u %hhu %hhu %hhu %hhu\n", level, chain.levels[level].width, chain.levels[level].height, pixel[0], pixel[1], pixel[2], pixel[3]);
+        }
+        FreeMipChain(&chain);
+        return 0;
+    }
+#endif
+
+#if PNG_SUPPORT_YUV
+    if(yuvPath)
+    {
+        YuvImage yuv;
+        const double start = GetTimeSeconds();
+        int result = DecodePngFileToYuv(path, yuvMatrix, yuvRange, yuvSubsampling, &control, &yuv);
+        if(result != 0)
+        {
+            return result;
+        }
+        printf("%s %ux%u with %ux%u chroma in %.3f ms\n", yuvPath, yuv.width, yuv.height, yuv.chromaWidth, yuv.chromaHeight, (GetTimeSeconds() - start) * 1000.0);
+        result = WriteYuvFile(yuvPath, &yuv);
+        FreeYuvImage(&yuv);
+        return result;
+    }
+#endif
+
+#if PNG_SUPPORT_BCN
+    if(blockPath)
+    {
+        unsigned char* blocks;
+        unsigned long blocksSize;
+        unsigned int width, height;
+        const double start = GetTimeSeconds();
+        int result = DecodePngFileToBlocks(path, blockFormat, &control, &blocks, &blocksSize, &width, &height);
+        if(result != 0)
+        {
+            return result;
+        }
+        printf("%s %lu bytes of blocks in %.3f ms\n", blockPath, blocksSize, (GetTimeSeconds() - start) * 1000.0);
+        result = WriteDdsFile(blockPath, blockFormat, width, height, blocks, blocksSize);
+        free(blocks);
+        return result;
+    }
+#endif
+
+    Image image;
+#if PNG_SUPPORT_CACHE
+    if(diskCacheDirectory)
+    {
+        const int result = DecodePngFileCached(diskCacheDirectory, path, compressDiskCache, &image, &decodeOptions, NULL, &control);
+        if(result != 0)
+        {
+            return result;
+        }
+    }
+    else
+#endif
+    if(directInput)
+    {
+        // Huge one-shot inputs are streamed around the page cache instead of being read whole
+        const int result = DecodePngFileDirect(path, &image, &decodeOptions, &control);
+        if(result != 0)
+        {
+            return result;
+        }
+    }
+    else
+    {
+        unsigned char* buffer;
+        unsigned long bufferSize;
+        if(ReadPngFile(path, &buffer, &bufferSize) == -1)
+        {
+            return -1;
+        }
+
+        const int result = DecodePngBuffer(buffer, bufferSize, &image, &decodeOptions, NULL, &control);
+        free(buffer);
+        if(result != 0)
+        {
+            return result;
+        }
+    }
+
+#if PNG_SUPPORT_ENCODER
+    // Re-encoding replaces the pixel dump
+    if(benchmarkEncode)
+    {
+        const int result = BenchmarkFilterStrategies(&image, &encodeOptions);
+        FreeImage(&image);
+        return result;
+    }
+    if(encodePath)
+    {
+        unsigned char* png;
+        unsigned long pngSize;
+        const double start = GetTimeSeconds();
+        int result = EncodePng(&image, &encodeOptions, &png, &pngSize);
+        FreeImage(&image);
+        if(result == 0)
+        {
+            printf("%s %lu bytes in %.3f ms\n", encodePath, pngSize, (GetTimeSeconds() - start) * 1000.0);
+            result = WritePngFile(encodePath, png, pngSize);
+            free(png);
+        }
+        return result;
+    }
+#endif
+
+    // Print the first pixel of each row, or its first byte for compact formats
+    for(unsigned int y = 0; y < image.height; y++)
+    {
+        const unsigned char* pixel = image.pixels + y * image.stride;
+        if(image.format == FORMAT_RGBA8)
+        {
+            printf("%hhu %hhu %hhu %hhu\n", pixel[0], pixel[1], pixel[2], pixel[3]);
+        }
+        else if(image.format == FORMAT_RGBA16)
+        {
+            const uint16_t* samples = (const uint16_t*)pixel;
+            printf("%hu %hu %hu %hu\n", samples[0], samples[1], samples[2], samples[3]);
+        }
+        else
+        {
+            printf("%hhu\n", pixel[0]);
+        }
+    }
+    FreeImage(&image);
+
+    return 0;
+}